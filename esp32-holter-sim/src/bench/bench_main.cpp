@@ -0,0 +1,648 @@
+// =============================================================================
+// CardioGuard ESP32 Holter ECG Simulator — Generator Benchmark (native)
+// =============================================================================
+// Measures the portable synthesis and packet code on the host:
+//
+//   pio run -e native && .pio/build/native/program [--csv] [--seconds N] [--seed S]
+//                                                        [--rate HZ]
+//
+// For every mode the same signal is generated (N seconds at --rate, by
+// default SAMPLE_RATE) and then framed the way the sender task does at
+// MTU 247:
+//   frames/s    generated frames per second (one frame = one sample per lead)
+//   ns/frame    generation cost per frame, one generateNextFrame() call each
+//   block ns    the same with generateBlock(), BENCH_BLOCK_FRAMES per call —
+//               its output must be identical (checked, the run fails if not)
+//   realtime    frames/s ÷ sample rate — headroom over the stream rate
+//   pkts/s      packets per second end to end: generateBlock() plus the
+//               framing, the sender path of one CPU
+//   B/frame     payload bytes per frame on the wire
+//
+// The QRS detector is then run over one lead of each rhythm and scored
+// against the generator's own beat positions (match within ±150 ms):
+//   ns/sample   detector cost per input sample
+//   Se, +P      sensitivity and positive predictivity
+//   err ms      mean |detected - true| R-peak position
+//   class       beats whose N/V code matches the generator's
+//
+// The signal of each Rice mode, and full-scale steps that take the escape
+// path, are then framed as FORMAT_RICE packets and decoded with riceDecode():
+//   escapes     samples sent as escapes (must be > 0 for the steps — checked)
+//   decoded     frames decoded bit-exact — must be all of them (checked)
+//
+// Last, the detector's signal is framed as a FEC-protected stream (parity
+// packet per group, room left for it in every packet) and every packet of
+// every group is dropped in turn and rebuilt from the others:
+//   ns/packet   parity cost per data packet (parityAdd() + the parity packet)
+//   overhead    parity bytes ÷ data bytes
+//   rebuilt     packets rebuilt bit-exact — must be all of them (checked)
+//
+// --csv prints one machine-readable line per mode, so results can be
+// appended to a log and compared between commits. Every run starts from the
+// same seed, so the signal hash only changes when the generated signal does.
+// =============================================================================
+
+// tools/sync_sketch.py leaves bench/ out of the Arduino sketch; any other
+// Arduino build of src/ must not see this host program either
+#ifndef ARDUINO
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../ecg_synth.h"
+#include "../ecg_packet.h"
+#include "../qrs_detect.h"
+
+#define BENCH_MTU          247   // Same local MTU the firmware requests
+#define BENCH_DEFAULT_SECS 120   // Signal length per mode
+#define BENCH_MAX_SECS     600
+#define BENCH_MIN_RUN_NS   200000000LL  // Repeat each measurement for ≥ 200 ms
+#define BENCH_BLOCK_FRAMES 32    // Frames per generateBlock() call, as the firmware's ring writes
+
+struct BenchCase {
+  const char* name;
+  SynthPath   path;
+  bool        arrhythmia;
+  uint8_t     rhythm;    // RHYTHM_*
+  uint8_t     leads;
+  uint8_t     format;    // FORMAT_* used for the packet measurement
+};
+
+const BenchCase CASES[] = {
+  { "normal/reference",     SYNTH_PATH_REFERENCE, false, RHYTHM_NORMAL,       1,         0 },
+  { "normal/lut",           SYNTH_PATH_LUT,       false, RHYTHM_NORMAL,       1,         0 },
+  { "normal/fixed",         SYNTH_PATH_FIXED,     false, RHYTHM_NORMAL,       1,         0 },
+  { "arrhythmia/reference", SYNTH_PATH_REFERENCE, true,  RHYTHM_NORMAL,       1,         0 },
+  { "arrhythmia/lut",       SYNTH_PATH_LUT,       true,  RHYTHM_NORMAL,       1,         0 },
+  { "arrhythmia/fixed",     SYNTH_PATH_FIXED,     true,  RHYTHM_NORMAL,       1,         0 },
+  { "3-lead/lut",           SYNTH_PATH_LUT,       false, RHYTHM_NORMAL,       3,         0 },
+  { "12-lead/reference",    SYNTH_PATH_REFERENCE, false, RHYTHM_NORMAL,       MAX_LEADS, 0 },
+  { "12-lead/lut",          SYNTH_PATH_LUT,       false, RHYTHM_NORMAL,       MAX_LEADS, 0 },
+  { "12-lead/fixed",        SYNTH_PATH_FIXED,     false, RHYTHM_NORMAL,       MAX_LEADS, 0 },
+  { "rice/lut",             SYNTH_PATH_LUT,       false, RHYTHM_NORMAL,       1,         FORMAT_RICE },
+  { "rice-12-lead/lut",     SYNTH_PATH_LUT,       false, RHYTHM_NORMAL,       MAX_LEADS, FORMAT_RICE },
+  { "af/lut",               SYNTH_PATH_LUT,       false, RHYTHM_AF,           1,         0 },
+  { "vt/fixed",             SYNTH_PATH_FIXED,     false, RHYTHM_VT,           1,         0 },
+  { "avblock/lut",          SYNTH_PATH_LUT,       false, RHYTHM_AV_BLOCK,     1,         0 },
+  { "ste-12-lead/lut",      SYNTH_PATH_LUT,       false, RHYTHM_ST_ELEVATION, MAX_LEADS, 0 },
+};
+
+#define CASE_COUNT (sizeof(CASES) / sizeof(CASES[0]))
+
+// Detector cases — one lead, float LUT path
+const BenchCase DETECT_CASES[] = {
+  { "normal",     SYNTH_PATH_LUT, false, RHYTHM_NORMAL,       1, 0 },
+  { "arrhythmia", SYNTH_PATH_LUT, true,  RHYTHM_NORMAL,       1, 0 },
+  { "af",         SYNTH_PATH_LUT, false, RHYTHM_AF,           1, 0 },
+  { "vt",         SYNTH_PATH_LUT, false, RHYTHM_VT,           1, 0 },
+  { "svt",        SYNTH_PATH_LUT, false, RHYTHM_SVT,          1, 0 },
+  { "brady",      SYNTH_PATH_LUT, false, RHYTHM_BRADY,        1, 0 },
+  { "avblock",    SYNTH_PATH_LUT, false, RHYTHM_AV_BLOCK,     1, 0 },
+  { "ste",        SYNTH_PATH_LUT, false, RHYTHM_ST_ELEVATION, 1, 0 },
+};
+
+#define DETECT_CASE_COUNT (sizeof(DETECT_CASES) / sizeof(DETECT_CASES[0]))
+#define DETECT_MATCH_MS   150   // AAMI EC57 match window
+#define DETECT_MAX_BEATS  (BENCH_MAX_SECS * 4)  // 240 BPM
+
+// FEC cases — the last detector signal, one lead
+struct FecCase {
+  const char* name;
+  uint8_t     format;    // FORMAT_RICE or legacy (0)
+  uint8_t     group;     // Data packets per parity packet
+};
+
+const FecCase FEC_CASES[] = {
+  { "legacy/4",  0,           4 },
+  { "legacy/16", 0,           16 },
+  { "rice/4",    FORMAT_RICE, 4 },
+  { "rice/16",   FORMAT_RICE, 16 },
+};
+
+#define FEC_CASE_COUNT (sizeof(FEC_CASES) / sizeof(FEC_CASES[0]))
+#define FEC_MAX_GROUP  16
+#define RICE_STEP_FRAMES 50   // Frames between full-scale steps of the escape test
+
+struct BenchResult {
+  double   framesPerSec;
+  double   nsPerFrame;
+  double   nsPerFrameBlock;
+  double   packetsPerSec;  // End to end: block generation + framing
+  double   bytesPerFrame;
+  uint32_t checksum;     // Keeps the optimizer from dropping the work
+  uint32_t signalHash;   // FNV-1a of the generated frames
+  uint32_t blockHash;    // The same over the generateBlock() output
+};
+
+int16_t*   frameBuf = nullptr;
+BeatTables benchTables;
+SynthState synth;
+uint32_t   benchSeed = SYNTH_DEFAULT_SEED;
+uint16_t   benchRate = SAMPLE_RATE;
+
+inline int64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Generate `frames` frames from a fresh stream into frameBuf, frame by
+ * frame or in blocks.
+ */
+void generateRun(const BenchCase& bc, uint32_t frames, bool block) {
+  synthPath = bc.path;
+  synthInit(synth, &benchTables, 72.0);
+  synthSeed(synth, benchSeed);
+  setSampleRate(synth, benchRate);
+  if (bc.rhythm != RHYTHM_NORMAL) setRhythm(synth, bc.rhythm);
+  synth.arrhythmiaMode = bc.arrhythmia;
+  if (block) {
+    for (uint32_t i = 0; i < frames; i += BENCH_BLOCK_FRAMES) {
+      uint32_t n = frames - i < BENCH_BLOCK_FRAMES ? frames - i : BENCH_BLOCK_FRAMES;
+      generateBlock(synth, frameBuf + i * bc.leads, n, bc.leads);
+    }
+    return;
+  }
+  for (uint32_t i = 0; i < frames; i++) {
+    generateNextFrame(synth, frameBuf + i * bc.leads, bc.leads);
+  }
+}
+
+/**
+ * FNV-1a over the first `frames` frames of frameBuf.
+ */
+uint32_t hashFrames(uint32_t frames, uint8_t leads) {
+  uint32_t hash = 2166136261u;
+  const uint8_t* bytes = (const uint8_t*)frameBuf;
+  for (size_t i = 0; i < (size_t)frames * leads * sizeof(int16_t); i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * Frame the whole buffer into packets as the sender task would.
+ * Returns the packet count; *bytes receives the total packet length.
+ */
+uint32_t packetizeRun(const BenchCase& bc, uint32_t frames, uint64_t* bytes,
+                      uint32_t* checksum) {
+  static uint8_t packet[BENCH_MTU];
+  const uint16_t maxLen = BENCH_MTU - 3;
+  uint32_t pos = 0, packets = 0;
+  uint16_t seq = 0;
+
+  while (pos < frames) {
+    const int16_t* src = frameBuf + pos * bc.leads;
+    uint32_t remaining = frames - pos;
+    uint16_t len, used;
+
+    if (bc.format & FORMAT_RICE) {
+      uint16_t available = remaining < MAX_EXT_SAMPLES_PER_PACKET ? remaining : MAX_EXT_SAMPLES_PER_PACKET;
+      len = buildRicePacket(packet, seq, maxLen, src, available, bc.leads, &used);
+    } else if (bc.leads > 1) {
+      uint32_t perPacket = (maxLen - extHeaderLength(bc.leads)) / (2 * bc.leads);
+      used = remaining < perPacket ? remaining : perPacket;
+      len = buildExtRawPacket(packet, seq, src, used, bc.leads);
+    } else {
+      uint32_t perPacket = (maxLen - PACKET_HEADER_SIZE) / 2;
+      if (perPacket > MAX_SAMPLES_PER_PACKET) perPacket = MAX_SAMPLES_PER_PACKET;
+      used = remaining < perPacket ? remaining : perPacket;
+      len = buildRawPacket(packet, seq, src, used);
+    }
+
+    *checksum += packet[len - 1];
+    *bytes += len;
+    pos += used;
+    seq++;
+    packets++;
+  }
+  return packets;
+}
+
+BenchResult runCase(const BenchCase& bc, uint32_t frames) {
+  BenchResult r = {};
+
+  // Generation — repeated until the run is long enough to time reliably;
+  // blocks first, so the packets below are built from the per-frame output
+  int64_t elapsed = 0;
+  uint64_t generated = 0;
+  for (int block = 1; block >= 0; block--) {
+    elapsed = 0;
+    generated = 0;
+    while (elapsed < BENCH_MIN_RUN_NS) {
+      int64_t t0 = nowNs();
+      generateRun(bc, frames, block);
+      elapsed += nowNs() - t0;
+      generated += frames;
+      r.checksum += (uint16_t)frameBuf[(frames - 1) * bc.leads];
+    }
+    if (block) {
+      r.blockHash = hashFrames(frames, bc.leads);
+      r.nsPerFrameBlock = (double)elapsed / generated;
+    }
+  }
+  r.signalHash = hashFrames(frames, bc.leads);
+  r.framesPerSec = generated * 1e9 / elapsed;
+  r.nsPerFrame   = (double)elapsed / generated;
+
+  // Packet framing over the last generated signal
+  elapsed = 0;
+  uint64_t packets = 0, framed = 0, packetBytes = 0;
+  while (elapsed < BENCH_MIN_RUN_NS) {
+    int64_t t0 = nowNs();
+    packets += packetizeRun(bc, frames, &packetBytes, &r.checksum);
+    elapsed += nowNs() - t0;
+    framed += frames;
+  }
+  // Both stages per frame, as the generator and sender tasks run them
+  double framingNsPerFrame = (double)elapsed / framed;
+  r.packetsPerSec = (double)packets / framed * 1e9 / (r.nsPerFrameBlock + framingNsPerFrame);
+  r.bytesPerFrame = (double)packetBytes / framed;
+  return r;
+}
+
+struct DetectResult {
+  double   nsPerSample;
+  uint32_t beats;       // Beats the generator produced
+  uint32_t detected;
+  uint32_t matched;
+  double   errorMs;     // Mean |error| of the matched beats
+  uint32_t classMatched;
+};
+
+QrsBeat truthBeats[DETECT_MAX_BEATS];
+QrsBeat foundBeats[DETECT_MAX_BEATS];
+
+/**
+ * Generate one lead with the true R peaks, time the detector over it and
+ * score its beats against them.
+ */
+DetectResult runDetectCase(const BenchCase& bc, uint32_t frames) {
+  DetectResult r = {};
+  synthPath = bc.path;
+  synthInit(synth, &benchTables, 72.0);
+  synthSeed(synth, benchSeed);
+  setSampleRate(synth, benchRate);
+  if (bc.rhythm != RHYTHM_NORMAL) setRhythm(synth, bc.rhythm);
+  synth.arrhythmiaMode = bc.arrhythmia;
+  for (uint32_t i = 0; i < frames; i++) {
+    if (generateNextFrame(synth, frameBuf + i, 1) && r.beats < DETECT_MAX_BEATS) {
+      truthBeats[r.beats++] = { synth.beatStartIndex + rPeakOffset(synth), 0, beatCode(synth) };
+    }
+  }
+
+  static QrsDetector det;
+  int64_t elapsed = 0;
+  uint64_t processed = 0;
+  while (elapsed < BENCH_MIN_RUN_NS) {
+    r.detected = 0;
+    int64_t t0 = nowNs();
+    qrsInit(det, benchRate);
+    for (uint32_t i = 0; i < frames; i++) {
+      QrsBeat beat;
+      if (qrsProcess(det, frameBuf[i], &beat) && r.detected < DETECT_MAX_BEATS) {
+        foundBeats[r.detected++] = beat;
+      }
+    }
+    elapsed += nowNs() - t0;
+    processed += frames;
+  }
+  r.nsPerSample = (double)elapsed / processed;
+
+  // The detector learns for its first QRS_LEARN_SAMPLES; beats before it
+  // (and within the match window of the end) are not scored
+  uint32_t window = DETECT_MATCH_MS * benchRate / 1000;
+  uint32_t first = QRS_LEARN_SAMPLES * (benchRate / QRS_RATE) + window;
+  uint32_t last = frames - window;
+  uint32_t scoredTruth = 0, scoredFound = 0;
+  double errorSum = 0;
+  uint32_t j = 0;
+  for (uint32_t i = 0; i < r.beats; i++) {
+    const QrsBeat& t = truthBeats[i];
+    if (t.frame < first || t.frame >= last) continue;
+    scoredTruth++;
+    while (j < r.detected && foundBeats[j].frame + window < t.frame) j++;
+    if (j < r.detected && foundBeats[j].frame <= t.frame + window) {
+      r.matched++;
+      errorSum += foundBeats[j].frame > t.frame ? foundBeats[j].frame - t.frame : t.frame - foundBeats[j].frame;
+      r.classMatched += (foundBeats[j].code == t.code);
+      j++;
+    }
+  }
+  for (uint32_t i = 0; i < r.detected; i++) {
+    scoredFound += (foundBeats[i].frame >= first && foundBeats[i].frame < last);
+  }
+  r.beats = scoredTruth;
+  r.detected = scoredFound;
+  r.errorMs = r.matched ? errorSum / r.matched * 1000.0 / benchRate : 0;
+  return r;
+}
+
+struct RiceResult {
+  uint32_t packets;
+  uint32_t escapes;
+  uint32_t decoded;     // Frames decoded bit-exact
+};
+
+/**
+ * Frame frameBuf as FORMAT_RICE packets the way the sender does, decode
+ * each one and compare it with the frames it was built from. Escapes are
+ * counted from the packet's k and the deltas, as the encoder decides them.
+ */
+RiceResult runRiceCase(uint8_t leads, uint32_t frames) {
+  RiceResult r = {};
+  static uint8_t packet[BENCH_MTU];
+  static int16_t decoded[MAX_EXT_SAMPLES_PER_PACKET * MAX_LEADS];
+  const uint16_t maxLen = BENCH_MTU - 3;
+
+  for (uint32_t pos = 0; pos < frames; r.packets++) {
+    const int16_t* src = frameBuf + pos * leads;
+    uint32_t remaining = frames - pos;
+    uint16_t available = remaining < MAX_EXT_SAMPLES_PER_PACKET ? remaining : MAX_EXT_SAMPLES_PER_PACKET;
+    uint16_t used;
+    uint16_t len = buildRicePacket(packet, r.packets, maxLen, src, available, leads, &used);
+
+    const uint8_t* k = packet + packet[5] + leads * 2;
+    for (uint32_t i = 1; i < used; i++) {
+      for (uint8_t c = 0; c < leads; c++) {
+        int32_t delta = (int32_t)src[i * leads + c] - src[(i - 1) * leads + c];
+        uint32_t z = delta < 0 ? (uint32_t)(-2 * delta - 1) : (uint32_t)(2 * delta);
+        r.escapes += (z >> k[c]) >= RICE_ESCAPE_Q;
+      }
+    }
+
+    uint8_t channels = 0;
+    uint16_t count = riceDecode(decoded, MAX_EXT_SAMPLES_PER_PACKET, &channels, packet, len);
+    if (count == used && channels == leads &&
+        memcmp(decoded, src, (size_t)used * leads * sizeof(int16_t)) == 0) {
+      r.decoded += used;
+    }
+    pos += used;
+  }
+  return r;
+}
+
+/**
+ * Full-scale square wave with a little noise: mostly small deltas (small
+ * k) and a ±65535 step every RICE_STEP_FRAMES frames, shifted per lead.
+ */
+void fillSteps(uint8_t leads, uint32_t frames) {
+  uint32_t noise = benchSeed;
+  for (uint32_t i = 0; i < frames; i++) {
+    for (uint8_t c = 0; c < leads; c++) {
+      noise = noise * 1664525u + 1013904223u;
+      int16_t jitter = (int16_t)(noise >> 29);   // 0..7
+      bool high = ((i + c * 7) / RICE_STEP_FRAMES) & 1;
+      frameBuf[i * leads + c] = high ? (int16_t)(32767 - jitter) : (int16_t)(-32768 + jitter);
+    }
+  }
+}
+
+struct FecResult {
+  double   nsPerPacket;
+  double   overheadPct;
+  uint32_t packets;
+  uint32_t rebuilt;
+};
+
+/**
+ * Frame frameBuf (one lead) as the sender does with FEC on, time the parity
+ * packets over the stream, then rebuild each packet of every group from
+ * the parity packet and the rest of the group.
+ */
+FecResult runFecCase(const FecCase& fc, uint32_t frames) {
+  FecResult r = {};
+  const uint16_t maxLen = BENCH_MTU - 3 - PARITY_OVERHEAD;
+  uint32_t capacity = frames + 1;   // ≥ 1 frame per packet
+  uint8_t*  packets = (uint8_t*)malloc((size_t)capacity * BENCH_MTU);
+  uint16_t* lengths = (uint16_t*)malloc(capacity * sizeof(uint16_t));
+  uint64_t dataBytes = 0;
+
+  for (uint32_t pos = 0; pos < frames; r.packets++) {
+    uint8_t* packet = packets + (size_t)r.packets * BENCH_MTU;
+    uint32_t remaining = frames - pos;
+    uint16_t used;
+    if (fc.format & FORMAT_RICE) {
+      uint16_t available = remaining < MAX_EXT_SAMPLES_PER_PACKET ? remaining : MAX_EXT_SAMPLES_PER_PACKET;
+      lengths[r.packets] = buildRicePacket(packet, r.packets, maxLen, frameBuf + pos, available, 1, &used);
+    } else {
+      uint32_t perPacket = (maxLen - PACKET_HEADER_SIZE) / 2;
+      if (perPacket > MAX_SAMPLES_PER_PACKET) perPacket = MAX_SAMPLES_PER_PACKET;
+      used = remaining < perPacket ? remaining : perPacket;
+      lengths[r.packets] = buildRawPacket(packet, r.packets, frameBuf + pos, used);
+    }
+    dataBytes += lengths[r.packets];
+    pos += used;
+  }
+
+  static ParityGroup group;
+  static uint8_t parity[BENCH_MTU + PARITY_OVERHEAD];
+  uint64_t parityBytes = 0, protectedPackets = 0;
+  int64_t elapsed = 0;
+  while (elapsed < BENCH_MIN_RUN_NS) {
+    parityBytes = 0;
+    int64_t t0 = nowNs();
+    group.count = 0;
+    for (uint32_t i = 0; i < r.packets; i++) {
+      parityAdd(group, packets + (size_t)i * BENCH_MTU, lengths[i]);
+      if (group.count == fc.group || i + 1 == r.packets) {
+        parityBytes += buildParityPacket(parity, group);
+        group.count = 0;
+      }
+    }
+    elapsed += nowNs() - t0;
+    protectedPackets += r.packets;
+  }
+  r.nsPerPacket = (double)elapsed / protectedPackets;
+  r.overheadPct = 100.0 * parityBytes / dataBytes;
+
+  const uint8_t* others[FEC_MAX_GROUP];
+  uint16_t otherLengths[FEC_MAX_GROUP];
+  static uint8_t rebuilt[BENCH_MTU];
+  for (uint32_t first = 0; first < r.packets; first += fc.group) {
+    uint32_t n = r.packets - first < fc.group ? r.packets - first : fc.group;
+    group.count = 0;
+    for (uint32_t i = 0; i < n; i++) parityAdd(group, packets + (size_t)(first + i) * BENCH_MTU, lengths[first + i]);
+    uint16_t parityLen = buildParityPacket(parity, group);
+
+    for (uint32_t lost = 0; lost < n; lost++) {
+      uint8_t count = 0;
+      for (uint32_t i = 0; i < n; i++) {
+        if (i == lost) continue;
+        others[count] = packets + (size_t)(first + i) * BENCH_MTU;
+        otherLengths[count++] = lengths[first + i];
+      }
+      uint16_t len = parityRecover(rebuilt, parity, parityLen, others, otherLengths, count);
+      const uint8_t* original = packets + (size_t)(first + lost) * BENCH_MTU;
+      r.rebuilt += (len == lengths[first + lost] && memcmp(rebuilt, original, len) == 0);
+    }
+  }
+
+  free(packets);
+  free(lengths);
+  return r;
+}
+
+int main(int argc, char** argv) {
+  bool csv = false;
+  int seconds = BENCH_DEFAULT_SECS;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--csv") == 0) {
+      csv = true;
+    } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+      seconds = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      benchSeed = (uint32_t)strtoul(argv[++i], nullptr, 0);
+    } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+      benchRate = (uint16_t)atoi(argv[++i]);
+      if (!isSupportedSampleRate(benchRate)) {
+        fprintf(stderr, "unsupported rate %u (250, 500 or 1000)\n", benchRate);
+        return 2;
+      }
+    } else {
+      fprintf(stderr, "usage: %s [--csv] [--seconds N] [--seed S] [--rate HZ]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (seconds < 1) seconds = 1;
+  if (seconds > BENCH_MAX_SECS) seconds = BENCH_MAX_SECS;
+
+  uint32_t frames = (uint32_t)seconds * benchRate;
+  frameBuf = (int16_t*)malloc((size_t)frames * MAX_LEADS * sizeof(int16_t));
+  // The paths switch per mode, so the tables keep both sets
+  uint8_t tableSets = BEAT_TABLES_FLOAT | BEAT_TABLES_Q;
+  void* tableStorage = malloc(beatTablesSize(tableSets, benchRate));
+  if (!frameBuf || !tableStorage) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  beatTablesInit(benchTables, tableStorage, tableSets, benchRate);
+
+  buildBeatTemplates();
+
+  if (csv) {
+    printf("mode,leads,frames_per_sec,ns_per_frame,block_ns_per_frame,realtime,e2e_packets_per_sec,bytes_per_frame\n");
+  } else {
+    printf("CardioGuard generator benchmark — %d s of signal per mode at %u Hz, MTU %d\n\n",
+      seconds, benchRate, BENCH_MTU);
+    printf("%-22s %5s %12s %10s %10s %10s %11s %8s\n",
+      "mode", "leads", "frames/s", "ns/frame", "block ns", "realtime", "pkts/s", "B/frame");
+  }
+
+  uint32_t checksum = 0, signalHash = 0;
+  int status = 0;
+  for (size_t i = 0; i < CASE_COUNT; i++) {
+    const BenchCase& bc = CASES[i];
+    BenchResult r = runCase(bc, frames);
+    checksum += r.checksum;
+    signalHash = (signalHash * 31) ^ r.signalHash;
+    double realtime = r.framesPerSec / benchRate;
+
+    if (csv) {
+      printf("%s,%u,%.0f,%.1f,%.1f,%.0f,%.0f,%.2f\n", bc.name, bc.leads,
+        r.framesPerSec, r.nsPerFrame, r.nsPerFrameBlock, realtime, r.packetsPerSec, r.bytesPerFrame);
+    } else {
+      printf("%-22s %5u %12.0f %10.1f %10.1f %9.0fx %11.0f %8.2f\n", bc.name, bc.leads,
+        r.framesPerSec, r.nsPerFrame, r.nsPerFrameBlock, realtime, r.packetsPerSec, r.bytesPerFrame);
+    }
+    if (r.blockHash != r.signalHash) {
+      fprintf(stderr, "%s: generateBlock() output differs (%08x, per frame %08x)\n",
+        bc.name, r.blockHash, r.signalHash);
+      status = 1;
+    }
+  }
+
+  if (!csv) printf("\nsignal %08x (seed 0x%08x), checksum %08x\n", signalHash, benchSeed, checksum);
+
+  if (csv) {
+    printf("\ndetector,ns_per_sample,beats,detected,sensitivity,predictivity,error_ms,class_match\n");
+  } else {
+    printf("\nQRS detector — lead II, matched within ±%d ms\n\n", DETECT_MATCH_MS);
+    printf("%-22s %10s %6s %8s %7s %7s %7s %7s\n",
+      "rhythm", "ns/sample", "beats", "detected", "Se %", "+P %", "err ms", "class %");
+  }
+  for (size_t i = 0; i < DETECT_CASE_COUNT; i++) {
+    const BenchCase& bc = DETECT_CASES[i];
+    DetectResult r = runDetectCase(bc, frames);
+    double se = r.beats ? 100.0 * r.matched / r.beats : 0;
+    double pp = r.detected ? 100.0 * r.matched / r.detected : 0;
+    double cls = r.matched ? 100.0 * r.classMatched / r.matched : 0;
+    if (csv) {
+      printf("%s,%.1f,%u,%u,%.2f,%.2f,%.1f,%.2f\n", bc.name, r.nsPerSample, r.beats, r.detected,
+        se, pp, r.errorMs, cls);
+    } else {
+      printf("%-22s %10.1f %6u %8u %7.1f %7.1f %7.1f %7.1f\n", bc.name, r.nsPerSample, r.beats,
+        r.detected, se, pp, r.errorMs, cls);
+    }
+  }
+
+  if (csv) {
+    printf("\nrice,leads,packets,escapes,frames,decoded\n");
+  } else {
+    printf("\nRice round trip — MTU %d, every packet decoded\n\n", BENCH_MTU);
+    printf("%-22s %5s %8s %8s %9s %9s\n", "stream", "leads", "packets", "escapes", "frames", "decoded");
+  }
+  for (size_t i = 0; i <= CASE_COUNT; i++) {
+    // The Rice modes, then the step input (i == CASE_COUNT) in 1 and 12 leads
+    const char* name;
+    uint8_t leads;
+    bool steps = i == CASE_COUNT;
+    if (!steps) {
+      const BenchCase& bc = CASES[i];
+      if (!(bc.format & FORMAT_RICE)) continue;
+      generateRun(bc, frames, false);
+      name = bc.name;
+      leads = bc.leads;
+    }
+    for (uint8_t pass = 0; pass < (steps ? 2 : 1); pass++) {
+      if (steps) {
+        leads = pass ? MAX_LEADS : 1;
+        name = pass ? "steps-12-lead" : "steps";
+        fillSteps(leads, frames);
+      }
+      RiceResult r = runRiceCase(leads, frames);
+      if (csv) {
+        printf("%s,%u,%u,%u,%u,%u\n", name, leads, r.packets, r.escapes, frames, r.decoded);
+      } else {
+        printf("%-22s %5u %8u %8u %9u %9u\n", name, leads, r.packets, r.escapes, frames, r.decoded);
+      }
+      if (r.decoded != frames) {
+        fprintf(stderr, "%s: %u of %u frames not decoded bit-exact\n", name, frames - r.decoded, frames);
+        status = 1;
+      }
+      if (steps && !r.escapes) {
+        fprintf(stderr, "%s: no escape coded, the escape path is untested\n", name);
+        status = 1;
+      }
+    }
+  }
+
+  if (csv) {
+    printf("\nfec,group,ns_per_packet,overhead_pct,packets,rebuilt\n");
+  } else {
+    printf("\nFEC parity — MTU %d, every packet of each group lost once\n\n", BENCH_MTU);
+    printf("%-22s %5s %10s %9s %8s %8s\n", "stream", "group", "ns/packet", "overhead", "packets", "rebuilt");
+  }
+  for (size_t i = 0; i < FEC_CASE_COUNT; i++) {
+    const FecCase& fc = FEC_CASES[i];
+    FecResult r = runFecCase(fc, frames);
+    if (csv) {
+      printf("%s,%u,%.1f,%.2f,%u,%u\n", fc.name, fc.group, r.nsPerPacket, r.overheadPct,
+        r.packets, r.rebuilt);
+    } else {
+      printf("%-22s %5u %10.1f %8.1f%% %8u %8u\n", fc.name, fc.group, r.nsPerPacket, r.overheadPct,
+        r.packets, r.rebuilt);
+    }
+    if (r.rebuilt != r.packets) {
+      fprintf(stderr, "%s: %u of %u packets not rebuilt from parity\n", fc.name,
+        r.packets - r.rebuilt, r.packets);
+      status = 1;
+    }
+  }
+  free(frameBuf);
+  return status;
+}
+
+#endif  // ARDUINO
@@ -0,0 +1,376 @@
+// =============================================================================
+// CardioGuard ESP32 Holter ECG Simulator — Packet Framing
+// =============================================================================
+// See ecg_packet.h for the wire formats.
+// =============================================================================
+
+#include "ecg_packet.h"
+
+#include <string.h>
+
+/**
+ * Build a legacy (format 0) ECG packet.
+ *
+ * Packet format (exactly matches ECGParser.ts):
+ *   Byte 0-1: uint16 sequence number (little-endian)
+ *   Byte 2-3: uint16 sample count (little-endian)
+ *   Byte 4+:  int16[] ADC values (little-endian)
+ *
+ * Returns the packet length.
+ */
+uint16_t buildRawPacket(uint8_t* packet, uint16_t seq, const int16_t* samples, uint16_t count) {
+  // Header: sequence number (uint16 LE)
+  packet[0] = seq & 0xFF;
+  packet[1] = (seq >> 8) & 0xFF;
+
+  // Header: sample count (uint16 LE)
+  packet[2] = count & 0xFF;
+  packet[3] = (count >> 8) & 0xFF;
+
+  for (uint16_t i = 0; i < count; i++) {
+    // int16 little-endian
+    int offset = PACKET_HEADER_SIZE + i * 2;
+    packet[offset]     = samples[i] & 0xFF;
+    packet[offset + 1] = (samples[i] >> 8) & 0xFF;
+  }
+
+  return PACKET_HEADER_SIZE + count * 2;
+}
+
+/**
+ * Write the extended header (everything except the count field, which is
+ * only known once the payload is built). Returns the header length.
+ */
+uint8_t writeExtHeader(uint8_t* packet, uint16_t seq, uint8_t flags, uint8_t channels,
+                       const ExtHeaderFields* fields) {
+  static const ExtHeaderFields none = {};
+  if (!fields) fields = &none;
+  packet[0] = seq & 0xFF;
+  packet[1] = (seq >> 8) & 0xFF;
+
+  uint8_t headerLen = EXT_HEADER_SIZE;
+  if (channels > 1) {
+    flags |= FORMAT_MULTI;
+    packet[headerLen++] = channels;
+  }
+  if (flags & FORMAT_BACKFILL) {
+    packet[headerLen++] = fields->frameOffset & 0xFF;
+    packet[headerLen++] = (fields->frameOffset >> 8) & 0xFF;
+  }
+  if (flags & FORMAT_RATE) {
+    packet[headerLen++] = fields->sampleRate & 0xFF;
+    packet[headerLen++] = (fields->sampleRate >> 8) & 0xFF;
+  }
+  if (flags & FORMAT_STAMP) {
+    for (int i = 0; i < 4; i++) packet[headerLen++] = (fields->frameIndex >> (8 * i)) & 0xFF;
+    for (int i = 0; i < 4; i++) packet[headerLen++] = (fields->timestampUs >> (8 * i)) & 0xFF;
+  }
+  if (flags & FORMAT_BENCH) {
+    for (int i = 0; i < 4; i++) packet[headerLen++] = (fields->sentUs >> (8 * i)) & 0xFF;
+  }
+  if (flags & FORMAT_PARITY) packet[headerLen++] = fields->parityCount;
+  packet[4] = flags;
+  packet[5] = headerLen;
+  return headerLen;
+}
+
+inline void writeExtCount(uint8_t* packet, uint16_t count) {
+  uint16_t countField = count | PACKET_FLAG_EXTENDED;
+  packet[2] = countField & 0xFF;
+  packet[3] = (countField >> 8) & 0xFF;
+}
+
+/**
+ * Build an uncompressed extended packet of interleaved multi-lead frames.
+ * Returns the packet length.
+ */
+uint16_t buildExtRawPacket(uint8_t* packet, uint16_t seq, const int16_t* frames,
+                           uint16_t count, uint8_t channels,
+                           uint8_t flags, const ExtHeaderFields* fields) {
+  uint8_t headerLen = writeExtHeader(packet, seq, flags, channels, fields);
+  writeExtCount(packet, count);
+
+  uint16_t values = count * channels;
+  for (uint16_t i = 0; i < values; i++) {
+    int offset = headerLen + i * 2;
+    packet[offset]     = frames[i] & 0xFF;
+    packet[offset + 1] = (frames[i] >> 8) & 0xFF;
+  }
+
+  return headerLen + values * 2;
+}
+
+// ─── Rice Coding ─────────────────────────────────────────────────────────────
+// Payload of a FORMAT_RICE packet with C channels (after the extended header):
+//   [0 .. 2C-1]     int16[C]  Keyframe — first frame, verbatim (every packet
+//                             decodes on its own, so a lost packet never
+//                             corrupts the next one)
+//   [2C .. 3C-1]    uint8[C]  Rice parameter k per channel
+//   [3C+]           Bitstream, MSB first: for each remaining frame, one code
+//                   per channel (channel order as in the frame)
+//          zigzag(delta) = q·2^k + r → q '1' bits, one '0', then r in k bits
+//          q ≥ RICE_ESCAPE_Q → RICE_ESCAPE_Q '1' bits, then the sample
+//          itself as 16 raw bits (the decoder restarts its predictor there)
+//          Zero padded to a byte boundary.
+
+struct BitWriter {
+  uint8_t* out;
+  uint16_t bytes;
+  uint32_t acc;
+  uint8_t  accBits;
+};
+
+/**
+ * Append the low nbits (≤ 24) of value, MSB first.
+ */
+inline void bitPut(BitWriter& w, uint32_t value, uint8_t nbits) {
+  w.acc = (w.acc << nbits) | value;
+  w.accBits += nbits;
+  while (w.accBits >= 8) {
+    w.accBits -= 8;
+    w.out[w.bytes++] = (uint8_t)(w.acc >> w.accBits);
+  }
+}
+
+inline void bitFlush(BitWriter& w) {
+  if (w.accBits > 0) {
+    w.out[w.bytes++] = (uint8_t)(w.acc << (8 - w.accBits));
+    w.accBits = 0;
+  }
+}
+
+inline uint32_t zigzag(int32_t v) {
+  return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+inline int32_t unzigzag(uint32_t z) {
+  return (int32_t)(z >> 1) ^ -(int32_t)(z & 1);
+}
+
+struct BitReader {
+  const uint8_t* in;
+  uint32_t bits;          // Bits available
+  uint32_t pos;
+};
+
+/**
+ * Read nbits (≤ 16), MSB first. Returns false past the end.
+ */
+inline bool bitGet(BitReader& r, uint8_t nbits, uint32_t* value) {
+  if (r.pos + nbits > r.bits) return false;
+  uint32_t v = 0;
+  for (uint8_t i = 0; i < nbits; i++, r.pos++) {
+    v = (v << 1) | ((r.in[r.pos >> 3] >> (7 - (r.pos & 7))) & 1);
+  }
+  *value = v;
+  return true;
+}
+
+inline uint32_t riceCodeBits(uint32_t z, uint8_t k) {
+  uint32_t q = z >> k;
+  return (q < RICE_ESCAPE_Q) ? q + 1 + k : RICE_ESCAPE_Q + 16;
+}
+
+/**
+ * Build a FORMAT_RICE packet from up to `available` frames of `channels`
+ * interleaved samples, packing as many frames as fit in maxLen bytes.
+ * *used receives the number of frames encoded. Returns the packet length.
+ */
+uint16_t buildRicePacket(uint8_t* packet, uint16_t seq, uint16_t maxLen,
+                         const int16_t* frames, uint16_t available,
+                         uint8_t channels, uint16_t* used,
+                         uint8_t flags, const ExtHeaderFields* fields) {
+  uint8_t headerLen = writeExtHeader(packet, seq, flags | FORMAT_RICE, channels, fields);
+  uint8_t* payload = packet + headerLen;
+
+  // Keyframe, then k per channel from the mean zig-zag magnitude (sum ≤ n·2^k rule)
+  uint8_t k[MAX_LEADS];
+  uint32_t n = (available > 1) ? available - 1 : 1;
+  for (uint8_t c = 0; c < channels; c++) {
+    payload[c * 2]     = frames[c] & 0xFF;
+    payload[c * 2 + 1] = (frames[c] >> 8) & 0xFF;
+
+    uint32_t sum = 0;
+    for (uint16_t i = 1; i < available; i++) {
+      sum += zigzag((int32_t)frames[i * channels + c] - frames[(i - 1) * channels + c]);
+    }
+    k[c] = 0;
+    while (k[c] < RICE_MAX_K && (n << k[c]) < sum) k[c]++;
+    payload[channels * 2 + c] = k[c];
+  }
+
+  uint16_t fixedLen = headerLen + channels * 3;
+  BitWriter w = { packet + fixedLen, 0, 0, 0 };
+  uint32_t budgetBits = (uint32_t)(maxLen - fixedLen) * 8;
+  uint32_t bits = 0;
+  uint16_t count = 1;
+
+  while (count < available) {
+    const int16_t* cur  = frames + count * channels;
+    const int16_t* prev = cur - channels;
+
+    // Only whole frames go into a packet
+    uint32_t z[MAX_LEADS];
+    uint32_t frameBits = 0;
+    for (uint8_t c = 0; c < channels; c++) {
+      z[c] = zigzag((int32_t)cur[c] - prev[c]);
+      frameBits += riceCodeBits(z[c], k[c]);
+    }
+    if (bits + frameBits > budgetBits) break;
+
+    for (uint8_t c = 0; c < channels; c++) {
+      uint32_t q = z[c] >> k[c];
+      if (q < RICE_ESCAPE_Q) {
+        bitPut(w, (1u << q) - 1, q);                       // q ones
+        bitPut(w, 0, 1);                                   // terminator
+        if (k[c]) bitPut(w, z[c] & ((1u << k[c]) - 1), k[c]); // remainder
+      } else {
+        bitPut(w, (1u << RICE_ESCAPE_Q) - 1, RICE_ESCAPE_Q);
+        bitPut(w, (uint16_t)cur[c], 16);
+      }
+    }
+    bits += frameBits;
+    count++;
+  }
+  bitFlush(w);
+
+  writeExtCount(packet, count);
+  *used = count;
+  return fixedLen + w.bytes;
+}
+
+// ─── Parity Packets ──────────────────────────────────────────────────────────
+
+/**
+ * XOR `len` bytes into a parity buffer that so far holds `held` bytes; the
+ * part beyond them is copied (XOR with the zero padding).
+ */
+inline void parityMix(uint8_t* data, uint16_t held, const uint8_t* bytes, uint16_t len) {
+  uint16_t common = len < held ? len : held;
+  for (uint16_t i = 0; i < common; i++) data[i] ^= bytes[i];
+  if (len > held) memcpy(data + held, bytes + held, len - held);
+}
+
+void parityAdd(ParityGroup& g, const uint8_t* packet, uint16_t len) {
+  if (len > PARITY_MAX_DATA) len = PARITY_MAX_DATA;
+  if (g.count == 0) {
+    g.firstSeq = packet[0] | (packet[1] << 8);
+    g.lengthXor = 0;
+    g.longest = 0;
+  }
+  uint16_t n = len > 2 ? len - 2 : 0;
+  parityMix(g.data, g.longest, packet + 2, n);
+  if (n > g.longest) g.longest = n;
+  g.lengthXor ^= len;
+  g.count++;
+}
+
+uint16_t buildParityPacket(uint8_t* packet, const ParityGroup& g) {
+  ExtHeaderFields fields = {};
+  fields.parityCount = g.count;
+  uint8_t headerLen = writeExtHeader(packet, g.firstSeq, FORMAT_PARITY, 1, &fields);
+  writeExtCount(packet, 0);
+  packet[headerLen]     = g.lengthXor & 0xFF;
+  packet[headerLen + 1] = (g.lengthXor >> 8) & 0xFF;
+  memcpy(packet + headerLen + 2, g.data, g.longest);
+  return headerLen + 2 + g.longest;
+}
+
+uint16_t parityRecover(uint8_t* out, const uint8_t* parity, uint16_t parityLen,
+                       const uint8_t* const* packets, const uint16_t* lengths, uint8_t count) {
+  if (parityLen < EXT_HEADER_SIZE || !(parity[4] & FORMAT_PARITY)) return 0;
+  uint8_t headerLen = parity[5];
+  if (parityLen < headerLen + 2 || parity[headerLen - 1] != count + 1) return 0;
+
+  uint16_t held = parityLen - headerLen - 2;
+  uint16_t len = parity[headerLen] | (parity[headerLen + 1] << 8);
+  memcpy(out + 2, parity + headerLen + 2, held);
+  for (uint8_t j = 0; j < count; j++) {
+    uint16_t n = lengths[j] > 2 ? lengths[j] - 2 : 0;
+    parityMix(out + 2, held, packets[j] + 2, n);
+    if (n > held) held = n;
+    len ^= lengths[j];
+  }
+  if (len < 2 || len - 2 > held) return 0;
+
+  // The group's sequence numbers are consecutive: the missing one is the
+  // only one not among the packets that arrived
+  uint16_t first = parity[0] | (parity[1] << 8);
+  uint16_t seq = first;
+  for (uint8_t k = 0; k <= count; k++) {
+    uint16_t candidate = first + k;
+    bool present = false;
+    for (uint8_t j = 0; j < count && !present; j++) {
+      present = (uint16_t)(packets[j][0] | (packets[j][1] << 8)) == candidate;
+    }
+    if (!present) {
+      seq = candidate;
+      break;
+    }
+  }
+  out[0] = seq & 0xFF;
+  out[1] = (seq >> 8) & 0xFF;
+  return len;
+}
+
+// ─── Rice Decoding ───────────────────────────────────────────────────────────
+
+uint16_t riceDecode(int16_t* frames, uint16_t maxFrames, uint8_t* channels,
+                    const uint8_t* packet, uint16_t len) {
+  if (len < EXT_HEADER_SIZE) return 0;
+  uint16_t countField = packet[2] | (packet[3] << 8);
+  uint8_t flags = packet[4];
+  uint8_t headerLen = packet[5];
+  if (!(countField & PACKET_FLAG_EXTENDED) || !(flags & FORMAT_RICE) ||
+      headerLen < EXT_HEADER_SIZE || headerLen > len) return 0;
+  uint8_t ch = (flags & FORMAT_MULTI) ? packet[EXT_HEADER_SIZE] : 1;
+  uint16_t count = countField & ~PACKET_FLAG_EXTENDED;
+  uint16_t fixedLen = headerLen + ch * 3;
+  if (ch == 0 || ch > MAX_LEADS || count == 0 || count > maxFrames || fixedLen > len) return 0;
+
+  // Keyframe and k per channel
+  const uint8_t* payload = packet + headerLen;
+  uint8_t k[MAX_LEADS];
+  for (uint8_t c = 0; c < ch; c++) {
+    frames[c] = (int16_t)(payload[c * 2] | (payload[c * 2 + 1] << 8));
+    k[c] = payload[ch * 2 + c];
+    if (k[c] > RICE_MAX_K) return 0;
+  }
+
+  BitReader r = { packet + fixedLen, (uint32_t)(len - fixedLen) * 8, 0 };
+  for (uint16_t i = 1; i < count; i++) {
+    int16_t* cur = frames + i * ch;
+    const int16_t* prev = cur - ch;
+    for (uint8_t c = 0; c < ch; c++) {
+      uint32_t q = 0, bit;
+      while (q < RICE_ESCAPE_Q) {
+        if (!bitGet(r, 1, &bit)) return 0;
+        if (!bit) break;                 // Terminator
+        q++;
+      }
+      uint32_t value;
+      if (q == RICE_ESCAPE_Q) {
+        // Escape: the sample itself, the next delta starts from it
+        if (!bitGet(r, 16, &value)) return 0;
+        cur[c] = (int16_t)value;
+      } else {
+        uint32_t rem = 0;
+        if (k[c] && !bitGet(r, k[c], &rem)) return 0;
+        cur[c] = (int16_t)(prev[c] + unzigzag((q << k[c]) | rem));
+      }
+    }
+  }
+  *channels = ch;
+  return count;
+}
+
+/**
+ * Smallest packet (header + one frame) a format needs — it must fit in
+ * MTU - 3 or the stream cannot be sent at all.
+ */
+uint16_t minPacketSize(uint8_t format, uint8_t channels, uint8_t extraFlags) {
+  uint8_t flags = (format & FORMAT_STAMP) | extraFlags;
+  if (format & FORMAT_RICE)                    return extHeaderLength(channels, flags) + channels * 3;
+  if (channels > 1 || (format & FORMAT_STAMP)) return extHeaderLength(channels, flags) + channels * 2;
+  return PACKET_HEADER_SIZE + 2;
+}
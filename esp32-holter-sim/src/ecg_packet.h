@@ -0,0 +1,171 @@
+// =============================================================================
+// CardioGuard ESP32 Holter ECG Simulator — Packet Framing
+// =============================================================================
+// Builds ECG notification payloads; the central-side decoders check them in
+// the native benchmark. Transport independent (no BLE headers), shared by
+// the firmware and the benchmark.
+//
+// Packet Format (exactly matches mobile ECGParser.ts):
+//   [0-1]  uint16  Sequence number (little-endian)
+//   [2-3]  uint16  Number of samples in this packet (little-endian)
+//   [4+]   int16[] Raw ADC values (little-endian, 2 bytes each)
+// =============================================================================
+
+#pragma once
+
+#include <stdint.h>
+#include "ecg_synth.h"
+
+#define PACKET_HEADER_SIZE     4    // uint16 seq + uint16 count
+#define MAX_SAMPLES_PER_PACKET 100  // Upper bound accepted by ECGParser.ts
+
+// ─── Extended Packet Formats ────────────────────────────────────────────────
+// Bit 15 of the count field marks an extended packet. ECGParser.ts rejects
+// such a count as out of range, so extended packets are only sent after the
+// central opts in over the control characteristic (format 0 stays default).
+//   [0-1]  uint16  Sequence number
+//   [2-3]  uint16  Sample count | PACKET_FLAG_EXTENDED
+//   [4]    uint8   Format flags (FORMAT_*)
+//   [5]    uint8   Header length — payload starts here, so parsers can skip
+//                  header fields they do not know
+//   [6]    uint8   Channel count (only with FORMAT_MULTI)
+//   [+2]   uint16  Frame offset within the original packet (only with
+//                  FORMAT_BACKFILL)
+//   [+2]   uint16  Sample rate in Hz (only with FORMAT_RATE — sent while the
+//                  stream runs at another rate than SAMPLE_RATE)
+//   [+4]   uint32  Stream index of the packet's first frame (only with
+//                  FORMAT_STAMP) — counts every frame since boot, so gaps
+//                  and wraps of the 16-bit sequence number are unambiguous
+//   [+4]   uint32  Sample-clock time of that frame, µs since boot (low 32
+//                  bits; wraps after ~71 min, the frame index does not)
+//   [+4]   uint32  Send time, µs since boot (low 32 bits — only with
+//                  FORMAT_BENCH; the central echoes it for the round trip)
+//   [+1]   uint8   Packets covered (only with FORMAT_PARITY — see below)
+// Optional fields follow in flag-bit order.
+#define PACKET_FLAG_EXTENDED       0x8000
+#define EXT_HEADER_SIZE            6
+#define FORMAT_RICE                0x01  // Delta + zig-zag + Rice coded samples
+#define FORMAT_MULTI               0x02  // Interleaved multi-lead frames (set by device)
+#define FORMAT_BACKFILL            0x04  // Resent recorded packet (set by device)
+#define FORMAT_RATE                0x08  // Non-default sample rate (set by device)
+#define FORMAT_STAMP               0x10  // 32-bit frame index + µs timestamp
+#define FORMAT_BENCH               0x20  // Link benchmark filler, not ECG (set by device)
+#define FORMAT_PARITY              0x40  // FEC parity of a packet group, not ECG (set by device)
+#define FORMAT_NEGOTIABLE          (FORMAT_RICE | FORMAT_STAMP)
+#define FORMAT_CAPABILITIES        (FORMAT_RICE | FORMAT_MULTI | FORMAT_BACKFILL | FORMAT_RATE | \
+                                    FORMAT_STAMP | FORMAT_BENCH | FORMAT_PARITY)
+#define MAX_EXT_SAMPLES_PER_PACKET 250   // Frames per packet — ≤ 1 s at any rate, bounds latency
+#define RICE_MAX_K                 14
+#define RICE_ESCAPE_Q              16    // Unary prefix length of an escape
+
+/**
+ * Values of the optional extended header fields. Each is only written when
+ * its FORMAT_* flag is set.
+ */
+struct ExtHeaderFields {
+  uint16_t frameOffset;   // FORMAT_BACKFILL
+  uint16_t sampleRate;    // FORMAT_RATE
+  uint32_t frameIndex;    // FORMAT_STAMP
+  uint32_t timestampUs;   // FORMAT_STAMP
+  uint32_t sentUs;        // FORMAT_BENCH
+  uint8_t  parityCount;   // FORMAT_PARITY
+};
+
+/**
+ * Extended header length for a format — used to size packets up front.
+ */
+inline uint8_t extHeaderLength(uint8_t channels, uint8_t flags = 0) {
+  return EXT_HEADER_SIZE + (channels > 1 ? 1 : 0) + ((flags & FORMAT_BACKFILL) ? 2 : 0)
+       + ((flags & FORMAT_RATE) ? 2 : 0) + ((flags & FORMAT_STAMP) ? 8 : 0)
+       + ((flags & FORMAT_BENCH) ? 4 : 0) + ((flags & FORMAT_PARITY) ? 1 : 0);
+}
+
+/**
+ * Legacy (format 0) packet of single-lead samples. Returns the length.
+ */
+uint16_t buildRawPacket(uint8_t* packet, uint16_t seq, const int16_t* samples, uint16_t count);
+
+/**
+ * Uncompressed extended packet of interleaved frames. Returns the length.
+ * The optional header fields selected by flags come from `fields`.
+ */
+uint16_t buildExtRawPacket(uint8_t* packet, uint16_t seq, const int16_t* frames,
+                           uint16_t count, uint8_t channels,
+                           uint8_t flags = 0, const ExtHeaderFields* fields = nullptr);
+
+/**
+ * FORMAT_RICE packet holding as many of `available` frames as fit in maxLen.
+ * *used receives the frame count. Returns the length.
+ */
+uint16_t buildRicePacket(uint8_t* packet, uint16_t seq, uint16_t maxLen,
+                         const int16_t* frames, uint16_t available,
+                         uint8_t channels, uint16_t* used,
+                         uint8_t flags = 0, const ExtHeaderFields* fields = nullptr);
+
+/**
+ * Smallest packet (header + one frame) a format needs. extraFlags are the
+ * device-set header fields (FORMAT_BACKFILL, FORMAT_RATE) it will carry.
+ * With FORMAT_STAMP even a single lead goes out in an extended packet.
+ */
+uint16_t minPacketSize(uint8_t format, uint8_t channels, uint8_t extraFlags = 0);
+
+// ─── Parity Packets (FORMAT_PARITY) ─────────────────────────────────────────
+// Forward error correction without retransmission: after a group of up to K
+// packets with consecutive sequence numbers the device sends one parity
+// packet, from which the central rebuilds a single lost packet of the group
+// locally instead of asking for a backfill.
+//   [0-1]  uint16  Sequence number of the group's first packet
+//   [2-3]  uint16  PACKET_FLAG_EXTENDED (no samples)
+//   [4]    uint8   FORMAT_PARITY
+//   [5]    uint8   Header length
+//   [6]    uint8   Packets covered
+//   [+2]   uint16  XOR of their lengths
+//   [+]    XOR of their bytes from offset 2 on, each zero padded to the
+//          longest
+// The lost packet is that XOR combined with every other packet of the group
+// the same way, cut to the length XOR; its first two bytes are its sequence
+// number. A parity packet is PARITY_OVERHEAD bytes longer than the longest
+// packet it covers, so packets of a protected stream leave that much room.
+#define PARITY_MAX_DATA            512   // Longest packet a group can cover (ATT value limit)
+#define PARITY_OVERHEAD            (EXT_HEADER_SIZE + 1 + 2 - 2)   // 7
+
+/**
+ * Parity of the packets sent so far in a group.
+ */
+struct ParityGroup {
+  uint16_t firstSeq;
+  uint8_t  count;        // Packets added (0 = empty group)
+  uint16_t lengthXor;
+  uint16_t longest;      // Longest packet added, without its sequence number
+  uint8_t  data[PARITY_MAX_DATA];
+};
+
+/**
+ * Add a packet to the group. The first packet starts the group at its
+ * sequence number; the caller keeps the rest consecutive.
+ */
+void parityAdd(ParityGroup& g, const uint8_t* packet, uint16_t len);
+
+/**
+ * Parity packet of the group (count must be > 0). Returns the length. The
+ * caller empties the group (count = 0) for the next one.
+ */
+uint16_t buildParityPacket(uint8_t* packet, const ParityGroup& g);
+
+/**
+ * Central side: rebuild the one packet of a group that did not arrive from
+ * its parity packet and the `count` packets that did, and write it to out.
+ * Returns its length, or 0 if `parity` is not a parity packet or more than
+ * one packet is missing.
+ */
+uint16_t parityRecover(uint8_t* out, const uint8_t* parity, uint16_t parityLen,
+                       const uint8_t* const* packets, const uint16_t* lengths, uint8_t count);
+
+/**
+ * Central side: decode a FORMAT_RICE packet into interleaved frames (room
+ * for maxFrames frames of up to MAX_LEADS samples). *channels receives the
+ * channel count. Returns the frame count, or 0 if the packet is not a
+ * FORMAT_RICE packet, is cut short or holds more than maxFrames frames.
+ */
+uint16_t riceDecode(int16_t* frames, uint16_t maxFrames, uint8_t* channels,
+                    const uint8_t* packet, uint16_t len);
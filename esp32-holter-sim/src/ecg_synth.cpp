@@ -0,0 +1,1148 @@
+// =============================================================================
+// CardioGuard ESP32 Holter ECG Simulator — Waveform Synthesis
+// =============================================================================
+// See ecg_synth.h. Plain C/C++ only — builds unchanged for the firmware and
+// the native benchmark.
+// =============================================================================
+
+#include "ecg_synth.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Generator State
+// ─────────────────────────────────────────────────────────────────────────────
+
+SynthPath synthPath = SYNTH_DEFAULT_PATH;
+
+#define WANDER_RAD_PER_S 0.3    // Baseline wander
+#define JITTER_RAD_PER_S 25.0   // PVC jitter and AF f-waves (0.1 rad/sample at 250 Hz)
+
+/**
+ * Advance a xorshift32 state and return the new value.
+ */
+inline uint32_t xorshift32(uint32_t& state) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+/**
+ * Uniform integer in [lo, hi) from the stream's generator (hi - lo ≤ 65536).
+ */
+inline int32_t synthRandom(SynthState& s, int32_t lo, int32_t hi) {
+  return lo + (int32_t)(((xorshift32(s.rngState) >> 16) * (uint32_t)(hi - lo)) >> 16);
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// ECG Waveform Generator
+// ─────────────────────────────────────────────────────────────────────────────
+
+/**
+ * Gaussian function — for modeling ECG wave components.
+ */
+float gaussian(float x, float center, float width) {
+  float diff = x - center;
+  return exp(-(diff * diff) / (2.0 * width * width));
+}
+
+// ─── Wave Components ────────────────────────────────────────────────────────
+// Each wave is a Gaussian (center and width as a fraction of the beat) with
+// its amplitude in lead II, plus a direction in the cardiac vector space
+// (X: right→left, Y: superior→inferior, Z: anterior→posterior). The scalar
+// model uses the amplitudes directly; the multi-lead model projects the
+// direction onto each lead, scaled so that lead II reproduces the scalar
+// waveform exactly.
+
+struct WaveComponent {
+  float center;
+  float width;
+  float amplitude;   // mV in lead II
+  float dir[3];      // Heart vector direction (X, Y, Z)
+};
+
+// Normal sinus rhythm model:
+//   - P wave: Small positive deflection before QRS
+//   - QRS complex: Sharp R-peak, Q and S deflections
+//   - T wave: Broad positive wave after QRS
+//   - U wave: Very small (for realism)
+constexpr WaveComponent NORMAL_WAVES[] = {
+  { 0.12, 0.025,  0.15, {  0.50,  0.80, -0.10 } },  // P wave (at ~12% of cycle, width ~2.5%)
+  { 0.20, 0.008, -0.10, {  0.60,  0.60,  0.40 } },  // Q wave (septal, small negative before R)
+  { 0.22, 0.010,  1.20, {  0.50,  0.80,  0.30 } },  // R peak (sharp positive peak)
+  { 0.24, 0.008, -0.25, { -0.20,  0.50, -0.90 } },  // S wave (negative deflection after R)
+  { 0.38, 0.040,  0.30, {  0.50,  0.70,  0.10 } },  // T wave (broad positive)
+  { 0.50, 0.025,  0.03, {  0.50,  0.70,  0.10 } },  // U wave (very small)
+};
+
+// PVC (Premature Ventricular Contraction) model — wide QRS, leftward axis
+constexpr WaveComponent PVC_WAVES[] = {
+  { 0.20, 0.018,  0.08, {  0.50,  0.80, -0.10 } },  // Small P
+  { 0.22, 0.015, -0.20, {  0.60,  0.60,  0.40 } },  // Deep Q
+  { 0.25, 0.020,  1.80, {  0.80,  0.50,  0.60 } },  // Tall R
+  { 0.30, 0.018, -0.50, { -0.20,  0.50, -0.90 } },  // Deep S
+  { 0.45, 0.060, -0.25, {  0.50,  0.70,  0.10 } },  // Inverted T
+};
+
+// Atrial fibrillation — no P wave (the atria only show f-waves, added on
+// the baseline), ventricular complex as in sinus rhythm
+constexpr WaveComponent AF_WAVES[] = {
+  { 0.20, 0.008, -0.10, {  0.60,  0.60,  0.40 } },  // Q
+  { 0.22, 0.010,  1.20, {  0.50,  0.80,  0.30 } },  // R
+  { 0.24, 0.008, -0.25, { -0.20,  0.50, -0.90 } },  // S
+  { 0.38, 0.040,  0.28, {  0.50,  0.70,  0.10 } },  // T
+};
+
+// Ventricular tachycardia — no P, QRS wider than a third of the (short)
+// cycle, discordant T; the beats merge into a near-sinusoidal trace
+constexpr WaveComponent VT_WAVES[] = {
+  { 0.10, 0.040, -0.20, {  0.60,  0.60,  0.40 } },  // Slurred Q
+  { 0.20, 0.050,  1.50, {  0.80,  0.50,  0.60 } },  // Broad R
+  { 0.32, 0.040, -0.60, { -0.20,  0.50, -0.90 } },  // Deep S
+  { 0.62, 0.090, -0.40, {  0.50,  0.70,  0.10 } },  // Discordant T
+};
+
+// Supraventricular tachycardia — narrow QRS, P retrograde and small (in the
+// ST segment), T close to the next beat
+constexpr WaveComponent SVT_WAVES[] = {
+  { 0.10, 0.020, -0.10, {  0.60,  0.60,  0.40 } },  // Q
+  { 0.14, 0.025,  1.10, {  0.50,  0.80,  0.30 } },  // R
+  { 0.18, 0.020, -0.25, { -0.20,  0.50, -0.90 } },  // S
+  { 0.28, 0.030, -0.05, { -0.50, -0.80,  0.10 } },  // Retrograde P (inverted)
+  { 0.48, 0.080,  0.25, {  0.50,  0.70,  0.10 } },  // T
+};
+
+// AV block — sinus P wave with a long PR interval (~250 ms at 75 BPM);
+// non-conducted beats keep only the P wave (AV_BLOCK_P_END)
+constexpr WaveComponent AV_BLOCK_WAVES[] = {
+  { 0.10, 0.025,  0.15, {  0.50,  0.80, -0.10 } },  // P
+  { 0.34, 0.008, -0.10, {  0.60,  0.60,  0.40 } },  // Q
+  { 0.36, 0.010,  1.20, {  0.50,  0.80,  0.30 } },  // R
+  { 0.38, 0.008, -0.25, { -0.20,  0.50, -0.90 } },  // S
+  { 0.52, 0.040,  0.30, {  0.50,  0.70,  0.10 } },  // T
+};
+
+// ST elevation — sinus beat with a raised ST segment and a taller T,
+// pointing anterior (largest in V2-V4, as an anterior infarction)
+constexpr WaveComponent STE_WAVES[] = {
+  { 0.12, 0.025,  0.15, {  0.50,  0.80, -0.10 } },  // P
+  { 0.20, 0.008, -0.10, {  0.60,  0.60,  0.40 } },  // Q
+  { 0.22, 0.010,  1.20, {  0.50,  0.80,  0.30 } },  // R
+  { 0.24, 0.008, -0.20, { -0.20,  0.50, -0.90 } },  // S (shallower)
+  { 0.30, 0.035,  0.15, {  0.30,  0.30, -0.90 } },  // ST segment elevation
+  { 0.38, 0.040,  0.40, {  0.30,  0.50, -0.60 } },  // Hyperacute T
+};
+
+#define WAVE_COUNT(w) (sizeof(w) / sizeof((w)[0]))
+
+// Beat morphologies — BeatTables::morphology and RhythmSpec::morphology
+enum BeatMorphology : uint8_t {
+  MORPH_NORMAL, MORPH_PVC, MORPH_AF, MORPH_VT, MORPH_SVT, MORPH_AV_BLOCK, MORPH_STE,
+  MORPH_COUNT
+};
+
+struct WaveSet {
+  const WaveComponent* waves;
+  uint8_t              count;
+};
+
+constexpr WaveSet MORPHOLOGIES[MORPH_COUNT] = {
+  { NORMAL_WAVES,   WAVE_COUNT(NORMAL_WAVES) },
+  { PVC_WAVES,      WAVE_COUNT(PVC_WAVES) },
+  { AF_WAVES,       WAVE_COUNT(AF_WAVES) },
+  { VT_WAVES,       WAVE_COUNT(VT_WAVES) },
+  { SVT_WAVES,      WAVE_COUNT(SVT_WAVES) },
+  { AV_BLOCK_WAVES, WAVE_COUNT(AV_BLOCK_WAVES) },
+  { STE_WAVES,      WAVE_COUNT(STE_WAVES) },
+};
+
+/**
+ * Position of the R peak within the beat: center of the largest wave.
+ */
+constexpr float rPeakCenter(const WaveSet& set) {
+  float center = 0.0f, amplitude = 0.0f;
+  for (uint8_t w = 0; w < set.count; w++) {
+    float a = set.waves[w].amplitude < 0 ? -set.waves[w].amplitude : set.waves[w].amplitude;
+    if (a > amplitude) {
+      amplitude = a;
+      center = set.waves[w].center;
+    }
+  }
+  return center;
+}
+
+constexpr float R_PEAK_CENTERS[MORPH_COUNT] = {
+  rPeakCenter(MORPHOLOGIES[MORPH_NORMAL]),
+  rPeakCenter(MORPHOLOGIES[MORPH_PVC]),
+  rPeakCenter(MORPHOLOGIES[MORPH_AF]),
+  rPeakCenter(MORPHOLOGIES[MORPH_VT]),
+  rPeakCenter(MORPHOLOGIES[MORPH_SVT]),
+  rPeakCenter(MORPHOLOGIES[MORPH_AV_BLOCK]),
+  rPeakCenter(MORPHOLOGIES[MORPH_STE]),
+};
+
+// Direction of the PVC jitter component (same as the T wave)
+constexpr float PVC_JITTER_DIR[3] = { 0.50, 0.70, 0.10 };
+
+// Direction of the AF f-waves (atrial, same as the P wave)
+constexpr float ATRIAL_DIR[3] = { 0.50, 0.80, -0.10 };
+
+#define AF_FWAVE_MV     0.05f   // f-wave amplitude in lead II (jitter oscillator, ~4 Hz)
+#define AV_BLOCK_P_END  0.25f   // Non-conducted beat: isoelectric after this point
+
+// ─── Rhythm Library ─────────────────────────────────────────────────────────
+// Rates are the usual textbook values; R-R variation is uniform ± ‰ per beat
+// (sinus rhythm ±5 %, AF ±30 % — irregularly irregular).
+
+const RhythmSpec RHYTHMS[RHYTHM_COUNT] = {
+  // name        morphology       BPM  HRV ‰  conduction  f-waves
+  { "normal",    MORPH_NORMAL,    72,   50,   0,          false },
+  { "af",        MORPH_AF,        110, 300,   0,          true  },
+  { "vt",        MORPH_VT,        170,  10,   0,          false },
+  { "svt",       MORPH_SVT,       190,  10,   0,          false },
+  { "brady",     MORPH_NORMAL,    42,   50,   0,          false },
+  { "avblock",   MORPH_AV_BLOCK,  75,   20,   3,          false },  // Mobitz II 3:2
+  { "ste",       MORPH_STE,       80,   50,   0,          false },
+};
+
+// Lead vectors (Dower transform, heart vector → 12-lead). Limb leads III,
+// aVR, aVL and aVF follow from I and II by Einthoven/Goldberger.
+constexpr float LEAD_VECTORS[MAX_LEADS][3] = {
+  {  0.632,  -0.235,   0.059  },  // I
+  {  0.235,   1.066,  -0.132  },  // II
+  { -0.397,   1.301,  -0.191  },  // III  = II - I
+  { -0.4335, -0.4155,  0.0365 },  // aVR  = -(I + II) / 2
+  {  0.5145, -0.768,   0.125  },  // aVL  = I - II / 2
+  { -0.081,   1.1835, -0.1615 },  // aVF  = II - I / 2
+  { -0.515,   0.157,  -0.917  },  // V1
+  {  0.044,   0.164,  -1.387  },  // V2
+  {  0.882,   0.098,  -1.277  },  // V3
+  {  1.213,   0.127,  -0.601  },  // V4
+  {  1.125,   0.127,  -0.086  },  // V5
+  {  0.831,   0.076,   0.230  },  // V6
+};
+
+const char* const LEAD_NAMES[MAX_LEADS] = {
+  "I", "II", "III", "aVR", "aVL", "aVF", "V1", "V2", "V3", "V4", "V5", "V6"
+};
+
+/**
+ * Heart vector gain of a direction: dir scaled so its lead II projection is
+ * 1.0. Multiplying by a lead-II amplitude gives the component's heart vector.
+ */
+constexpr void directionGain(const float dir[3], float out[3]) {
+  const float* leadII = LEAD_VECTORS[1];
+  float proj = leadII[0] * dir[0] + leadII[1] * dir[1] + leadII[2] * dir[2];
+  for (int c = 0; c < 3; c++) out[c] = dir[c] / proj;
+}
+
+/**
+ * Heart vector (X, Y, Z) at a position within the beat (0.0 - 1.0).
+ * Projected onto lead II it equals beatMorphology().
+ */
+void beatVector(float posInBeat, uint8_t morphology, float v[3]) {
+  const WaveComponent* waves = MORPHOLOGIES[morphology].waves;
+  size_t count = MORPHOLOGIES[morphology].count;
+
+  v[0] = v[1] = v[2] = 0.0;
+  for (size_t i = 0; i < count; i++) {
+    float gain[3];
+    directionGain(waves[i].dir, gain);
+    float a = gaussian(posInBeat, waves[i].center, waves[i].width) * waves[i].amplitude;
+    for (int c = 0; c < 3; c++) v[c] += a * gain[c];
+  }
+}
+
+/**
+ * Lead voltage from a heart vector.
+ */
+inline float projectLead(uint8_t lead, const float v[3]) {
+  const float* l = LEAD_VECTORS[lead];
+  return l[0] * v[0] + l[1] * v[1] + l[2] * v[2];
+}
+
+/**
+ * Beat morphology at a position within the beat (0.0 - 1.0), in mV.
+ * Deterministic part of the waveform only — no jitter, wander or noise.
+ */
+float beatMorphology(float posInBeat, uint8_t morphology) {
+  const WaveComponent* waves = MORPHOLOGIES[morphology].waves;
+  size_t count = MORPHOLOGIES[morphology].count;
+
+  float value = 0.0;
+  for (size_t i = 0; i < count; i++) {
+    value += gaussian(posInBeat, waves[i].center, waves[i].width) * waves[i].amplitude;
+  }
+  return value;
+}
+
+/**
+ * Envelope of the PVC jitter component (multiplied by a fast sinusoid).
+ */
+float pvcJitterEnvelope(float posInBeat) {
+  return gaussian(posInBeat, 0.60, 0.05);
+}
+
+/**
+ * Generate a single ECG sample (in mV) — reference path.
+ * Evaluates the full Gaussian model for every sample.
+ */
+float generateECGSample(SynthState& s, uint32_t idx) {
+  // Position within beat (0.0 - 1.0)
+  float beatStart = s.nextRPeakAt - s.rrIntervalSamples;
+  float posInBeat = fmod((float)(idx - (uint32_t)beatStart), s.rrIntervalSamples) / s.rrIntervalSamples;
+  if (posInBeat < 0) posInBeat += 1.0;
+  if (s.beatBlocked && posInBeat >= AV_BLOCK_P_END) posInBeat = 0.0;
+
+  const RhythmSpec& rhythm = RHYTHMS[s.rhythm];
+  float value = beatMorphology(posInBeat, s.arrhythmiaMode ? (uint8_t)MORPH_PVC : rhythm.morphology);
+
+  if (s.arrhythmiaMode) {
+    float jitter = sin(idx * (JITTER_RAD_PER_S / s.sampleRate)) * 0.15;
+    value += jitter * pvcJitterEnvelope(posInBeat);
+  }
+  if (rhythm.fibrillation) {
+    value += sin(idx * (JITTER_RAD_PER_S / s.sampleRate)) * AF_FWAVE_MV;
+  }
+
+  // Baseline wander (very slow sinusoidal)
+  value += sin((float)idx / s.sampleRate * WANDER_RAD_PER_S) * 0.02;
+
+  // Noise addition (small amount — for realism)
+  value += ((float)synthRandom(s, -100, 100) / 100.0) * 0.015;
+
+  return value;
+}
+
+/**
+ * Generate one multi-lead frame (in mV) — reference path.
+ */
+void generateLeadsReference(SynthState& s, uint32_t idx, float* mv, uint8_t leads) {
+  float beatStart = s.nextRPeakAt - s.rrIntervalSamples;
+  float posInBeat = fmod((float)(idx - (uint32_t)beatStart), s.rrIntervalSamples) / s.rrIntervalSamples;
+  if (posInBeat < 0) posInBeat += 1.0;
+  if (s.beatBlocked && posInBeat >= AV_BLOCK_P_END) posInBeat = 0.0;
+
+  const RhythmSpec& rhythm = RHYTHMS[s.rhythm];
+  float v[3];
+  beatVector(posInBeat, s.arrhythmiaMode ? (uint8_t)MORPH_PVC : rhythm.morphology, v);
+
+  if (s.arrhythmiaMode) {
+    float jitter = sin(idx * (JITTER_RAD_PER_S / s.sampleRate)) * 0.15 * pvcJitterEnvelope(posInBeat);
+    float gain[3];
+    directionGain(PVC_JITTER_DIR, gain);
+    for (int c = 0; c < 3; c++) v[c] += jitter * gain[c];
+  }
+  if (rhythm.fibrillation) {
+    float fwave = sin(idx * (JITTER_RAD_PER_S / s.sampleRate)) * AF_FWAVE_MV;
+    float gain[3];
+    directionGain(ATRIAL_DIR, gain);
+    for (int c = 0; c < 3; c++) v[c] += fwave * gain[c];
+  }
+
+  float wander = sin((float)idx / s.sampleRate * WANDER_RAD_PER_S) * 0.02;
+
+  for (uint8_t l = 0; l < leads; l++) {
+    mv[l] = projectLead(l, v) + wander + ((float)synthRandom(s, -100, 100) / 100.0) * 0.015;
+  }
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Beat Template Engine (LUT path)
+// ─────────────────────────────────────────────────────────────────────────────
+// The Gaussian model of every morphology is evaluated at compile time into
+// normalized beat templates (constexpr, so they live in flash and cost no
+// startup time). Whenever a stream's R-R interval or rhythm changes, the
+// templates it uses are resampled into its BeatTables, so the per-sample
+// work is a plain table read.
+
+// exp() split for constexpr evaluation (fdlibm's ln 2 = LN2_HI + LN2_LO)
+#define LN2_HI 6.93147180369123816490e-01
+#define LN2_LO 1.90821492927058770002e-10
+
+/**
+ * exp() usable in constant expressions: x = k·ln2 + r with |r| ≤ ln2/2, a
+ * Taylor series for e^r, then the exact scale by 2^k. Within about one
+ * double ulp of the C library, so the float templates round the same way
+ * as the runtime model.
+ */
+constexpr double constExp(double x) {
+  if (x < -110.0) return 0.0;   // Below the smallest float
+  int k = (int)(x / (LN2_HI + LN2_LO) + (x < 0 ? -0.5 : 0.5));
+  double r = (x - k * LN2_HI) - k * LN2_LO;
+  double term = 1.0, sum = 1.0;
+  for (int n = 1; n < 20; n++) {
+    term *= r / n;
+    sum += term;
+  }
+  double scale = 1.0, base = k < 0 ? 0.5 : 2.0;
+  for (int e = k < 0 ? -k : k; e; e >>= 1) {
+    if (e & 1) scale *= base;
+    base *= base;
+  }
+  return sum * scale;
+}
+
+/**
+ * gaussian() for constant expressions — same arithmetic, same precision.
+ */
+constexpr float constGaussian(float x, float center, float width) {
+  float diff = x - center;
+  return (float)constExp(-(diff * diff) / (2.0 * width * width));
+}
+
+struct BeatTemplate {
+  float mv[BEAT_TEMPLATE_LEN + 1];        // Lead II (+1 guard point for interpolation)
+  float vec[3][BEAT_TEMPLATE_LEN + 1];    // Heart vector (X, Y, Z)
+};
+
+/**
+ * Template of one morphology: beatMorphology() and beatVector() over the
+ * normalized beat, summed in the same order.
+ */
+constexpr BeatTemplate makeBeatTemplate(const WaveSet& set) {
+  BeatTemplate t = {};
+  float gain[8][3] = {};
+  for (uint8_t w = 0; w < set.count; w++) directionGain(set.waves[w].dir, gain[w]);
+
+  for (int i = 0; i <= BEAT_TEMPLATE_LEN; i++) {
+    float pos = (float)i / BEAT_TEMPLATE_LEN;
+    float value = 0.0f, v[3] = { 0.0f, 0.0f, 0.0f };
+    for (uint8_t w = 0; w < set.count; w++) {
+      float a = constGaussian(pos, set.waves[w].center, set.waves[w].width) * set.waves[w].amplitude;
+      value += a;
+      for (int c = 0; c < 3; c++) v[c] += a * gain[w][c];
+    }
+    t.mv[i] = value;
+    for (int c = 0; c < 3; c++) t.vec[c][i] = v[c];
+  }
+  return t;
+}
+
+struct EnvelopeTemplate {
+  float v[BEAT_TEMPLATE_LEN + 1];
+};
+
+constexpr EnvelopeTemplate makePVCJitterTemplate() {
+  EnvelopeTemplate t = {};
+  for (int i = 0; i <= BEAT_TEMPLATE_LEN; i++) {
+    t.v[i] = constGaussian((float)i / BEAT_TEMPLATE_LEN, 0.60, 0.05);   // pvcJitterEnvelope()
+  }
+  return t;
+}
+
+constexpr BeatTemplate BEAT_TEMPLATES[MORPH_COUNT] = {
+  makeBeatTemplate(MORPHOLOGIES[MORPH_NORMAL]),
+  makeBeatTemplate(MORPHOLOGIES[MORPH_PVC]),
+  makeBeatTemplate(MORPHOLOGIES[MORPH_AF]),
+  makeBeatTemplate(MORPHOLOGIES[MORPH_VT]),
+  makeBeatTemplate(MORPHOLOGIES[MORPH_SVT]),
+  makeBeatTemplate(MORPHOLOGIES[MORPH_AV_BLOCK]),
+  makeBeatTemplate(MORPHOLOGIES[MORPH_STE]),
+};
+constexpr EnvelopeTemplate PVC_JITTER_TEMPLATE = makePVCJitterTemplate();
+
+// Per-lead gains of the PVC jitter and of the AF f-waves
+float leadJitterGain[MAX_LEADS];
+float leadAtrialGain[MAX_LEADS];
+
+float sineLUT[SINE_LUT_LEN + 1];
+
+void buildFixedPointConstants();
+void storeBeatEntryQ(BeatTables& t, uint16_t j, float beat, float pvc, float jitter,
+                     const float* vecBeat, const float* vecPVC);
+
+void buildBeatTemplates() {
+  float jitterGain[3], atrialGain[3];
+  directionGain(PVC_JITTER_DIR, jitterGain);
+  directionGain(ATRIAL_DIR, atrialGain);
+  for (uint8_t l = 0; l < MAX_LEADS; l++) {
+    leadJitterGain[l] = projectLead(l, jitterGain);
+    leadAtrialGain[l] = projectLead(l, atrialGain);
+  }
+
+  buildFixedPointConstants();
+
+  for (int i = 0; i <= SINE_LUT_LEN; i++) {
+    sineLUT[i] = sin(2.0 * M_PI * i / SINE_LUT_LEN);
+  }
+}
+
+/**
+ * Linear interpolation into a normalized template at pos (0.0 - 1.0).
+ */
+float sampleTemplate(const float* tmpl, float pos) {
+  float x = pos * BEAT_TEMPLATE_LEN;
+  int   i = (int)x;
+  if (i >= BEAT_TEMPLATE_LEN) return tmpl[BEAT_TEMPLATE_LEN];
+  float frac = x - i;
+  return tmpl[i] + (tmpl[i + 1] - tmpl[i]) * frac;
+}
+
+uint8_t beatTablesFor(SynthPath path) {
+  return path == SYNTH_PATH_LUT ? BEAT_TABLES_FLOAT
+       : path == SYNTH_PATH_FIXED ? BEAT_TABLES_Q : 0;
+}
+
+size_t beatTablesSize(uint8_t sets, uint16_t maxRate) {
+  size_t entry = ((sets & BEAT_TABLES_FLOAT) ? 9 * sizeof(float) : 0)
+               + ((sets & BEAT_TABLES_Q) ? 9 * sizeof(int16_t) : 0);
+  return entry * BEAT_TABLE_LEN(maxRate);
+}
+
+void beatTablesInit(BeatTables& t, void* storage, uint8_t sets, uint16_t maxRate) {
+  uint16_t n = BEAT_TABLE_LEN(maxRate);
+  t = BeatTables();
+  t.capacity = n;
+  float* f = (float*)storage;
+  if (sets & BEAT_TABLES_FLOAT) {
+    t.beat = f;
+    t.pvc = f + n;
+    t.pvcJitter = f + 2 * n;
+    for (int c = 0; c < 3; c++) {
+      t.vecBeat[c] = f + (3 + c) * n;
+      t.vecPVC[c]  = f + (6 + c) * n;
+    }
+    f += 9 * n;
+  }
+  int16_t* q = (int16_t*)f;
+  if (sets & BEAT_TABLES_Q) {
+    t.beatQ = q;
+    t.pvcQ = q + n;
+    t.pvcJitterQ = q + 2 * n;
+    for (int c = 0; c < 3; c++) {
+      t.vecBeatQ[c] = q + (3 + c) * n;
+      t.vecPVCQ[c]  = q + (6 + c) * n;
+    }
+  }
+  t.rr = -1.0f;   // Nothing resampled yet
+}
+
+void resampleBeatTables(SynthState& s) {
+  BeatTables& t = *s.tables;
+  float rrSamples = s.rrIntervalSamples;
+  uint16_t len = (uint16_t)ceilf(rrSamples);
+  if (len > t.capacity) len = t.capacity;
+  if (len < 1) len = 1;
+
+  uint8_t morphology = RHYTHMS[s.rhythm].morphology;
+  const BeatTemplate& beat = BEAT_TEMPLATES[morphology];
+  const BeatTemplate& pvc  = BEAT_TEMPLATES[MORPH_PVC];
+  // The reference path keeps no tables and only needs the lengths below
+  uint16_t filled = t.beat || t.beatQ ? len : 0;
+  for (uint16_t j = 0; j < filled; j++) {
+    float pos = (float)j / rrSamples;
+    float b = sampleTemplate(beat.mv, pos);
+    float p = sampleTemplate(pvc.mv, pos);
+    float jitter = sampleTemplate(PVC_JITTER_TEMPLATE.v, pos);
+    float vb[3], vp[3];
+    for (int c = 0; c < 3; c++) {
+      vb[c] = sampleTemplate(beat.vec[c], pos);
+      vp[c] = sampleTemplate(pvc.vec[c], pos);
+    }
+    if (t.beat) {
+      t.beat[j]      = b;
+      t.pvc[j]       = p;
+      t.pvcJitter[j] = jitter;
+      for (int c = 0; c < 3; c++) {
+        t.vecBeat[c][j] = vb[c];
+        t.vecPVC[c][j]  = vp[c];
+      }
+    }
+    if (t.beatQ) storeBeatEntryQ(t, j, b, p, jitter, vb, vp);
+  }
+
+  t.len = len;
+  t.rr  = rrSamples;
+  t.morphology = morphology;
+  t.blockedLen = (uint16_t)(AV_BLOCK_P_END * rrSamples);
+}
+
+/**
+ * Tables of a stream, resampled first if its R-R interval changed.
+ */
+inline const BeatTables& currentTables(SynthState& s) {
+  if (s.rrIntervalSamples != s.tables->rr || RHYTHMS[s.rhythm].morphology != s.tables->morphology) {
+    resampleBeatTables(s);
+  }
+  return *s.tables;
+}
+
+/**
+ * Table index of sample idx within the current beat. Past the end of the
+ * tables the isoelectric tail is held; a beat that is not conducted (AV
+ * block) keeps its P wave and is isoelectric after it.
+ */
+inline uint32_t beatPhase(const SynthState& s, const BeatTables& t, uint32_t idx) {
+  uint32_t phase = idx - s.beatStartIndex;
+  if (phase >= t.len) phase = t.len - 1;
+  if (s.beatBlocked && phase >= t.blockedLen) phase = 0;
+  return phase;
+}
+
+/**
+ * Sine from the lookup table. phase: 0 - 2^32 maps to 0 - 2π.
+ */
+inline float lutSin(uint32_t phase) {
+  uint32_t i    = phase >> 24;
+  float    frac = (phase & 0x00FFFFFF) * (1.0f / 16777216.0f);
+  return sineLUT[i] + (sineLUT[i + 1] - sineLUT[i]) * frac;
+}
+
+/**
+ * Generate a single ECG sample (in mV) — LUT path.
+ *
+ * Unlike the reference path, the beat phase restarts at every R-R boundary
+ * (beatStartIndex), so HRV-shortened beats are truncated and lengthened
+ * beats hold the isoelectric tail instead of wrapping into a new beat.
+ */
+float generateECGSampleLUT(SynthState& s, uint32_t idx) {
+  const BeatTables& t = currentTables(s);
+  uint32_t phase = beatPhase(s, t, idx);
+
+  float value;
+  if (s.arrhythmiaMode) {
+    value = t.pvc[phase] + lutSin(idx * s.jitterPhaseInc) * 0.15f * t.pvcJitter[phase];
+  } else {
+    value = t.beat[phase];
+  }
+  if (RHYTHMS[s.rhythm].fibrillation) {
+    value += lutSin(idx * s.jitterPhaseInc) * AF_FWAVE_MV;
+  }
+
+  // Baseline wander (0.3 rad/s, as in the reference path)
+  value += lutSin(idx * s.wanderPhaseInc) * 0.02f;
+
+  // Noise addition (±0.015 mV)
+  value += (float)synthRandom(s, -100, 100) * (ECG_NOISE_MV / 100.0f);
+
+  return value;
+}
+
+/**
+ * Generate one multi-lead frame (in mV) — LUT path.
+ * Three table reads give the heart vector; each lead is then a 3-term
+ * dot product plus its own noise.
+ */
+void generateLeadsLUT(SynthState& s, uint32_t idx, float* mv, uint8_t leads) {
+  const BeatTables& t = currentTables(s);
+  uint32_t phase = beatPhase(s, t, idx);
+
+  float* const* vec = s.arrhythmiaMode ? t.vecPVC : t.vecBeat;
+  float v[3] = { vec[0][phase], vec[1][phase], vec[2][phase] };
+
+  float jitter = 0.0f, fwave = 0.0f;
+  if (s.arrhythmiaMode) {
+    jitter = lutSin(idx * s.jitterPhaseInc) * 0.15f * t.pvcJitter[phase];
+  }
+  if (RHYTHMS[s.rhythm].fibrillation) {
+    fwave = lutSin(idx * s.jitterPhaseInc) * AF_FWAVE_MV;
+  }
+  float wander = lutSin(idx * s.wanderPhaseInc) * 0.02f;
+
+  for (uint8_t l = 0; l < leads; l++) {
+    mv[l] = projectLead(l, v) + leadJitterGain[l] * jitter + leadAtrialGain[l] * fwave + wander
+          + (float)synthRandom(s, -100, 100) * (ECG_NOISE_MV / 100.0f);
+  }
+}
+
+// Mobile app does the reverse: raw * adcToMv = mV, so we do mV / adcToMv = raw
+int16_t mvToADC(float mv) {
+  // Single-precision multiply — ADC_TO_MV is a double literal
+  return (int16_t)(mv * (float)(1.0 / ADC_TO_MV));
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Fixed-Point Generator
+// ─────────────────────────────────────────────────────────────────────────────
+// Same model as the LUT path, without any float math per sample:
+//   - Beat tables hold mV in Q12 (1 mV = 4096), envelopes in Q15
+//   - Lead vectors and jitter gains in Q13, mV → ADC gain in Q15
+//   - Baseline wander and PVC jitter come from second-order recurrence
+//     oscillators, s[n] = 2cos(w)·s[n-1] - s[n-2] (Q30 state, Q29 coefficient),
+//     re-seeded from sin() every OSC_RESYNC_SAMPLES to cancel drift
+//   - Noise from the stream's xorshift32 generator, as on the float paths
+
+#define Q12_ONE          4096
+#define ADC_GAIN_Q15     ((int32_t)(32768.0 / (Q12_ONE * ADC_TO_MV) + 0.5))  // 2797
+#define WANDER_AMP_Q12   ((int32_t)(0.02 * Q12_ONE + 0.5))
+#define JITTER_AMP_Q12   ((int32_t)(0.15 * Q12_ONE + 0.5))
+#define FWAVE_AMP_Q12    ((int32_t)(AF_FWAVE_MV * Q12_ONE + 0.5))
+#define NOISE_SPAN_Q12   ((int32_t)(2 * ECG_NOISE_MV * Q12_ONE + 0.5) + 1)
+
+int16_t leadVectorsQ[MAX_LEADS][3];            // Q13
+int16_t leadJitterGainQ[MAX_LEADS];            // Q13
+int16_t leadAtrialGainQ[MAX_LEADS];            // Q13
+
+inline int16_t toQ(float v, float scale) {
+  return (int16_t)lroundf(v * scale);
+}
+
+/**
+ * Store table entry j, resampled in float, in fixed point.
+ * Called from resampleBeatTables().
+ */
+void storeBeatEntryQ(BeatTables& t, uint16_t j, float beat, float pvc, float jitter,
+                     const float* vecBeat, const float* vecPVC) {
+  t.beatQ[j]      = toQ(beat, Q12_ONE);
+  t.pvcQ[j]       = toQ(pvc, Q12_ONE);
+  t.pvcJitterQ[j] = toQ(jitter, 32767.0f);
+  for (int c = 0; c < 3; c++) {
+    t.vecBeatQ[c][j] = toQ(vecBeat[c], Q12_ONE);
+    t.vecPVCQ[c][j]  = toQ(vecPVC[c], Q12_ONE);
+  }
+}
+
+/**
+ * Convert lead projection constants. Called from buildBeatTemplates().
+ */
+void buildFixedPointConstants() {
+  for (uint8_t l = 0; l < MAX_LEADS; l++) {
+    for (int c = 0; c < 3; c++) leadVectorsQ[l][c] = toQ(LEAD_VECTORS[l][c], 8192.0f);
+    leadJitterGainQ[l] = toQ(leadJitterGain[l], 8192.0f);
+    leadAtrialGainQ[l] = toQ(leadAtrialGain[l], 8192.0f);
+  }
+}
+
+/**
+ * Position the oscillator at sample idx using exact sin() values.
+ */
+void oscSeed(Oscillator& osc, uint32_t idx) {
+  osc.coef = (int32_t)lround(2.0 * cos(osc.omega) * 536870912.0);
+  osc.s1 = (int32_t)lround(sin(fmod(osc.omega * ((double)idx - 1.0), 2.0 * M_PI)) * 1073741824.0);
+  osc.s2 = (int32_t)lround(sin(fmod(osc.omega * ((double)idx - 2.0), 2.0 * M_PI)) * 1073741824.0);
+  osc.next = idx;
+}
+
+/**
+ * Next value of an oscillator already positioned at the right sample.
+ */
+inline int32_t oscAdvance(Oscillator& osc) {
+  int32_t s0 = (int32_t)(((int64_t)osc.coef * osc.s1) >> 29) - osc.s2;
+  osc.s2 = osc.s1;
+  osc.s1 = s0;
+  osc.next++;
+  return s0;
+}
+
+/**
+ * sin(omega · idx) in Q30. Sequential calls cost one multiply; a jump in idx
+ * (stream restart) or the periodic resync falls back to oscSeed().
+ */
+inline int32_t oscStep(Oscillator& osc, uint32_t idx) {
+  if (idx != osc.next || (idx & (OSC_RESYNC_SAMPLES - 1)) == 0) oscSeed(osc, idx);
+  return oscAdvance(osc);
+}
+
+/**
+ * Uniform noise in Q12 mV, ±ECG_NOISE_MV.
+ */
+inline int32_t noiseQ12(uint32_t& state) {
+  return (int32_t)(((xorshift32(state) >> 16) * (uint32_t)NOISE_SPAN_Q12) >> 16) - NOISE_SPAN_Q12 / 2;
+}
+
+/**
+ * Q12 mV → ADC counts (Q15 gain), saturating to int16.
+ */
+inline int16_t mvQ12ToADC(int32_t mvQ12) {
+  int32_t adc = (mvQ12 * ADC_GAIN_Q15) >> 15;
+  if (adc > 32767) adc = 32767;
+  if (adc < -32768) adc = -32768;
+  return (int16_t)adc;
+}
+
+/**
+ * Generate a single ECG sample directly as an ADC value — fixed-point path.
+ */
+int16_t generateECGSampleQ15(SynthState& s, uint32_t idx) {
+  const BeatTables& t = currentTables(s);
+  uint32_t phase = beatPhase(s, t, idx);
+
+  int32_t value = s.arrhythmiaMode ? t.pvcQ[phase] : t.beatQ[phase];
+
+  int32_t jitterSin = oscStep(s.jitterOsc, idx);  // Advanced every sample to stay sequential
+  if (s.arrhythmiaMode) {
+    int32_t jitter = (int32_t)(((int64_t)jitterSin * JITTER_AMP_Q12) >> 30);
+    value += (jitter * t.pvcJitterQ[phase]) >> 15;
+  }
+  if (RHYTHMS[s.rhythm].fibrillation) {
+    value += (int32_t)(((int64_t)jitterSin * FWAVE_AMP_Q12) >> 30);
+  }
+
+  value += (int32_t)(((int64_t)oscStep(s.wanderOsc, idx) * WANDER_AMP_Q12) >> 30);
+  value += noiseQ12(s.rngState);
+
+  return mvQ12ToADC(value);
+}
+
+/**
+ * Generate one multi-lead frame directly as ADC values — fixed-point path.
+ */
+void generateLeadsQ15(SynthState& s, uint32_t idx, int16_t* adc, uint8_t leads) {
+  const BeatTables& t = currentTables(s);
+  uint32_t phase = beatPhase(s, t, idx);
+
+  int16_t* const* vec = s.arrhythmiaMode ? t.vecPVCQ : t.vecBeatQ;
+  int32_t vx = vec[0][phase], vy = vec[1][phase], vz = vec[2][phase];
+
+  int32_t jitterSin = oscStep(s.jitterOsc, idx);
+  int32_t jitter = 0, fwave = 0;
+  if (s.arrhythmiaMode) {
+    jitter = (int32_t)(((int64_t)jitterSin * JITTER_AMP_Q12) >> 30);
+    jitter = (jitter * t.pvcJitterQ[phase]) >> 15;
+  }
+  if (RHYTHMS[s.rhythm].fibrillation) {
+    fwave = (int32_t)(((int64_t)jitterSin * FWAVE_AMP_Q12) >> 30);
+  }
+  int32_t wander = (int32_t)(((int64_t)oscStep(s.wanderOsc, idx) * WANDER_AMP_Q12) >> 30);
+
+  for (uint8_t l = 0; l < leads; l++) {
+    const int16_t* q = leadVectorsQ[l];
+    int32_t mv = (q[0] * vx + q[1] * vy + q[2] * vz + leadJitterGainQ[l] * jitter +
+                  leadAtrialGainQ[l] * fwave) >> 13;
+    adc[l] = mvQ12ToADC(mv + wander + noiseQ12(s.rngState));
+  }
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Beat Scheduling
+// ─────────────────────────────────────────────────────────────────────────────
+
+void setHeartRate(SynthState& s, float bpm) {
+  s.heartRateBPM = bpm;
+  s.rrIntervalSamples = (60.0 / s.heartRateBPM) * s.sampleRate;
+}
+
+void setSampleRate(SynthState& s, uint16_t rate) {
+  s.sampleRate = rate;
+  // Phase increments for a 32-bit phase accumulator (2^32 = one full turn)
+  s.wanderPhaseInc = (uint32_t)(WANDER_RAD_PER_S / rate / (2.0 * M_PI) * 4294967296.0);
+  s.jitterPhaseInc = (uint32_t)(JITTER_RAD_PER_S / rate / (2.0 * M_PI) * 4294967296.0);
+  // next = UINT32_MAX makes the oscillators re-seed with the new omega
+  s.wanderOsc = { WANDER_RAD_PER_S / rate, 0, 0, 0, UINT32_MAX };
+  s.jitterOsc = { JITTER_RAD_PER_S / rate, 0, 0, 0, UINT32_MAX };
+  setHeartRate(s, s.heartRateBPM);
+  s.nextRPeakAt = s.beatStartIndex + s.rrIntervalSamples;
+}
+
+void synthReset(SynthState& s) {
+  s.sampleIndex = 0;
+  s.nextRPeakAt = s.rrIntervalSamples;
+  s.beatStartIndex = 0;
+  s.beatCount = 0;
+  s.beatBlocked = false;
+  s.rngState = s.seed;
+}
+
+void setRhythm(SynthState& s, uint8_t rhythm) {
+  if (rhythm >= RHYTHM_COUNT) return;
+  s.rhythm = rhythm;
+  s.beatCount = 0;
+  s.beatBlocked = false;
+  setHeartRate(s, RHYTHMS[rhythm].bpm);
+}
+
+int8_t findRhythm(const char* name) {
+  for (uint8_t r = 0; r < RHYTHM_COUNT; r++) {
+    if (strcmp(name, RHYTHMS[r].name) == 0) return r;
+  }
+  return -1;
+}
+
+void synthSeed(SynthState& s, uint32_t seed) {
+  s.seed = seed ? seed : SYNTH_DEFAULT_SEED;   // xorshift32 never leaves 0
+  s.rngState = s.seed;
+}
+
+void synthInit(SynthState& s, BeatTables* tables, float bpm) {
+  s.arrhythmiaMode = false;
+  s.rhythm = RHYTHM_NORMAL;
+  s.seed = SYNTH_DEFAULT_SEED;
+  s.tables = tables;
+  s.heartRateBPM = bpm;
+  s.beatStartIndex = 0;
+  setSampleRate(s, SAMPLE_RATE);
+  synthReset(s);
+  resampleBeatTables(s);
+}
+
+/**
+ * Start the next beat at sampleIndex: draw its R-R and decide whether it is
+ * conducted. Returns true for a conducted beat.
+ */
+bool startBeat(SynthState& s) {
+  const RhythmSpec& rhythm = RHYTHMS[s.rhythm];
+
+  // HRV: vary R-R interval by the rhythm's ± ‰ (±5% in sinus rhythm)
+  int32_t hrv = rhythm.hrvPermille;
+  float variation = ((float)synthRandom(s, -hrv, hrv) / 1000.0) * s.rrIntervalSamples;
+  float newRR = s.rrIntervalSamples + variation;
+
+  // Irregular R-R in arrhythmia mode
+  if (s.arrhythmiaMode) {
+    float extraVariation = ((float)synthRandom(s, -200, 200) / 1000.0) * s.rrIntervalSamples;
+    newRR += extraVariation;
+  }
+
+  s.nextRPeakAt = s.sampleIndex + newRR;
+  s.beatStartIndex = s.sampleIndex;
+
+  // AV block: every conduction-th P wave is not followed by a QRS
+  s.beatCount++;
+  s.beatBlocked = rhythm.conduction && s.beatCount % rhythm.conduction == 0;
+  return !s.beatBlocked;
+}
+
+bool generateNextFrame(SynthState& s, int16_t* frame, uint8_t leads) {
+  switch (synthPath) {
+    case SYNTH_PATH_FIXED:
+      if (leads == 1) {
+        frame[0] = generateECGSampleQ15(s, s.sampleIndex);
+      } else {
+        generateLeadsQ15(s, s.sampleIndex, frame, leads);
+      }
+      break;
+
+    case SYNTH_PATH_LUT:
+    case SYNTH_PATH_REFERENCE: {
+      bool lut = (synthPath == SYNTH_PATH_LUT);
+      if (leads == 1) {
+        float mv = lut ? generateECGSampleLUT(s, s.sampleIndex) : generateECGSample(s, s.sampleIndex);
+        frame[0] = mvToADC(mv);
+      } else {
+        float mv[MAX_LEADS];
+        if (lut) {
+          generateLeadsLUT(s, s.sampleIndex, mv, leads);
+        } else {
+          generateLeadsReference(s, s.sampleIndex, mv, leads);
+        }
+        for (uint8_t l = 0; l < leads; l++) frame[l] = mvToADC(mv[l]);
+      }
+      break;
+    }
+  }
+
+  s.sampleIndex++;
+
+  // R-peak check — new beat
+  return s.sampleIndex >= (uint32_t)s.nextRPeakAt && startBeat(s);
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Block Generation
+// ─────────────────────────────────────────────────────────────────────────────
+// generateBlock() cuts a block into runs of frames that need no decision per
+// frame: a run ends at the beat boundary, where the beat tables end (the
+// isoelectric tail or the blocked beat's baseline is then held) and where
+// the fixed-point oscillators re-seed. Within a run the table index moves
+// by `step` (1, or 0 while a value is held), and the rhythm and arrhythmia
+// mode pick tables and gains once. A component that is off gets a zero
+// gain, which adds exactly nothing, so the output equals that of
+// generateNextFrame() frame for frame.
+
+struct SynthRun {
+  uint32_t idx;      // Sample index of the first frame
+  uint32_t phase;    // Table index of the first frame
+  uint32_t step;     // 1, or 0 while the value at `phase` is held
+  uint32_t frames;
+};
+
+/**
+ * The longest run (up to maxFrames) starting at the stream's next sample.
+ */
+inline SynthRun nextRun(const SynthState& s, const BeatTables& t, uint32_t maxFrames) {
+  SynthRun r;
+  r.idx = s.sampleIndex;
+  uint32_t boundary = (uint32_t)s.nextRPeakAt;
+  r.frames = boundary > r.idx ? boundary - r.idx : 1;
+  uint32_t resync = OSC_RESYNC_SAMPLES - (r.idx & (OSC_RESYNC_SAMPLES - 1));
+  if (r.frames > resync) r.frames = resync;
+  if (r.frames > maxFrames) r.frames = maxFrames;
+
+  // Same index as beatPhase(), frame by frame
+  uint32_t phase = r.idx - s.beatStartIndex;
+  uint32_t end = s.beatBlocked ? t.blockedLen : t.len;
+  if (phase < end) {
+    r.phase = phase;
+    r.step = 1;
+    if (r.frames > end - phase) r.frames = end - phase;
+  } else {
+    r.phase = s.beatBlocked ? 0 : t.len - 1;
+    r.step = 0;
+  }
+  return r;
+}
+
+/**
+ * One run, one lead — float LUT path (generateECGSampleLUT()).
+ */
+void runLUT(SynthState& s, const BeatTables& t, const SynthRun& r, int16_t* out) {
+  const float* beat = s.arrhythmiaMode ? t.pvc : t.beat;
+  float jitterGain = s.arrhythmiaMode ? 0.15f : 0.0f;
+  float fwaveGain = RHYTHMS[s.rhythm].fibrillation ? AF_FWAVE_MV : 0.0f;
+  uint32_t phase = r.phase;
+  for (uint32_t i = 0; i < r.frames; i++, phase += r.step) {
+    uint32_t idx = r.idx + i;
+    float js = lutSin(idx * s.jitterPhaseInc);
+    float value = beat[phase] + js * jitterGain * t.pvcJitter[phase];
+    value += js * fwaveGain;
+    value += lutSin(idx * s.wanderPhaseInc) * 0.02f;
+    value += (float)synthRandom(s, -100, 100) * (ECG_NOISE_MV / 100.0f);
+    out[i] = mvToADC(value);
+  }
+}
+
+/**
+ * One run, several leads — float LUT path (generateLeadsLUT()).
+ */
+void runLeadsLUT(SynthState& s, const BeatTables& t, const SynthRun& r, int16_t* out,
+                 uint8_t leads) {
+  float* const* vec = s.arrhythmiaMode ? t.vecPVC : t.vecBeat;
+  float jitterGain = s.arrhythmiaMode ? 0.15f : 0.0f;
+  float fwaveGain = RHYTHMS[s.rhythm].fibrillation ? AF_FWAVE_MV : 0.0f;
+  uint32_t phase = r.phase;
+  for (uint32_t i = 0; i < r.frames; i++, phase += r.step, out += leads) {
+    uint32_t idx = r.idx + i;
+    float v[3] = { vec[0][phase], vec[1][phase], vec[2][phase] };
+    float js = lutSin(idx * s.jitterPhaseInc);
+    float jitter = js * jitterGain * t.pvcJitter[phase];
+    float fwave = js * fwaveGain;
+    float wander = lutSin(idx * s.wanderPhaseInc) * 0.02f;
+    for (uint8_t l = 0; l < leads; l++) {
+      out[l] = mvToADC(projectLead(l, v) + leadJitterGain[l] * jitter + leadAtrialGain[l] * fwave + wander
+                       + (float)synthRandom(s, -100, 100) * (ECG_NOISE_MV / 100.0f));
+    }
+  }
+}
+
+/**
+ * Position both oscillators for a run: nextRun() cuts runs at every resync
+ * point, so within one they simply advance.
+ */
+inline void oscSyncRun(SynthState& s, uint32_t idx) {
+  bool resync = (idx & (OSC_RESYNC_SAMPLES - 1)) == 0;
+  if (resync || idx != s.jitterOsc.next) oscSeed(s.jitterOsc, idx);
+  if (resync || idx != s.wanderOsc.next) oscSeed(s.wanderOsc, idx);
+}
+
+/**
+ * One run, one lead — fixed-point path (generateECGSampleQ15()).
+ */
+void runQ15(SynthState& s, const BeatTables& t, const SynthRun& r, int16_t* out) {
+  const int16_t* beat = s.arrhythmiaMode ? t.pvcQ : t.beatQ;
+  int32_t jitterAmp = s.arrhythmiaMode ? JITTER_AMP_Q12 : 0;
+  int32_t fwaveAmp = RHYTHMS[s.rhythm].fibrillation ? FWAVE_AMP_Q12 : 0;
+  oscSyncRun(s, r.idx);
+  uint32_t phase = r.phase;
+  for (uint32_t i = 0; i < r.frames; i++, phase += r.step) {
+    int32_t value = beat[phase];
+    int32_t js = oscAdvance(s.jitterOsc);
+    int32_t jitter = (int32_t)(((int64_t)js * jitterAmp) >> 30);
+    value += (jitter * t.pvcJitterQ[phase]) >> 15;
+    value += (int32_t)(((int64_t)js * fwaveAmp) >> 30);
+    value += (int32_t)(((int64_t)oscAdvance(s.wanderOsc) * WANDER_AMP_Q12) >> 30);
+    value += noiseQ12(s.rngState);
+    out[i] = mvQ12ToADC(value);
+  }
+}
+
+/**
+ * One run, several leads — fixed-point path (generateLeadsQ15()).
+ */
+void runLeadsQ15(SynthState& s, const BeatTables& t, const SynthRun& r, int16_t* out,
+                 uint8_t leads) {
+  int16_t* const* vec = s.arrhythmiaMode ? t.vecPVCQ : t.vecBeatQ;
+  int32_t jitterAmp = s.arrhythmiaMode ? JITTER_AMP_Q12 : 0;
+  int32_t fwaveAmp = RHYTHMS[s.rhythm].fibrillation ? FWAVE_AMP_Q12 : 0;
+  oscSyncRun(s, r.idx);
+  uint32_t phase = r.phase;
+  for (uint32_t i = 0; i < r.frames; i++, phase += r.step, out += leads) {
+    int32_t vx = vec[0][phase], vy = vec[1][phase], vz = vec[2][phase];
+    int32_t js = oscAdvance(s.jitterOsc);
+    int32_t jitter = (int32_t)(((int64_t)js * jitterAmp) >> 30);
+    jitter = (jitter * t.pvcJitterQ[phase]) >> 15;
+    int32_t fwave = (int32_t)(((int64_t)js * fwaveAmp) >> 30);
+    int32_t wander = (int32_t)(((int64_t)oscAdvance(s.wanderOsc) * WANDER_AMP_Q12) >> 30);
+    for (uint8_t l = 0; l < leads; l++) {
+      const int16_t* q = leadVectorsQ[l];
+      int32_t mv = (q[0] * vx + q[1] * vy + q[2] * vz + leadJitterGainQ[l] * jitter +
+                    leadAtrialGainQ[l] * fwave) >> 13;
+      out[l] = mvQ12ToADC(mv + wander + noiseQ12(s.rngState));
+    }
+  }
+}
+
+/**
+ * One run — reference path: the Gaussian model itself, frame by frame.
+ */
+void runReference(SynthState& s, const SynthRun& r, int16_t* out, uint8_t leads) {
+  for (uint32_t i = 0; i < r.frames; i++, out += leads) {
+    if (leads == 1) {
+      out[0] = mvToADC(generateECGSample(s, r.idx + i));
+    } else {
+      float mv[MAX_LEADS];
+      generateLeadsReference(s, r.idx + i, mv, leads);
+      for (uint8_t l = 0; l < leads; l++) out[l] = mvToADC(mv[l]);
+    }
+  }
+}
+
+uint16_t generateBlock(SynthState& s, int16_t* out, uint32_t count, uint8_t leads,
+                       uint32_t* beats, uint16_t maxBeats) {
+  uint16_t started = 0;
+  for (uint32_t done = 0; done < count;) {
+    const BeatTables& t = currentTables(s);
+    SynthRun r = nextRun(s, t, count - done);
+    int16_t* dst = out + (size_t)done * leads;
+    switch (synthPath) {
+      case SYNTH_PATH_FIXED:
+        if (leads == 1) {
+          runQ15(s, t, r, dst);
+        } else {
+          runLeadsQ15(s, t, r, dst, leads);
+        }
+        break;
+      case SYNTH_PATH_LUT:
+        if (leads == 1) {
+          runLUT(s, t, r, dst);
+        } else {
+          runLeadsLUT(s, t, r, dst, leads);
+        }
+        break;
+      case SYNTH_PATH_REFERENCE:
+        runReference(s, r, dst, leads);
+        break;
+    }
+    s.sampleIndex += r.frames;
+    done += r.frames;
+
+    if (s.sampleIndex >= (uint32_t)s.nextRPeakAt && startBeat(s)) {
+      if (started < maxBeats) beats[started] = done - 1;
+      started++;
+    }
+  }
+  return started;
+}
+
+/**
+ * Morphology of the current beat.
+ */
+inline uint8_t currentMorphology(const SynthState& s) {
+  return s.arrhythmiaMode ? (uint8_t)MORPH_PVC : RHYTHMS[s.rhythm].morphology;
+}
+
+uint32_t rPeakOffset(const SynthState& s) {
+  return (uint32_t)(R_PEAK_CENTERS[currentMorphology(s)] * s.rrIntervalSamples + 0.5f);
+}
+
+char beatCode(const SynthState& s) {
+  uint8_t m = currentMorphology(s);
+  return (m == MORPH_PVC || m == MORPH_VT) ? 'V' : 'N';
+}
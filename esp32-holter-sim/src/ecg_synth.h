@@ -0,0 +1,297 @@
+// =============================================================================
+// CardioGuard ESP32 Holter ECG Simulator — Waveform Synthesis
+// =============================================================================
+// Gaussian ECG model, beat template engine and fixed-point generator.
+// Depends on nothing but the C library, so the same code runs in the
+// firmware and in the native (host) benchmark — see platformio.ini.
+// =============================================================================
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// ─── ECG Signal Configuration ───────────────────────────────────────────────
+// These match mobile/src/constants/config.ts → ECG_CONFIG.
+
+#define SAMPLE_RATE       250     // Hz — default rate, same as sampleRate
+#ifndef SAMPLE_RATE_MAX
+#define SAMPLE_RATE_MAX   1000    // Highest runtime rate (sizes the beat tables)
+#endif
+#define ADC_TO_MV         0.00286 // Calibration factor — same as adcToMv
+
+// ─── Multi-Lead ─────────────────────────────────────────────────────────────
+// Leads are projections of one shared cardiac vector, so the beat model is
+// evaluated once per sample no matter how many leads are streamed.
+// Lead order: I, II, III, aVR, aVL, aVF, V1-V6 (3-lead = first three).
+#define MAX_LEADS 12
+
+// ─── Beat Template Engine ───────────────────────────────────────────────────
+// 1 = samples are read from precomputed beat tables (fast path)
+// 0 = every sample evaluates the Gaussian model directly (reference path)
+#ifndef ECG_USE_BEAT_LUT
+#define ECG_USE_BEAT_LUT   1
+#endif
+#define BEAT_TEMPLATE_LEN  512    // Resolution of the normalized (0.0 - 1.0) beat
+#define BEAT_TABLE_LEN(rate) ((60 * (rate)) / 40 + 1)  // Longest beat at `rate`: 40 BPM
+#define BEAT_TABLE_MAX     BEAT_TABLE_LEN(SAMPLE_RATE_MAX)
+#define SINE_LUT_LEN       256    // Must be a power of two (phase uses top 8 bits)
+#ifndef ECG_NOISE_MV
+#define ECG_NOISE_MV       0.015f // Uniform noise amplitude (±mV) of the LUT paths
+#endif
+
+// ─── Fixed-Point Generator ──────────────────────────────────────────────────
+// 1 = synthesis runs in integer arithmetic (beat tables in Q12 mV, lead and
+//     ADC gains in Q13/Q15, recurrence oscillators, xorshift noise). Output
+//     stays within ±2 ADC counts of the float LUT path, noise excluded.
+// Set with build_flags = -D ECG_FIXED_POINT=1. Takes precedence over
+// ECG_USE_BEAT_LUT.
+#ifndef ECG_FIXED_POINT
+#define ECG_FIXED_POINT    0
+#endif
+#define OSC_RESYNC_SAMPLES 4096   // Re-seed oscillators from sin() (power of two)
+
+// ─── Random Numbers ─────────────────────────────────────────────────────────
+// Noise and HRV come from a xorshift32 generator in each stream's state, so
+// a stream is reproducible: the same seed, heart rate and arrhythmia timing
+// give byte-identical samples on every run and on every build.
+#define SYNTH_DEFAULT_SEED 0x9E3779B9
+
+// ─── Generator Path ─────────────────────────────────────────────────────────
+// All three paths are always compiled; the build flags above only pick the
+// default. The benchmark switches synthPath at runtime.
+
+enum SynthPath : uint8_t {
+  SYNTH_PATH_REFERENCE,   // Gaussian model per sample
+  SYNTH_PATH_LUT,         // Float beat tables
+  SYNTH_PATH_FIXED,       // Q12/Q15 beat tables
+};
+
+#if ECG_FIXED_POINT
+#define SYNTH_DEFAULT_PATH SYNTH_PATH_FIXED
+#elif ECG_USE_BEAT_LUT
+#define SYNTH_DEFAULT_PATH SYNTH_PATH_LUT
+#else
+#define SYNTH_DEFAULT_PATH SYNTH_PATH_REFERENCE
+#endif
+
+// ─── Rhythm Library ─────────────────────────────────────────────────────────
+// Beat morphologies are Gaussian wave sets like the sinus beat; their
+// normalized templates are computed at compile time (constexpr) and placed
+// in flash. A rhythm picks a morphology, its default rate, the R-R
+// variability and, for AV block, the conduction ratio.
+
+enum Rhythm : uint8_t {
+  RHYTHM_NORMAL,          // Sinus rhythm
+  RHYTHM_AF,              // Atrial fibrillation — no P, f-waves, irregular R-R
+  RHYTHM_VT,              // Ventricular tachycardia — wide QRS
+  RHYTHM_SVT,             // Supraventricular tachycardia — narrow QRS
+  RHYTHM_BRADY,           // Sinus bradycardia
+  RHYTHM_AV_BLOCK,        // Second-degree AV block, long PR, dropped QRS
+  RHYTHM_ST_ELEVATION,    // Sinus beat with ST elevation
+  RHYTHM_COUNT
+};
+
+struct RhythmSpec {
+  const char* name;          // Serial / scenario name
+  uint8_t     morphology;    // Beat template
+  uint8_t     bpm;           // Default heart rate
+  uint16_t    hrvPermille;   // R-R variation, ± ‰ per beat
+  uint8_t     conduction;    // Every n-th beat not conducted (0 = all conducted)
+  bool        fibrillation;  // Atrial f-waves on the baseline
+};
+
+extern const RhythmSpec RHYTHMS[RHYTHM_COUNT];
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Generator State
+// ─────────────────────────────────────────────────────────────────────────────
+// Everything one stream needs lives in a SynthState, so several independent
+// streams (e.g. virtual Holters) can be generated side by side. Only the
+// normalized templates (in flash) and the sine table are shared.
+
+extern SynthPath synthPath;         // Generator path of all streams
+
+struct Oscillator {
+  double   omega;    // rad/sample
+  int32_t  coef;     // 2cos(omega), Q29
+  int32_t  s1, s2;   // s[n-1], s[n-2], Q30
+  uint32_t next;     // Sample index the state is positioned at
+};
+
+// Table sets a stream keeps (beatTablesFor())
+#define BEAT_TABLES_FLOAT  0x01   // LUT path
+#define BEAT_TABLES_Q      0x02   // Fixed-point path
+
+/**
+ * Beat templates resampled to one stream's R-R interval and rhythm. "beat"
+ * is the dominant beat of the rhythm, "pvc" the ectopic beat of arrhythmia
+ * mode. The tables live in storage laid out by beatTablesInit(), and a
+ * stream keeps only the set its path reads: per entry 36 bytes of float or
+ * 18 bytes of Q tables — 54 KB or 27 KB at 1000 Hz, 13.5 KB or 6.8 KB at
+ * 250 Hz. A set that is not kept has null pointers.
+ */
+struct BeatTables {
+  float*   beat;
+  float*   pvc;
+  float*   pvcJitter;
+  float*   vecBeat[3];                      // Heart vector (X, Y, Z)
+  float*   vecPVC[3];
+  int16_t* beatQ;                           // Q12 mV
+  int16_t* pvcQ;
+  int16_t* pvcJitterQ;                      // Q15 envelope
+  int16_t* vecBeatQ[3];
+  int16_t* vecPVCQ[3];
+  uint16_t capacity;                        // Entries per table: BEAT_TABLE_LEN(max rate)
+  uint16_t len;
+  uint16_t blockedLen;                      // Non-conducted beat: P wave ends here
+  float    rr;                              // R-R the tables were built for
+  uint8_t  morphology;                      // Morphology of "beat"
+};
+
+struct SynthState {
+  uint16_t    sampleRate;         // Hz, see setSampleRate()
+  uint32_t    wanderPhaseInc;     // LUT path phase steps at sampleRate
+  uint32_t    jitterPhaseInc;
+  uint32_t    sampleIndex;
+  float       heartRateBPM;
+  float       rrIntervalSamples;  // R-R interval (in samples)
+  float       nextRPeakAt;
+  uint32_t    beatStartIndex;     // Sample index where the current beat began
+  bool        arrhythmiaMode;
+  uint8_t     rhythm;             // Rhythm, see setRhythm()
+  uint32_t    beatCount;          // Beats since the rhythm was set (AV block)
+  bool        beatBlocked;        // Current beat is not conducted (P wave only)
+  Oscillator  wanderOsc;          // Fixed-point path
+  Oscillator  jitterOsc;
+  uint32_t    seed;               // Restored into rngState by synthReset()
+  uint32_t    rngState;           // xorshift32 state — noise and HRV
+  BeatTables* tables;             // Owned by the caller, one per stream
+};
+
+extern const char* const LEAD_NAMES[MAX_LEADS];
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Generator API
+// ─────────────────────────────────────────────────────────────────────────────
+
+/**
+ * Build the lead gains, fixed-point constants and the sine table (the beat
+ * templates themselves are compile-time constants).
+ * Called once before the first sample of any stream.
+ */
+void buildBeatTemplates();
+
+/**
+ * Table sets (BEAT_TABLES_*) a generator path reads; none for the
+ * reference path.
+ */
+uint8_t beatTablesFor(SynthPath path);
+
+/**
+ * Bytes of storage for the table sets `sets` up to `maxRate` Hz.
+ */
+size_t beatTablesSize(uint8_t sets, uint16_t maxRate);
+
+/**
+ * Lay out the table sets `sets` in `storage` (beatTablesSize() bytes,
+ * 4-byte aligned) for streams up to `maxRate` Hz.
+ */
+void beatTablesInit(BeatTables& t, void* storage, uint8_t sets, uint16_t maxRate);
+
+/**
+ * Set up a stream: heart rate, tables and a reset to sample 0.
+ */
+void synthInit(SynthState& s, BeatTables* tables, float bpm);
+
+/**
+ * Resample the normalized templates to the stream's R-R interval and rhythm.
+ */
+void resampleBeatTables(SynthState& s);
+
+/**
+ * Set the heart rate and the R-R interval that goes with it.
+ */
+void setHeartRate(SynthState& s, float bpm);
+
+/**
+ * Switch the stream to a rhythm (RHYTHM_*) at its default heart rate. The
+ * current beat finishes with the old R-R; the tables are resampled on the
+ * next sample. synthInit() starts every stream in RHYTHM_NORMAL.
+ */
+void setRhythm(SynthState& s, uint8_t rhythm);
+
+/**
+ * Rhythm index of a RhythmSpec name ("af", "vt", ...), or -1.
+ */
+int8_t findRhythm(const char* name);
+
+/**
+ * Whether a runtime sample rate is supported: 250, 500 or 1000 Hz, up to
+ * SAMPLE_RATE_MAX. All three divide 1 s into whole microseconds.
+ */
+inline bool isSupportedSampleRate(uint16_t rate) {
+  return (rate == 250 || rate == 500 || rate == 1000) && rate <= SAMPLE_RATE_MAX;
+}
+
+/**
+ * Switch the stream to another sample rate. The beat keeps its duration in
+ * seconds; the tables are resampled on the next sample. synthInit() starts
+ * every stream at SAMPLE_RATE.
+ */
+void setSampleRate(SynthState& s, uint16_t rate);
+
+/**
+ * Restart the stream at sample 0 with a beat starting there and the random
+ * generator back at the stream's seed.
+ */
+void synthReset(SynthState& s);
+
+/**
+ * Set the stream's seed (0 selects SYNTH_DEFAULT_SEED) and restart the random
+ * generator from it. synthInit() uses SYNTH_DEFAULT_SEED.
+ */
+void synthSeed(SynthState& s, uint32_t seed);
+
+/**
+ * Generate the next frame (one ADC value per lead) with the active path and
+ * advance the beat state. Returns true when a new beat (R peak) starts; a
+ * beat that is not conducted (AV block) does not count.
+ */
+bool generateNextFrame(SynthState& s, int16_t* frame, uint8_t leads);
+
+/**
+ * Generate `count` frames (`leads` ADC values each, frame after frame)
+ * straight into `out` — a packet or ring buffer — with the active path.
+ * The samples are those of `count` generateNextFrame() calls; the beat
+ * boundary, table and rhythm checks run once per run of frames instead of
+ * once per frame. beats[] receives, for up to maxBeats beats, the offset of
+ * the frame after which a conducted beat starts (the frames for which
+ * generateNextFrame() returns true). Returns the number of such beats.
+ */
+uint16_t generateBlock(SynthState& s, int16_t* out, uint32_t count, uint8_t leads,
+                       uint32_t* beats = nullptr, uint16_t maxBeats = 0);
+
+/**
+ * Samples from the start of the current beat to its R peak, and the beat's
+ * MIT-BIH code ('V' for a ventricular complex, 'N' otherwise). This is
+ * ground truth for beat annotations; valid after generateNextFrame()
+ * returned true, and for every beat of a generateBlock() block while the
+ * heart rate and arrhythmia mode stay unchanged.
+ */
+uint32_t rPeakOffset(const SynthState& s);
+char     beatCode(const SynthState& s);
+
+// Individual paths — generateNextFrame() picks one of these per frame
+float   generateECGSample(SynthState& s, uint32_t idx);
+float   generateECGSampleLUT(SynthState& s, uint32_t idx);
+int16_t generateECGSampleQ15(SynthState& s, uint32_t idx);
+void    generateLeadsReference(SynthState& s, uint32_t idx, float* mv, uint8_t leads);
+void    generateLeadsLUT(SynthState& s, uint32_t idx, float* mv, uint8_t leads);
+void    generateLeadsQ15(SynthState& s, uint32_t idx, int16_t* adc, uint8_t leads);
+
+/**
+ * Convert mV value to raw ADC value.
+ * Mobile app does the reverse: raw * adcToMv = mV
+ */
+int16_t mvToADC(float mv);
@@ -9,266 +9,5118 @@
 //   - ECG data via Heart Rate Service (0x180D)
 //   - Battery level via Battery Service (0x180F)
 //   - Firmware info via Device Information Service (0x180A)
+//   - Timing/heap diagnostics via the CardioGuard Diagnostics Service (custom)
 //
 // Packet Format (exactly matches mobile ECGParser.ts):
 //   [0-1]  uint16  Sequence number (little-endian)
 //   [2-3]  uint16  Number of samples in this packet (little-endian)
 //   [4+]   int16[] Raw ADC values (little-endian, 2 bytes each)
 //
+// Extended packet formats (e.g. compressed samples) are opt-in through the
+// CardioGuard Control Service and flagged by bit 15 of the count field.
+// The same service starts bulk backfill of recorded packets, and switches
+// between synthetic beats and recordings replayed from flash.
+//
 // Heart rate adjustable via potentiometer (GPIO 34): 40-180 BPM
 // Heartbeat indicator via built-in LED (GPIO 2)
 // =============================================================================
 
 #include <Arduino.h>
+#ifdef BLE_BACKEND_NIMBLE
+#include <NimBLEDevice.h>   // NimBLE host (env:nimble) — also maps the BLE* class names
+#else
 #include <BLEDevice.h>
 #include <BLEServer.h>
 #include <BLEUtils.h>
 #include <BLE2902.h>
-#include <math.h>
+#include <esp_gap_ble_api.h> // Link tuning: data length, PHY, connection parameters
+#endif
+#include <Preferences.h>    // Heap figures of both BLE backends, kept in NVS
 #include <esp_task_wdt.h>   // For watchdog control
+#include <esp_timer.h>      // Sample clock for the generator task
+#include <esp_partition.h>  // Replay records in a flash data partition
+#include <esp_pm.h>         // Power-save mode: DFS and automatic light sleep
+#include <esp_freertos_hooks.h>  // Idle hooks: measured idle time per core
+#include <esp_heap_caps.h>  // The primary's beat tables in internal RAM
+#include <atomic>           // Lock-free sample ring between the cores
+
+#include "ecg_synth.h"      // Waveform model (portable, also built natively)
+#include "ecg_packet.h"     // Packet framing (portable)
+#include "qrs_detect.h"     // Streaming QRS detector (portable)
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Configuration — Values matching the mobile app
+// ─────────────────────────────────────────────────────────────────────────────
+
+// Device name (matches BLE_CONFIG.deviceNamePrefix = "CardioGuard")
+#define DEVICE_NAME "CardioGuard-SIM"
+
+// Firmware version
+#define FIRMWARE_VERSION "SIM-ESP32-1.0.0"
+
+// ─── BLE Service & Characteristic UUIDs ─────────────────────────────────────
+// These are identical to mobile/src/types/device.ts → ECG_SERVICE_UUIDS.
+
+// Heart Rate Service (ECG data is sent over this service)
+#define ECG_SERVICE_UUID        "0000180d-0000-1000-8000-00805f9b34fb"
+#define ECG_DATA_CHAR_UUID      "00002a37-0000-1000-8000-00805f9b34fb"
+
+// Battery Service
+#define BATTERY_SERVICE_UUID    "0000180f-0000-1000-8000-00805f9b34fb"
+#define BATTERY_LEVEL_CHAR_UUID "00002a19-0000-1000-8000-00805f9b34fb"
+
+// Device Information Service
+#define DEVICE_INFO_SERVICE_UUID    "0000180a-0000-1000-8000-00805f9b34fb"
+#define FIRMWARE_VERSION_CHAR_UUID  "00002a26-0000-1000-8000-00805f9b34fb"
+
+// CardioGuard Control Service (custom 128-bit — not used by the mobile app)
+#define CONTROL_SERVICE_UUID        "43470000-8c2e-4b6a-9d1f-2f5c7e9a0b10"
+#define CONTROL_CHAR_UUID           "43470001-8c2e-4b6a-9d1f-2f5c7e9a0b10"
+#define LINK_CHAR_UUID              "43470002-8c2e-4b6a-9d1f-2f5c7e9a0b10"
+#define SCENARIO_CHAR_UUID          "43470003-8c2e-4b6a-9d1f-2f5c7e9a0b10"
+#define ANNOTATION_CHAR_UUID        "43470004-8c2e-4b6a-9d1f-2f5c7e9a0b10"
+#define SUMMARY_CHAR_UUID           "43470005-8c2e-4b6a-9d1f-2f5c7e9a0b10"
+#define CONTROL_SERVICE_HANDLES     32
+
+// CardioGuard Diagnostics Service (custom 128-bit — for field debugging)
+#define DIAG_SERVICE_UUID           "43470010-8c2e-4b6a-9d1f-2f5c7e9a0b10"
+#define DIAG_CHAR_UUID              "43470011-8c2e-4b6a-9d1f-2f5c7e9a0b10"
+
+// ─── ECG Signal Configuration ───────────────────────────────────────────────
+// SAMPLE_RATE (the boot-time rate), ADC_TO_MV and the generator options live
+// in ecg_synth.h. The rate is switched at runtime (250/500/1000 Hz) through
+// the control characteristic; the timer period follows as 1e6 / sampleRate µs.
+
+#define SAMPLES_PER_PACKET 8      // Samples per packet at the default MTU (4+8*2=20 bytes)
+
+// ─── MTU / Packet Framing ───────────────────────────────────────────────────
+// The samples-per-packet count is decided per connection from the negotiated
+// ATT MTU. Packet interval follows: samplesPerPacket * 1000 / sampleRate ms
+// (at 250 Hz: 8 samples → 32ms at the default MTU, 100 samples → 400ms at
+// MTU ≥ 207; the interval halves at 500 Hz and quarters at 1000 Hz).
+#define DEFAULT_ATT_MTU        23   // Before (or without) MTU exchange
+#define BLE_MAX_MTU            247  // Requested local MTU (251-byte LL PDU - 4 L2CAP)
+#define ATT_NOTIFY_OVERHEAD    3    // Opcode + attribute handle
+#define MAX_PACKET_SIZE        (BLE_MAX_MTU - ATT_NOTIFY_OVERHEAD)
+
+// Packet layouts (legacy, extended, Rice) are defined in ecg_packet.h.
+
+// ─── Link Tuning ────────────────────────────────────────────────────────────
+// After a connection the primary asks for 251-byte LL PDUs (one 247-byte
+// notification per PDU), the 2M PHY where the controller has one, and a
+// connection interval that follows the packet period of the stream:
+//   LINK_PROFILE_BALANCED:   about two connection events per packet (default)
+//   LINK_PROFILE_THROUGHPUT: shortest interval — backfill, high rates
+//   LINK_PROFILE_LOW_POWER:  ≥ LINK_LOW_POWER_INTERVAL_MS; live packets are
+//                            held and sent as one burst per connection event
+// Intervals are in 1.25 ms units, the supervision timeout in 10 ms units.
+#define LINK_PROFILE_BALANCED       0
+#define LINK_PROFILE_THROUGHPUT     1
+#define LINK_PROFILE_LOW_POWER      2
+#define LINK_DLE_TX_OCTETS          251   // LL payload: BLE_MAX_MTU + 4 L2CAP
+#define LINK_INTERVAL_MIN           6     // 7.5 ms, the BLE minimum
+#define LINK_INTERVAL_FLOOR_MAX     12    // 15 ms — some centrals (iOS) reject a lower max
+#define LINK_INTERVAL_BALANCED_MAX  40    // 50 ms
+#define LINK_INTERVAL_MAX           400   // 500 ms
+#define LINK_LOW_POWER_INTERVAL_MS  200
+#define LINK_SUPERVISION_TIMEOUT    400   // 4 s
+#if defined(CONFIG_BT_BLE_50_FEATURES_SUPPORTED)
+#define LINK_2M_PHY                 1     // BLE 5 controller (ESP32-C3/S3)
+#else
+#define LINK_2M_PHY                 0     // Classic ESP32: BLE 4.2, 1M PHY only
+#endif
+
+// ─── Control Protocol ───────────────────────────────────────────────────────
+// Writes to the control characteristic: [opcode][args...]
+#define CONTROL_PROTOCOL_VERSION   13
+#define CTRL_OP_GET_STATUS         0x00  // No args — just refresh the status
+#define CTRL_OP_SET_FORMAT         0x01  // [u8 FORMAT_* flags]
+#define CTRL_OP_SET_LEADS          0x02  // [u8 lead count: 1, 3 or 12]
+#define CTRL_OP_BACKFILL           0x03  // [u16 first seq][u16 last seq] — no args cancels
+#define CTRL_OP_SET_OFFLINE        0x04  // [u8 OFFLINE_* mode]
+#define CTRL_OP_SET_SEED           0x05  // [u32 seed] — restarts the waveform, 0 = default
+#define CTRL_OP_SET_SOURCE         0x06  // [u8 SOURCE_*] — replay restarts at frame 0
+#define CTRL_OP_SET_RATE           0x07  // [u16 Hz: 250, 500 or 1000] — flushes the ring
+#define CTRL_OP_SET_LINK_PROFILE   0x08  // [u8 LINK_PROFILE_*]
+#define CTRL_OP_SCENARIO           0x09  // [u8 SCENARIO_CMD_*][script text...]
+#define CTRL_OP_SET_RHYTHM         0x0A  // [u8 RHYTHM_*] — at the rhythm's default BPM
+#define CTRL_OP_SET_ANNOTATION     0x0B  // [u8 ANNOTATION_FORMAT_*]
+#define CTRL_OP_SET_STREAM_MODE    0x0C  // [u8 STREAM_MODE_*]
+#define CTRL_OP_LINK_BENCH         0x0D  // [u8 BENCH_CMD_*]
+#define CTRL_OP_BENCH_ECHO         0x0E  // [u32 send time of a FORMAT_BENCH packet]
+#define CTRL_OP_SET_IMPAIRMENT     0x0F  // [ImpairConfig, 16 bytes] — no args turns it off
+#define CTRL_OP_SET_FEC            0x10  // [u8 live packets per parity packet, 0 = off]
+
+// ─── Offline Mode / Backfill ────────────────────────────────────────────────
+// OFFLINE_DRAIN:    the backlog goes out first after a reconnect (default,
+//                   works with every central)
+// OFFLINE_BACKFILL: packets keep being numbered while offline; after a
+//                   reconnect the live stream resumes at once and the central
+//                   fetches the gap with CTRL_OP_BACKFILL
+#define OFFLINE_DRAIN           0
+#define OFFLINE_BACKFILL        1
+#define SEQ_LOG_SIZE_PSRAM      65536  // Whole uint16 sequence space (256 KB)
+#define SEQ_LOG_SIZE_INTERNAL   1024   // Without PSRAM (power of two)
+#define BACKFILL_BURST          8      // Backfill packets between 1-tick yields
+#define LINK_TURN_PACKETS       8      // Live packets between the other links' turns in a catch-up
+
+// ─── TX Backpressure ────────────────────────────────────────────────────────
+// A notification the stack refuses (no free L2CAP buffer, or the link is
+// congested) waits in a short TX queue and is retried on the sender's next
+// pass instead of lost; the frames behind it wait in the sample ring, and
+// the other links are served meanwhile.
+#define TX_GIVE_UP_MS           2000   // Refused this long → dropped (still backfillable)
+#define TX_QUEUE_PACKETS        4      // One live step: a packet and its parity, each duplicated
+
+// ─── Forward Error Correction ───────────────────────────────────────────────
+// A FORMAT_PARITY packet after every group of live packets lets the central
+// rebuild one lost packet per group without a backfill round trip. Off on
+// every new connection until the central asks for a group size; the
+// overhead is one parity packet per group.
+#define FEC_MIN_GROUP           2      // 50 % overhead
+#define FEC_MAX_GROUP           32     // ~3 % overhead
+#define FEC_SERIAL_GROUP        8      // Serial 'j' toggles between off and this
+
+// ─── Link Benchmark ─────────────────────────────────────────────────────────
+// Saturation ramp of FORMAT_BENCH packets on the ECG characteristic — see
+// the Link Benchmark section. The ECG stream waits in the ring meanwhile.
+#define BENCH_CMD_STOP          0
+#define BENCH_CMD_START         1
+#define BENCH_STEP_MS           2000   // Duration of one load step
+#define BENCH_FIRST_SAMPLES     8      // Filler samples per packet in the first step
+#define BENCH_RATE_STEP_PCT     50     // Packet rate increase per step once packets are full
+#define BENCH_SUSTAINED_PCT     95     // A step holds if this share of its packets went out
+#define BENCH_MAX_STEPS         32
+#define BENCH_RTT_SAMPLES       256    // Echoed round trips kept for the percentiles
+#define BENCH_RTT_MAX_US        10000000  // Longer echoes are stale or corrupt
+
+// ─── Link Impairment ────────────────────────────────────────────────────────
+// Seeded loss, duplicates, reordering and stalls between framing and notify
+// of the primary's ECG packets — see the Link Impairment section.
+#define IMPAIR_QUEUE_PACKETS    32     // Held for reordering and stalls (≤ 32, a bitmask)
+#define IMPAIR_MAX_BURST        64     // Longest loss burst (packets)
+#define IMPAIR_MAX_STALL_MS     5000
+
+// ─── Sample Pipeline ────────────────────────────────────────────────────────
+// Generator task (timer driven, APP core) → lock-free sample ring → BLE sender
+// task (PRO core, with the Bluedroid host)
+// The ring doubles as the offline recording: it lives in PSRAM when the board
+// has it, so generation continues while no central is connected.
+#define SAMPLE_RING_SIZE      8192  // int16 values without PSRAM (~2.7 s of 12-lead at 250 Hz)
+#define RING_PSRAM_RESERVE    (256 * 1024)  // PSRAM left free for other users (bytes)
+#define RING_WRITE_FRAMES     32    // Frames the generator writes in place per block
+#define GENERATOR_TASK_STACK  4096
+#define GENERATOR_TASK_PRIO   5     // Above loop() (1) and the sender
+#define SENDER_TASK_STACK     4096
+#define SENDER_TASK_PRIO      3
+// The sender shares a core with the Bluedroid host (it only feeds it); the
+// generator gets the other core, where only loop() competes (prio 1).
+#if CONFIG_FREERTOS_UNICORE
+#define SENDER_TASK_CORE      0
+#define GENERATOR_TASK_CORE   0
+#else
+#ifdef CONFIG_BT_BLUEDROID_PINNED_TO_CORE
+#define SENDER_TASK_CORE      CONFIG_BT_BLUEDROID_PINNED_TO_CORE
+#else
+#define SENDER_TASK_CORE      PRO_CPU_NUM
+#endif
+#define GENERATOR_TASK_CORE   (1 - SENDER_TASK_CORE)
+#endif
+#define STATUS_INTERVAL_MS    10000 // Serial status line while streaming
+
+// ─── Diagnostics ────────────────────────────────────────────────────────────
+// Hot-path timings (cycle counter), deadline counters, heap and stack usage.
+// Statistics restart with every stream; see updateDiagnostics() for the
+// characteristic layout.
+#define DIAG_VERSION          4
+#define DIAG_INTERVAL_MS      10000 // Notify + Serial mirror while streaming
+#define DIAG_HIST_BUCKETS     8     // ×4 µs buckets: <16, <64, <256, … <65536, ≥65536 µs
+#define LOOP_DEADLINE_US      32000 // Default-MTU packet period (8 samples)
+
+// ─── BLE Backend ────────────────────────────────────────────────────────────
+// Bluedroid (env:esp32) or the NimBLE host (env:nimble, -D BLE_BACKEND_NIMBLE
+// with the NimBLE-Arduino library). The Arduino NimBLE wrapper has no raw
+// GAP/GATTS event hooks, so granted link parameters, congestion events and
+// the fleet's per-Holter addresses are Bluedroid only; subscriptions come
+// from its per-connection onSubscribe() instead of the CCCD writes.
+#ifdef BLE_BACKEND_NIMBLE
+#define BLE_NIMBLE            1
+#define BLE_BACKEND_NAME      "NimBLE"
+#define CHR_READ              NIMBLE_PROPERTY::READ
+#define CHR_WRITE             NIMBLE_PROPERTY::WRITE
+#define CHR_NOTIFY            NIMBLE_PROPERTY::NOTIFY
+#else
+#define BLE_NIMBLE            0
+#define BLE_BACKEND_NAME      "Bluedroid"
+#define CHR_READ              BLECharacteristic::PROPERTY_READ
+#define CHR_WRITE             BLECharacteristic::PROPERTY_WRITE
+#define CHR_NOTIFY            BLECharacteristic::PROPERTY_NOTIFY
+#endif
+
+// ─── Fleet (Virtual Holters) ────────────────────────────────────────────────
+// FLEET_SIZE > 1 makes one board present FLEET_SIZE Holters: the primary
+// device plus FLEET_SIZE - 1 virtual ones. Each is advertised in turn under
+// its own random static address and name and served over its own
+// connection. Set with build_flags = -D FLEET_SIZE=3.
+#ifndef FLEET_SIZE
+#define FLEET_SIZE            1
+#endif
+#define FLEET_ENABLED         (FLEET_SIZE > 1)
+#define VIRTUAL_HOLTERS       (FLEET_SIZE - 1)
+#define FLEET_RING_SIZE       512   // Samples per virtual Holter (~2 s at 250 Hz)
+#define FLEET_BPM_BASE        64    // Virtual Holter k: BASE + STEP·k BPM
+#define FLEET_BPM_STEP        11
+#define FLEET_PVC_PERIOD_MS   60000 // Virtual Holter k: PVC episode every PERIOD + k·30 s
+#define FLEET_PVC_STEP_MS     30000
+
+#if defined(CONFIG_BTDM_CTRL_BLE_MAX_CONN_EFF) && FLEET_SIZE > CONFIG_BTDM_CTRL_BLE_MAX_CONN_EFF
+#warning "FLEET_SIZE exceeds the controller's BLE connection limit — extra Holters never connect"
+#endif
+
+// ─── Fan-Out (Followers) ────────────────────────────────────────────────────
+// Without a fleet, up to ECG_FOLLOWERS more centrals can connect next to the
+// primary's and subscribe to the same stream (a clinician's tablet next to
+// the patient's phone). It is generated once; each follower reads the sample
+// ring at its own cursor, packetized for its own MTU. A fleet uses those
+// connections for its virtual Holters instead. Off by default, like the
+// fleet; set with build_flags = -D ECG_FOLLOWERS=2.
+#ifndef ECG_FOLLOWERS
+#define ECG_FOLLOWERS         0
+#endif
+
+#if FLEET_ENABLED && ECG_FOLLOWERS > 0
+#error "ECG_FOLLOWERS needs FLEET_SIZE 1 — a fleet attributes every connection to a Holter"
+#endif
+#if ECG_FOLLOWERS > 8
+#error "ECG_FOLLOWERS is at most 8 (one subscription bit each per notified value)"
+#endif
+#if FLEET_ENABLED && BLE_NIMBLE
+#error "FLEET_SIZE > 1 needs the Bluedroid backend (per-Holter advertising addresses)"
+#endif
+
+// Subscriptions tracked per link: the library's BLE2902 holds one value for
+// all connections, so it only serves a single central on Bluedroid
+#define SUBSCRIPTIONS_PER_LINK (FLEET_ENABLED || ECG_FOLLOWERS || BLE_NIMBLE)
+#if defined(CONFIG_BTDM_CTRL_BLE_MAX_CONN_EFF) && ECG_FOLLOWERS >= CONFIG_BTDM_CTRL_BLE_MAX_CONN_EFF
+#warning "ECG_FOLLOWERS exceeds the controller's BLE connection limit — extra followers never connect"
+#endif
+
+// ─── Sample Source ──────────────────────────────────────────────────────────
+// SOURCE_SYNTH:  Gaussian beat model (ecg_synth)
+// SOURCE_REPLAY: a recording in the "ecgdata" flash partition (partitions.csv),
+//                memory-mapped and read in place — see the Replay section
+#define SOURCE_SYNTH            0
+#define SOURCE_REPLAY           1
+#define REPLAY_PARTITION_LABEL  "ecgdata"
+#define REPLAY_MAGIC            0x43524743  // "CGRC" little-endian
+#define REPLAY_VERSION          1
+
+// ─── Beat Annotations ───────────────────────────────────────────────────────
+// One notification per beat on the annotation characteristic — see the
+// Beat Annotations section for the value layouts.
+#define ANNOTATION_FORMAT_BEAT     0   // CardioGuard beat record (default)
+#define ANNOTATION_FORMAT_HRM      1   // Heart Rate Measurement layout (0x2A37)
+#define ANNOTATION_ORIGIN_MODEL    0   // Synthetic source: the model's own R peak
+#define ANNOTATION_ORIGIN_DETECTOR 1   // Replay: streaming QRS detector
+#define ANNOTATION_QUEUE_SIZE      16  // Beats between the generator and loop()
+
+// ─── Signal Summary ─────────────────────────────────────────────────────────
+// One notification per second on the summary characteristic — see the
+// Signal Summary section for the value layout.
+#define STREAM_MODE_FULL        0      // Raw packets and summaries (default)
+#define STREAM_MODE_SUMMARY     1      // Summaries only — raw frames wait as while offline
+#define SUMMARY_QUEUE_SIZE      4      // Windows between the generator and loop()
+#define SUMMARY_FLAT_MV         0.05f  // Less range in a window → flat line
+#define SUMMARY_CLIP_MV         5.0f   // Beyond ± this → front end saturated
+#define SUMMARY_ASYSTOLE_MS     3000   // No beat for this long → no heart rate
+#define SUMMARY_BACKLOG_MS      1000   // Raw frames waiting longer → link behind
+#define SUMMARY_Q_FLAT          0x01   // Quality flags of a window
+#define SUMMARY_Q_CLIPPED       0x02
+#define SUMMARY_Q_NO_BEAT       0x04
+#define SUMMARY_Q_RESTART       0x08   // First window after a stream restart
+#define SUMMARY_Q_BACKLOG       0x10
+
+// ─── Scenario Engine ────────────────────────────────────────────────────────
+// Scripted timelines for unattended soak runs — see the Scenario section.
+#define SCENARIO_CMD_STOP       0
+#define SCENARIO_CMD_LOAD       1     // Replace the script with this text
+#define SCENARIO_CMD_APPEND     2     // Append this text (scripts longer than one write)
+#define SCENARIO_CMD_START      3     // Parse and (re)start — built-in soak if none loaded
+#define SCENARIO_TEXT_SIZE      2048  // Script bytes
+#define SCENARIO_MAX_EVENTS     48
+#define SCENARIO_EVENT_TEXT     24    // Source line kept per event for the marker log
+#define SCENARIO_RAMP_STEP_MS   250   // BPM ramp update period
+#ifndef SCENARIO_AUTOSTART
+#define SCENARIO_AUTOSTART      0     // 1: start the script (the built-in soak) at boot
+#endif
+
+// ─── Hardware Pins ──────────────────────────────────────────────────────────
+// DeneyapKart A1: Built-in blue LED = GPIO 13 (LEDB)
+// If using standard ESP32 DevKit, set LED_PIN to 2.
+#define LED_PIN       13      // DeneyapKart A1 built-in LED (LEDB)
+#define POT_PIN       34      // Potentiometer (BPM adjustment, optional)
+// WARNING: "D8" label on DeneyapKart is NOT GPIO 8!
+// GPIO 6-11 are connected to SPI Flash — using them causes crash.
+// BOOT button (GPIO 0) is safe on all ESP32 boards.
+#define BUTTON_PIN    0       // BOOT button (GPIO 0) — arrhythmia trigger
+
+// ─── Power Management ───────────────────────────────────────────────────────
+// The low-power link profile also puts the board into power-save mode:
+//   - the generator wakes once per POWER_GEN_BATCH frames instead of every
+//     sample (the sender already holds packets for one burst per interval)
+//   - loop() sleeps POWER_LOOP_PERIOD_MS after every pass instead of spinning
+//   - with CONFIG_PM_ENABLE the CPU clock drops to POWER_MIN_FREQ_MHZ while
+//     none of the firmware's tasks runs (DFS); they always run at full clock
+//   - with tickless idle (CONFIG_FREERTOS_USE_TICKLESS_IDLE) that idle time
+//     becomes automatic light sleep between bursts and connection events
+// The prebuilt Arduino core has no tickless idle; light sleep with BLE needs
+// an ESP-IDF build of the core with it and a Bluetooth sleep clock.
+#define POWER_GEN_BATCH          10     // Frames per generator wake-up in power-save mode
+#define POWER_LOOP_PERIOD_MS     20
+#define POWER_MAX_FREQ_MHZ       240
+#define POWER_MIN_FREQ_MHZ       40     // XTAL
+#define POWER_REPORT_INTERVAL_MS 60000  // Energy report and battery update
+#ifdef CONFIG_PM_ENABLE
+#define POWER_DFS                1
+#else
+#define POWER_DFS                0
+#endif
+#if POWER_DFS && defined(CONFIG_FREERTOS_USE_TICKLESS_IDLE)
+#define POWER_LIGHT_SLEEP        1
+#else
+#define POWER_LIGHT_SLEEP        0
+#endif
+
+// ─── Energy Model ───────────────────────────────────────────────────────────
+// The time both cores are idle is measured (see Power — Activity
+// Accounting) and drawn at the idle current — light sleep, WAITI at the DFS
+// minimum or WAITI at full clock, depending on the mode; the rest of each
+// interval at least one core runs, at the active current. Radio time is
+// estimated from the bytes notified and the connection or advertising
+// events. Currents are typical ESP32 datasheet values at 3.3 V; measure
+// the module and adjust them before sizing a battery.
+#define POWER_SUPPLY_V           3.3f
+#define POWER_ACTIVE_MA          50.0f  // CPU at 240 MHz, radio off
+#define POWER_IDLE_MA            27.0f  // WAITI at 240 MHz (no DFS)
+#define POWER_IDLE_DFS_MA        13.0f  // WAITI at POWER_MIN_FREQ_MHZ
+#define POWER_SLEEP_MA           1.5f   // Automatic light sleep, BT sleep clock running
+#define POWER_TX_MA              130.0f // BLE TX at 0 dBm (added to the CPU current)
+#define POWER_RX_MA              100.0f // BLE RX
+#define POWER_EVENT_US           500    // Radio on per connection event besides our packets
+#define POWER_ADV_EVENT_US       1500   // Radio on per advertising event (3 channels)
+#define POWER_ADV_INTERVAL_MS    30     // BLEAdvertising default: 20-40 ms
+#define POWER_LL_OVERHEAD        17     // Bytes on air per notification: ATT 3 + L2CAP 4 + LL 10
+
+// ─── Battery Simulation ─────────────────────────────────────────────────────
+// The level follows the energy model (charge used per report interval).
+#define BATTERY_START_LEVEL  95
+#ifndef BATTERY_CAPACITY_MAH
+#define BATTERY_CAPACITY_MAH 500    // LiPo cell of the simulated device
+#endif
+#define BATTERY_MIN_LEVEL    5      // Reported level never drops below this
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Global Variables
+// ─────────────────────────────────────────────────────────────────────────────
+
+BLEServer*         pServer         = nullptr;
+BLECharacteristic* pECGChar        = nullptr;
+BLECharacteristic* pBatteryChar    = nullptr;
+BLECharacteristic* pFirmwareChar   = nullptr;
+BLECharacteristic* pControlChar    = nullptr;
+BLECharacteristic* pLinkChar       = nullptr;
+BLECharacteristic* pScenarioChar   = nullptr;
+BLECharacteristic* pAnnotationChar = nullptr;
+BLECharacteristic* pSummaryChar    = nullptr;
+BLECharacteristic* pDiagChar       = nullptr;
+#if BLE_NIMBLE
+typedef NimBLEDescriptor CccdDescriptor;   // NimBLE adds the CCCDs itself; never set
+#else
+typedef BLE2902 CccdDescriptor;
+#endif
+CccdDescriptor*    pECGCCCD        = nullptr;
+typedef uint8_t    BdAddress[6];      // Bluetooth device address
+
+bool deviceConnected    = false;
+bool oldDeviceConnected = false;
+uint16_t sequenceNumber = 0;          // Continues across reconnects
+volatile uint32_t connectionCount = 0;  // Bumped per connection (sender resync)
+volatile uint16_t negotiatedMTU    = DEFAULT_ATT_MTU;
+volatile uint16_t samplesPerPacket = SAMPLES_PER_PACKET;
+volatile uint8_t  streamFormat     = 0;  // FORMAT_* flags negotiated for this connection
+volatile uint8_t  configuredLeads  = 1;  // Requested lead count (applied by the generator)
+volatile uint8_t  leadCount        = 1;  // Lead count the generator is producing
+volatile uint8_t  offlineMode      = OFFLINE_DRAIN;
+volatile uint32_t requestedSeed    = SYNTH_DEFAULT_SEED;
+volatile bool     seedPending      = false;  // Generator restarts the waveform from requestedSeed
+volatile uint8_t  requestedRhythm  = RHYTHM_NORMAL;
+volatile bool     rhythmPending    = false;  // Generator switches to requestedRhythm
+volatile uint8_t  sampleSource     = SOURCE_SYNTH;  // Requested source (applied by the generator)
+volatile uint16_t configuredRate   = SAMPLE_RATE;   // Requested sample rate (applied by the generator)
+volatile uint16_t sampleRate       = SAMPLE_RATE;   // Rate of the frames in the ring
+volatile uint8_t  annotationFormat = ANNOTATION_FORMAT_BEAT;
+volatile uint8_t  streamMode       = STREAM_MODE_FULL;
+volatile uint8_t  fecGroup         = 0;  // Live packets per parity packet (0 = off), per connection
+uint8_t  batteryLevel   = BATTERY_START_LEVEL;
+float    batteryChargeMah = BATTERY_CAPACITY_MAH * BATTERY_START_LEVEL / 100.0f;
+volatile uint8_t  configuredBatch  = 1;  // Frames per generator wake-up (applied by the generator)
+uint8_t  generatorBatch = 1;
+bool     powerSaveActive = false;
+
+// Timers
+unsigned long lastStatusTime   = 0;
+unsigned long lastPowerReport  = 0;
+unsigned long lastLEDTime      = 0;
+unsigned long lastDiagTime     = 0;
+bool          ledState         = false;   // loop() owns the LED
+std::atomic<uint32_t> lastBeatMs(0);      // millis() of the last synthetic beat (generator)
+volatile bool controlStatusDirty = false;  // Sender asks loop() to refresh the status
+volatile bool linkStatusDirty    = false;  // GAP events ask loop() to refresh the link value
+volatile bool linkRetunePending  = false;  // loop() re-requests connection parameters
+volatile bool txCongested        = false;  // Primary link congested (GATT event)
+volatile bool scenarioStartPending = false;  // loop() (re)starts the scenario
+volatile bool scenarioStopPending  = false;
+
+// Generator state of the primary Holter (virtual Holters have their own)
+SynthState  synth;
+BeatTables* synthTables = nullptr;   // allocBeatTables()
+
+// Arrhythmia simulation (arrhythmiaMode itself is generator state)
+unsigned long arrhythmiaStart = 0;
+#define ARRHYTHMIA_DURATION_MS 10000  // 10-second arrhythmia (button, Serial)
+unsigned long arrhythmiaDurationMs = ARRHYTHMIA_DURATION_MS;  // Scenarios set their own
+
+/**
+ * Beat tables for one stream: only the set the generator path reads
+ * (beatTablesFor()), sized for SAMPLE_RATE_MAX. The primary's tables stay
+ * in internal RAM — the generator reads them every frame, and a PSRAM
+ * cache miss costs more than the read — unless it is full; the virtual
+ * Holters' go to PSRAM when the board has it.
+ */
+BeatTables* allocBeatTables(bool internal) {
+  uint8_t sets = beatTablesFor(synthPath);
+  size_t bytes = beatTablesSize(sets, SAMPLE_RATE_MAX);
+  void* storage = nullptr;
+  if (bytes && (internal || !psramFound())) {
+    storage = heap_caps_malloc(bytes, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  }
+  if (bytes && !storage && psramFound()) storage = ps_malloc(bytes);
+  if (bytes && !storage) {
+    Serial.printf("[SYS] FATAL: no memory for %u KB of beat tables (lower SAMPLE_RATE_MAX)\n",
+      bytes / 1024);
+    for (;;) delay(1000);
+  }
+  BeatTables* t = new BeatTables;
+  beatTablesInit(*t, storage, sets, SAMPLE_RATE_MAX);
+  return t;
+}
+
+/**
+ * FORMAT_RATE for a stream at another rate than SAMPLE_RATE: its extended
+ * packets then carry the rate. At the default rate the header stays short.
+ */
+inline uint8_t rateFlag(uint16_t rate) {
+  return rate != SAMPLE_RATE ? FORMAT_RATE : 0;
+}
+
+/**
+ * Device-chosen header fields of the primary's extended packets: the rate
+ * (see rateFlag()) and the stamp if the central asked for FORMAT_STAMP.
+ */
+inline uint8_t liveFlags() {
+  return rateFlag(sampleRate) | (streamFormat & FORMAT_STAMP);
+}
+
+/**
+ * Longest live packet at the current MTU: with FEC on (`group` > 0) each
+ * leaves room for the parity packet of its group.
+ */
+inline uint16_t livePacketLimit(uint8_t group = fecGroup) {
+  return negotiatedMTU - ATT_NOTIFY_OVERHEAD - (group ? PARITY_OVERHEAD : 0);
+}
+
+inline void putLE16(uint8_t* p, uint16_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+}
+
+inline void putLE32(uint8_t* p, uint32_t v) {
+  for (int i = 0; i < 4; i++) p[i] = (v >> (8 * i)) & 0xFF;
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Diagnostics — Hot-Path Timing
+// ─────────────────────────────────────────────────────────────────────────────
+// Each TimingStat has a single writer (loop, generator or sender task), so
+// recording needs no lock; a reader may see one sample half applied, which
+// is fine for diagnostics. Durations are measured in CPU cycles
+// (ESP.getCycleCount(), sub-µs resolution) and kept in µs.
+
+enum DiagStatId : uint8_t {
+  DIAG_LOOP,        // One loop() iteration
+  DIAG_GENERATOR,   // One generator wake-up (all pending ticks)
+  DIAG_SEND,        // transmitECGPacket(), including any wait for stack buffers
+  DIAG_NOTIFY,      // One sendNotification() call
+  DIAG_STAT_COUNT
+};
+
+const char* const DIAG_STAT_NAMES[DIAG_STAT_COUNT] = {
+  "loop", "generator", "send", "notify"
+};
+
+struct TimingStat {
+  uint32_t count;
+  uint32_t minUs;
+  uint32_t maxUs;
+  uint64_t sumUs;
+  uint32_t hist[DIAG_HIST_BUCKETS];
+};
+
+TimingStat diagStats[DIAG_STAT_COUNT];
+uint32_t   cyclesPerUs           = 240;  // Set from the CPU clock in setup()
+uint32_t   diagPacketsSent       = 0;
+uint32_t   diagDeadlineMisses    = 0;    // Packets sent ≥ one packet period late
+uint32_t   diagGeneratorLateTicks = 0;   // Timer ticks the generator had to catch up
+uint32_t   diagLoopOverruns      = 0;    // loop() iterations ≥ LOOP_DEADLINE_US
+uint32_t   diagTxRetries         = 0;    // Notifications the stack refused (retried)
+uint32_t   diagTxDrops           = 0;    // Packets given up after TX_GIVE_UP_MS or a disconnect
+uint32_t   diagTxBacklogMax      = 0;    // Most frames queued behind a sent packet
+uint32_t   diagFecParity         = 0;    // Parity packets sent
+uint32_t   diagClockRateMilliHz  = 0;    // Effective sample rate since the clock origin
+int32_t    diagClockDriftUs      = 0;    // Stream time produced minus time elapsed
+uint32_t   diagClockLagMaxUs     = 0;    // Worst generator lag behind the sample clock
+uint32_t   loopStackHighWater    = 0;
+
+void diagReset() {
+  memset(diagStats, 0, sizeof(diagStats));
+  for (uint8_t i = 0; i < DIAG_STAT_COUNT; i++) diagStats[i].minUs = UINT32_MAX;
+  diagPacketsSent = 0;
+  diagDeadlineMisses = 0;
+  diagGeneratorLateTicks = 0;
+  diagLoopOverruns = 0;
+  diagTxRetries = 0;
+  diagTxDrops = 0;
+  diagTxBacklogMax = 0;
+  diagFecParity = 0;
+  diagClockRateMilliHz = 0;
+  diagClockDriftUs = 0;
+  diagClockLagMaxUs = 0;
+}
+
+/**
+ * Histogram bucket of a duration: [0,16) [16,64) … [65536,∞) µs.
+ */
+inline uint8_t diagBucket(uint32_t us) {
+  if (us < 16) return 0;
+  uint8_t b = (uint8_t)((31 - __builtin_clz(us)) / 2 - 1);
+  return b < DIAG_HIST_BUCKETS ? b : DIAG_HIST_BUCKETS - 1;
+}
+
+/**
+ * Record a duration measured with ESP.getCycleCount().
+ */
+inline uint32_t diagRecord(DiagStatId id, uint32_t cycles) {
+  TimingStat& st = diagStats[id];
+  uint32_t us = cycles / cyclesPerUs;
+  st.count++;
+  st.sumUs += us;
+  if (us < st.minUs) st.minUs = us;
+  if (us > st.maxUs) st.maxUs = us;
+  st.hist[diagBucket(us)]++;
+  return us;
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Power — Activity Accounting
+// ─────────────────────────────────────────────────────────────────────────────
+// Idle time is measured per core. An idle hook on each core opens an idle
+// span on the idle task's first pass; the next powerEnter() or powerBusy()
+// on that core — loop(), the generator or the sender running again —
+// closes it. While both cores are idle the chip can drop to the DFS
+// minimum or light sleep, so that overlap is timed as well: the chip is
+// awake for the rest of the interval. The BLE host and controller tasks
+// do not close a span; their radio time is modelled instead. All state
+// sits under one spinlock, taken once per wake-up by the generator at
+// batch 1 and once per idle-loop pass by the idle tasks. In power-save
+// mode a running task holds the CPU_FREQ_MAX lock, so DFS lowers the clock
+// only when all three are idle and the cycle-counter diagnostics stay at
+// full clock; otherwise the clock is at maximum anyway and the lock is
+// skipped.
+
+#define POWER_CORES        portNUM_PROCESSORS
+#define POWER_ALL_IDLE     ((1u << POWER_CORES) - 1)
+
+enum PowerTask : uint8_t {
+  POWER_LOOP,
+  POWER_GENERATOR,
+  POWER_SENDER,
+  POWER_TASKS
+};
+
+/**
+ * Idle spans of both cores. mask has a bit per core idle since sinceUs.
+ */
+struct PowerIdle {
+  int64_t sinceUs[POWER_CORES];  // esp_timer µs the core's idle span started
+  int64_t coreUs[POWER_CORES];   // Finished idle spans, running totals
+  int64_t bothSinceUs;           // All cores idle since
+  int64_t bothUs;                // Finished all-idle spans, running total
+  uint8_t mask;
+};
+
+/**
+ * Idle time in one report interval.
+ */
+struct PowerIdleTimes {
+  int64_t coreUs[POWER_CORES];
+  int64_t bothUs;
+};
+
+portMUX_TYPE   powerIdleMux = portMUX_INITIALIZER_UNLOCKED;
+PowerIdle      powerIdle = {};
+PowerIdleTimes powerIdleTaken = {};    // Totals at the last powerTakeIdle()
+bool         powerPmLocked[POWER_TASKS];  // Task holds powerLock for this span (owner only)
+uint32_t     powerFrames = 0;          // Frames generated (primary) — running totals
+uint32_t     powerTxPackets = 0;       // Notifications the stack accepted (all links)
+uint32_t     powerTxBytes = 0;
+#if POWER_DFS
+esp_pm_lock_handle_t powerLock = nullptr;
+#endif
+
+/**
+ * Idle hook of both cores, called on every pass of the idle task before it
+ * waits for an interrupt (WAITI, or light sleep when DFS allows it).
+ */
+bool powerIdleHook() {
+  uint8_t core = (uint8_t)xPortGetCoreID();
+  uint8_t bit = 1u << core;
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&powerIdleMux);
+  if (!(powerIdle.mask & bit)) {
+    powerIdle.sinceUs[core] = now;
+    powerIdle.mask |= bit;
+    if (powerIdle.mask == POWER_ALL_IDLE) powerIdle.bothSinceUs = now;
+  }
+  portEXIT_CRITICAL(&powerIdleMux);
+  return true;
+}
+
+/**
+ * The calling task runs again: close its core's idle span. The sender
+ * calls it after the backfill yield inside its bracket; loop()'s 100 ms
+ * waits for the BLE stack are rare and left to its next powerEnter().
+ */
+void powerBusy() {
+  uint8_t core = (uint8_t)xPortGetCoreID();
+  uint8_t bit = 1u << core;
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&powerIdleMux);
+  if (powerIdle.mask & bit) {
+    if (powerIdle.mask == POWER_ALL_IDLE) powerIdle.bothUs += now - powerIdle.bothSinceUs;
+    powerIdle.coreUs[core] += now - powerIdle.sinceUs[core];
+    powerIdle.mask &= ~bit;
+  }
+  portEXIT_CRITICAL(&powerIdleMux);
+}
+
+void powerEnter(PowerTask task) {
+#if POWER_DFS
+  powerPmLocked[task] = powerLock && powerSaveActive;
+  if (powerPmLocked[task]) esp_pm_lock_acquire(powerLock);
+#endif
+  powerBusy();
+}
+
+void powerExit(PowerTask task) {
+#if POWER_DFS
+  if (powerPmLocked[task]) esp_pm_lock_release(powerLock);
+#endif
+}
+
+/**
+ * Install the idle hooks; the idle spans count from here.
+ */
+void setupPowerIdle() {
+  for (uint8_t core = 0; core < POWER_CORES; core++) {
+    esp_err_t err = esp_register_freertos_idle_hook_for_cpu(powerIdleHook, core);
+    if (err != ESP_OK) Serial.printf("[PWR] Idle hook on core %u failed: %s\n", core, esp_err_to_name(err));
+  }
+}
+
+/**
+ * Idle time since the last call, per core and with all cores idle at once,
+ * including spans still open.
+ */
+PowerIdleTimes powerTakeIdle() {
+  PowerIdleTimes total;
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&powerIdleMux);
+  for (uint8_t core = 0; core < POWER_CORES; core++) {
+    total.coreUs[core] = powerIdle.coreUs[core];
+    if (powerIdle.mask & (1u << core)) total.coreUs[core] += now - powerIdle.sinceUs[core];
+  }
+  total.bothUs = powerIdle.bothUs;
+  if (powerIdle.mask == POWER_ALL_IDLE) total.bothUs += now - powerIdle.bothSinceUs;
+  portEXIT_CRITICAL(&powerIdleMux);
+
+  PowerIdleTimes span;
+  for (uint8_t core = 0; core < POWER_CORES; core++) {
+    span.coreUs[core] = total.coreUs[core] - powerIdleTaken.coreUs[core];
+  }
+  span.bothUs = total.bothUs - powerIdleTaken.bothUs;
+  powerIdleTaken = total;
+  return span;
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Fleet — Virtual Holters
+// ─────────────────────────────────────────────────────────────────────────────
+// Each virtual Holter has its own generator state, sequence stream, BPM and
+// PVC schedule. It streams legacy (format 0) packets live while its central
+// is subscribed — no offline recording, control or backfill; those stay
+// with the primary device, and Control writes from a virtual Holter's
+// central are ignored (handleControlCommand()). The generator task fills
+// every ring, the sender task drains them — lock-free, the same
+// single-producer/single-consumer scheme as the primary's sample ring (see
+// Sample Pipeline): the generator only writes ringHead (release after each
+// block) and never looks at the tail, the sender only writes ringTail,
+// notices being lapped and checks every copy against the head afterwards.
+// A new subscription restarts the stream in the generator, which publishes
+// it through ringRestarts.
+//
+// BLECharacteristic::notify() sends to every connected central, so with a
+// fleet all ECG packets go to their own link only (notifyLink()), and
+// subscriptions are tracked per link (ecgSubscription()). The primary's
+// other characteristics reach its central only (notifyValue()).
+
+struct VirtualHolter {
+  SynthState    synth;
+  uint16_t      sequenceNumber;
+  char          name[24];
+  BdAddress     address;           // Random static
+  volatile bool connected;
+  volatile bool subscribed;
+  uint16_t      connId;
+  uint16_t      mtu;
+  uint16_t      samplesPerPacket;
+  uint32_t      pvcPeriodMs;
+  unsigned long nextPvcAt;         // millis() of the next PVC episode
+  unsigned long pvcStart;
+  volatile bool restartPending;    // New subscription: the generator restarts the stream
+  int16_t       ring[FLEET_RING_SIZE];
+  std::atomic<uint32_t> ringHead;      // Total samples written (generator)
+  std::atomic<uint32_t> ringRestarts;  // Stream restarts (generator, release)
+  uint32_t      restartHead;       // ringHead at the last restart (generator)
+  uint32_t      ringTail;          // Total samples sent (sender)
+  uint32_t      tailRestarts;      // Restarts ringTail has followed (sender)
+  uint32_t      overflows;         // Samples lapped before they were sent (sender)
+};
+
+VirtualHolter fleet[FLEET_ENABLED ? VIRTUAL_HOLTERS : 1];
+BdAddress     primaryAddress;       // Random static address of the primary in a fleet
+uint16_t      primaryConnId = 0;
+volatile bool primarySubscribed = false;
+volatile int8_t advertisedHolter = -1;   // 0 = primary, k = fleet[k - 1], -1 = none
+volatile bool fleetAdvertisePending = false;
+
+uint16_t samplesForMTU(uint16_t mtu);
+
+/**
+ * Random static address of Holter `index`: top two bits set, the rest from
+ * the Bluetooth MAC, so every board and index gets a stable, unique one.
+ */
+void fleetAddress(uint8_t index, BdAddress addr) {
+  uint8_t mac[6];
+  esp_read_mac(mac, ESP_MAC_BT);
+  addr[0] = 0xC0 | (mac[3] & 0x3F);
+  addr[1] = mac[4];
+  addr[2] = mac[5];
+  addr[3] = 'C';
+  addr[4] = 'G';
+  addr[5] = index;
+}
+
+/**
+ * Allocate the virtual Holters' tables (PSRAM when present) and give each
+ * its own heart rate and PVC schedule.
+ */
+void setupFleet() {
+  if (!FLEET_ENABLED) return;
+  fleetAddress(0, primaryAddress);
+
+  for (uint8_t k = 0; k < VIRTUAL_HOLTERS; k++) {
+    VirtualHolter& v = fleet[k];
+    synthInit(v.synth, allocBeatTables(false), FLEET_BPM_BASE + FLEET_BPM_STEP * (k + 1));
+    synthSeed(v.synth, SYNTH_DEFAULT_SEED * (k + 2));   // Own, but fixed, noise and HRV
+    snprintf(v.name, sizeof(v.name), "%s-%02u", DEVICE_NAME, k + 2);
+    fleetAddress(k + 1, v.address);
+    v.pvcPeriodMs = FLEET_PVC_PERIOD_MS + FLEET_PVC_STEP_MS * k;
+    v.nextPvcAt = v.pvcPeriodMs;
+    v.mtu = DEFAULT_ATT_MTU;
+    v.samplesPerPacket = samplesForMTU(DEFAULT_ATT_MTU);
+  }
+  Serial.printf("[BLE] Fleet: %u Holters (%u virtual)\n", FLEET_SIZE, VIRTUAL_HOLTERS);
+}
+
+VirtualHolter* fleetFind(uint16_t connId) {
+  for (uint8_t k = 0; k < VIRTUAL_HOLTERS; k++) {
+    if (fleet[k].connected && fleet[k].connId == connId) return &fleet[k];
+  }
+  return nullptr;
+}
+
+/**
+ * Notify one attribute to one link straight through the stack's API — no
+ * library value, no heap. Returns false if the stack refused it.
+ */
+inline bool sendNotification(uint16_t connId, uint16_t handle, const uint8_t* data,
+                             uint16_t len) {
+#if BLE_NIMBLE
+  os_mbuf* om = ble_hs_mbuf_from_flat(data, len);   // From the host's mbuf pool
+  return om && ble_gattc_notify_custom(connId, handle, om) == 0;   // Consumes om
+#else
+  return esp_ble_gatts_send_indicate(pServer->getGattsIf(), connId, handle, len,
+                                     (uint8_t*)data, false) == ESP_OK;
+#endif
+}
+
+/**
+ * Notify one link only.
+ */
+inline bool notifyLink(uint16_t connId, const uint8_t* data, uint16_t len) {
+  if (!sendNotification(connId, pECGChar->getHandle(), data, len)) return false;
+  powerTxPackets++;   // Sender task only
+  powerTxBytes += len;
+  return true;
+}
+
+/**
+ * A virtual Holter's central (un)subscribed to the ECG data: its stream
+ * restarts with every subscription (in the generator, generateFleet()).
+ */
+void fleetSubscription(VirtualHolter& v, bool enable) {
+  if (enable && !v.subscribed) v.restartPending = true;
+  v.subscribed = enable;
+}
+
+/**
+ * Generator task: follow a sample rate change of the primary, whose timer
+ * paces the virtual Holters too.
+ */
+void setFleetSampleRate(uint16_t rate) {
+  for (uint8_t k = 0; k < VIRTUAL_HOLTERS; k++) setSampleRate(fleet[k].synth, rate);
+}
+
+/**
+ * Generator task: `ticks` samples for every subscribed virtual Holter,
+ * generated a block at a time and published with one head store per block.
+ */
+void generateFleet(uint32_t ticks) {
+  int16_t block[RING_WRITE_FRAMES];
+  for (uint8_t k = 0; k < VIRTUAL_HOLTERS; k++) {
+    VirtualHolter& v = fleet[k];
+    uint32_t head = v.ringHead.load(std::memory_order_relaxed);
+    if (v.restartPending) {
+      v.restartPending = false;
+      synthReset(v.synth);
+      v.restartHead = head;
+      v.ringRestarts.store(v.ringRestarts.load(std::memory_order_relaxed) + 1,
+                           std::memory_order_release);
+    }
+    if (!v.subscribed) continue;
+    for (uint32_t done = 0; done < ticks;) {
+      uint32_t n = min<uint32_t>(ticks - done, RING_WRITE_FRAMES);
+      generateBlock(v.synth, block, n, 1);
+      for (uint32_t i = 0; i < n; i++) v.ring[(head + i) % FLEET_RING_SIZE] = block[i];
+      head += n;
+      v.ringHead.store(head, std::memory_order_release);
+      done += n;
+    }
+  }
+}
+
+/**
+ * Sender task (serveOtherLinks()): send every whole legacy packet the
+ * virtual Holters have.
+ * A packet the stack refuses stays in its ring for the next pass; a ring
+ * the generator laps meanwhile loses its oldest samples.
+ */
+void sendFleetPackets(uint8_t* packet) {
+  int16_t samples[MAX_SAMPLES_PER_PACKET];
+  // The generator may be writing up to a block past the head
+  const uint32_t span = FLEET_RING_SIZE - RING_WRITE_FRAMES;
+  for (uint8_t k = 0; k < VIRTUAL_HOLTERS; k++) {
+    VirtualHolter& v = fleet[k];
+    for (;;) {
+      if (!v.subscribed || v.restartPending) break;
+      uint32_t restarts = v.ringRestarts.load(std::memory_order_acquire);
+      if (restarts != v.tailRestarts) {
+        v.tailRestarts = restarts;
+        v.ringTail = v.restartHead;
+        v.sequenceNumber = 0;
+      }
+      uint16_t count = v.samplesPerPacket;
+      uint32_t head = v.ringHead.load(std::memory_order_acquire);
+      if (head - v.ringTail > span) {
+        v.overflows += head - span - v.ringTail;
+        v.ringTail = head - span;
+      }
+      if (head - v.ringTail < count) break;
+
+      for (uint16_t i = 0; i < count; i++) samples[i] = v.ring[(v.ringTail + i) % FLEET_RING_SIZE];
+      // Lapped mid-copy: the loop moves the tail and copies again
+      if (v.ringHead.load(std::memory_order_acquire) - v.ringTail > span) continue;
+
+      uint16_t len = buildRawPacket(packet, v.sequenceNumber, samples, count);
+      if (!notifyLink(v.connId, packet, len)) {
+        diagTxRetries++;
+        break;
+      }
+      v.ringTail += count;
+      v.sequenceNumber++;
+      diagPacketsSent++;
+    }
+  }
+}
+
+/**
+ * loop(): PVC episodes on each virtual Holter's own schedule.
+ */
+void updateFleetSchedules(unsigned long now) {
+  for (uint8_t k = 0; k < VIRTUAL_HOLTERS; k++) {
+    VirtualHolter& v = fleet[k];
+    if (!v.synth.arrhythmiaMode && now >= v.nextPvcAt) {
+      v.synth.arrhythmiaMode = true;
+      v.pvcStart = now;
+      v.nextPvcAt = now + v.pvcPeriodMs;
+    } else if (v.synth.arrhythmiaMode && now - v.pvcStart >= ARRHYTHMIA_DURATION_MS) {
+      v.synth.arrhythmiaMode = false;
+    }
+  }
+}
+
+/**
+ * loop(): advertise the lowest-numbered Holter that has no central yet,
+ * under its own address and name. Connections are attributed to whichever
+ * Holter was being advertised.
+ */
+void advertiseNextHolter() {
+  int8_t next = -1;
+  if (!deviceConnected) {
+    next = 0;
+  } else {
+    for (uint8_t k = 0; k < VIRTUAL_HOLTERS && next < 0; k++) {
+      if (!fleet[k].connected) next = k + 1;
+    }
+  }
+
+  BLEAdvertising* adv = BLEDevice::getAdvertising();
+  adv->stop();
+  advertisedHolter = next;
+  if (next < 0) {
+    Serial.println("[BLE] Fleet: every Holter connected, advertising stopped.");
+    return;
+  }
+#if !BLE_NIMBLE
+  adv->setDeviceAddress(next ? fleet[next - 1].address : primaryAddress, BLE_ADDR_TYPE_RANDOM);
+  esp_ble_gap_set_device_name(next ? fleet[next - 1].name : DEVICE_NAME);
+#endif
+  adv->start();
+  Serial.printf("[BLE] Fleet: advertising %s\n", next ? fleet[next - 1].name : DEVICE_NAME);
+}
+
+/**
+ * Serial: one line per virtual Holter.
+ */
+void printFleet() {
+  for (uint8_t k = 0; k < VIRTUAL_HOLTERS; k++) {
+    const VirtualHolter& v = fleet[k];
+    Serial.printf("[ECG] %s: %s  seq=%u  BPM=%.0f  PVC=%s  mtu=%u  overflows=%u\n",
+      v.name, v.subscribed ? "streaming" : v.connected ? "connected" : "idle",
+      v.sequenceNumber, v.synth.heartRateBPM, v.synth.arrhythmiaMode ? "YES" : "no",
+      v.mtu, v.overflows);
+  }
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Fan-Out — Followers
+// ─────────────────────────────────────────────────────────────────────────────
+// Without a fleet, a central that connects while the primary's is connected
+// becomes a follower. It gets the primary's stream without disturbing it:
+// no second generator, and the ring, the primary's sequence numbers and its
+// stream format stay as they are. The sender reads the shared ring for each
+// follower at its own cursor with ringRead() — as for a backfill, frames
+// stay readable until the generator laps them, whatever the primary's tail
+// does — and sends uncompressed packets sized for the follower's MTU (legacy
+// for one lead, extended otherwise), numbered from 0 per subscription.
+//
+// A follower that falls a whole ring behind skips to the oldest frame, and
+// its sequence numbers jump by the packets it missed. The beat annotations
+// and the summaries describe the same stream, so they go to every follower
+// subscribed to them too, and each follower picks its own stream mode: in
+// STREAM_MODE_SUMMARY its raw packets pause, its frames wait in the ring
+// while it holds them, and older ones are skipped as when it is lapped.
+//
+// Offline recording, backfill, FEC, impairment and the benchmark stay with
+// the primary, and so does the rest of Control: a follower's central can
+// read the status and set its stream mode, its other writes are ignored
+// (handleControlCommand()).
+
+struct Follower {
+  volatile bool connected;
+  volatile bool subscribed;
+  volatile bool restartPending;    // New subscription: the sender starts at the live edge
+  volatile bool congested;
+  volatile uint8_t streamMode;     // STREAM_MODE_*, its own central's choice
+  uint16_t      connId;
+  volatile uint16_t mtu;
+  uint16_t      sequenceNumber;    // Sender task from here on
+  uint32_t      cursorEpoch;       // Ring epoch the cursor counts in
+  uint32_t      cursor;            // Next ring frame to send
+  uint32_t      packets;
+  uint32_t      overflows;         // Frames lapped before they were sent
+};
+
+Follower followers[ECG_FOLLOWERS ? ECG_FOLLOWERS : 1];
+volatile bool followerAdvertisePending = false;
+volatile bool followerAdvertising = false;   // Advertising while the primary is connected
+
+Follower* followerFind(uint16_t connId) {
+  for (uint8_t k = 0; k < ECG_FOLLOWERS; k++) {
+    if (followers[k].connected && followers[k].connId == connId) return &followers[k];
+  }
+  return nullptr;
+}
+
+uint8_t followersConnected() {
+  uint8_t n = 0;
+  for (uint8_t k = 0; k < ECG_FOLLOWERS; k++) n += followers[k].connected;
+  return n;
+}
+
+void followerResetSubscriptions(uint8_t k);
+
+/**
+ * onConnect() while the primary's central is connected: take a free
+ * follower slot. Returns false if every slot is taken.
+ */
+bool followerConnect(uint16_t connId) {
+  for (uint8_t k = 0; k < ECG_FOLLOWERS; k++) {
+    Follower& f = followers[k];
+    if (f.connected) continue;
+    f.connId = connId;
+    f.mtu = DEFAULT_ATT_MTU;
+    f.subscribed = false;
+    f.congested = false;
+    f.streamMode = STREAM_MODE_FULL;
+    followerResetSubscriptions(k);
+    f.connected = true;
+    Serial.printf("[BLE] Follower %u connected (conn %u), %u of %u slots used\n",
+      k + 1, connId, followersConnected(), ECG_FOLLOWERS);
+    return true;
+  }
+  return false;
+}
+
+/**
+ * A central (un)subscribed to the ECG data — from the raw CCCD write
+ * (Bluedroid, gattsEventHandler()) or onSubscribe() (NimBLE). A follower
+ * starts at the live edge with every subscription.
+ */
+void ecgSubscription(uint16_t connId, bool enable) {
+  VirtualHolter* v = fleetFind(connId);
+  if (v) {
+    fleetSubscription(*v, enable);
+    return;
+  }
+  Follower* f = followerFind(connId);
+  if (f) {
+    if (enable && !f->subscribed) f->restartPending = true;
+    f->subscribed = enable;
+    return;
+  }
+  if (connId == primaryConnId) primarySubscribed = enable;
+}
+
+/**
+ * Serial: one line per connected follower.
+ */
+void printFollowers() {
+  for (uint8_t k = 0; k < ECG_FOLLOWERS; k++) {
+    const Follower& f = followers[k];
+    if (!f.connected) continue;
+    const char* state = !f.subscribed ? "connected"
+      : f.streamMode == STREAM_MODE_SUMMARY ? "summary only" : "streaming";
+    Serial.printf("[ECG] Follower %u: %s  seq=%u  mtu=%u  packets=%u  overflows=%u%s\n",
+      k + 1, state, f.sequenceNumber, f.mtu, f.packets, f.overflows,
+      f.congested ? "  congested" : "");
+  }
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Notify Path — Preallocated Values
+// ─────────────────────────────────────────────────────────────────────────────
+// BLECharacteristic::setValue() builds a std::string per call, and notify()
+// copies that value twice more and the peer map once per notification —
+// heap traffic for every annotation, summary and status update, and in a
+// fleet it also reaches the virtual Holters' centrals. The notified
+// characteristics therefore keep their value in a NotifyValue buffer
+// allocated once by attachValue(), and notifyValue() sends from the
+// caller's buffer straight through the GATT API to the primary's central,
+// like notifyLink() does for ECG packets (Bluedroid still copies it into
+// its own message). The library's copy, which answers reads, is only
+// refreshed when a central actually reads the characteristic.
+//
+// Each BLE2902 holds one value for all connections, so in a fleet or with
+// followers another central's subscription would switch the primary's
+// notifications too. There, and on NimBLE, the primary's subscriptions are
+// tracked per characteristic instead (valueSubscription()), and so are the
+// followers' subscriptions to the values that describe the shared stream
+// (toFollowers: the annotations and the summaries).
+
+#define NOTIFY_VALUE_MAX  292   // Largest notified value (diagnostics)
+
+struct NotifyValue {
+  BLECharacteristic* characteristic;
+  CccdDescriptor*    cccd;       // Bluedroid only
+  uint8_t*           data;       // capacity bytes, allocated by attachValue()
+  uint16_t           capacity;
+  uint16_t           length;
+  volatile bool      primarySubscribed; // SUBSCRIPTIONS_PER_LINK: the primary's CCCD
+  bool               toFollowers;        // Notified to subscribed followers too
+  volatile uint8_t   followerSubscribed; // toFollowers: bit k for followers[k]'s CCCD
+  portMUX_TYPE       mux = portMUX_INITIALIZER_UNLOCKED;
+};
+
+NotifyValue batteryValue, controlValue, linkValue, scenarioValue,
+            annotationValue, summaryValue, diagValue;
+NotifyValue* const notifyValues[] = { &batteryValue, &controlValue, &linkValue,
+                                      &scenarioValue, &annotationValue, &summaryValue,
+                                      &diagValue };
+uint32_t    bleHeapBytes = 0;   // Heap taken by setupBLE() (boot report, 'd')
+
+void valueSubscription(NotifyValue& v, uint16_t connId, bool enable);
+
+/**
+ * BTC task, before a read is answered: hand the latest value to the
+ * library. setValue() allocates, so only the copy out of the buffer runs
+ * under the lock.
+ */
+void refreshValue(NotifyValue& v) {
+  static uint8_t copy[NOTIFY_VALUE_MAX];   // Reads are answered by one task
+  portENTER_CRITICAL(&v.mux);
+  uint16_t len = v.length;
+  memcpy(copy, v.data, len);
+  portEXIT_CRITICAL(&v.mux);
+  v.characteristic->setValue(copy, len);
+}
+
+class NotifyReadCallbacks : public BLECharacteristicCallbacks {
+ public:
+  explicit NotifyReadCallbacks(NotifyValue& v) : value(v) {}
+  void onRead(BLECharacteristic* c) override { refreshValue(value); }
+#if BLE_NIMBLE
+  void onSubscribe(BLECharacteristic* c, ble_gap_conn_desc* desc, uint16_t subValue) override {
+    valueSubscription(value, desc->conn_handle, subValue & 0x0001);
+  }
+#endif
+
+ private:
+  NotifyValue& value;
+};
+
+/**
+ * Setup: give `c` its CCCD (NimBLE adds it by itself) and a value buffer of
+ * `capacity` bytes. With `readCallbacks` false the characteristic has
+ * callbacks of its own, which must call refreshValue() from onRead() and,
+ * on NimBLE, valueSubscription() from onSubscribe().
+ */
+void attachValue(BLECharacteristic* c, NotifyValue& v, uint16_t capacity,
+                 bool readCallbacks = true) {
+  v.characteristic = c;
+#if !BLE_NIMBLE
+  v.cccd = new BLE2902();
+  c->addDescriptor(v.cccd);
+#endif
+  v.data = new uint8_t[capacity];
+  v.capacity = capacity;
+  v.length = 0;
+  if (readCallbacks) c->setCallbacks(new NotifyReadCallbacks(v));
+}
+
+/**
+ * Store a new value and notify it to the primary's central if it
+ * subscribed, and for a toFollowers value to every subscribed follower.
+ * Returns false if nothing was sent; the value is kept for reads either
+ * way.
+ */
+bool notifyValue(NotifyValue& v, const uint8_t* data, uint16_t len) {
+  if (len > v.capacity) len = v.capacity;
+  portENTER_CRITICAL(&v.mux);
+  memcpy(v.data, data, len);
+  v.length = len;
+  portEXIT_CRITICAL(&v.mux);
+
+#if BLE_NIMBLE
+  bool subscribed = v.primarySubscribed;
+#else
+  bool subscribed = SUBSCRIPTIONS_PER_LINK ? v.primarySubscribed : v.cccd->getNotifications();
+#endif
+  uint16_t handle = v.characteristic->getHandle();
+  bool sent = deviceConnected && subscribed && sendNotification(primaryConnId, handle, data, len);
+  for (uint8_t k = 0; k < ECG_FOLLOWERS; k++) {
+    const Follower& f = followers[k];
+    if (!(v.followerSubscribed & (1u << k)) || !f.connected || f.congested) continue;
+    sent |= sendNotification(f.connId, handle, data, len);
+  }
+  return sent;
+}
+
+/**
+ * A central (un)subscribed to one of the notified values. The primary's
+ * subscription counts, and a follower's for a toFollowers value; the
+ * others' reach the shared BLE2902 at most.
+ */
+void valueSubscription(NotifyValue& v, uint16_t connId, bool enable) {
+  Follower* f = followerFind(connId);
+  if (f) {
+    if (!v.toFollowers) return;
+    uint8_t bit = 1u << (f - followers);
+    v.followerSubscribed = enable ? v.followerSubscribed | bit : v.followerSubscribed & ~bit;
+    return;
+  }
+  if (connId == primaryConnId) v.primarySubscribed = enable;
+}
+
+/**
+ * onConnect() of a new primary central: it has not subscribed to anything.
+ */
+void notifyResetSubscriptions() {
+  for (NotifyValue* v : notifyValues) v->primarySubscribed = false;
+}
+
+/**
+ * followerConnect(): the central in slot `k` has not subscribed to anything.
+ */
+void followerResetSubscriptions(uint8_t k) {
+  for (NotifyValue* v : notifyValues) v->followerSubscribed &= ~(1u << k);
+}
+
+// ─── Heap Comparison — Bluedroid vs NimBLE ──────────────────────────────────
+// Each build keeps its own heap figures in NVS under its backend's key —
+// what setupBLE() took and the lowest free heap seen since boot (the
+// high-water mark of use) — and prints them next to the other backend's.
+// Flash env:esp32 and env:nimble in turn on one board, let each run through
+// the same load (a scenario), and the second prints the difference.
+
+#define HEAP_NVS_NAMESPACE  "cg-heap"
+#define HEAP_NVS_STEP       1024   // Min free heap drop worth a flash write
+
+struct BleHeapRecord {
+  uint32_t bleHeap;   // Taken by setupBLE()
+  uint32_t minFree;   // Lowest free heap since boot
+};
+
+const char* const HEAP_BACKEND_KEYS[] = { "bluedroid", "nimble" };
+BleHeapRecord heapRecord = { 0, 0 };   // This build (setup(), then loop())
+
+bool heapRecordLoad(uint8_t backend, BleHeapRecord* r) {
+  Preferences prefs;
+  if (!prefs.begin(HEAP_NVS_NAMESPACE, true)) return false;   // Nothing stored yet
+  bool ok = prefs.getBytes(HEAP_BACKEND_KEYS[backend], r, sizeof(*r)) == sizeof(*r);
+  prefs.end();
+  return ok;
+}
+
+void heapRecordSave() {
+  Preferences prefs;
+  if (!prefs.begin(HEAP_NVS_NAMESPACE, false)) return;
+  prefs.putBytes(HEAP_BACKEND_KEYS[BLE_NIMBLE], &heapRecord, sizeof(heapRecord));
+  prefs.end();
+}
+
+/**
+ * setup() after setupBLE(), then loop() with every energy report: store a
+ * new low of the free heap (in HEAP_NVS_STEP steps, to spare the flash).
+ */
+void heapTrack() {
+  uint32_t minFree = ESP.getMinFreeHeap();
+  if (heapRecord.bleHeap == bleHeapBytes && minFree + HEAP_NVS_STEP > heapRecord.minFree) return;
+  heapRecord.bleHeap = bleHeapBytes;
+  heapRecord.minFree = minFree;
+  heapRecordSave();
+}
+
+/**
+ * Serial (boot, 'd'): this backend's heap figures and the other's, if that
+ * build ever ran on this board.
+ */
+void heapCompare() {
+  BleHeapRecord other;
+  uint8_t otherBackend = !BLE_NIMBLE;
+  Serial.printf("[SYS] Heap, %s: BLE %u KB, min free %u KB\n", BLE_BACKEND_NAME,
+    heapRecord.bleHeap / 1024, heapRecord.minFree / 1024);
+  if (!heapRecordLoad(otherBackend, &other)) {
+    Serial.printf("[SYS] Heap, %s: no record yet — run env:%s once to compare\n",
+      otherBackend ? "NimBLE" : "Bluedroid", otherBackend ? "nimble" : "esp32");
+    return;
+  }
+  // Positive: NimBLE leaves that much more heap
+  const BleHeapRecord& bluedroid = BLE_NIMBLE ? other : heapRecord;
+  const BleHeapRecord& nimble = BLE_NIMBLE ? heapRecord : other;
+  Serial.printf("[SYS] Heap, %s: BLE %u KB, min free %u KB → NimBLE saves %+d KB of BLE heap, "
+    "high-water %+d KB\n", otherBackend ? "NimBLE" : "Bluedroid", other.bleHeap / 1024,
+    other.minFree / 1024, ((int32_t)bluedroid.bleHeap - (int32_t)nimble.bleHeap) / 1024,
+    ((int32_t)nimble.minFree - (int32_t)bluedroid.minFree) / 1024);
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Link Tuning — Data Length, PHY and Connection Parameters
+// ─────────────────────────────────────────────────────────────────────────────
+// The central picks the first connection parameters; onConnect() then asks
+// for longer LL PDUs and the 2M PHY, and loop() requests an interval for
+// the stream (requestLinkParams()) — again whenever the MTU, format, lead
+// count, rate or profile changes what a packet period is. What the central
+// actually grants arrives as GAP events and is published on the link
+// characteristic. Virtual Holters keep the parameters their central chose.
+// On NimBLE the requests go out the same way but nothing reports the grant
+// (and the PHY stays 1M): the link characteristic shows the central's
+// initial choice.
+
+struct LinkInfo {
+  uint8_t  txPhy;       // 1 = 1M, 2 = 2M, 3 = Coded
+  uint8_t  rxPhy;
+  uint16_t txOctets;    // LL payload per PDU
+  uint16_t rxOctets;
+  uint16_t interval;    // 1.25 ms units
+  uint16_t latency;     // Connection events the peripheral may skip
+  uint16_t timeout;     // Supervision timeout, 10 ms units
+};
+
+BdAddress     primaryPeer;                  // Central of the primary Holter
+LinkInfo      linkInfo = { 1, 1, 27, 27, 0, 0, 0 };
+volatile uint8_t linkProfile = LINK_PROFILE_BALANCED;
+uint16_t      linkRequestedMax = 0;         // Last max interval asked for (0 = none yet)
+
+const char* const LINK_PROFILE_NAMES[] = { "balanced", "throughput", "low-power" };
+
+uint16_t livePacketFrames(uint16_t maxLen);
+
+inline const char* linkPhyName(uint8_t phy) {
+  return phy == 2 ? "2M" : phy == 3 ? "Coded" : "1M";
+}
+
+/**
+ * Ask for 251-byte PDUs and, on BLE 5 controllers, the 2M PHY, for the
+ * primary's link. Both are one-off requests per connection; the results
+ * come back as GAP events.
+ */
+void requestLinkFeatures() {
+#if BLE_NIMBLE
+  pServer->setDataLen(primaryConnId, LINK_DLE_TX_OCTETS);
+#else
+  esp_ble_gap_set_pkt_data_len(primaryPeer, LINK_DLE_TX_OCTETS);
+#if LINK_2M_PHY
+  esp_ble_gap_set_preferred_phy(primaryPeer, 0, ESP_BLE_GAP_PHY_2M_PREF_MASK,
+                                ESP_BLE_GAP_PHY_2M_PREF_MASK, ESP_BLE_GAP_PHY_OPTIONS_NO_PREF);
+#endif
+#endif
+}
+
+/**
+ * Request a connection interval for the live packet period of the primary
+ * stream under the current profile. Skipped if it equals the last request.
+ *
+ * BALANCED asks for half the packet period, so every packet finds an event
+ * with room for a retransmission; LOW_POWER asks for at least a whole
+ * period and lets the sender batch; THROUGHPUT asks for the minimum. The
+ * range leaves the central room to pick (max, down to 3/4 of it).
+ */
+void requestLinkParams() {
+  uint32_t periodUs = (uint32_t)livePacketFrames(livePacketLimit())
+                    * 1000000 / configuredRate;
+  uint32_t target;
+  switch (linkProfile) {
+    case LINK_PROFILE_THROUGHPUT:
+      target = LINK_INTERVAL_MIN;
+      break;
+    case LINK_PROFILE_LOW_POWER:
+      target = max<uint32_t>(periodUs, LINK_LOW_POWER_INTERVAL_MS * 1000) / 1250;
+      target = min<uint32_t>(target, LINK_INTERVAL_MAX);
+      break;
+    default:
+      target = constrain(periodUs / 2 / 1250, LINK_INTERVAL_MIN, LINK_INTERVAL_BALANCED_MAX);
+      break;
+  }
+
+  uint16_t maxInt = max<uint16_t>(target, LINK_INTERVAL_FLOOR_MAX);
+  uint16_t minInt = max<uint16_t>(target * 3 / 4, LINK_INTERVAL_MIN);
+  if (maxInt == linkRequestedMax) return;
+  linkRequestedMax = maxInt;
+
+  // Latency 0: every event carries data — skipping one only delays it
+#if BLE_NIMBLE
+  pServer->updateConnParams(primaryConnId, minInt, maxInt, 0, LINK_SUPERVISION_TIMEOUT);
+#else
+  esp_ble_conn_update_params_t params = {};
+  memcpy(params.bda, primaryPeer, sizeof(BdAddress));
+  params.min_int = minInt;
+  params.max_int = maxInt;
+  params.latency = 0;
+  params.timeout = LINK_SUPERVISION_TIMEOUT;
+  esp_ble_gap_update_conn_params(&params);
+#endif
+  Serial.printf("[BLE] Link: %s profile → requesting %.2f-%.2f ms interval (packet every %u ms)\n",
+    LINK_PROFILE_NAMES[linkProfile], minInt * 1.25f, maxInt * 1.25f, periodUs / 1000);
+}
+
+/**
+ * Switch the link profile; loop() sends the new request. Shared by the
+ * control characteristic and the Serial commands.
+ */
+bool applyLinkProfile(uint8_t profile) {
+  if (profile > LINK_PROFILE_LOW_POWER) {
+    Serial.printf("[CTL] Unsupported link profile: %u\n", profile);
+    return false;
+  }
+  linkProfile = profile;
+  linkRetunePending = true;
+  linkStatusDirty = true;
+  Serial.printf("[CTL] Link profile → %s\n", LINK_PROFILE_NAMES[profile]);
+  return true;
+}
+
+#if !BLE_NIMBLE
+/**
+ * GAP events (BTC task): record and log what the primary's link was granted.
+ */
+void linkGapHandler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param) {
+  switch (event) {
+    case ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT:
+      // No address in this event — only the primary's link requests it
+      if (param->pkt_data_lenth_cmpl.status != ESP_BT_STATUS_SUCCESS) {
+        Serial.printf("[BLE] Link: data length request failed (%d)\n",
+          param->pkt_data_lenth_cmpl.status);
+        return;
+      }
+      linkInfo.txOctets = param->pkt_data_lenth_cmpl.params.tx_len;
+      linkInfo.rxOctets = param->pkt_data_lenth_cmpl.params.rx_len;
+      Serial.printf("[BLE] Link: data length tx %u / rx %u octets\n", linkInfo.txOctets, linkInfo.rxOctets);
+      break;
+
+    case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT:
+      if (memcmp(param->update_conn_params.bda, primaryPeer, sizeof(BdAddress)) != 0) return;
+      if (param->update_conn_params.status != ESP_BT_STATUS_SUCCESS) {
+        // The central may still grant something later; retry on the next change
+        Serial.printf("[BLE] Link: connection update rejected (%d)\n",
+          param->update_conn_params.status);
+        linkRequestedMax = 0;
+        return;
+      }
+      linkInfo.interval = param->update_conn_params.conn_int;
+      linkInfo.latency  = param->update_conn_params.latency;
+      linkInfo.timeout  = param->update_conn_params.timeout;
+      Serial.printf("[BLE] Link: interval %.2f ms, latency %u, timeout %u ms\n",
+        linkInfo.interval * 1.25f, linkInfo.latency, linkInfo.timeout * 10);
+      break;
+
+#if LINK_2M_PHY
+    case ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT:
+      if (memcmp(param->phy_update.bda, primaryPeer, sizeof(BdAddress)) != 0) return;
+      if (param->phy_update.status != ESP_BT_STATUS_SUCCESS) {
+        Serial.printf("[BLE] Link: PHY update failed (%d)\n", param->phy_update.status);
+        return;
+      }
+      linkInfo.txPhy = param->phy_update.tx_phy;
+      linkInfo.rxPhy = param->phy_update.rx_phy;
+      Serial.printf("[BLE] Link: PHY tx %s / rx %s\n",
+        linkPhyName(linkInfo.txPhy), linkPhyName(linkInfo.rxPhy));
+      break;
+#endif
+
+    default:
+      return;
+  }
+  linkStatusDirty = true;
+}
+#endif
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Power Management — Power-Save Mode and Battery Model
+// ─────────────────────────────────────────────────────────────────────────────
+// loop() switches power-save mode with the link profile and closes an
+// energy report every POWER_REPORT_INTERVAL_MS: measured idle time per core
+// and with both cores idle, the awake rest, modelled radio time, the
+// average current and the energy per generated frame. The charge used
+// comes off batteryChargeMah.
+
+#if CONFIG_IDF_TARGET_ESP32S3
+typedef esp_pm_config_esp32s3_t PowerConfig;
+#elif CONFIG_IDF_TARGET_ESP32C3
+typedef esp_pm_config_esp32c3_t PowerConfig;
+#else
+typedef esp_pm_config_esp32_t PowerConfig;
+#endif
+
+int64_t  powerReportStartUs = 0;
+uint32_t powerReportFrames = 0;    // Running totals at the start of the interval
+uint32_t powerReportTxPackets = 0;
+uint32_t powerReportTxBytes = 0;
+
+extern bool advertisingPaused;
+
+/**
+ * Current of the idle part of an interval in the active mode.
+ */
+inline float powerIdleMa() {
+  if (!powerSaveActive) return POWER_IDLE_MA;
+  if (POWER_LIGHT_SLEEP) return POWER_SLEEP_MA;
+  return POWER_DFS ? POWER_IDLE_DFS_MA : POWER_IDLE_MA;
+}
+
+/**
+ * Turn power-save mode on or off. The generator picks up the new batch on
+ * its next wake-up.
+ */
+void applyPowerSave(bool on) {
+  powerSaveActive = on;
+  configuredBatch = on ? POWER_GEN_BATCH : 1;
+#if POWER_DFS
+  PowerConfig pm = {};
+  pm.max_freq_mhz = POWER_MAX_FREQ_MHZ;
+  pm.min_freq_mhz = on ? POWER_MIN_FREQ_MHZ : POWER_MAX_FREQ_MHZ;
+  pm.light_sleep_enable = on && POWER_LIGHT_SLEEP;
+  esp_err_t err = esp_pm_configure(&pm);
+  if (err != ESP_OK) Serial.printf("[PWR] esp_pm_configure failed: %s\n", esp_err_to_name(err));
+#endif
+  if (on) {
+    Serial.printf("[PWR] Power save on: generator every %u frames, loop every %u ms, %s\n",
+      POWER_GEN_BATCH, POWER_LOOP_PERIOD_MS,
+      POWER_LIGHT_SLEEP ? "DFS + light sleep" : POWER_DFS ? "DFS (no tickless idle)" : "no DFS");
+  } else {
+    Serial.println("[PWR] Power save off");
+  }
+}
+
+/**
+ * Set the battery level (and the modelled charge behind it) and notify it.
+ */
+void setBatteryLevel(uint8_t level) {
+  batteryChargeMah = BATTERY_CAPACITY_MAH * level / 100.0f;
+  batteryLevel = level;
+  notifyValue(batteryValue, &batteryLevel, 1);
+}
+
+/**
+ * Close the report interval: split it into awake, idle and radio time,
+ * take the charge off the battery and log the result.
+ */
+void powerReport() {
+  int64_t now = esp_timer_get_time();
+  float   spanUs = (float)(now - powerReportStartUs);
+  PowerIdleTimes idle = powerTakeIdle();
+  uint32_t frames  = powerFrames - powerReportFrames;
+  uint32_t packets = powerTxPackets - powerReportTxPackets;
+  uint32_t bytes   = powerTxBytes - powerReportTxBytes;
+  powerReportStartUs = now;
+  powerReportFrames += frames;
+  powerReportTxPackets += packets;
+  powerReportTxBytes += bytes;
+  if (spanUs <= 0) return;
+
+  // Radio: our notifications on air plus the fixed cost of every
+  // connection event (or advertising event while nobody is connected)
+  float txUs = (bytes + packets * POWER_LL_OVERHEAD) * 8.0f / (linkInfo.txPhy == 2 ? 2 : 1);
+  float eventUs = 0;
+  if (deviceConnected && linkInfo.interval) {
+    eventUs = spanUs / (linkInfo.interval * 1250.0f) * POWER_EVENT_US;
+  } else if (!deviceConnected && !advertisingPaused) {
+    eventUs = spanUs / (POWER_ADV_INTERVAL_MS * 1000.0f) * POWER_ADV_EVENT_US;
+  }
+  float idleUs = min((float)idle.bothUs, spanUs);
+  float activeUs = spanUs - idleUs;
+  float chargeMaUs = activeUs * POWER_ACTIVE_MA + idleUs * powerIdleMa()
+                   + txUs * POWER_TX_MA + eventUs * POWER_RX_MA;
+  float avgMa = chargeMaUs / spanUs;
+  float energyUj = chargeMaUs * POWER_SUPPLY_V / 1000.0f;   // mA·µs·V = nJ
+
+  batteryChargeMah = max(0.0f, batteryChargeMah - chargeMaUs / 3.6e9f);
+  uint8_t level = constrain((int)lroundf(batteryChargeMah * 100.0f / BATTERY_CAPACITY_MAH),
+                            BATTERY_MIN_LEVEL, 100);
+
+  Serial.printf("[PWR] %.1f s: awake %.2f s (%.1f%%), idle %.1f s (%s), radio %.0f ms → %.1f mA avg, %.1f µJ/frame\n",
+    spanUs / 1e6f, activeUs / 1e6f, activeUs * 100.0f / spanUs, idleUs / 1e6f,
+    !powerSaveActive ? "WAITI" : POWER_LIGHT_SLEEP ? "light sleep" : POWER_DFS ? "DFS" : "WAITI",
+    (txUs + eventUs) / 1000.0f, avgMa, frames ? energyUj / frames : 0.0f);
+  Serial.print("[PWR] Idle per core:");
+  for (uint8_t core = 0; core < POWER_CORES; core++) {
+    Serial.printf(" %u: %.1f%%", core, min(idle.coreUs[core] * 100.0f / spanUs, 100.0f));
+  }
+  Serial.println();
+  Serial.printf("[BAT] Battery: %u%% (%.1f of %u mAh, ~%.1f h left at this rate)\n",
+    level, batteryChargeMah, BATTERY_CAPACITY_MAH,
+    (batteryChargeMah - BATTERY_CAPACITY_MAH * BATTERY_MIN_LEVEL / 100.0f) / avgMa);
+
+  if (level != batteryLevel) {
+    batteryLevel = level;
+    notifyValue(batteryValue, &batteryLevel, 1);
+  }
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// BLE Server Callbacks
+// ─────────────────────────────────────────────────────────────────────────────
+
+/**
+ * Largest sample count whose packet fits in one notification at this MTU.
+ */
+uint16_t samplesForMTU(uint16_t mtu) {
+  int payload = (int)mtu - ATT_NOTIFY_OVERHEAD - PACKET_HEADER_SIZE;
+  int count = payload / 2;
+  if (count > MAX_SAMPLES_PER_PACKET) count = MAX_SAMPLES_PER_PACKET;
+  if (count < 1) count = 1;
+  return (uint16_t)count;
+}
+
+/**
+ * BLE host task, either backend: a central connected with the parameters
+ * it chose (`interval` 1.25 ms, `timeout` 10 ms units).
+ */
+void centralConnected(BLEServer* server, uint16_t connId, const BdAddress peer,
+                      uint16_t interval, uint16_t latency, uint16_t timeout) {
+  if (FLEET_ENABLED) fleetAdvertisePending = true;
+  if (ECG_FOLLOWERS) {
+    followerAdvertising = false;   // A connection ends advertising
+    followerAdvertisePending = true;
+  }
+
+  if (FLEET_ENABLED && advertisedHolter > 0) {
+    VirtualHolter& v = fleet[advertisedHolter - 1];
+    v.connId = connId;
+    v.mtu = DEFAULT_ATT_MTU;
+    v.samplesPerPacket = samplesForMTU(DEFAULT_ATT_MTU);
+    v.subscribed = false;
+    v.connected = true;
+    Serial.printf("[BLE] %s connected (conn %u)\n", v.name, connId);
+    return;
+  }
+
+  // The primary's central is here already: a follower, its stream untouched
+  if (ECG_FOLLOWERS && deviceConnected) {
+    if (!followerConnect(connId)) {
+      Serial.printf("[BLE] No follower slot left for conn %u, disconnecting it\n", connId);
+      server->disconnect(connId);
+    }
+    return;
+  }
+
+  // Every connection starts at the default MTU until the central exchanges it
+  primaryConnId = connId;
+  negotiatedMTU = DEFAULT_ATT_MTU;
+  samplesPerPacket = samplesForMTU(DEFAULT_ATT_MTU);
+  streamFormat = 0;  // Legacy format until the central opts in
+  fecGroup = 0;      // So is FEC
+  // The lead count is a property of the recording and stays as it was.
+  // Nothing is sent until the central (re-)enables notifications.
+#if !BLE_NIMBLE
+  pECGCCCD->setNotifications(false);
+#endif
+  primarySubscribed = false;
+  notifyResetSubscriptions();
+  txCongested = false;
+  connectionCount++;
+  deviceConnected = true;
+  Serial.println("[BLE] Device connected!");
+
+  // Link tuning: start from what the central chose, then ask for more
+  memcpy(primaryPeer, peer, sizeof(BdAddress));
+  linkInfo = { 1, 1, 27, 27, interval, latency, timeout };
+  linkRequestedMax = 0;
+  linkRetunePending = true;
+  linkStatusDirty = true;
+  requestLinkFeatures();
+  Serial.printf("[BLE] Link: interval %.2f ms, latency %u, timeout %u ms (central's choice)%s\n",
+    linkInfo.interval * 1.25f, linkInfo.latency, linkInfo.timeout * 10,
+    LINK_2M_PHY && !BLE_NIMBLE ? "" : ", 1M PHY only");
+  // LED blinks fast → connected
+}
+
+/**
+ * BLE host task: a central exchanged the MTU.
+ */
+void centralMtuChanged(uint16_t connId, uint16_t mtu) {
+  VirtualHolter* v = fleetFind(connId);
+  if (v) {
+    v->mtu = mtu;
+    v->samplesPerPacket = samplesForMTU(v->mtu);
+    Serial.printf("[BLE] %s MTU=%u → %u samples/packet\n", v->name, v->mtu, v->samplesPerPacket);
+    return;
+  }
+  Follower* f = followerFind(connId);
+  if (f) {
+    f->mtu = mtu;
+    Serial.printf("[BLE] Follower %u MTU=%u\n", (unsigned)(f - followers) + 1, f->mtu);
+    return;
+  }
+
+  negotiatedMTU = mtu;
+  samplesPerPacket = samplesForMTU(negotiatedMTU);
+  Serial.printf("[BLE] MTU=%u → %u samples/packet (%u ms interval)\n",
+    negotiatedMTU, samplesPerPacket, samplesPerPacket * 1000 / sampleRate);
+  linkRetunePending = true;  // Longer packets → longer connection interval
+}
+
+/**
+ * BLE host task: a central disconnected.
+ */
+void centralDisconnected(uint16_t connId) {
+  // Re-advertise — DO NOT USE DELAY!
+  // delay() here blocks the BLE event callback and can cause
+  // stack corruption. Instead, we start advertising in loop().
+  if (FLEET_ENABLED) fleetAdvertisePending = true;
+  if (ECG_FOLLOWERS) followerAdvertisePending = true;
+
+  VirtualHolter* v = fleetFind(connId);
+  if (v) {
+    v->subscribed = false;
+    v->connected = false;
+    Serial.printf("[BLE] %s disconnected.\n", v->name);
+    return;
+  }
+  Follower* f = followerFind(connId);
+  if (f) {
+    f->subscribed = false;
+    f->connected = false;
+    Serial.printf("[BLE] Follower %u disconnected.\n", (unsigned)(f - followers) + 1);
+    return;
+  }
+
+  deviceConnected = false;
+  Serial.println("[BLE] Connection lost.");
+}
+
+class MyServerCallbacks : public BLEServerCallbacks {
+#if BLE_NIMBLE
+  void onConnect(BLEServer* server, ble_gap_conn_desc* desc) override {
+    centralConnected(server, desc->conn_handle, desc->peer_id_addr.val, desc->conn_itvl,
+                     desc->conn_latency, desc->supervision_timeout);
+  }
+  void onMTUChange(uint16_t mtu, ble_gap_conn_desc* desc) override {
+    centralMtuChanged(desc->conn_handle, mtu);
+  }
+  void onDisconnect(BLEServer* server, ble_gap_conn_desc* desc) override {
+    centralDisconnected(desc->conn_handle);
+  }
+#else
+  void onConnect(BLEServer* server, esp_ble_gatts_cb_param_t* param) override {
+    centralConnected(server, param->connect.conn_id, param->connect.remote_bda,
+                     param->connect.conn_params.interval, param->connect.conn_params.latency,
+                     param->connect.conn_params.timeout);
+  }
+  void onMtuChanged(BLEServer* server, esp_ble_gatts_cb_param_t* param) override {
+    centralMtuChanged(param->mtu.conn_id, param->mtu.mtu);
+  }
+  void onDisconnect(BLEServer* server, esp_ble_gatts_cb_param_t* param) override {
+    centralDisconnected(param->disconnect.conn_id);
+  }
+#endif
+};
+
+#if BLE_NIMBLE
+/**
+ * NimBLE: ECG subscriptions arrive per connection.
+ */
+class EcgCallbacks : public BLECharacteristicCallbacks {
+  void onSubscribe(BLECharacteristic* c, ble_gap_conn_desc* desc, uint16_t subValue) override {
+    ecgSubscription(desc->conn_handle, subValue & 0x0001);
+  }
+};
+#endif
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Replay — Recorded ECG from Flash
+// ─────────────────────────────────────────────────────────────────────────────
+// A record is converted on the host (tools/make_replay.py) and written to
+// the "ecgdata" partition. The partition is memory-mapped once at boot, so
+// the generator reads frames straight out of flash through the cache: the
+// record never lands in RAM, whatever its size.
+//
+// Partition layout (little-endian):
+//   [0-3]   uint32  REPLAY_MAGIC
+//   [4-5]   uint16  REPLAY_VERSION
+//   [6-7]   uint16  Sample rate — replay needs the stream at this rate
+//   [8]     uint8   Channels per frame (1..MAX_LEADS, lead order as LEAD_NAMES)
+//   [9-11]          Reserved
+//   [12-15] uint32  Frame count
+//   [16-19] uint32  Annotation count
+//   [20-23] uint32  Offset of the int16 frames (even)
+//   [24-27] uint32  Offset of the annotations (multiple of 4)
+//   [28-51] char[]  Record name, NUL padded
+// Samples are ADC counts (mV / ADC_TO_MV), frames interleaved like the ring.
+// Annotations are sorted by frame; they drive the heartbeat LED.
+
+struct ReplayHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t sampleRate;
+  uint8_t  channels;
+  uint8_t  reserved[3];
+  uint32_t frames;
+  uint32_t annotations;
+  uint32_t sampleOffset;
+  uint32_t annotationOffset;
+  char     name[24];
+};
+
+struct ReplayAnnotation {
+  uint32_t frame;
+  char     code;       // MIT-BIH beat code: 'N', 'V', 'A', ...
+  uint8_t  reserved[3];
+};
+
+const int16_t*          replaySamples     = nullptr;  // Mapped flash, nullptr = no record
+const ReplayAnnotation* replayAnnotations = nullptr;
+const ReplayHeader*     replayHeader      = nullptr;
+spi_flash_mmap_handle_t replayMapHandle;
+uint32_t                replayFrame       = 0;  // Next frame (generator task only)
+uint32_t                replayNextAnn     = 0;  // Next annotation index
+uint32_t                replayLoops       = 0;  // Completed passes over the record
+uint8_t                 activeSource      = SOURCE_SYNTH;
+
+/**
+ * Map the replay partition and validate its header. Without a partition or
+ * a valid record the replay source is simply unavailable.
+ */
+void setupReplay() {
+  const esp_partition_t* part = esp_partition_find_first(
+    ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, REPLAY_PARTITION_LABEL);
+  if (!part) {
+    Serial.println("[ECG] Replay: no \"" REPLAY_PARTITION_LABEL "\" partition (see partitions.csv)");
+    return;
+  }
+
+  const void* base;
+  if (esp_partition_mmap(part, 0, part->size, SPI_FLASH_MMAP_DATA, &base, &replayMapHandle) != ESP_OK) {
+    Serial.println("[ECG] Replay: mapping the partition failed");
+    return;
+  }
+
+  const ReplayHeader* h = (const ReplayHeader*)base;
+  uint64_t sampleBytes = (uint64_t)h->frames * h->channels * sizeof(int16_t);
+  uint64_t annBytes    = (uint64_t)h->annotations * sizeof(ReplayAnnotation);
+  const char* error = nullptr;
+  if (h->magic != REPLAY_MAGIC || h->version != REPLAY_VERSION) {
+    error = "partition holds no record";
+  } else if (!isSupportedSampleRate(h->sampleRate)) {
+    error = "unsupported sample rate";
+  } else if (h->channels < 1 || h->channels > MAX_LEADS || h->frames == 0) {
+    error = "bad channel or frame count";
+  } else if ((h->sampleOffset & 1) || (h->annotationOffset & 3) ||
+             h->sampleOffset + sampleBytes > part->size ||
+             h->annotationOffset + annBytes > part->size) {
+    error = "record exceeds the partition";
+  }
+  if (error) {
+    Serial.printf("[ECG] Replay: %s\n", error);
+    spi_flash_munmap(replayMapHandle);
+    return;
+  }
+
+  replayHeader      = h;
+  replaySamples     = (const int16_t*)((const uint8_t*)base + h->sampleOffset);
+  replayAnnotations = (const ReplayAnnotation*)((const uint8_t*)base + h->annotationOffset);
+  Serial.printf("[ECG] Replay: \"%.*s\", %u ch at %u Hz, %u frames (%u:%02u), %u annotations — mapped %u KB\n",
+    (int)sizeof(h->name), h->name, h->channels, h->sampleRate, h->frames,
+    h->frames / h->sampleRate / 60, h->frames / h->sampleRate % 60, h->annotations, part->size / 1024);
+}
+
+/**
+ * Rewind the record to frame 0.
+ */
+void replayRestart() {
+  replayFrame = 0;
+  replayNextAnn = 0;
+}
+
+/**
+ * Next replayed frame for `leads` leads, looping at the end of the record.
+ * Returns a pointer into mapped flash when the record has exactly that many
+ * channels, otherwise fills `scratch` (missing leads read 0). *beat is set
+ * when an annotated beat falls on this frame.
+ */
+const int16_t* replayNextFrame(int16_t* scratch, uint8_t leads, bool* beat) {
+  const ReplayHeader& h = *replayHeader;
+  const int16_t* src = replaySamples + (size_t)replayFrame * h.channels;
+
+  *beat = false;
+  while (replayNextAnn < h.annotations && replayAnnotations[replayNextAnn].frame <= replayFrame) {
+    *beat |= (replayAnnotations[replayNextAnn].frame == replayFrame);
+    replayNextAnn++;
+  }
+
+  if (++replayFrame >= h.frames) {
+    replayRestart();
+    replayLoops++;
+  }
+
+  if (leads == h.channels) return src;
+  for (uint8_t l = 0; l < leads; l++) scratch[l] = l < h.channels ? src[l] : 0;
+  return scratch;
+}
+
+/**
+ * Switch the sample source. Replay is refused when no record is mapped.
+ * Shared by the control characteristic and the Serial commands.
+ */
+bool applySampleSource(uint8_t source) {
+  if (source > SOURCE_REPLAY) {
+    Serial.printf("[CTL] Unsupported source: %u\n", source);
+    return false;
+  }
+  if (source == SOURCE_REPLAY && !replaySamples) {
+    Serial.println("[CTL] Rejected: no replay record in flash");
+    return false;
+  }
+  if (source == SOURCE_REPLAY && replayHeader->sampleRate != configuredRate) {
+    Serial.printf("[CTL] Rejected: record is %u Hz, stream %u Hz — set the rate first\n",
+      replayHeader->sampleRate, configuredRate);
+    return false;
+  }
+  sampleSource = source;
+  Serial.printf("[CTL] Source → %s\n", source == SOURCE_REPLAY ? "replay" : "synthetic");
+  return true;
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Beat Annotations
+// ─────────────────────────────────────────────────────────────────────────────
+// Every beat goes out as one notification on the annotation characteristic,
+// so a central does not have to find R peaks in the raw stream itself.
+// Synthetic beats are exact: the model knows where the R peak of a beat
+// falls as soon as the beat starts, and the beat is queued once that frame
+// is in the ring. Replayed records run through the streaming QRS detector
+// (qrs_detect.h) on lead 0 — MLII in MIT-BIH records — and are queued about
+// 0.3 s after their R peak. The generator queues, loop() notifies; beats
+// while no central is connected are not kept.
+//
+// ANNOTATION_FORMAT_BEAT:
+//   [0-1]  uint16  Beat counter (wraps)
+//   [2-5]  uint32  Stream frame index of the R peak (as FORMAT_STAMP)
+//   [6-9]  uint32  Sample-clock time of the R peak, µs since boot (low 32 bits)
+//   [10-11] uint16 R-R interval in ms (0 = first beat after a restart)
+//   [12]   uint8   MIT-BIH beat code ('N', 'V')
+//   [13]   uint8   Origin (ANNOTATION_ORIGIN_*)
+// ANNOTATION_FORMAT_HRM (Bluetooth Heart Rate Measurement layout):
+//   [0]    uint8   Flags: 0x10 — 8-bit heart rate, R-R interval present
+//   [1]    uint8   Heart rate of this R-R, BPM
+//   [2-3]  uint16  R-R interval in 1/1024 s
+// The stream already occupies the 0x2A37 characteristic with its own packet
+// format, so the standard layout is offered here. Beats without an R-R (the
+// first after a restart) are not sent in it.
+
+struct BeatAnnotation {
+  uint32_t frame;        // Stream frame index of the R peak
+  uint32_t timestampUs;
+  uint16_t rrMs;
+  char     code;
+  uint8_t  origin;       // ANNOTATION_ORIGIN_*
+};
+
+// Single-producer (generator) / single-consumer (loop()) queue
+BeatAnnotation        annotationQueue[ANNOTATION_QUEUE_SIZE];
+std::atomic<uint32_t> annotationHead(0);
+std::atomic<uint32_t> annotationTail(0);
+uint32_t              annotationDropped = 0;  // Queue full — loop() stalled
+uint16_t              annotationCount = 0;    // Beat counter of the last value
+
+// Generator task only — frames count in the ring's current epoch, which
+// every restart of the annotations begins as well
+QrsDetector detector;
+uint32_t    detectorOrigin = 0;     // Ring frame of the detector's frame 0
+uint32_t    pendingPeakFrame = 0;   // Synthetic R peak not yet in the ring
+char        pendingPeakCode = 0;    // 0 = none pending
+uint32_t    lastPeakFrame = 0;
+bool        lastPeakValid = false;  // lastPeakFrame gives the next R-R
+
+void ringStamp(uint32_t frame, ExtHeaderFields* fields);
+void summaryBeat(uint32_t frame, uint32_t rrMs);
+
+/**
+ * Restart the annotations at ring frame `frame`: clears the detector and
+ * the R-R chain. The generator calls it whenever the stream restarts (ring
+ * reset, new seed, other source).
+ */
+void annotationRestart(uint32_t frame) {
+  qrsInit(detector, sampleRate);
+  detectorOrigin = frame;
+  pendingPeakCode = 0;
+  lastPeakValid = false;
+}
+
+/**
+ * Queue the R peak at ring frame `frame` (generator task).
+ */
+void annotationPush(uint32_t frame, char code, uint8_t origin) {
+  uint32_t rrMs = lastPeakValid ? (uint64_t)(frame - lastPeakFrame) * 1000 / sampleRate : 0;
+  lastPeakFrame = frame;
+  lastPeakValid = true;
+  summaryBeat(frame, rrMs);
+
+  uint32_t head = annotationHead.load(std::memory_order_relaxed);
+  if (head - annotationTail.load(std::memory_order_acquire) >= ANNOTATION_QUEUE_SIZE) {
+    annotationDropped++;
+    return;
+  }
+  ExtHeaderFields stamp;
+  ringStamp(frame, &stamp);
+  BeatAnnotation& a = annotationQueue[head % ANNOTATION_QUEUE_SIZE];
+  a.frame = stamp.frameIndex;
+  a.timestampUs = stamp.timestampUs;
+  a.rrMs = min<uint32_t>(rrMs, 0xFFFF);
+  a.code = code;
+  a.origin = origin;
+  annotationHead.store(head + 1, std::memory_order_release);
+}
+
+/**
+ * Annotation work for the frame just pushed as ring frame `frame`
+ * (generator task). `beatStart`: the model starts a conducted beat with
+ * the next frame.
+ */
+void annotateFrame(const int16_t* samples, uint32_t frame, bool beatStart) {
+  if (activeSource == SOURCE_REPLAY) {
+    QrsBeat beat;
+    if (qrsProcess(detector, samples[0], &beat)) {
+      annotationPush(detectorOrigin + beat.frame, beat.code, ANNOTATION_ORIGIN_DETECTOR);
+    }
+    return;
+  }
+  if (pendingPeakCode && frame == pendingPeakFrame) {
+    annotationPush(frame, pendingPeakCode, ANNOTATION_ORIGIN_MODEL);
+    pendingPeakCode = 0;
+  }
+  if (beatStart) {
+    pendingPeakFrame = frame + 1 + rPeakOffset(synth);
+    pendingPeakCode = beatCode(synth);
+  }
+}
+
+/**
+ * Notify the queued beats (loop()) in the active annotation format.
+ */
+void notifyAnnotations() {
+  uint32_t head = annotationHead.load(std::memory_order_acquire);
+  uint32_t tail = annotationTail.load(std::memory_order_relaxed);
+  for (; tail != head; tail++) {
+    const BeatAnnotation& a = annotationQueue[tail % ANNOTATION_QUEUE_SIZE];
+    annotationCount++;
+    uint8_t value[14];
+    size_t len;
+    if (annotationFormat == ANNOTATION_FORMAT_HRM) {
+      if (a.rrMs == 0) continue;
+      value[0] = 0x10;
+      value[1] = min<uint32_t>(60000 / a.rrMs, 0xFF);
+      putLE16(value + 2, ((uint32_t)a.rrMs * 1024 + 500) / 1000);
+      len = 4;
+    } else {
+      putLE16(value, annotationCount);
+      putLE32(value + 2, a.frame);
+      putLE32(value + 6, a.timestampUs);
+      putLE16(value + 10, a.rrMs);
+      value[12] = a.code;
+      value[13] = a.origin;
+      len = sizeof(value);
+    }
+    notifyValue(annotationValue, value, len);
+  }
+  annotationTail.store(tail, std::memory_order_release);
+}
+
+/**
+ * Select the annotation value layout (ANNOTATION_FORMAT_*). Shared by the
+ * control characteristic and the Serial commands.
+ */
+bool applyAnnotationFormat(uint8_t format) {
+  if (format > ANNOTATION_FORMAT_HRM) {
+    Serial.printf("[CTL] Unsupported annotation format: %u\n", format);
+    return false;
+  }
+  annotationFormat = format;
+  Serial.printf("[CTL] Annotations → %s\n",
+    format == ANNOTATION_FORMAT_HRM ? "heart rate measurement" : "beat records");
+  return true;
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Signal Summary
+// ─────────────────────────────────────────────────────────────────────────────
+// A preview for dashboards that do not need every sample: once per second
+// of lead 0 the generator closes a window — envelope, mean, heart rate and
+// quality flags, a few bytes per second — and loop() notifies it on the
+// summary characteristic. The window is built up frame by frame, so it costs
+// a compare and an add per sample. Centrals subscribe to the raw stream,
+// the summary or both; CTRL_OP_SET_STREAM_MODE with STREAM_MODE_SUMMARY
+// pauses the raw packets while the summaries go on, e.g. when the link
+// degrades. The raw frames are then handled as while offline: they wait in
+// the ring (OFFLINE_DRAIN) or are numbered for a backfill (OFFLINE_BACKFILL)
+// — a running backfill is cancelled. A read returns the latest window.
+//
+// Subscriptions and the stream mode are per link: followers get the
+// summaries they subscribed to, and a follower's STREAM_MODE_SUMMARY pauses
+// only its own raw packets (see Fan-Out — Followers).
+//
+// Summary value:
+//   [0-1]  uint16  Window counter (wraps)
+//   [2-5]  uint32  Stream frame index of the first frame (as FORMAT_STAMP)
+//   [6-7]  uint16  Frames in the window (= sample rate)
+//   [8-9]  int16   Minimum, ADC counts
+//   [10-11] int16  Maximum
+//   [12-13] int16  Mean
+//   [14]   uint8   Heart rate, BPM — mean R-R of the window's beats, else the
+//                  last one (0 = none for SUMMARY_ASYSTOLE_MS)
+//   [15]   uint8   Beats annotated in the window
+//   [16]   uint8   Quality flags (SUMMARY_Q_*)
+// Beats are counted when they are annotated, about 0.3 s after their R peak
+// for a replay (see Beat Annotations).
+
+struct SummaryWindow {
+  uint32_t frame;        // Stream frame index of the first frame
+  uint16_t frames;
+  int16_t  minimum, maximum, mean;
+  uint8_t  heartRate;
+  uint8_t  beats;
+  uint8_t  flags;        // SUMMARY_Q_*
+};
+
+constexpr int32_t SUMMARY_FLAT_COUNTS = (int32_t)(SUMMARY_FLAT_MV / ADC_TO_MV);
+constexpr int32_t SUMMARY_CLIP_COUNTS = (int32_t)(SUMMARY_CLIP_MV / ADC_TO_MV);
+
+// Single-producer (generator) / single-consumer (loop()) queue
+SummaryWindow         summaryQueue[SUMMARY_QUEUE_SIZE];
+std::atomic<uint32_t> summaryHead(0);
+std::atomic<uint32_t> summaryTail(0);
+uint32_t              summaryDropped = 0;  // Queue full — loop() stalled
+uint16_t              summaryCount = 0;    // Window counter of the last value
+
+// Generator task only — the window being built, in ring frames
+SummaryWindow summaryOpen;
+int32_t       summarySum = 0;
+uint32_t      summaryStart = 0;      // Ring frame of the first frame
+uint32_t      summaryRrSumMs = 0;    // R-R intervals of the window's beats
+uint8_t       summaryRrCount = 0;
+uint32_t      summaryLastBeat = 0;   // Ring frame of the last beat (or the restart)
+uint8_t       summaryHeartRate = 0;  // Carried over windows without an R-R
+
+uint32_t ringAvailable();
+
+/**
+ * Start a new window at ring frame `frame`, dropping the open one — the
+ * generator restarts the summary together with the beat annotations.
+ */
+void summaryRestart(uint32_t frame) {
+  summaryOpen.frames = 0;
+  summaryOpen.beats = 0;
+  summaryOpen.flags = SUMMARY_Q_RESTART;
+  summaryRrSumMs = 0;
+  summaryRrCount = 0;
+  summaryLastBeat = frame;
+  summaryHeartRate = 0;
+}
+
+/**
+ * Count an annotated beat at ring frame `frame` (generator task).
+ */
+void summaryBeat(uint32_t frame, uint32_t rrMs) {
+  if (summaryOpen.beats < 0xFF) summaryOpen.beats++;
+  summaryLastBeat = frame;
+  if (rrMs && summaryRrCount < 0xFF) {
+    summaryRrSumMs += rrMs;
+    summaryRrCount++;
+  }
+}
+
+/**
+ * Add lead 0 of the frame just pushed as ring frame `frame` to the window
+ * and queue the window once it holds a second (generator task).
+ */
+void summarizeFrame(int16_t sample, uint32_t frame) {
+  SummaryWindow& w = summaryOpen;
+  if (w.frames == 0) {
+    w.minimum = w.maximum = sample;
+    summarySum = 0;
+    summaryStart = frame;
+  }
+  if (sample < w.minimum) w.minimum = sample;
+  if (sample > w.maximum) w.maximum = sample;
+  if (sample >= SUMMARY_CLIP_COUNTS || sample <= -SUMMARY_CLIP_COUNTS) w.flags |= SUMMARY_Q_CLIPPED;
+  summarySum += sample;
+  if (++w.frames < sampleRate) return;
+
+  if (w.maximum - w.minimum < SUMMARY_FLAT_COUNTS) w.flags |= SUMMARY_Q_FLAT;
+  if ((uint64_t)(frame - summaryLastBeat) * 1000 >= (uint64_t)SUMMARY_ASYSTOLE_MS * sampleRate) {
+    w.flags |= SUMMARY_Q_NO_BEAT;
+    summaryHeartRate = 0;
+  } else if (summaryRrCount) {
+    summaryHeartRate = min<uint32_t>((60000u * summaryRrCount + summaryRrSumMs / 2) / summaryRrSumMs, 0xFF);
+  }
+  w.heartRate = summaryHeartRate;
+  w.mean = summarySum / (int32_t)w.frames;
+
+  uint32_t head = summaryHead.load(std::memory_order_relaxed);
+  if (head - summaryTail.load(std::memory_order_acquire) >= SUMMARY_QUEUE_SIZE) {
+    summaryDropped++;
+  } else {
+    ExtHeaderFields stamp;
+    ringStamp(summaryStart, &stamp);
+    summaryQueue[head % SUMMARY_QUEUE_SIZE] = w;
+    summaryQueue[head % SUMMARY_QUEUE_SIZE].frame = stamp.frameIndex;
+    summaryHead.store(head + 1, std::memory_order_release);
+  }
+  w.frames = 0;
+  w.beats = 0;
+  w.flags = 0;
+  summaryRrSumMs = 0;
+  summaryRrCount = 0;
+}
+
+/**
+ * Notify the queued windows (loop()). SUMMARY_Q_BACKLOG is added here:
+ * it tells how far the raw stream is behind as the summary goes out.
+ */
+void notifySummaries() {
+  uint32_t head = summaryHead.load(std::memory_order_acquire);
+  uint32_t tail = summaryTail.load(std::memory_order_relaxed);
+  for (; tail != head; tail++) {
+    const SummaryWindow& w = summaryQueue[tail % SUMMARY_QUEUE_SIZE];
+    uint8_t flags = w.flags;
+    if ((uint64_t)ringAvailable() * 1000 > (uint64_t)SUMMARY_BACKLOG_MS * sampleRate) {
+      flags |= SUMMARY_Q_BACKLOG;
+    }
+    uint8_t value[17];
+    putLE16(value, ++summaryCount);
+    putLE32(value + 2, w.frame);
+    putLE16(value + 6, w.frames);
+    putLE16(value + 8, w.minimum);
+    putLE16(value + 10, w.maximum);
+    putLE16(value + 12, w.mean);
+    value[14] = w.heartRate;
+    value[15] = w.beats;
+    value[16] = flags;
+    notifyValue(summaryValue, value, sizeof(value));
+  }
+  summaryTail.store(tail, std::memory_order_release);
+}
+
+/**
+ * Select what the primary central receives (STREAM_MODE_*). Shared by the
+ * control characteristic and the Serial commands.
+ */
+bool applyStreamMode(uint8_t mode) {
+  if (mode > STREAM_MODE_SUMMARY) {
+    Serial.printf("[CTL] Unsupported stream mode: %u\n", mode);
+    return false;
+  }
+  if (mode == streamMode) return true;
+  streamMode = mode;
+  if (mode == STREAM_MODE_SUMMARY) {
+    Serial.println("[CTL] Stream → summary only, raw frames kept as while offline");
+  } else {
+    uint32_t backlog = ringAvailable();
+    Serial.printf("[CTL] Stream → full resolution, resumes at seq=%u, %u frames buffered (%.1f s)\n",
+      sequenceNumber, backlog, (float)backlog / sampleRate);
+  }
+  return true;
+}
+
+/**
+ * Select what a follower's central receives (STREAM_MODE_*), on its own
+ * CTRL_OP_SET_STREAM_MODE; the primary's stream mode stays as it is.
+ */
+bool applyFollowerStreamMode(Follower& f, uint8_t mode) {
+  if (mode > STREAM_MODE_SUMMARY) {
+    Serial.printf("[CTL] Unsupported stream mode: %u\n", mode);
+    return false;
+  }
+  f.streamMode = mode;
+  Serial.printf("[CTL] Follower %u stream → %s\n", (unsigned)(&f - followers) + 1,
+    mode == STREAM_MODE_SUMMARY ? "summary only" : "full resolution");
+  return true;
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Sample Pipeline — Timer-Driven Generator + Sample Ring
+// ─────────────────────────────────────────────────────────────────────────────
+// An esp_timer ticks at sampleRate and wakes the generator task, which
+// writes ADC samples into a fixed-size ring. The timer only wakes it: how
+// many frames are due follows from the sample clock — absolute microsecond
+// deadlines from clockOriginUs, frame k due at clockOriginUs + k /
+// sampleRate — so a late wake-up catches up and neither wake-up jitter nor
+// a timer restart accumulates as drift. The sender task drains the ring
+// into BLE packets. Nothing in loop() (Serial, analogRead, delay) can shift
+// sample timing anymore — at worst the ring absorbs a late sender.
+//
+// The clock runs from boot, connected or not. While no central is
+// connected the ring fills up as an offline recording; after a reconnect
+// the sender drains the backlog first, with the sequence numbers continuing,
+// so the central receives the outage without a gap. In OFFLINE_BACKFILL
+// mode the sender numbers the offline frames instead and the central
+// fetches them later as a backfill (see Bulk Backfill below).
+
+// The ring holds frames: one int16 per lead, interleaved. Indices count
+// frames since the last ringReset(); frame f lives at
+// (f % ringFrameCapacity) * ringFrameSize. Consumed frames stay readable
+// until the producer laps them, which is what backfill reads from;
+// ringEpoch tells frame indices of different resets apart. For
+// FORMAT_STAMP, ringFrameBase carries the stream frame count across resets
+// and ringStartUs/ringRate put frame f at ringStartUs + f / ringRate on the
+// sample clock.
+//
+// The ring is a lock-free single-producer/single-consumer queue — the
+// generator and the sender run on different cores and never wait for each
+// other:
+//   - ringHead is written by the generator only (release after the frame
+//     data), ringTail by the sender only. A full ring is overwritten: the
+//     generator never looks at the tail; the sender notices it was lapped,
+//     moves its tail and counts the overflow (ringSync()).
+//   - A copy out of the ring is checked against the head afterwards, so a
+//     frame the generator overwrote mid-copy is never used.
+//   - ringReset() (generator, on a lead or rate change) changes the layout
+//     inside a seqlock: ringEpoch is odd while it runs. The sender adopts a
+//     new epoch by restarting its tail at 0.
+// The generator writes a block of up to RING_WRITE_FRAMES frames in place
+// (ringWriteBegin()/ringWriteEnd()) before it moves the head, so that many
+// slots past the head are never readable.
+
+int16_t*              sampleRing = nullptr;
+uint32_t              ringCapacity = 0;       // Allocated int16 values
+uint32_t              ringFrameCapacity = 0;  // Whole frames that fit (per frame size)
+std::atomic<uint32_t> ringHead(0);            // Frames written this epoch (generator)
+std::atomic<uint32_t> ringEpoch(0);           // +2 per ringReset(); odd while it runs
+uint32_t              ringTail = 0;           // Frames consumed (sender)
+uint32_t              ringTailEpoch = 0;      // Epoch ringTail counts in (sender)
+uint8_t               ringFrameSize = 1;      // Values per frame (= lead count)
+uint32_t              ringFrameBase = 0;      // Stream frames before this epoch
+int64_t               ringStartUs = 0;        // Sample clock time of frame 0 of this epoch
+uint16_t              ringRate = SAMPLE_RATE; // Sample rate of this epoch
+uint32_t              ringOverflows = 0;      // Frames lapped before the sender got them
+bool                  ringInPSRAM = false;
+
+esp_timer_handle_t sampleTimer   = nullptr;
+TaskHandle_t       generatorTask = nullptr;
+TaskHandle_t       senderTask    = nullptr;
+
+int64_t  clockOriginUs = 0;   // esp_timer time of clock frame 0 (start or rate change)
+uint64_t clockFrames   = 0;   // Frames produced since clockOriginUs (generator)
+
+/**
+ * Producer: room for the next *frames frames at the head, to be written in
+ * place and published with ringWriteEnd(). *frames is cut to
+ * RING_WRITE_FRAMES and to the end of the buffer (the block is contiguous).
+ * A full ring is overwritten, so the stream stays live instead of stalling
+ * the generator.
+ */
+int16_t* ringWriteBegin(uint32_t* frames) {
+  uint32_t head = ringHead.load(std::memory_order_relaxed);
+  if (head == 0) ringStartUs = clockOriginUs + (int64_t)(clockFrames * 1000000 / sampleRate);
+  uint32_t pos = head % ringFrameCapacity;
+  *frames = min<uint32_t>(min<uint32_t>(*frames, RING_WRITE_FRAMES), ringFrameCapacity - pos);
+  return sampleRing + pos * ringFrameSize;
+}
+
+/**
+ * Producer: publish the `frames` frames written since ringWriteBegin().
+ */
+inline void ringWriteEnd(uint32_t frames) {
+  ringHead.store(ringHead.load(std::memory_order_relaxed) + frames, std::memory_order_release);
+}
+
+/**
+ * Seqlock read side: the epoch now, or false while a reset is running.
+ */
+inline bool ringReadBegin(uint32_t* epoch) {
+  *epoch = ringEpoch.load(std::memory_order_acquire);
+  return !(*epoch & 1);
+}
+
+/**
+ * The current epoch — a running reset counts as done. Compare against this
+ * wherever an epoch is remembered (sequence log, backfill).
+ */
+inline uint32_t ringEpochNow() {
+  return (ringEpoch.load(std::memory_order_acquire) + 1) & ~1u;
+}
+
+/**
+ * Whether everything read since ringReadBegin() — layout and the frames
+ * from `first` on — is still intact: no reset meanwhile, and the head has
+ * not lapped `first`.
+ */
+inline bool ringReadValid(uint32_t epoch, uint32_t first) {
+  std::atomic_thread_fence(std::memory_order_acquire);
+  uint32_t head = ringHead.load(std::memory_order_relaxed);
+  return ringEpoch.load(std::memory_order_relaxed) == epoch &&
+         first + ringFrameCapacity >= head + RING_WRITE_FRAMES;
+}
+
+/**
+ * Consumer: adopt a reset (tail back to 0) and step the tail past frames
+ * the producer lapped, counting them. Returns false while a reset is
+ * running; otherwise *epoch and *head describe the ring as synced.
+ */
+bool ringSync(uint32_t* epoch, uint32_t* head) {
+  if (!ringReadBegin(epoch)) return false;
+  uint32_t h = ringHead.load(std::memory_order_acquire);
+  uint32_t capacity = ringFrameCapacity;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (ringEpoch.load(std::memory_order_relaxed) != *epoch) return false;
+
+  if (ringTailEpoch != *epoch) {
+    ringTailEpoch = *epoch;
+    ringTail = 0;
+  }
+  if (h - ringTail > capacity - RING_WRITE_FRAMES) {
+    uint32_t oldest = h - capacity + RING_WRITE_FRAMES;
+    ringOverflows += oldest - ringTail;
+    ringTail = oldest;
+  }
+  *head = h;
+  return true;
+}
+
+/**
+ * Number of complete frames in the ring. Exact in the sender; anywhere
+ * else a snapshot for status output.
+ */
+uint32_t ringAvailable() {
+  uint32_t epoch;
+  if (!ringReadBegin(&epoch)) return 0;
+  uint32_t head = ringHead.load(std::memory_order_acquire);
+  uint32_t tail = (ringTailEpoch == epoch) ? ringTail : 0;
+  uint32_t n = head - tail;
+  return min<uint32_t>(n, ringFrameCapacity - RING_WRITE_FRAMES);
+}
+
+/**
+ * Copy `frames` frames starting at frame index `first`. The caller checks
+ * the copy with ringReadValid().
+ */
+inline void ringCopy(int16_t* dst, uint32_t first, uint32_t frames) {
+  uint32_t pos = first % ringFrameCapacity;
+  for (uint32_t f = 0; f < frames; f++) {
+    const int16_t* src = sampleRing + pos * ringFrameSize;
+    for (uint8_t c = 0; c < ringFrameSize; c++) *dst++ = src[c];
+    if (++pos == ringFrameCapacity) pos = 0;
+  }
+}
+
+/**
+ * Consumer: copy up to maxFrames frames into dst without consuming them.
+ * *frameSize receives the frame size they were written with, *firstFrame
+ * (optional) the index of the first one. A copy the producer overtook is
+ * retried from the new oldest frame.
+ */
+uint16_t ringPeek(int16_t* dst, uint16_t maxFrames, uint8_t* frameSize,
+                  uint32_t* firstFrame = nullptr) {
+  for (;;) {
+    uint32_t epoch, head;
+    if (!ringSync(&epoch, &head)) return 0;
+    uint32_t frames = head - ringTail;
+    if (frames > maxFrames) frames = maxFrames;
+    uint8_t size = ringFrameSize;
+    ringCopy(dst, ringTail, frames);
+    if (!ringReadValid(epoch, ringTail)) continue;
+
+    *frameSize = size;
+    if (firstFrame) *firstFrame = ringTail;
+    return (uint16_t)frames;
+  }
+}
+
+/**
+ * Consumer: consume up to maxFrames frames without copying them (offline
+ * numbering — the frames stay in the ring for a later backfill).
+ */
+uint16_t ringSkip(uint16_t maxFrames, uint32_t* firstFrame) {
+  uint32_t epoch, head;
+  *firstFrame = ringTail;
+  if (!ringSync(&epoch, &head)) return 0;
+  uint32_t frames = head - ringTail;
+  if (frames > maxFrames) frames = maxFrames;
+  *firstFrame = ringTail;
+  ringTail += frames;
+  return (uint16_t)frames;
+}
+
+/**
+ * Consumer: copy up to maxFrames already consumed frames starting at frame
+ * index `first` of ring epoch `epoch`. Returns 0 when those frames have
+ * been overwritten or the ring was reset since.
+ */
+uint16_t ringRead(int16_t* dst, uint32_t first, uint16_t maxFrames, uint32_t epoch,
+                  uint8_t* frameSize) {
+  uint32_t now;
+  *frameSize = ringFrameSize;
+  if (!ringReadBegin(&now) || now != epoch) return 0;
+  uint32_t head = ringHead.load(std::memory_order_acquire);
+  if (first >= head || first + ringFrameCapacity < head + RING_WRITE_FRAMES) return 0;
+
+  uint32_t frames = head - first;
+  if (frames > maxFrames) frames = maxFrames;
+  uint8_t size = ringFrameSize;
+  ringCopy(dst, first, frames);
+  if (!ringReadValid(epoch, first)) return 0;
+  *frameSize = size;
+  return (uint16_t)frames;
+}
+
+/**
+ * Consumer: discard frames previously returned by ringPeek(). If the ring
+ * was reset since, they are gone already.
+ */
+void ringConsume(uint16_t frames, uint8_t frameSize) {
+  if (ringTailEpoch != ringEpoch.load(std::memory_order_acquire) || frameSize != ringFrameSize) {
+    return;
+  }
+  ringTail += frames;
+}
+
+/**
+ * Consumer: pop up to maxFrames frames into dst. Returns the number copied.
+ */
+uint16_t ringPop(int16_t* dst, uint16_t maxFrames, uint8_t* frameSize) {
+  uint16_t frames = ringPeek(dst, maxFrames, frameSize);
+  ringConsume(frames, *frameSize);
+  return frames;
+}
+
+/**
+ * FORMAT_STAMP fields of ring frame `frame`: its index in the whole stream
+ * and its sample-clock time.
+ */
+void ringStamp(uint32_t frame, ExtHeaderFields* fields) {
+  uint32_t epoch;
+  do {
+    while (!ringReadBegin(&epoch)) {}
+    fields->frameIndex = ringFrameBase + frame;
+    fields->timestampUs = (uint32_t)(ringStartUs + (int64_t)frame * 1000000 / ringRate);
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while (ringEpoch.load(std::memory_order_relaxed) != epoch);
+}
+
+/**
+ * Producer: empty the ring and switch it to a new frame size. This also
+ * discards the offline recording, since its frames no longer match.
+ */
+void ringReset(uint8_t frameSize) {
+  uint32_t epoch = ringEpoch.load(std::memory_order_relaxed);
+  ringEpoch.store(epoch + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  ringFrameBase += ringHead.load(std::memory_order_relaxed);
+  ringRate = sampleRate;
+  ringFrameSize = frameSize;
+  ringFrameCapacity = ringCapacity / frameSize;
+  ringHead.store(0, std::memory_order_relaxed);
+
+  ringEpoch.store(epoch + 2, std::memory_order_release);
+}
+
+/**
+ * Allocate the ring: as much PSRAM as is free (minus RING_PSRAM_RESERVE) for
+ * a long offline recording, otherwise SAMPLE_RING_SIZE values of internal RAM.
+ */
+void setupSampleRing() {
+  // Largest free block, not total free — the buffer must be contiguous
+  uint32_t psramBlock = psramFound() ? ESP.getMaxAllocPsram() : 0;
+  if (psramBlock > RING_PSRAM_RESERVE + SAMPLE_RING_SIZE * 2) {
+    ringCapacity = (psramBlock - RING_PSRAM_RESERVE) / sizeof(int16_t);
+    sampleRing = (int16_t*)ps_malloc(ringCapacity * sizeof(int16_t));
+    ringInPSRAM = (sampleRing != nullptr);
+  }
+  if (!sampleRing) {
+    ringCapacity = SAMPLE_RING_SIZE;
+    sampleRing = (int16_t*)malloc(ringCapacity * sizeof(int16_t));
+  }
+  ringReset(leadCount);
+
+  Serial.printf("[ECG] Sample ring: %u KB in %s → %u s offline at 1 lead, %u s at %u leads\n",
+    ringCapacity * 2 / 1024, ringInPSRAM ? "PSRAM" : "internal RAM",
+    ringCapacity / sampleRate, ringCapacity / MAX_LEADS / sampleRate, MAX_LEADS);
+}
+
+/**
+ * Sample timer period: one tick per generatorBatch frames.
+ */
+inline uint64_t sampleTimerPeriodUs() {
+  return (uint64_t)(1000000 / sampleRate) * generatorBatch;
+}
+
+/**
+ * Restart the sample clock: frame 0 is due now. At the start of the
+ * recording and on a sample rate change; a batch change keeps it.
+ */
+inline void sampleClockStart() {
+  clockOriginUs = esp_timer_get_time();
+  clockFrames = 0;
+}
+
+/**
+ * esp_timer callback — one tick per sample period (per batch in
+ * power-save mode). Runs in the esp_timer task, so it only wakes the
+ * generator.
+ */
+void onSampleTimer(void* arg) {
+  xTaskNotifyGive(generatorTask);
+}
+
+/**
+ * Generator task: produces the frames that fell due on the sample clock
+ * since its last wake-up — one per tick normally, more if it was delayed
+ * or a timer restart shifted the tick phase. Effective rate, drift and
+ * the worst lag are kept for the diagnostics.
+ * A lead count or sample rate change takes effect here, flushing the
+ * frames recorded before it; a new seed or source restarts the waveform.
+ * Every one of them also restarts the beat annotations and the summary.
+ *
+ * Frames are generated in blocks straight into the ring; annotations and
+ * the summary then go over the block frame by frame.
+ */
+void generatorTaskMain(void* arg) {
+  uint32_t beatAt[RING_WRITE_FRAMES];
+  powerEnter(POWER_GENERATOR);
+  for (;;) {
+    powerExit(POWER_GENERATOR);
+    uint32_t ticks = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    powerEnter(POWER_GENERATOR);
+    uint32_t t0 = ESP.getCycleCount();
+    if (ticks > 1) diagGeneratorLateTicks += ticks - 1;
+    bool restart = false;
+    if (configuredLeads != leadCount) {
+      leadCount = configuredLeads;
+      ringReset(leadCount);
+      linkRetunePending = true;
+      restart = true;
+    }
+    bool retime = false;
+    if (configuredRate != sampleRate) {
+      sampleRate = configuredRate;
+      setSampleRate(synth, sampleRate);
+      setFleetSampleRate(sampleRate);
+      ringReset(leadCount);
+      linkRetunePending = true;
+      retime = true;
+      restart = true;
+      sampleClockStart();
+    }
+    if (configuredBatch != generatorBatch) {
+      generatorBatch = configuredBatch;
+      retime = true;
+    }
+    if (retime) {
+      esp_timer_stop(sampleTimer);
+      esp_timer_start_periodic(sampleTimer, sampleTimerPeriodUs());
+    }
+    if (rhythmPending) {
+      rhythmPending = false;
+      setRhythm(synth, requestedRhythm);
+    }
+    if (seedPending) {
+      seedPending = false;
+      synthSeed(synth, requestedSeed);
+      synthReset(synth);
+      replayRestart();
+      restart = true;
+    }
+    if (sampleSource != activeSource) {
+      activeSource = sampleSource;
+      replayRestart();
+      restart = true;
+    }
+    if (restart) {
+      uint32_t at = ringHead.load(std::memory_order_relaxed);
+      annotationRestart(at);
+      summaryRestart(at);
+    }
+    int64_t elapsedUs = esp_timer_get_time() - clockOriginUs;
+    uint64_t due = (uint64_t)elapsedUs * sampleRate / 1000000;
+    uint32_t frames = due > clockFrames ? due - clockFrames : 0;
+    uint32_t lagUs = elapsedUs - (int64_t)(clockFrames * 1000000 / sampleRate);
+    if (lagUs > diagClockLagMaxUs) diagClockLagMaxUs = lagUs;
+    for (uint32_t left = frames; left;) {
+      uint32_t ringFrame = ringHead.load(std::memory_order_relaxed);
+      uint32_t n = left;
+      int16_t* block = ringWriteBegin(&n);
+      uint16_t beats = 0;
+      if (activeSource == SOURCE_REPLAY) {
+        for (uint32_t i = 0; i < n; i++) {
+          int16_t* dst = block + i * leadCount;
+          bool beat;
+          const int16_t* src = replayNextFrame(dst, leadCount, &beat);
+          if (src != dst) memcpy(dst, src, leadCount * sizeof(int16_t));
+          if (beat) beatAt[beats++] = i;
+        }
+      } else {
+        beats = generateBlock(synth, block, n, leadCount, beatAt, RING_WRITE_FRAMES);
+      }
+      ringWriteEnd(n);
+      clockFrames += n;
+      left -= n;
+
+      // Heartbeat indicator: loop() flashes the LED
+      if (beats) lastBeatMs.store(millis(), std::memory_order_relaxed);
+      for (uint32_t i = 0, b = 0; i < n; i++) {
+        const int16_t* frame = block + i * leadCount;
+        bool beat = b < beats && beatAt[b] == i;
+        b += beat;
+        annotateFrame(frame, ringFrame + i, beat && activeSource == SOURCE_SYNTH);
+        summarizeFrame(frame[0], ringFrame + i);
+      }
+    }
+    if (elapsedUs > 0) {
+      diagClockDriftUs = (int64_t)(clockFrames * 1000000 / sampleRate) - elapsedUs;
+      diagClockRateMilliHz = clockFrames * 1000000000ULL / elapsedUs;
+    }
+    generateFleet(frames);
+    powerFrames += frames;
+    diagRecord(DIAG_GENERATOR, ESP.getCycleCount() - t0);
+    // The sender decides whether a whole packet is ready (it depends on format)
+    xTaskNotifyGive(senderTask);
+  }
+}
+
+/**
+ * Reset the stream state and start the sample clock.
+ * Called once from setup() — the recording then runs until power-off.
+ */
+void startRecording() {
+  esp_timer_stop(sampleTimer);  // Harmless if not running
+  sequenceNumber = 0;
+  synthReset(synth);
+  diagReset();
+  leadCount = configuredLeads;
+  ringReset(leadCount);
+  annotationRestart(0);
+  summaryRestart(0);
+  sampleClockStart();
+  esp_timer_start_periodic(sampleTimer, sampleTimerPeriodUs());
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Sequence Log & Bulk Backfill
+// ─────────────────────────────────────────────────────────────────────────────
+// The sender logs the first ring frame of every sequence number it assigns,
+// so a range of sequence numbers maps back to frames that are still in the
+// ring. Only the sender task touches the log and the running backfill.
+//
+// A backfill resends logged packets under their original sequence numbers,
+// flagged FORMAT_BACKFILL, back-to-back at the current MTU. Live packets
+// always go first, so live latency grows by at most one backfill packet.
+// A logged packet that no longer fits one notification is split; every part
+// carries its frame offset within the original packet.
+
+enum BackfillState : uint8_t {
+  BACKFILL_IDLE,
+  BACKFILL_ACTIVE,
+  BACKFILL_DONE,
+  BACKFILL_REJECTED,    // Nothing of the range is logged, or it cannot fit the MTU
+  BACKFILL_CANCELLED,   // By the central, a disconnect or a lead change
+};
+
+enum BackfillRequest : uint8_t {
+  BACKFILL_REQ_NONE,
+  BACKFILL_REQ_START,
+  BACKFILL_REQ_CANCEL,
+};
+
+struct BackfillJob {
+  volatile uint8_t state;  // BackfillState
+  uint16_t nextSeq;        // Packet being resent
+  uint16_t lastSeq;        // Last packet of the range (inclusive)
+  uint16_t offset;         // Frames of nextSeq already resent
+  uint32_t startMs;
+  uint32_t elapsedMs;
+  uint32_t packets;        // Notifications sent
+  uint32_t frames;
+  uint32_t bytes;
+  uint32_t expired;        // Packets the ring had already overwritten
+};
+
+uint32_t* seqLog = nullptr;
+uint32_t  seqLogMask = 0;        // Entries - 1 (power of two)
+uint32_t  seqLogCount = 0;       // Valid entries; the newest is sequenceNumber - 1
+uint32_t  seqLogNextFrame = 0;   // Frame after the newest logged packet
+uint32_t  seqLogEpoch = 0;       // Ring epoch the logged frame indices refer to
+
+BackfillJob  backfill = {};
+portMUX_TYPE backfillMux = portMUX_INITIALIZER_UNLOCKED;
+uint8_t      backfillRequest = BACKFILL_REQ_NONE;  // Control → sender hand-off
+uint16_t     backfillReqFirst = 0;
+uint16_t     backfillReqLast = 0;
+
+/**
+ * Allocate the sequence log — in PSRAM it covers the whole uint16 sequence
+ * space. Called before setupSampleRing(), which takes the PSRAM that is left.
+ */
+void setupSeqLog() {
+  uint32_t entries = SEQ_LOG_SIZE_INTERNAL;
+  if (psramFound()) {
+    seqLog = (uint32_t*)ps_malloc(SEQ_LOG_SIZE_PSRAM * sizeof(uint32_t));
+    if (seqLog) entries = SEQ_LOG_SIZE_PSRAM;
+  }
+  if (!seqLog) seqLog = (uint32_t*)malloc(entries * sizeof(uint32_t));
+  seqLogMask = entries - 1;
+}
+
+void seqLogReset() {
+  seqLogCount = 0;
+  seqLogEpoch = ringEpochNow();
+}
+
+/**
+ * Log packet `seq` (always sequenceNumber, which the caller then advances).
+ */
+void seqLogRecord(uint16_t seq, uint32_t firstFrame, uint16_t frames) {
+  seqLog[seq & seqLogMask] = firstFrame;
+  seqLogNextFrame = firstFrame + frames;
+  if (seqLogCount <= seqLogMask) seqLogCount++;
+}
+
+/**
+ * Frame range [*first, *end) of a logged sequence number.
+ */
+bool seqLogLookup(uint16_t seq, uint32_t* first, uint32_t* end) {
+  uint16_t age = sequenceNumber - 1 - seq;  // 0 = newest
+  if (age >= seqLogCount) return false;
+  *first = seqLog[seq & seqLogMask];
+  *end = age ? seqLog[(uint16_t)(seq + 1) & seqLogMask] : seqLogNextFrame;
+  return true;
+}
+
+/**
+ * Hand a backfill request to the sender task (control characteristic).
+ */
+void requestBackfill(uint8_t request, uint16_t first, uint16_t last) {
+  portENTER_CRITICAL(&backfillMux);
+  backfillRequest = request;
+  backfillReqFirst = first;
+  backfillReqLast = last;
+  portEXIT_CRITICAL(&backfillMux);
+  xTaskNotifyGive(senderTask);
+}
+
+/**
+ * End the running backfill and report catch-up time and throughput.
+ */
+void finishBackfill(uint8_t state) {
+  backfill.elapsedMs = millis() - backfill.startMs;
+  backfill.state = state;
+  controlStatusDirty = true;
+
+  uint32_t ms = backfill.elapsedMs ? backfill.elapsedMs : 1;
+  float ecgSeconds = (float)backfill.frames / sampleRate;
+  float realtime = ecgSeconds * 1000.0f / ms;
+  Serial.printf("[BLE] Backfill %s at seq=%u: %u packets, %u frames (%.1f s ECG) in %u ms → %.1f kB/s, %.0fx realtime, %u expired\n",
+    state == BACKFILL_DONE ? "done" : "cancelled", backfill.nextSeq,
+    backfill.packets, backfill.frames, ecgSeconds, backfill.elapsedMs,
+    (float)backfill.bytes / ms, realtime, backfill.expired);
+  if (realtime > 0) {
+    Serial.printf("[BLE] At this rate 24 h of recording catches up in %.1f min\n",
+      86400.0f / realtime / 60.0f);
+  }
+}
+
+/**
+ * Start resending sequence numbers first..last. Bounds outside the log are
+ * clamped to the oldest and newest logged packet.
+ */
+void startBackfill(uint16_t first, uint16_t last) {
+  if (backfill.state == BACKFILL_ACTIVE) finishBackfill(BACKFILL_CANCELLED);
+
+  uint16_t newest = sequenceNumber - 1;
+  uint16_t oldest = sequenceNumber - seqLogCount;
+  if ((uint16_t)(newest - first) >= seqLogCount) first = oldest;
+  if ((uint16_t)(newest - last) >= seqLogCount)  last = newest;
+
+  uint16_t needed = extHeaderLength(leadCount, FORMAT_BACKFILL | liveFlags()) +
+                    leadCount * ((streamFormat & FORMAT_RICE) ? 3 : 2);
+  bool fits = needed <= negotiatedMTU - ATT_NOTIFY_OVERHEAD;
+  if (seqLogCount == 0 || (uint16_t)(last - first) > (uint16_t)(newest - first) || !fits) {
+    backfill.state = BACKFILL_REJECTED;
+    controlStatusDirty = true;
+    Serial.printf("[BLE] Backfill rejected: seq %u..%u, %u packets logged%s\n",
+      first, last, seqLogCount, fits ? "" : ", MTU too small");
+    return;
+  }
+
+  backfill = {};
+  backfill.state = BACKFILL_ACTIVE;
+  backfill.nextSeq = first;
+  backfill.lastSeq = last;
+  backfill.startMs = millis();
+  controlStatusDirty = true;
+  Serial.printf("[BLE] Backfill seq %u..%u (%u packets)\n",
+    first, last, (uint16_t)(last - first) + 1);
+}
+
+/**
+ * Pick up a request from the control characteristic and drop the log when
+ * the ring was reset (its frame indices restarted). Sender task only.
+ */
+void serviceBackfill() {
+  if (seqLogEpoch != ringEpochNow()) {
+    seqLogReset();
+    if (backfill.state == BACKFILL_ACTIVE) finishBackfill(BACKFILL_CANCELLED);
+  }
+
+  portENTER_CRITICAL(&backfillMux);
+  uint8_t  request = backfillRequest;
+  uint16_t first = backfillReqFirst;
+  uint16_t last = backfillReqLast;
+  backfillRequest = BACKFILL_REQ_NONE;
+  portEXIT_CRITICAL(&backfillMux);
+
+  if (request == BACKFILL_REQ_START) {
+    startBackfill(first, last);
+  } else if (request == BACKFILL_REQ_CANCEL && backfill.state == BACKFILL_ACTIVE) {
+    finishBackfill(BACKFILL_CANCELLED);
+  }
+}
+
+/**
+ * Build the next backfill packet in the streamed format. Packets whose
+ * frames were overwritten are skipped. Returns 0 once the range is done.
+ */
+uint16_t buildBackfillPacket(uint8_t* packet, int16_t* frames, uint16_t maxLen) {
+  for (;;) {
+    uint32_t first = 0, end = 0;
+    uint16_t count = seqLogLookup(backfill.nextSeq, &first, &end) ? end - first : 0;
+
+    if (backfill.offset < count) {
+      uint16_t want = min<uint16_t>(count - backfill.offset, MAX_EXT_SAMPLES_PER_PACKET);
+      uint8_t channels;
+      uint16_t got = ringRead(frames, first + backfill.offset, want, seqLogEpoch, &channels);
+
+      if (got > 0) {
+        uint16_t used, len;
+        uint8_t flags = FORMAT_BACKFILL | liveFlags();
+        ExtHeaderFields fields = { backfill.offset, sampleRate };
+        ringStamp(first + backfill.offset, &fields);
+        if (streamFormat & FORMAT_RICE) {
+          len = buildRicePacket(packet, backfill.nextSeq, maxLen, frames, got, channels,
+                                &used, flags, &fields);
+        } else {
+          uint16_t perPacket = (maxLen - extHeaderLength(channels, flags)) / (2 * channels);
+          used = min(got, perPacket);
+          len = buildExtRawPacket(packet, backfill.nextSeq, frames, used, channels,
+                                  flags, &fields);
+        }
+        backfill.offset += used;
+        backfill.frames += used;
+        return len;
+      }
+      backfill.expired++;
+    }
+
+    // This packet is complete (or empty) — move on
+    if (backfill.nextSeq == backfill.lastSeq) return 0;
+    backfill.nextSeq++;
+    backfill.offset = 0;
+  }
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Link Benchmark — Saturation Ramp and Round Trips
+// ─────────────────────────────────────────────────────────────────────────────
+// Measures what the primary's link sustains with the central at hand. The
+// sender replaces the ECG stream with FORMAT_BENCH packets (zero filler
+// samples, their own sequence numbers) and raises the load every
+// BENCH_STEP_MS: first the packet size doubles up to the MTU, then the
+// packet rate grows by BENCH_RATE_STEP_PCT. Packets are paced on absolute
+// deadlines; one the stack refuses (or a congestion holds back) is retried
+// on the next wake-up. The ramp ends at the first step that gets less than
+// BENCH_SUSTAINED_PCT of its packets out; the best step before it is the
+// peak sustained rate. Samples/s count the filler samples — what a
+// single-lead raw stream would carry at that packet rate and size.
+//
+// Every packet carries its send time. A central that writes it back with
+// CTRL_OP_BENCH_ECHO gets the round trip measured, its own processing
+// included; the percentiles cover the newest BENCH_RTT_SAMPLES echoes. The
+// ECG frames wait in the ring meanwhile, as while offline, and go out as a
+// catch-up afterwards.
+
+enum BenchState : uint8_t {
+  BENCH_IDLE,
+  BENCH_RUNNING,
+  BENCH_DONE,
+  BENCH_CANCELLED,    // By the central, Serial or a disconnect
+};
+
+enum BenchRequest : uint8_t {
+  BENCH_REQ_NONE,
+  BENCH_REQ_START,
+  BENCH_REQ_STOP,
+};
+
+struct LinkBench {
+  volatile uint8_t state;  // BenchState
+  uint8_t  steps;          // Steps finished
+  uint16_t packetLen;      // Notification length of the current step
+  uint32_t periodUs;       // Packet period of the current step
+  int64_t  stepStartUs;
+  uint32_t stepSent;
+  uint32_t stepRefused;
+  uint16_t seq;            // Own sequence numbers — the ECG ones are untouched
+  uint32_t refused;        // Attempts refused or held back by a congestion, whole run
+  uint32_t refusedAtSps;   // Offered samples/s of the first step with a refusal (0 = none)
+  uint32_t peakSps;        // Best sustained step: samples/s, packets/s, packet length
+  uint16_t peakPps;
+  uint16_t peakLen;
+  uint16_t rttCount;       // Echoes in the percentiles
+  uint32_t rttP50Us;
+  uint32_t rttP90Us;
+  uint32_t rttP99Us;
+  uint32_t rttMaxUs;
+};
+
+LinkBench         bench = {};
+volatile uint8_t  benchRequest = BENCH_REQ_NONE;  // Control/Serial → sender hand-off
+uint32_t          benchRtt[BENCH_RTT_SAMPLES];     // Newest echoes, oldest overwritten
+volatile uint32_t benchEchoes = 0;                 // Echoes accepted this run
+volatile bool     benchReportPending = false;      // loop() reports a finished run
+
+inline bool primaryNotifying();
+bool txQueueEmpty();
+void updateDiagnostics();
+
+/**
+ * Filler samples of a bench packet of `len` bytes.
+ */
+inline uint16_t benchSamples(uint16_t len) {
+  return (len - extHeaderLength(1, FORMAT_BENCH)) / 2;
+}
+
+/**
+ * Hand a start or stop to the sender task (control characteristic, Serial).
+ */
+void requestLinkBench(uint8_t request) {
+  benchRequest = request;
+  xTaskNotifyGive(senderTask);
+}
+
+/**
+ * First step: BENCH_FIRST_SAMPLES per packet at the live packet period.
+ */
+void startLinkBench() {
+  bench = {};
+  bench.state = BENCH_RUNNING;
+  bench.packetLen = min<uint16_t>(extHeaderLength(1, FORMAT_BENCH) + 2 * BENCH_FIRST_SAMPLES,
+                                  negotiatedMTU - ATT_NOTIFY_OVERHEAD);
+  bench.periodUs = (uint32_t)1000000 * BENCH_FIRST_SAMPLES / sampleRate;
+  bench.stepStartUs = esp_timer_get_time();
+  benchEchoes = 0;
+  controlStatusDirty = true;
+  Serial.printf("[BLE] Link benchmark: %u ms steps from %u B every %u us, MTU %u — ECG waits in the ring\n",
+    BENCH_STEP_MS, bench.packetLen, bench.periodUs, negotiatedMTU);
+}
+
+void finishLinkBench(uint8_t state) {
+  bench.state = state;
+  benchReportPending = true;
+  controlStatusDirty = true;
+}
+
+/**
+ * Close the running step and set up the next load. Returns false once the
+ * ramp is over.
+ */
+bool finishBenchStep(int64_t now) {
+  uint16_t samples = benchSamples(bench.packetLen);
+  uint32_t scheduled = (uint32_t)BENCH_STEP_MS * 1000 / bench.periodUs;
+  uint32_t offered = (uint64_t)samples * 1000000 / bench.periodUs;
+  uint32_t achieved = (uint64_t)bench.stepSent * samples * 1000 / BENCH_STEP_MS;
+  bool held = (uint64_t)bench.stepSent * 100 >= (uint64_t)scheduled * BENCH_SUSTAINED_PCT;
+  Serial.printf("[BLE] Bench step %u: %u B every %u us → %u/%u packets, %u refused, %u samples/s%s\n",
+    bench.steps, bench.packetLen, bench.periodUs, bench.stepSent, scheduled, bench.stepRefused,
+    achieved, held ? "" : "  SATURATED");
+
+  bench.steps++;
+  if (bench.stepRefused && !bench.refusedAtSps) bench.refusedAtSps = offered;
+  if (held && achieved > bench.peakSps) {
+    bench.peakSps = achieved;
+    bench.peakPps = bench.stepSent * 1000 / BENCH_STEP_MS;
+    bench.peakLen = bench.packetLen;
+  }
+  if (!held || bench.steps >= BENCH_MAX_STEPS || bench.periodUs == 1) {
+    finishLinkBench(BENCH_DONE);
+    return false;
+  }
+
+  // Bigger packets up to the MTU, then more of them
+  uint16_t maxLen = negotiatedMTU - ATT_NOTIFY_OVERHEAD;
+  if (bench.packetLen < maxLen) {
+    bench.packetLen = min<uint32_t>(extHeaderLength(1, FORMAT_BENCH) + 4 * samples, maxLen);
+  } else {
+    bench.periodUs = max<uint32_t>(bench.periodUs * 100 / (100 + BENCH_RATE_STEP_PCT), 1);
+  }
+  bench.stepStartUs = now;
+  bench.stepSent = 0;
+  bench.stepRefused = 0;
+  return true;
+}
+
+/**
+ * Sender task: pick up a request and send the bench packets due by now.
+ * Returns true while the benchmark owns the link.
+ */
+bool runLinkBench(uint8_t* packet) {
+  static const int16_t filler[MAX_PACKET_SIZE / 2] = {};
+
+  uint8_t request = benchRequest;
+  benchRequest = BENCH_REQ_NONE;
+  if (request == BENCH_REQ_START) {
+    startLinkBench();
+  } else if (request == BENCH_REQ_STOP && bench.state == BENCH_RUNNING) {
+    finishLinkBench(BENCH_CANCELLED);
+  }
+  if (bench.state != BENCH_RUNNING) return false;
+  if (!deviceConnected || !primaryNotifying()) {
+    finishLinkBench(BENCH_CANCELLED);
+    return false;
+  }
+
+  int64_t now = esp_timer_get_time();
+  if (now - bench.stepStartUs >= (int64_t)BENCH_STEP_MS * 1000 && !finishBenchStep(now)) {
+    return false;
+  }
+
+  if (!txQueueEmpty()) return true;   // Stream packets still waiting go first
+
+  uint16_t len = min<uint16_t>(bench.packetLen, negotiatedMTU - ATT_NOTIFY_OVERHEAD);
+  uint32_t due = (now - bench.stepStartUs) / bench.periodUs + 1;
+  while (bench.stepSent < due) {
+    ExtHeaderFields fields = {};
+    fields.sentUs = (uint32_t)esp_timer_get_time();
+    uint16_t n = buildExtRawPacket(packet, bench.seq, filler, benchSamples(len), 1,
+                                   FORMAT_BENCH, &fields);
+    if (txCongested || !notifyLink(primaryConnId, packet, n)) {
+      bench.stepRefused++;
+      bench.refused++;
+      break;
+    }
+    bench.seq++;
+    bench.stepSent++;
+  }
+  return true;
+}
+
+/**
+ * CTRL_OP_BENCH_ECHO (BLE host task): the central wrote back the send time
+ * of a bench packet.
+ */
+void benchEcho(uint32_t sentUs) {
+  uint32_t rtt = (uint32_t)esp_timer_get_time() - sentUs;
+  if (bench.state != BENCH_RUNNING || rtt > BENCH_RTT_MAX_US) return;
+  benchRtt[benchEchoes % BENCH_RTT_SAMPLES] = rtt;
+  benchEchoes++;
+}
+
+/**
+ * Nearest-rank percentile of n sorted values.
+ */
+inline uint32_t benchPercentile(const uint32_t* sorted, uint16_t n, uint8_t pct) {
+  return n ? sorted[((uint32_t)n * pct + 99) / 100 - 1] : 0;
+}
+
+/**
+ * loop(): round-trip percentiles and the result of a finished run, on
+ * Serial and the diagnostics characteristic.
+ */
+void reportLinkBench() {
+  // Insertion sort — at most BENCH_RTT_SAMPLES values, once per run
+  static uint32_t sorted[BENCH_RTT_SAMPLES];
+  uint32_t echoes = benchEchoes;
+  uint16_t n = min<uint32_t>(echoes, BENCH_RTT_SAMPLES);
+  for (uint16_t i = 0; i < n; i++) {
+    uint32_t v = benchRtt[i];
+    uint16_t j = i;
+    for (; j > 0 && sorted[j - 1] > v; j--) sorted[j] = sorted[j - 1];
+    sorted[j] = v;
+  }
+  bench.rttCount = n;
+  bench.rttP50Us = benchPercentile(sorted, n, 50);
+  bench.rttP90Us = benchPercentile(sorted, n, 90);
+  bench.rttP99Us = benchPercentile(sorted, n, 99);
+  bench.rttMaxUs = n ? sorted[n - 1] : 0;
+
+  Serial.printf("[BLE] Link benchmark %s after %u steps: peak sustained %u samples/s (%u packets/s × %u B = %.1f kB/s)\n",
+    bench.state == BENCH_DONE ? "done" : "cancelled", bench.steps, bench.peakSps,
+    bench.peakPps, bench.peakLen, bench.peakPps * bench.peakLen / 1000.0f);
+  if (bench.refusedAtSps) {
+    Serial.printf("[BLE] First refusals at %u samples/s offered, %u in total\n",
+      bench.refusedAtSps, bench.refused);
+  }
+  if (n) {
+    Serial.printf("[BLE] RTT over %u echoes: p50 %.1f ms  p90 %.1f ms  p99 %.1f ms  max %.1f ms\n",
+      n, bench.rttP50Us / 1000.0f, bench.rttP90Us / 1000.0f, bench.rttP99Us / 1000.0f,
+      bench.rttMaxUs / 1000.0f);
+  } else {
+    Serial.println("[BLE] RTT: no echoes (the central writes CTRL_OP_BENCH_ECHO back)");
+  }
+  updateDiagnostics();
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Link Impairment — Seeded Loss, Reordering, Duplicates and Stalls
+// ─────────────────────────────────────────────────────────────────────────────
+// Bad radio conditions on demand, so the central's reassembly and gap
+// handling can be measured without an RF chamber. When configured, every
+// ECG packet of the primary (live and backfill) passes this stage between
+// framing and notify:
+//   loss       independent drops, and bursts that start with a chance per
+//              packet and take burstLength packets in a row
+//   duplicate  a packet goes out twice
+//   reorder    packets wait in a window of reorderWindow and leave in
+//              random order, each up to reorderWindow - 1 places late
+//   stall      a chance per packet that the link holds everything for
+//              stallMs, then sends it as one burst
+// A lost packet stays in the sequence log, so a backfill can fetch it — as
+// after a real loss. Decisions come from a xorshift32 generator seeded per
+// configuration, so the same stream gets the same impairments in every run.
+// Only the sender task touches the stage; Control, Serial and scenarios hand
+// a new configuration over through applyImpairment().
+
+struct ImpairConfig {
+  uint16_t dropPermille;    // Independent loss per packet
+  uint16_t burstPermille;   // Chance that a packet starts a loss burst
+  uint8_t  burstLength;     // Packets lost per burst, the first included
+  uint8_t  reorderWindow;   // Packets shuffled within (0 or 1 = in order)
+  uint16_t dupPermille;     // Chance that a packet goes out twice
+  uint16_t stallPermille;   // Chance that a packet starts a stall
+  uint16_t stallMs;         // Length of a stall
+  uint32_t seed;            // 0 = SYNTH_DEFAULT_SEED
+};
+
+struct ImpairStats {
+  uint32_t packets;         // Packets that entered the stage
+  uint32_t dropped;         // Independent losses
+  uint32_t burstDropped;    // Packets lost in bursts
+  uint32_t bursts;
+  uint32_t duplicated;
+  uint32_t reordered;       // Released ahead of an older held packet
+  uint32_t stalls;
+};
+
+struct HeldPacket {
+  uint16_t len;
+  uint8_t  data[MAX_PACKET_SIZE];
+};
+
+// Serial 'i' presets (off, mild, harsh)
+const ImpairConfig IMPAIR_PRESETS[] = {
+  {},
+  { 10, 5, 4, 2, 5, 0, 0, 0 },
+  { 50, 20, 10, 6, 20, 10, 500, 0 },
+};
+const char* const IMPAIR_PRESET_NAMES[] = { "off", "mild", "harsh" };
+
+ImpairConfig     impairConfigured = {};   // Last applied (Control, Serial, scenarios)
+ImpairConfig     impairRequested = {};    // Hand-off to the sender, under impairMux
+volatile bool    impairPending = false;
+portMUX_TYPE     impairMux = portMUX_INITIALIZER_UNLOCKED;
+
+ImpairConfig     impair = {};             // Active configuration (sender task)
+bool             impairActive = false;
+ImpairStats      impairStats = {};
+uint32_t         impairRng = SYNTH_DEFAULT_SEED;
+uint8_t          impairBurstLeft = 0;     // Packets still to lose in this burst
+bool             impairStalled = false;
+bool             impairDraining = false;  // Held packets going out in order, as the TX queue allows
+unsigned long    impairStallEnd = 0;
+HeldPacket       impairHeld[IMPAIR_QUEUE_PACKETS];
+uint8_t          impairOrder[IMPAIR_QUEUE_PACKETS];  // Held slots, oldest first
+uint8_t          impairHeldCount = 0;
+uint32_t         impairSlotsUsed = 0;     // Bit per impairHeld slot
+
+bool transmitECGPacket(uint8_t* packet, uint16_t len);
+bool txQueueFull();
+
+inline bool impairEnabled(const ImpairConfig& c) {
+  return c.dropPermille || c.burstPermille || c.dupPermille || c.stallPermille ||
+         c.reorderWindow > 1;
+}
+
+inline uint32_t impairRandom() {
+  impairRng ^= impairRng << 13;
+  impairRng ^= impairRng >> 17;
+  impairRng ^= impairRng << 5;
+  return impairRng;
+}
+
+/**
+ * True with a chance of permille / 1000. A zero rate draws nothing, so
+ * enabling one impairment does not change the pattern of the others.
+ */
+inline bool impairChance(uint16_t permille) {
+  return permille && impairRandom() % 1000 < permille;
+}
+
+/**
+ * Send (or, while disconnected, discard) the held packet at `pos` in
+ * arrival order.
+ */
+void impairRelease(uint8_t pos) {
+  uint8_t slot = impairOrder[pos];
+  if (pos) impairStats.reordered++;
+  memmove(impairOrder + pos, impairOrder + pos + 1, impairHeldCount - pos - 1);
+  impairHeldCount--;
+  impairSlotsUsed &= ~(1u << slot);
+  if (deviceConnected) transmitECGPacket(impairHeld[slot].data, impairHeld[slot].len);
+}
+
+/**
+ * Hold a copy of a packet; a full queue sends its oldest packet first.
+ */
+void impairHold(const uint8_t* packet, uint16_t len) {
+  if (impairHeldCount == IMPAIR_QUEUE_PACKETS) impairRelease(0);
+  uint8_t slot = __builtin_ctz(~impairSlotsUsed);
+  impairSlotsUsed |= 1u << slot;
+  impairHeld[slot].len = len;
+  memcpy(impairHeld[slot].data, packet, len);
+  impairOrder[impairHeldCount++] = slot;
+}
+
+void printImpairStats(const char* prefix) {
+  const ImpairStats& st = impairStats;
+  Serial.printf("%s%u packets: %u dropped + %u in %u bursts, %u duplicated, %u reordered, %u stalls\n",
+    prefix, st.packets, st.dropped, st.burstDropped, st.bursts, st.duplicated,
+    st.reordered, st.stalls);
+}
+
+/**
+ * Change the impairment configuration. Shared by the control
+ * characteristic, the Serial commands and scenarios; the sender takes it
+ * over before its next packet.
+ */
+bool applyImpairment(const ImpairConfig& c) {
+  if (c.dropPermille > 1000 || c.burstPermille > 1000 || c.dupPermille > 1000 ||
+      c.stallPermille > 1000 || (c.burstPermille && (c.burstLength < 1 || c.burstLength > IMPAIR_MAX_BURST)) ||
+      c.reorderWindow > IMPAIR_QUEUE_PACKETS / 2 || c.stallMs > IMPAIR_MAX_STALL_MS) {
+    Serial.printf("[CTL] Rejected impairment: rates ≤ 100%%, bursts 1-%u, window ≤ %u, stalls ≤ %u ms\n",
+      IMPAIR_MAX_BURST, IMPAIR_QUEUE_PACKETS / 2, IMPAIR_MAX_STALL_MS);
+    return false;
+  }
+
+  impairConfigured = c;
+  portENTER_CRITICAL(&impairMux);
+  impairRequested = c;
+  impairPending = true;
+  portEXIT_CRITICAL(&impairMux);
+  if (!impairEnabled(c)) {
+    Serial.println("[CTL] Impairment → off");
+    return true;
+  }
+  Serial.printf("[CTL] Impairment → drop %.1f%%, burst %.1f%% × %u, reorder %u, dup %.1f%%, stall %.1f%% × %u ms, seed 0x%08X\n",
+    c.dropPermille / 10.0f, c.burstPermille / 10.0f, c.burstLength, c.reorderWindow,
+    c.dupPermille / 10.0f, c.stallPermille / 10.0f, c.stallMs, c.seed ? c.seed : SYNTH_DEFAULT_SEED);
+  return true;
+}
+
+/**
+ * Release held packets in arrival order while the TX queue has room; the
+ * rest follow on the sender's next passes.
+ */
+void impairDrain() {
+  while (impairHeldCount && !txQueueFull()) impairRelease(0);
+  impairDraining = impairHeldCount > 0;
+}
+
+/**
+ * End a stall that is over: everything held goes out as one burst.
+ */
+void impairStallCheck() {
+  if (impairStalled && (long)(millis() - impairStallEnd) >= 0) {
+    impairStalled = false;
+    impairDrain();
+  }
+}
+
+/**
+ * Sender task, every pass and before every packet: take over a new
+ * configuration (once what is held under the old one has gone out), end a
+ * stall with its burst and drop held packets once the central is gone.
+ */
+void serviceImpairment() {
+  if (impairDraining || (impairPending && impairHeldCount)) impairDrain();
+  if (impairPending && !impairHeldCount) {
+    portENTER_CRITICAL(&impairMux);
+    ImpairConfig c = impairRequested;
+    impairPending = false;
+    portEXIT_CRITICAL(&impairMux);
+
+    if (impairActive) printImpairStats("[BLE] Impairment replaced after ");
+    impair = c;
+    impairActive = impairEnabled(c);
+    impairStats = {};
+    impairRng = c.seed ? c.seed : SYNTH_DEFAULT_SEED;
+    impairBurstLeft = 0;
+    impairStalled = false;
+  }
+  if (!deviceConnected) {
+    impairHeldCount = 0;
+    impairSlotsUsed = 0;
+    impairStalled = false;
+    impairDraining = false;
+    return;
+  }
+  impairStallCheck();
+}
+
+/**
+ * Pass one built packet through the stage — only once txReady(), so the
+ * packet, its duplicate and whatever the stage releases fit the TX queue.
+ * Returns false only when the packet was really dropped by the stack;
+ * losses of the stage are silent, as on the air.
+ */
+bool impairPacket(uint8_t* packet, uint16_t len) {
+  impairStats.packets++;
+  impairStallCheck();
+  if (impairBurstLeft) {
+    impairBurstLeft--;
+    impairStats.burstDropped++;
+    return true;
+  }
+  if (impairChance(impair.burstPermille)) {
+    impairBurstLeft = impair.burstLength - 1;
+    impairStats.bursts++;
+    impairStats.burstDropped++;
+    return true;
+  }
+  if (impairChance(impair.dropPermille)) {
+    impairStats.dropped++;
+    return true;
+  }
+
+  bool twice = impairChance(impair.dupPermille);
+  impairStats.duplicated += twice;
+  if (!impairStalled && impairChance(impair.stallPermille)) {
+    impairStalled = true;
+    impairStallEnd = millis() + impair.stallMs;
+    impairStats.stalls++;
+  }
+  if (!impairStalled && !impairDraining && impair.reorderWindow <= 1) {
+    bool sent = transmitECGPacket(packet, len);
+    if (twice && sent) transmitECGPacket(packet, len);
+    return sent;
+  }
+
+  impairHold(packet, len);
+  if (twice) impairHold(packet, len);
+  while (!impairStalled && !impairDraining && impairHeldCount >= impair.reorderWindow) {
+    impairRelease(impairRandom() % impairHeldCount);
+  }
+  return true;
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Forward Error Correction — XOR Parity Groups
+// ─────────────────────────────────────────────────────────────────────────────
+// Notifications are not acknowledged, so a packet lost on the air is a gap
+// until a backfill round trip fetches it. With a group size K set for the
+// connection (CTRL_OP_SET_FEC, Serial 'j'), the sender follows every K live
+// packets with a FORMAT_PARITY packet — the XOR of the group, see
+// ecg_packet.h — from which the central rebuilds any single lost packet of
+// the group locally, at most K packet periods later. A group closes early
+// when a ring overflow skips sequence numbers. Parity packets pass the Link
+// Impairment stage like the data, so recovery can be measured under loss;
+// backfill packets are not covered (a backfill is already a recovery).
+// Live packets leave PARITY_OVERHEAD bytes of the MTU free so the parity
+// packet of a group of full packets still fits.
+
+bool sendECGPacket(uint8_t* packet, uint16_t len);
+
+ParityGroup fecGroupData;   // Sender task only
+
+/**
+ * Sender task: send the parity packet of the open group, if any.
+ */
+void fecFlush() {
+  static uint8_t parity[MAX_PACKET_SIZE + PARITY_OVERHEAD];
+  if (fecGroupData.count == 0) return;
+  uint16_t len = buildParityPacket(parity, fecGroupData);
+  fecGroupData.count = 0;
+  if (sendECGPacket(parity, len)) diagFecParity++;
+}
+
+/**
+ * Sender task: add the live packet just sent to the open group of `group`
+ * packets (0 = FEC off), and close the group once it is full.
+ */
+void fecProtect(const uint8_t* packet, uint16_t len, uint8_t group) {
+  if (!group) {
+    fecGroupData.count = 0;
+    return;
+  }
+  uint16_t seq = packet[0] | (packet[1] << 8);
+  if (fecGroupData.count && seq != (uint16_t)(fecGroupData.firstSeq + fecGroupData.count)) {
+    fecFlush();
+  }
+  parityAdd(fecGroupData, packet, len);
+  if (fecGroupData.count >= group) fecFlush();
+}
+
+/**
+ * Set the live packets per parity packet (0 = off) for this connection, if
+ * the stream still fits the MTU with the room a parity packet needs. Shared
+ * by the control characteristic and the Serial commands.
+ */
+bool applyFecGroup(uint8_t group) {
+  if (group && (group < FEC_MIN_GROUP || group > FEC_MAX_GROUP)) {
+    Serial.printf("[CTL] Unsupported FEC group: %u (0, or %u-%u packets)\n",
+      group, FEC_MIN_GROUP, FEC_MAX_GROUP);
+    return false;
+  }
+  uint16_t needed = minPacketSize(streamFormat, configuredLeads, liveFlags());
+  if (needed > livePacketLimit(group)) {
+    Serial.printf("[CTL] Rejected: FEC needs MTU ≥ %u with the current format\n",
+      needed + ATT_NOTIFY_OVERHEAD + PARITY_OVERHEAD);
+    return false;
+  }
+
+  fecGroup = group;
+  linkRetunePending = true;  // Shorter packets → shorter packet period
+  if (group) {
+    Serial.printf("[CTL] FEC → 1 parity packet per %u (%u%% overhead)\n", group, 100 / group);
+  } else {
+    Serial.println("[CTL] FEC off");
+  }
+  return true;
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// BLE Packet Sending
+// ─────────────────────────────────────────────────────────────────────────────
+
+uint16_t riceBatch     = SAMPLES_PER_PACKET * 2;  // Adaptive FORMAT_RICE batch (sender task)
+uint32_t overflowsSeen = 0;                       // ringOverflows already accounted for
+
+#if !BLE_NIMBLE
+/**
+ * Raw GATT events (Bluedroid): congestion of the primary's link (it wakes
+ * the sender once it clears) and of the followers' links, and, in a fleet
+ * or with followers, per-link subscriptions from the CCCD writes.
+ */
+void gattsEventHandler(esp_gatts_cb_event_t event, esp_gatt_if_t gattsIf,
+                       esp_ble_gatts_cb_param_t* param) {
+  if (event == ESP_GATTS_CONGEST_EVT) {
+    if (param->congest.conn_id != primaryConnId) {
+      Follower* f = followerFind(param->congest.conn_id);
+      if (f) f->congested = param->congest.congested;
+      return;
+    }
+    txCongested = param->congest.congested;
+    if (!txCongested) xTaskNotifyGive(senderTask);
+    return;
+  }
+  if (!SUBSCRIPTIONS_PER_LINK || event != ESP_GATTS_WRITE_EVT || param->write.len < 1) return;
+
+  bool enable = param->write.value[0] & 0x01;
+  if (param->write.handle == pECGCCCD->getHandle()) {
+    ecgSubscription(param->write.conn_id, enable);
+    return;
+  }
+  for (NotifyValue* v : notifyValues) {
+    if (param->write.handle == v->cccd->getHandle()) {
+      valueSubscription(*v, param->write.conn_id, enable);
+      return;
+    }
+  }
+}
+#endif
+
+/**
+ * Send a built ECG packet to the primary's central — through the Link
+ * Impairment stage when one is configured. Returns false if the packet had
+ * to be dropped (see transmitECGPacket()).
+ */
+bool sendECGPacket(uint8_t* packet, uint16_t len) {
+  return impairActive ? impairPacket(packet, len) : transmitECGPacket(packet, len);
+}
+
+// A refused packet waits here, oldest first — sender task only
+struct TxSlot {
+  uint16_t      len;
+  uint32_t      cycles;          // ESP.getCycleCount() when it was handed over
+  unsigned long since;           // millis() of the first refusal
+  uint8_t       data[MAX_PACKET_SIZE];
+};
+
+TxSlot  txQueue[TX_QUEUE_PACKETS];
+uint8_t txQueueFirst = 0;
+uint8_t txQueueCount = 0;
+
+bool txQueueEmpty() {
+  return txQueueCount == 0;
+}
+
+bool txQueueFull() {
+  return txQueueCount == TX_QUEUE_PACKETS;
+}
+
+/**
+ * Count and log a packet that will not go out; it stays in the sequence
+ * log for a backfill.
+ */
+void txDrop(const uint8_t* packet, uint32_t cycles, unsigned long since, const char* reason) {
+  diagTxDrops++;
+  diagRecord(DIAG_SEND, ESP.getCycleCount() - cycles);
+  Serial.printf("[ECG] TX: seq %u dropped after %lu ms (%s) — backfill can resend it\n",
+    packet[0] | (packet[1] << 8), millis() - since, reason);
+}
+
+/**
+ * One attempt to notify a packet to the primary's central. Returns false
+ * if the link is congested or the stack has no free buffer.
+ */
+bool txNotify(const uint8_t* packet, uint16_t len, uint32_t cycles) {
+  if (txCongested) return false;
+  uint32_t t1 = ESP.getCycleCount();
+  bool sent = notifyLink(primaryConnId, packet, len);
+  uint32_t t2 = ESP.getCycleCount();
+  diagRecord(DIAG_NOTIFY, t2 - t1);
+  if (!sent) {
+    diagTxRetries++;
+    return false;
+  }
+  diagRecord(DIAG_SEND, t2 - cycles);
+  diagPacketsSent++;
+  return true;
+}
+
+/**
+ * Notify a built ECG packet to the primary's central.
+ *
+ * Goes straight to the GATT API — BLECharacteristic::notify() discards the
+ * result. A packet the stack refuses, or one behind packets already
+ * waiting, is copied into the TX queue; serviceTxQueue() retries it while
+ * the sender goes on with the other links. Returns false if the packet had
+ * to be dropped: the central is gone, or the queue is full (callers wait
+ * for txReady(), so it is not).
+ */
+bool transmitECGPacket(uint8_t* packet, uint16_t len) {
+  uint32_t t0 = ESP.getCycleCount();
+  if (!txQueueCount && txNotify(packet, len, t0)) return true;
+  if (!deviceConnected || txQueueFull()) {
+    txDrop(packet, t0, millis(), deviceConnected ? "TX queue full" : "disconnected");
+    return false;
+  }
+  TxSlot& slot = txQueue[(txQueueFirst + txQueueCount++) % TX_QUEUE_PACKETS];
+  slot.len = len;
+  slot.cycles = t0;
+  slot.since = millis();
+  memcpy(slot.data, packet, len);
+  return true;
+}
+
+/**
+ * Sender task, every pass and before every packet: send what the TX queue
+ * holds, oldest first, until the stack refuses one — retried on the next
+ * pass, which comes a tick later or as soon as the congestion clears. A
+ * packet refused for TX_GIVE_UP_MS, and every packet once the central is
+ * gone, is dropped. Returns true once the queue is empty.
+ */
+bool serviceTxQueue() {
+  while (txQueueCount) {
+    TxSlot& slot = txQueue[txQueueFirst];
+    if (!deviceConnected) {
+      txDrop(slot.data, slot.cycles, slot.since, "disconnected");
+    } else if (!txNotify(slot.data, slot.len, slot.cycles)) {
+      if (millis() - slot.since < TX_GIVE_UP_MS) return false;
+      txDrop(slot.data, slot.cycles, slot.since, "stack full");
+    }
+    txQueueFirst = (txQueueFirst + 1) % TX_QUEUE_PACKETS;
+    txQueueCount--;
+  }
+  return true;
+}
+
+/**
+ * Sender task: drop what is still queued for a previous central.
+ */
+void txQueueDrop() {
+  for (; txQueueCount; txQueueCount--) {
+    const TxSlot& slot = txQueue[txQueueFirst];
+    txDrop(slot.data, slot.cycles, slot.since, "reconnected");
+    txQueueFirst = (txQueueFirst + 1) % TX_QUEUE_PACKETS;
+  }
+}
+
+/**
+ * Sender task: whether the primary's link takes the next packet — the TX
+ * queue has drained and no impairment burst is still going out. Until then
+ * the frames wait in the ring.
+ */
+bool txReady() {
+  if (!serviceTxQueue()) return false;
+  serviceImpairment();
+  return !txQueueCount && !impairDraining;
+}
+
+/**
+ * Whether the primary's central has notifications enabled. With
+ * SUBSCRIPTIONS_PER_LINK the shared CCCD value says nothing about a
+ * particular link.
+ */
+inline bool primaryNotifying() {
+#if BLE_NIMBLE
+  return primarySubscribed;
+#else
+  return SUBSCRIPTIONS_PER_LINK ? primarySubscribed : pECGCCCD->getNotifications();
+#endif
+}
+
+/**
+ * Frames the sender waits for before it frames the next live packet.
+ *
+ * In FORMAT_RICE the number of frames per packet depends on the signal, so
+ * riceBatch tracks how many fitted last time: it shrinks to the fitted count
+ * when a packet fills up and grows by ~25% when everything fitted.
+ */
+uint16_t livePacketFrames(uint16_t maxLen) {
+  if (streamFormat & FORMAT_RICE) return riceBatch;
+  if (leadCount > 1 || (streamFormat & FORMAT_STAMP)) {
+    uint16_t perPacket = (maxLen - extHeaderLength(leadCount, liveFlags())) / (2 * leadCount);
+    return constrain(perPacket, 1, MAX_EXT_SAMPLES_PER_PACKET);
+  }
+  uint16_t legacy = samplesPerPacket;
+  return min<uint16_t>(legacy, (maxLen - PACKET_HEADER_SIZE) / 2);
+}
+
+/**
+ * LINK_PROFILE_LOW_POWER: frames the sender collects before it sends a
+ * burst — one granted connection interval's worth, so the radio wakes once
+ * per interval instead of once per packet. Capped at half the ring.
+ */
+uint16_t linkHoldFrames() {
+  if (linkProfile != LINK_PROFILE_LOW_POWER) return 0;
+  uint32_t frames = (uint32_t)linkInfo.interval * 1250 * sampleRate / 1000000;
+  return min<uint32_t>(frames, ringFrameCapacity / 2);
+}
+
+/**
+ * Advance the sequence number past the packets that frames dropped by a
+ * full ring would have filled, so the central sees the hole instead of a
+ * silent splice. The skipped numbers are logged without frames.
+ */
+void skipDroppedPackets(uint16_t perPacket, uint32_t nextFrame) {
+  uint32_t overflows = ringOverflows;
+  if (overflows == overflowsSeen) return;
+  uint32_t skipped = (overflows - overflowsSeen + perPacket - 1) / perPacket;
+  overflowsSeen = overflows;
+  if (skipped > seqLogMask + 1) {
+    sequenceNumber += skipped - (seqLogMask + 1);  // Older entries would be overwritten anyway
+    skipped = seqLogMask + 1;
+  }
+  while (skipped--) seqLogRecord(sequenceNumber++, nextFrame, 0);
+}
+
+/**
+ * Frame the next live packet from the ring. *framed receives its frame
+ * count and *firstFrame the ring index of its first frame. Returns 0 if not
+ * enough frames are queued yet.
+ */
+uint16_t buildLivePacket(uint8_t* packet, int16_t* frames, uint16_t maxLen,
+                         uint16_t* framed, uint32_t* firstFrame) {
+  uint16_t perPacket = livePacketFrames(maxLen);
+  if (ringAvailable() < perPacket) return 0;
+
+  uint8_t channels;
+  uint16_t len;
+  if (streamFormat & FORMAT_RICE) {
+    uint16_t available = ringPeek(frames, MAX_EXT_SAMPLES_PER_PACKET, &channels, firstFrame);
+    skipDroppedPackets(perPacket, *firstFrame);
+    uint16_t used = 0;
+    ExtHeaderFields fields = { 0, sampleRate };
+    ringStamp(*firstFrame, &fields);
+    len = buildRicePacket(packet, sequenceNumber, maxLen, frames, available, channels, &used,
+                          liveFlags(), &fields);
+    ringConsume(used, channels);
+    *framed = used;
+
+    if (used < available) {
+      riceBatch = used;
+    } else {
+      riceBatch = min<uint16_t>(MAX_EXT_SAMPLES_PER_PACKET, riceBatch + riceBatch / 4 + 1);
+    }
+  } else {
+    *framed = ringPeek(frames, perPacket, &channels, firstFrame);
+    ringConsume(*framed, channels);
+    skipDroppedPackets(perPacket, *firstFrame);
+    // A lead change can land between the checks — send those frames
+    // in the layout they were recorded with rather than mislabel them.
+    ExtHeaderFields fields = { 0, sampleRate };
+    ringStamp(*firstFrame, &fields);
+    len = (channels == 1 && leadCount == 1 && !(streamFormat & FORMAT_STAMP))
+        ? buildRawPacket(packet, sequenceNumber, frames, *framed)
+        : buildExtRawPacket(packet, sequenceNumber, frames, *framed, channels,
+                            liveFlags(), &fields);
+  }
+  return len;
+}
+
+/**
+ * OFFLINE_BACKFILL: number the frames recorded while no central is
+ * connected as the packets they would have gone out in, so the central can
+ * fetch them by sequence number after it reconnects.
+ */
+void fileOfflinePackets() {
+  uint16_t perPacket = livePacketFrames(livePacketLimit());
+  while (ringAvailable() >= perPacket) {
+    uint32_t firstFrame;
+    uint16_t framed = ringSkip(perPacket, &firstFrame);
+    if (!framed) break;  // A reset is running
+    skipDroppedPackets(perPacket, firstFrame);
+    seqLogRecord(sequenceNumber++, firstFrame, framed);
+  }
+}
+
+/**
+ * Frames per follower packet on an MTU of `mtu` for frames of `channels`
+ * values at `rate` — 0 if not even one frame fits.
+ */
+uint16_t followerFrames(uint16_t mtu, uint8_t channels, uint16_t rate) {
+  if (channels == 1) return samplesForMTU(mtu);
+  int room = (int)mtu - ATT_NOTIFY_OVERHEAD - extHeaderLength(channels, rateFlag(rate));
+  if (room < 2 * channels) return 0;
+  return min<uint16_t>(room / (2 * channels), MAX_EXT_SAMPLES_PER_PACKET);
+}
+
+/**
+ * Sender task (serveOtherLinks()): send every whole packet each subscribed
+ * follower in STREAM_MODE_FULL has in the ring past its cursor. A packet
+ * the stack refuses, or one for a congested link, is built again on the
+ * next pass; the other links go on meanwhile.
+ */
+void sendFollowerPackets(uint8_t* packet, int16_t* frames) {
+  for (uint8_t k = 0; k < ECG_FOLLOWERS; k++) {
+    Follower& f = followers[k];
+    if (!f.subscribed || f.streamMode == STREAM_MODE_SUMMARY) continue;
+    for (;;) {
+      uint32_t epoch;
+      if (!ringReadBegin(&epoch)) return;  // Reset running: next pass
+      uint32_t head = ringHead.load(std::memory_order_acquire);
+      if (f.restartPending) {
+        f.restartPending = false;
+        f.cursorEpoch = epoch;
+        f.cursor = head;
+        f.sequenceNumber = 0;
+      } else if (f.cursorEpoch != epoch) {
+        f.cursorEpoch = epoch;   // The ring restarted its frame indices
+        f.cursor = 0;
+      }
+
+      uint8_t channels = ringFrameSize;
+      uint16_t rate = ringRate;
+      uint16_t perPacket = followerFrames(f.mtu, channels, rate);
+      if (!perPacket || !f.subscribed || f.congested) break;
+      uint32_t span = ringFrameCapacity - RING_WRITE_FRAMES;
+      if (head - f.cursor > span) {
+        uint32_t lapped = head - span - f.cursor;
+        f.overflows += lapped;
+        f.sequenceNumber += (lapped + perPacket - 1) / perPacket;
+        f.cursor = head - span;
+      }
+      if (head - f.cursor < perPacket) break;
+
+      uint8_t size;
+      uint16_t count = ringRead(frames, f.cursor, perPacket, epoch, &size);
+      if (count < perPacket || size != channels) continue;  // Lapped or reset meanwhile
+
+      ExtHeaderFields fields = {};
+      fields.sampleRate = rate;
+      uint16_t len = channels == 1
+        ? buildRawPacket(packet, f.sequenceNumber, frames, count)
+        : buildExtRawPacket(packet, f.sequenceNumber, frames, count, channels,
+                            rateFlag(rate), &fields);
+      if (!notifyLink(f.connId, packet, len)) {
+        diagTxRetries++;
+        break;
+      }
+      f.cursor += count;
+      f.sequenceNumber++;
+      f.packets++;
+      diagPacketsSent++;
+    }
+  }
+}
+
+/**
+ * Sender task: the virtual Holters' and the followers' turn — every pass,
+ * and between packets of a long primary catch-up or backfill.
+ */
+void serveOtherLinks(uint8_t* packet, int16_t* frames) {
+  sendFleetPackets(packet);
+  sendFollowerPackets(packet, frames);
+}
+
+/**
+ * Sender task: drains the ring in whole packets once the generator
+ * signals that at least one packet worth of frames is ready.
+ * The packet size follows the MTU negotiated for the current connection.
+ * A packet the stack refuses waits in the TX queue: the pass ends, and the
+ * next passes serve the other links until it has gone out.
+ *
+ * After a reconnect the backlog recorded offline goes out back-to-back
+ * first (OFFLINE_DRAIN). In OFFLINE_BACKFILL the offline frames were
+ * already numbered, so live data resumes at once and the central fetches
+ * the gap as a backfill, which fills whatever time live packets leave.
+ * STREAM_MODE_SUMMARY keeps a connected central on the same offline path;
+ * switching back to full resolution starts a catch-up like a reconnect.
+ * So does a link benchmark for as long as it runs.
+ *
+ * A packet counts as a missed deadline when another full packet of frames is
+ * already waiting after it was framed — its data sat in the ring for at
+ * least one packet period longer than necessary. The post-reconnect
+ * catch-up is not counted, nor are frames held for a low-power burst.
+ */
+void senderTaskMain(void* arg) {
+  static int16_t frames[MAX_EXT_SAMPLES_PER_PACKET * MAX_LEADS];
+  static uint8_t packet[MAX_PACKET_SIZE];
+  uint32_t session = 0;
+  uint8_t  mode = STREAM_MODE_FULL;
+  bool     catchingUp = false;
+  uint8_t  burst = 0;
+  uint8_t  turn = 0;        // Live packets since the other links' last turn
+
+  powerEnter(POWER_SENDER);
+  for (;;) {
+    // A running backfill or benchmark, or packets waiting for the stack,
+    // poll every tick (a cleared congestion wakes the task at once);
+    // otherwise wait for the generator
+    powerExit(POWER_SENDER);
+    bool polling = backfill.state == BACKFILL_ACTIVE || bench.state == BENCH_RUNNING ||
+                   txQueueCount || impairDraining;
+    ulTaskNotifyTake(pdTRUE, polling ? 1 : portMAX_DELAY);
+    powerEnter(POWER_SENDER);
+    uint32_t epoch, head;
+    ringSync(&epoch, &head);  // Count lapped frames even while nothing is sent
+
+    if (session != connectionCount || mode != streamMode) {
+      if (session != connectionCount) txQueueDrop();  // Queued for the previous central
+      session = connectionCount;
+      mode = streamMode;
+      catchingUp = true;
+      fecGroupData.count = 0;  // Its packets went to another central or stream
+    }
+    serviceBackfill();
+    serviceTxQueue();
+    serviceImpairment();
+    serveOtherLinks(packet, frames);
+
+    // The benchmark owns the link while it runs; the stream waits as while
+    // offline and catches up afterwards
+    bool benching = runLinkBench(packet);
+    if (benching) catchingUp = true;
+
+    if (!deviceConnected || mode == STREAM_MODE_SUMMARY || benching) {
+      if (backfill.state == BACKFILL_ACTIVE) finishBackfill(BACKFILL_CANCELLED);
+      if (offlineMode == OFFLINE_BACKFILL) fileOfflinePackets();
+      continue;
+    }
+
+    // Low-power profile: wait until a connection interval's worth is queued
+    // (the catch-up and a running backfill go out at once)
+    uint16_t hold = linkHoldFrames();
+    if (hold && !catchingUp && backfill.state != BACKFILL_ACTIVE && ringAvailable() < hold) {
+      continue;
+    }
+
+    while (deviceConnected && primaryNotifying()) {
+      // A refused packet keeps its successors in the ring; the other links
+      // are served on the next pass
+      if (!txReady()) break;
+      uint8_t group = fecGroup;  // One value for the packet and its group
+      uint16_t framed;
+      uint32_t firstFrame;
+      if (seqLogEpoch != ringEpochNow()) serviceBackfill();
+
+      uint16_t len = buildLivePacket(packet, frames, livePacketLimit(group), &framed, &firstFrame);
+      if (len) {
+        uint32_t backlog = ringAvailable();
+        bool behind = backlog >= framed + hold;
+        if (behind && !catchingUp) diagDeadlineMisses++;
+        if (!behind) catchingUp = false;
+        if (backlog > diagTxBacklogMax) diagTxBacklogMax = backlog;
+        seqLogRecord(sequenceNumber++, firstFrame, framed);
+        sendECGPacket(packet, len);
+        fecProtect(packet, len, group);
+        // A catch-up can drain the ring for a long time; the followers'
+        // cursors and the virtual Holters' rings must not overflow meanwhile
+        if (++turn >= LINK_TURN_PACKETS) {
+          turn = 0;
+          serveOtherLinks(packet, frames);
+        }
+        continue;
+      }
+
+      if (backfill.state != BACKFILL_ACTIVE) break;
+      len = buildBackfillPacket(packet, frames, negotiatedMTU - ATT_NOTIFY_OVERHEAD);
+      if (!len) {
+        finishBackfill(BACKFILL_DONE);
+        break;
+      }
+      if (!sendECGPacket(packet, len)) break;
+      backfill.packets++;
+      backfill.bytes += len;
+      // notify() returns once the stack has queued the packet; yield now
+      // and then so loop() and the BLE host tasks keep running
+      if (++burst >= BACKFILL_BURST) {
+        burst = 0;
+        vTaskDelay(1);
+        powerBusy();
+        serveOtherLinks(packet, frames);
+      }
+    }
+  }
+}
+
+/**
+ * Allocate the log and the ring, and create the sample timer and the
+ * generator/sender tasks. startRecording() starts the clock.
+ */
+void setupSamplePipeline() {
+  setupSeqLog();
+  setupSampleRing();
+
+  xTaskCreatePinnedToCore(generatorTaskMain, "ecg_gen", GENERATOR_TASK_STACK, nullptr,
+                          GENERATOR_TASK_PRIO, &generatorTask, GENERATOR_TASK_CORE);
+  xTaskCreatePinnedToCore(senderTaskMain, "ecg_tx", SENDER_TASK_STACK, nullptr,
+                          SENDER_TASK_PRIO, &senderTask, SENDER_TASK_CORE);
+  Serial.printf("[SYS] Generator on core %d, sender + BLE host on core %d\n",
+    GENERATOR_TASK_CORE, SENDER_TASK_CORE);
+
+  esp_timer_create_args_t timerArgs = {};
+  timerArgs.callback = onSampleTimer;
+  timerArgs.dispatch_method = ESP_TIMER_TASK;
+  timerArgs.name = "ecg_sample";
+  esp_timer_create(&timerArgs, &sampleTimer);
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+// Control Characteristic
+// ─────────────────────────────────────────────────────────────────────────────
+
+/**
+ * Refresh the control status value and notify it to the central.
+ *
+ * Status format:
+ *   [0]    uint8   Control protocol version
+ *   [1]    uint8   Supported FORMAT_* flags
+ *   [2]    uint8   Active FORMAT_* flags
+ *   [3-4]  uint16  Negotiated MTU
+ *   [5-6]  uint16  Samples per legacy packet
+ *   [7]    uint8   Lead count
+ *   [8]    uint8   Offline mode (OFFLINE_*)
+ *   [9]    uint8   Backfill state (BackfillState)
+ *   [10-11] uint16 Backfill: packet being resent (last one once finished)
+ *   [12-13] uint16 Backfill: last packet of the range
+ *   [14-17] uint32 Backfill: elapsed ms (total once finished)
+ *   [18]   uint8   Sample source (SOURCE_*)
+ *   [19]   uint8   Sample rate / 10 Hz (25, 50 or 100)
+ *   [20]   uint8   Rhythm (RHYTHM_*)
+ *   [21]   uint8   Annotation format (ANNOTATION_FORMAT_*)
+ *   [22]   uint8   Stream mode of the primary's central (STREAM_MODE_*)
+ *   [23]   uint8   Link benchmark state (BenchState)
+ *   [24]   uint8   Live packets per FEC parity packet (0 = off)
+ *
+ * At the default MTU a notification carries the first 20 bytes; a read
+ * returns all of them (the rhythm, the annotation format, the stream mode,
+ * the benchmark state and the FEC group are then only visible by reading).
+ */
+void updateControlStatus() {
+  uint8_t status[25];
+  status[0] = CONTROL_PROTOCOL_VERSION;
+  status[1] = FORMAT_CAPABILITIES;
+  status[2] = streamFormat;
+  status[3] = negotiatedMTU & 0xFF;
+  status[4] = (negotiatedMTU >> 8) & 0xFF;
+  status[5] = samplesPerPacket & 0xFF;
+  status[6] = (samplesPerPacket >> 8) & 0xFF;
+  status[7] = configuredLeads;
+  status[8] = offlineMode;
+  status[9] = backfill.state;
+  putLE16(status + 10, backfill.nextSeq);
+  putLE16(status + 12, backfill.lastSeq);
+  putLE32(status + 14, backfill.state == BACKFILL_ACTIVE ? millis() - backfill.startMs
+                                                         : backfill.elapsedMs);
+  status[18] = sampleSource;
+  status[19] = configuredRate / 10;
+  status[20] = requestedRhythm;
+  status[21] = annotationFormat;
+  status[22] = streamMode;
+  status[23] = bench.state;
+  status[24] = fecGroup;
+
+  notifyValue(controlValue, status, sizeof(status));
+}
+
+/**
+ * Refresh the link value (read/notify) from the latest GAP events.
+ *
+ * Link format:
+ *   [0]    uint8   Link profile (LINK_PROFILE_*)
+ *   [1]    uint8   TX PHY (1 = 1M, 2 = 2M, 3 = Coded)
+ *   [2]    uint8   RX PHY
+ *   [3-4]  uint16  LL TX octets per PDU
+ *   [5-6]  uint16  LL RX octets per PDU
+ *   [7-8]  uint16  Connection interval (1.25 ms units)
+ *   [9-10] uint16  Peripheral latency (events)
+ *   [11-12] uint16 Supervision timeout (10 ms units)
+ *   [13-14] uint16 Frames held per low-power burst (0 = no batching)
+ */
+void updateLinkStatus() {
+  uint8_t value[15];
+  value[0] = linkProfile;
+  value[1] = linkInfo.txPhy;
+  value[2] = linkInfo.rxPhy;
+  putLE16(value + 3, linkInfo.txOctets);
+  putLE16(value + 5, linkInfo.rxOctets);
+  putLE16(value + 7, linkInfo.interval);
+  putLE16(value + 9, linkInfo.latency);
+  putLE16(value + 11, linkInfo.timeout);
+  putLE16(value + 13, linkHoldFrames());
 
-// ─────────────────────────────────────────────────────────────────────────────
-// Configuration — Values matching the mobile app
-// ─────────────────────────────────────────────────────────────────────────────
+  notifyValue(linkValue, value, sizeof(value));
+}
 
-// Device name (matches BLE_CONFIG.deviceNamePrefix = "CardioGuard")
-#define DEVICE_NAME "CardioGuard-SIM"
+/**
+ * Change format and/or lead count if the result fits the current MTU.
+ * Shared by the control characteristic and the Serial commands.
+ */
+bool applyStreamConfig(uint8_t format, uint8_t leads) {
+  if (leads != 1 && leads != 3 && leads != MAX_LEADS) {
+    Serial.printf("[CTL] Unsupported lead count: %u\n", leads);
+    return false;
+  }
+  uint16_t needed = minPacketSize(format, leads, rateFlag(configuredRate));
+  if (needed > livePacketLimit()) {
+    Serial.printf("[CTL] Rejected: format 0x%02X × %u leads needs MTU ≥ %u (now %u)\n",
+      format, leads, needed + negotiatedMTU - livePacketLimit(), negotiatedMTU);
+    return false;
+  }
 
-// Firmware version
-#define FIRMWARE_VERSION "SIM-ESP32-1.0.0"
+  streamFormat = format;
+  configuredLeads = leads;
+  linkRetunePending = true;
+  Serial.printf("[CTL] Stream format → 0x%02X, %u lead(s)\n", format, leads);
+  return true;
+}
 
-// ─── BLE Service & Characteristic UUIDs ─────────────────────────────────────
-// These are identical to mobile/src/types/device.ts → ECG_SERVICE_UUIDS.
+/**
+ * Change the sample rate if the stream format still fits the MTU with the
+ * rate field in its header. Shared by the control characteristic and the
+ * Serial commands; the generator applies it on its next tick.
+ */
+bool applySampleRate(uint16_t rate) {
+  if (!isSupportedSampleRate(rate)) {
+    Serial.printf("[CTL] Unsupported sample rate: %u Hz (250, 500 or 1000, ≤ %u)\n",
+      rate, SAMPLE_RATE_MAX);
+    return false;
+  }
+  if (sampleSource == SOURCE_REPLAY && replayHeader->sampleRate != rate) {
+    Serial.printf("[CTL] Rejected: replay record is %u Hz\n", replayHeader->sampleRate);
+    return false;
+  }
+  uint16_t needed = minPacketSize(streamFormat, configuredLeads, rateFlag(rate));
+  if (needed > livePacketLimit()) {
+    Serial.printf("[CTL] Rejected: %u Hz needs MTU ≥ %u with the current format\n",
+      rate, needed + negotiatedMTU - livePacketLimit());
+    return false;
+  }
 
-// Heart Rate Service (ECG data is sent over this service)
-#define ECG_SERVICE_UUID        "0000180d-0000-1000-8000-00805f9b34fb"
-#define ECG_DATA_CHAR_UUID      "00002a37-0000-1000-8000-00805f9b34fb"
+  configuredRate = rate;
+  Serial.printf("[CTL] Sample rate → %u Hz (legacy packet every %u ms, %u B/s per lead)\n",
+    rate, samplesPerPacket * 1000 / rate, rate * 2);
+  return true;
+}
 
-// Battery Service
-#define BATTERY_SERVICE_UUID    "0000180f-0000-1000-8000-00805f9b34fb"
-#define BATTERY_LEVEL_CHAR_UUID "00002a19-0000-1000-8000-00805f9b34fb"
+/**
+ * Switch the synthetic waveform to a rhythm (RHYTHM_*) at its default
+ * heart rate. Shared by the control characteristic, the Serial commands and
+ * scenarios; the generator switches between blocks on its next tick, so a
+ * block never sees a half-applied rhythm.
+ */
+bool applyRhythm(uint8_t rhythm) {
+  if (rhythm >= RHYTHM_COUNT) {
+    Serial.printf("[CTL] Unknown rhythm: %u\n", rhythm);
+    return false;
+  }
+  requestedRhythm = rhythm;
+  rhythmPending = true;
+  Serial.printf("[CTL] Rhythm → %s (%u BPM)\n", RHYTHMS[rhythm].name, RHYTHMS[rhythm].bpm);
+  return true;
+}
 
-// Device Information Service
-#define DEVICE_INFO_SERVICE_UUID    "0000180a-0000-1000-8000-00805f9b34fb"
-#define FIRMWARE_VERSION_CHAR_UUID  "00002a26-0000-1000-8000-00805f9b34fb"
+void scenarioUpload(const uint8_t* data, size_t len, bool append);
 
-// ─── ECG Signal Configuration ───────────────────────────────────────────────
-// These match mobile/src/constants/config.ts → ECG_CONFIG.
+/**
+ * Apply one control command from the central on `connId`: [opcode][args...].
+ * Every other setting acts on the primary's stream or on the whole device,
+ * so another central — a follower or a virtual Holter's — may only ask for
+ * the status, and a follower set its own stream mode.
+ */
+void handleControlCommand(uint16_t connId, const uint8_t* data, size_t len) {
+  if (len == 0) return;
+  if (!deviceConnected || connId != primaryConnId) {
+    Follower* f = followerFind(connId);
+    if (f && data[0] == CTRL_OP_SET_STREAM_MODE) {
+      if (len >= 2) applyFollowerStreamMode(*f, data[1]);
+      return;
+    }
+    if (data[0] != CTRL_OP_GET_STATUS) {
+      Serial.printf("[CTL] Opcode 0x%02X from conn %u ignored — not the primary's central\n",
+        data[0], connId);
+      return;
+    }
+  }
 
-#define SAMPLE_RATE       250     // Hz — same as sampleRate
-#define ADC_TO_MV         0.00286 // Calibration factor — same as adcToMv
-#define SAMPLES_PER_PACKET 8      // Number of samples per BLE packet (4+8*2=20 bytes, fits default MTU)
-#define PACKET_INTERVAL_MS 32     // (1000 / SAMPLE_RATE) * SAMPLES_PER_PACKET = 32ms
+  switch (data[0]) {
+    case CTRL_OP_GET_STATUS:
+      break;
+    case CTRL_OP_SET_FORMAT:
+      if (len < 2) return;
+      // Ignore flags that are not negotiable; a rejected change still
+      // refreshes the status so the central sees what is active.
+      applyStreamConfig(data[1] & FORMAT_NEGOTIABLE, configuredLeads);
+      break;
+    case CTRL_OP_SET_LEADS:
+      if (len < 2) return;
+      applyStreamConfig(streamFormat, data[1]);
+      break;
+    case CTRL_OP_BACKFILL:
+      // The sender task resolves the range and refreshes the status itself
+      if (len >= 5) {
+        requestBackfill(BACKFILL_REQ_START, data[1] | (data[2] << 8), data[3] | (data[4] << 8));
+      } else if (len == 1) {
+        requestBackfill(BACKFILL_REQ_CANCEL, 0, 0);
+      } else {
+        return;
+      }
+      break;
+    case CTRL_OP_SET_OFFLINE:
+      if (len < 2) return;
+      if (data[1] > OFFLINE_BACKFILL) {
+        Serial.printf("[CTL] Unsupported offline mode: %u\n", data[1]);
+        break;
+      }
+      offlineMode = data[1];
+      Serial.printf("[CTL] Offline mode → %s\n", offlineMode == OFFLINE_BACKFILL ? "backfill" : "drain");
+      break;
+    case CTRL_OP_SET_SEED:
+      if (len < 5) return;
+      // The generator applies it on its next tick; sequence numbers continue
+      requestedSeed = data[1] | (data[2] << 8) | (data[3] << 16) | ((uint32_t)data[4] << 24);
+      seedPending = true;
+      Serial.printf("[CTL] Seed → 0x%08X, waveform restarted\n", requestedSeed);
+      break;
+    case CTRL_OP_SET_SOURCE:
+      if (len < 2) return;
+      applySampleSource(data[1]);
+      break;
+    case CTRL_OP_SET_RATE:
+      if (len < 3) return;
+      applySampleRate(data[1] | (data[2] << 8));
+      break;
+    case CTRL_OP_SET_LINK_PROFILE:
+      if (len < 2) return;
+      applyLinkProfile(data[1]);
+      break;
+    case CTRL_OP_SCENARIO:
+      // Progress and markers are reported on the scenario characteristic
+      if (len < 2) return;
+      if (data[1] == SCENARIO_CMD_STOP) {
+        scenarioStopPending = true;
+      } else if (data[1] == SCENARIO_CMD_LOAD || data[1] == SCENARIO_CMD_APPEND) {
+        scenarioUpload(data + 2, len - 2, data[1] == SCENARIO_CMD_APPEND);
+      } else if (data[1] == SCENARIO_CMD_START) {
+        scenarioStartPending = true;
+      } else {
+        Serial.printf("[CTL] Unknown scenario command %u\n", data[1]);
+      }
+      break;
+    case CTRL_OP_SET_RHYTHM:
+      if (len < 2) return;
+      applyRhythm(data[1]);
+      break;
+    case CTRL_OP_SET_ANNOTATION:
+      if (len < 2) return;
+      applyAnnotationFormat(data[1]);
+      break;
+    case CTRL_OP_SET_STREAM_MODE:
+      if (len < 2) return;
+      applyStreamMode(data[1]);
+      break;
+    case CTRL_OP_SET_FEC:
+      if (len < 2) return;
+      applyFecGroup(data[1]);
+      break;
+    case CTRL_OP_LINK_BENCH:
+      // The sender task starts it and refreshes the status itself
+      if (len < 2) return;
+      if (data[1] > BENCH_CMD_START) {
+        Serial.printf("[CTL] Unknown benchmark command %u\n", data[1]);
+        break;
+      }
+      requestLinkBench(data[1] == BENCH_CMD_START ? BENCH_REQ_START : BENCH_REQ_STOP);
+      return;
+    case CTRL_OP_SET_IMPAIRMENT: {
+      // [u16 drop‰][u16 burst‰][u8 burst length][u8 reorder window]
+      // [u16 duplicate‰][u16 stall‰][u16 stall ms][u32 seed]
+      ImpairConfig c = {};
+      if (len >= 17) {
+        c.dropPermille  = data[1] | (data[2] << 8);
+        c.burstPermille = data[3] | (data[4] << 8);
+        c.burstLength   = data[5];
+        c.reorderWindow = data[6];
+        c.dupPermille   = data[7] | (data[8] << 8);
+        c.stallPermille = data[9] | (data[10] << 8);
+        c.stallMs       = data[11] | (data[12] << 8);
+        c.seed = data[13] | (data[14] << 8) | (data[15] << 16) | ((uint32_t)data[16] << 24);
+      } else if (len != 1) {
+        return;
+      }
+      applyImpairment(c);
+      return;
+    }
+    case CTRL_OP_BENCH_ECHO:
+      // One per bench packet at most — no status refresh
+      if (len < 5) return;
+      benchEcho(data[1] | (data[2] << 8) | (data[3] << 16) | ((uint32_t)data[4] << 24));
+      return;
+    default:
+      Serial.printf("[CTL] Unknown opcode 0x%02X\n", data[0]);
+      return;
+  }
 
-// ─── Hardware Pins ──────────────────────────────────────────────────────────
-// DeneyapKart A1: Built-in blue LED = GPIO 13 (LEDB)
-// If using standard ESP32 DevKit, set LED_PIN to 2.
-#define LED_PIN       13      // DeneyapKart A1 built-in LED (LEDB)
-#define POT_PIN       34      // Potentiometer (BPM adjustment, optional)
-// WARNING: "D8" label on DeneyapKart is NOT GPIO 8!
-// GPIO 6-11 are connected to SPI Flash — using them causes crash.
-// BOOT button (GPIO 0) is safe on all ESP32 boards.
-#define BUTTON_PIN    0       // BOOT button (GPIO 0) — arrhythmia trigger
+  updateControlStatus();
+}
 
-// ─── Battery Simulation ─────────────────────────────────────────────────────
-#define BATTERY_START_LEVEL  95
-#define BATTERY_DRAIN_INTERVAL_MS 120000  // 1% drop every 2 minutes
+class ControlCallbacks : public BLECharacteristicCallbacks {
+#if BLE_NIMBLE
+  void onWrite(BLECharacteristic* c, ble_gap_conn_desc* desc) override {
+    NimBLEAttValue value = c->getValue();
+    handleControlCommand(desc->conn_handle, value.data(), value.length());
+  }
+  void onSubscribe(BLECharacteristic* c, ble_gap_conn_desc* desc, uint16_t subValue) override {
+    valueSubscription(controlValue, desc->conn_handle, subValue & 0x0001);
+  }
+#else
+  void onWrite(BLECharacteristic* c, esp_ble_gatts_cb_param_t* param) override {
+    handleControlCommand(param->write.conn_id, c->getData(), c->getLength());
+  }
+#endif
+  void onRead(BLECharacteristic* c) override { refreshValue(controlValue); }
+};
 
 // ─────────────────────────────────────────────────────────────────────────────
-// Global Variables
+// Scenario Engine — Scripted Timelines
 // ─────────────────────────────────────────────────────────────────────────────
+// A scenario drives the simulator from a timeline instead of the
+// potentiometer, the BOOT button and the Serial keys, so a soak or load run
+// can be repeated exactly and compared between firmware and app releases.
+// The script is plain text, uploaded over Serial ('u') or CTRL_OP_SCENARIO,
+// one event per line (or separated by ';'); '#' starts a comment:
+//
+//   <time> <action> [args] [every <period>]
+//
+// Times are offsets from the start of the pass: 90, 90s, 10m, 2h, 1h30m,
+// 500ms. Actions:
+//   mark <text>           marker only
+//   bpm <40-180>          set the heart rate
+//   ramp <bpm> <time>     linear ramp from the current rate
+//   pvc <time>            PVC episode of this length
+//   disconnect [<time>]   drop every central; advertise again after <time>
+//   leads <n>, rate <Hz>, link <profile>, source <n>, seed <n>
+//                         same as the control opcodes
+//   battery <0-100>       simulated battery level
+//   rhythm <name|n>       switch the rhythm (normal, af, vt, svt, brady,
+//                         avblock, ste) at its default rate
+//   impair <what> <args>  one setting of the Link Impairment stage, the
+//                         others stay: drop <%>, burst <%> <packets>,
+//                         reorder <window>, dup <%>, stall <%> <time>,
+//                         seed <n>, off (all of them)
+//   repeat [<passes>]     restart the timeline (forever, or until N passes)
+//   end                   stop the scenario
+//
+// "every" repeats an event within the pass ("90s pvc 10s every 90s"). The
+// start restarts the waveform from its seed. Each event is logged with its
+// scenario time, the sequence number and the stream frame index (the
+// FORMAT_STAMP counter) and notified on the scenario characteristic, so it
+// can be lined up with what the central recorded. Events run in loop(); the
+// potentiometer is ignored while a scenario runs.
 
-BLEServer*         pServer         = nullptr;
-BLECharacteristic* pECGChar        = nullptr;
-BLECharacteristic* pBatteryChar    = nullptr;
-BLECharacteristic* pFirmwareChar   = nullptr;
+enum ScenarioAction : uint8_t {
+  SCN_MARK, SCN_BPM, SCN_RAMP, SCN_PVC, SCN_DISCONNECT, SCN_LEADS, SCN_RATE,
+  SCN_LINK, SCN_SOURCE, SCN_SEED, SCN_BATTERY, SCN_RHYTHM, SCN_IMPAIR, SCN_REPEAT, SCN_END,
+  SCN_ACTION_COUNT
+};
 
-bool deviceConnected    = false;
-bool oldDeviceConnected = false;
-uint16_t sequenceNumber = 0;
-uint8_t  batteryLevel   = BATTERY_START_LEVEL;
+const char* const SCENARIO_ACTION_NAMES[SCN_ACTION_COUNT] = {
+  "mark", "bpm", "ramp", "pvc", "disconnect", "leads", "rate",
+  "link", "source", "seed", "battery", "rhythm", "impair", "repeat", "end"
+};
 
-// ECG waveform generation
-uint32_t sampleIndex     = 0;
-float    heartRateBPM    = 72.0;
-float    rrIntervalSamples;  // R-R interval (in samples)
-float    nextRPeakAt;
+enum ScenarioImpairParam : uint8_t {
+  SCN_IMPAIR_DROP, SCN_IMPAIR_BURST, SCN_IMPAIR_REORDER, SCN_IMPAIR_DUP, SCN_IMPAIR_STALL,
+  SCN_IMPAIR_SEED, SCN_IMPAIR_OFF, SCN_IMPAIR_PARAM_COUNT
+};
 
-// Timers
-unsigned long lastPacketTime   = 0;
-unsigned long lastBatteryTime  = 0;
-unsigned long lastLEDTime      = 0;
-bool          ledState         = false;
+const char* const SCENARIO_IMPAIR_NAMES[SCN_IMPAIR_PARAM_COUNT] = {
+  "drop", "burst", "reorder", "dup", "stall", "seed", "off"
+};
 
-// Arrhythmia simulation
-bool arrhythmiaMode = false;
-unsigned long arrhythmiaStart = 0;
-#define ARRHYTHMIA_DURATION_MS 10000  // 10-second arrhythmia
+enum ScenarioState : uint8_t {
+  SCENARIO_IDLE,       // Never started, or stopped
+  SCENARIO_RUNNING,
+  SCENARIO_DONE,       // Reached "end", its last pass or the end of the timeline
+  SCENARIO_ERROR       // Script rejected — nothing runs
+};
 
-// ─────────────────────────────────────────────────────────────────────────────
-// BLE Server Callbacks
-// ─────────────────────────────────────────────────────────────────────────────
+#define SCENARIO_NEVER  0xFFFFFFFFu
 
-class MyServerCallbacks : public BLEServerCallbacks {
-  void onConnect(BLEServer* server) override {
-    deviceConnected = true;
-    Serial.println("[BLE] Device connected!");
-    // LED blinks fast → connected
+struct ScenarioEvent {
+  uint32_t atMs;                        // Offset within the pass
+  uint32_t everyMs;                     // Repeat period, 0 = once
+  uint32_t nextMs;                      // Next run in this pass (SCENARIO_NEVER = done)
+  uint32_t value;                       // BPM, leads, Hz, profile, source, seed, %, rhythm, passes
+  uint32_t durationMs;                  // ramp, pvc, disconnect, stall; burst length
+  uint8_t  action;                      // ScenarioAction
+  uint8_t  param;                       // ScenarioImpairParam
+  char     text[SCENARIO_EVENT_TEXT];   // Source line, for the log
+};
+
+// Built-in soak: a one-hour cycle run 24 times
+const char SCENARIO_SOAK[] =
+  "0 mark soak cycle\n"
+  "0 bpm 60\n"
+  "0 ramp 170 10m\n"
+  "10m ramp 60 10m\n"
+  "90s pvc 10s every 90s\n"
+  "30m rate 500\n"
+  "35m rate 250\n"
+  "40m disconnect 2m\n"
+  "45m rhythm af\n"
+  "48m rhythm svt\n"
+  "50m rhythm avblock\n"
+  "53m rhythm normal\n"
+  "1h repeat 24\n";
+
+char          scenarioText[SCENARIO_TEXT_SIZE];
+uint16_t      scenarioTextLen = 0;        // 0 = use SCENARIO_SOAK
+uint16_t      scenarioLineStart = 0;      // Serial upload: start of the current line
+bool          scenarioUploading = false;  // Serial input goes to the script
+ScenarioEvent scenarioEvents[SCENARIO_MAX_EVENTS];
+uint8_t       scenarioEventCount = 0;
+uint8_t       scenarioState = SCENARIO_IDLE;
+unsigned long scenarioStartMs = 0;        // millis() at the start of this pass
+uint16_t      scenarioPass = 0;
+bool          rampActive = false;
+float         rampFromBPM = 0, rampToBPM = 0;
+unsigned long rampStartMs = 0, rampDurationMs = 0, lastRampStep = 0;
+bool          advertisingPaused = false;  // "disconnect <time>" holds advertising
+unsigned long advertisingResumeAt = 0;
+
+/**
+ * Refresh the scenario value (read/notify) after event `index` ran.
+ *
+ * Scenario format:
+ *   [0]     uint8   State (ScenarioState)
+ *   [1]     uint8   Events in the script
+ *   [2-3]   uint16  Event that ran last (0xFFFF = none); failing line in
+ *                   SCENARIO_ERROR
+ *   [4-5]   uint16  Pass (from 0)
+ *   [6-9]   uint32  Scenario time of that event within its pass (ms)
+ *   [10-13] uint32  Stream frame index when it ran (as in FORMAT_STAMP)
+ *   [14-15] uint16  Sequence number when it ran
+ *   [16+]   char[]  Its source line (not terminated)
+ */
+void updateScenarioStatus(uint16_t index, uint32_t atMs, uint32_t frame) {
+  uint8_t value[16 + SCENARIO_EVENT_TEXT];
+  value[0] = scenarioState;
+  value[1] = scenarioEventCount;
+  putLE16(value + 2, index);
+  putLE16(value + 4, scenarioPass);
+  putLE32(value + 6, atMs);
+  putLE32(value + 10, frame);
+  putLE16(value + 14, sequenceNumber);
+  size_t textLen = 0;
+  if (index < scenarioEventCount && scenarioState != SCENARIO_ERROR) {
+    textLen = strnlen(scenarioEvents[index].text, SCENARIO_EVENT_TEXT);
+    memcpy(value + 16, scenarioEvents[index].text, textLen);
   }
 
-  void onDisconnect(BLEServer* server) override {
-    deviceConnected = false;
-    Serial.println("[BLE] Connection lost.");
-    // Re-advertise — DO NOT USE DELAY!
-    // delay() here blocks the BLE event callback and can cause
-    // stack corruption. Instead, we start advertising in loop().
+  notifyValue(scenarioValue, value, 16 + textLen);
+}
+
+/**
+ * Parse a scenario time ("90", "90s", "10m", "1h30m", "500ms") into ms.
+ */
+bool parseScenarioTime(const char* s, uint32_t* ms) {
+  uint32_t total = 0;
+  if (!*s) return false;
+  while (*s) {
+    if (*s < '0' || *s > '9') return false;
+    char* end;
+    uint32_t v = strtoul(s, &end, 10);
+    s = end;
+    uint32_t unit = 1000;  // Plain numbers are seconds
+    if (s[0] == 'm' && s[1] == 's') {
+      unit = 1;
+      s += 2;
+    } else if (*s == 'h' || *s == 'm' || *s == 's') {
+      unit = (*s == 'h') ? 3600000 : (*s == 'm') ? 60000 : 1000;
+      s++;
+    } else if (*s) {
+      return false;
+    }
+    total += v * unit;
   }
-};
+  *ms = total;
+  return true;
+}
 
-// ─────────────────────────────────────────────────────────────────────────────
-// ECG Waveform Generator
-// ─────────────────────────────────────────────────────────────────────────────
+bool parseScenarioNumber(const char* s, uint32_t* v) {
+  if (!s) return false;
+  char* end;
+  *v = strtoul(s, &end, 0);  // Decimal or 0x… (seeds)
+  return end != s && !*end;
+}
 
 /**
- * Gaussian function — for modeling ECG wave components.
+ * Parse a rate in percent ("2", "2%", "0.5%") into per mille.
  */
-float gaussian(float x, float center, float width) {
-  float diff = x - center;
-  return exp(-(diff * diff) / (2.0 * width * width));
+bool parseScenarioPercent(const char* s, uint32_t* permille) {
+  if (!s) return false;
+  char* end;
+  float pct = strtof(s, &end);
+  if (end == s || pct < 0 || pct > 100) return false;
+  if (*end == '%') end++;
+  *permille = (uint32_t)(pct * 10 + 0.5f);
+  return !*end;
 }
 
 /**
- * Generate a single ECG sample (in mV).
- * 
- * Normal sinus rhythm model:
- *   - P wave: Small positive deflection before QRS
- *   - QRS complex: Sharp R-peak, Q and S deflections
- *   - T wave: Broad positive wave after QRS
- *   - U wave: Very small (for realism)
+ * Arguments of "impair <what> …" from tok[2] on.
  */
-float generateECGSample(uint32_t idx) {
-  // Position within beat (0.0 - 1.0)
-  float beatStart = nextRPeakAt - rrIntervalSamples;
-  float posInBeat = fmod((float)(idx - (uint32_t)beatStart), rrIntervalSamples) / rrIntervalSamples;
-  if (posInBeat < 0) posInBeat += 1.0;
+bool parseScenarioImpair(char** tok, uint8_t count, ScenarioEvent& ev) {
+  if (count < 3) return false;
+  uint8_t p = 0;
+  while (p < SCN_IMPAIR_PARAM_COUNT && strcmp(tok[2], SCENARIO_IMPAIR_NAMES[p]) != 0) p++;
+  ev.param = p;
+  const char* arg = count > 3 ? tok[3] : nullptr;
+  const char* arg2 = count > 4 ? tok[4] : nullptr;
+  switch (p) {
+    case SCN_IMPAIR_DROP:
+    case SCN_IMPAIR_DUP:
+      return parseScenarioPercent(arg, &ev.value);
+    case SCN_IMPAIR_BURST:
+      return parseScenarioPercent(arg, &ev.value) && parseScenarioNumber(arg2, &ev.durationMs) &&
+             ev.durationMs >= 1 && ev.durationMs <= IMPAIR_MAX_BURST;
+    case SCN_IMPAIR_REORDER:
+      return parseScenarioNumber(arg, &ev.value) && ev.value <= IMPAIR_QUEUE_PACKETS / 2;
+    case SCN_IMPAIR_STALL:
+      return parseScenarioPercent(arg, &ev.value) && arg2 &&
+             parseScenarioTime(arg2, &ev.durationMs) && ev.durationMs <= IMPAIR_MAX_STALL_MS;
+    case SCN_IMPAIR_SEED:
+      return parseScenarioNumber(arg, &ev.value);
+    case SCN_IMPAIR_OFF:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/**
+ * Parse one script line. Returns 1 for an event, 0 for an empty or comment
+ * line and -1 for an error.
+ */
+int8_t parseScenarioLine(char* line, ScenarioEvent& ev) {
+  char* comment = strchr(line, '#');
+  if (comment) *comment = '\0';
+  while (isspace((unsigned char)*line)) line++;
+  size_t n = strlen(line);
+  while (n && isspace((unsigned char)line[n - 1])) line[--n] = '\0';
+  if (!n) return 0;
 
-  float value = 0.0;
+  memset(&ev, 0, sizeof(ev));
+  snprintf(ev.text, sizeof(ev.text), "%s", line);
 
-  if (arrhythmiaMode) {
-    // ─── Arrhythmia Mode: irregular rhythm ───
-    // PVC (Premature Ventricular Contraction) simulation
-    float jitter = sin(idx * 0.1) * 0.15;
-    
-    // Wide QRS
-    value += gaussian(posInBeat, 0.20, 0.018) * 0.08;   // Small P
-    value -= gaussian(posInBeat, 0.22, 0.015) * 0.20;    // Deep Q
-    value += gaussian(posInBeat, 0.25, 0.020) * 1.8;     // Tall R
-    value -= gaussian(posInBeat, 0.30, 0.018) * 0.50;    // Deep S
-    value += gaussian(posInBeat, 0.45, 0.060) * (-0.25); // Inverted T
-    value += jitter * gaussian(posInBeat, 0.60, 0.05);
-  } else {
-    // ─── Normal Sinus Rhythm ───
-    
-    // P wave (at ~12% of cycle, width ~2.5%)
-    value += gaussian(posInBeat, 0.12, 0.025) * 0.15;
+  char* tok[8];
+  uint8_t count = 0;
+  char* save;
+  for (char* t = strtok_r(line, " \t", &save); t && count < 8; t = strtok_r(nullptr, " \t", &save)) {
+    tok[count++] = t;
+  }
+  if (count >= 4 && strcmp(tok[count - 2], "every") == 0) {
+    if (!parseScenarioTime(tok[count - 1], &ev.everyMs) || ev.everyMs == 0) return -1;
+    count -= 2;
+  }
+  if (count < 2 || !parseScenarioTime(tok[0], &ev.atMs)) return -1;
 
-    // Q wave (small negative deflection before R)
-    value -= gaussian(posInBeat, 0.20, 0.008) * 0.10;
+  uint8_t a = 0;
+  while (a < SCN_ACTION_COUNT && strcmp(tok[1], SCENARIO_ACTION_NAMES[a]) != 0) a++;
+  ev.action = a;
+  const char* arg = count > 2 ? tok[2] : nullptr;
 
-    // R peak (sharp positive peak)
-    value += gaussian(posInBeat, 0.22, 0.010) * 1.20;
+  switch (a) {
+    case SCN_MARK:
+      return 1;
+    case SCN_BPM:
+      return parseScenarioNumber(arg, &ev.value) && ev.value >= 40 && ev.value <= 180 ? 1 : -1;
+    case SCN_RAMP:
+      return parseScenarioNumber(arg, &ev.value) && ev.value >= 40 && ev.value <= 180 &&
+             count > 3 && parseScenarioTime(tok[3], &ev.durationMs) ? 1 : -1;
+    case SCN_PVC:
+      return arg && parseScenarioTime(arg, &ev.durationMs) ? 1 : -1;
+    case SCN_DISCONNECT:
+      return !arg || parseScenarioTime(arg, &ev.durationMs) ? 1 : -1;
+    case SCN_LEADS:
+    case SCN_RATE:
+    case SCN_LINK:
+    case SCN_SOURCE:
+    case SCN_SEED:
+      // Checked when the event runs, by the same code as the control opcodes
+      return parseScenarioNumber(arg, &ev.value) ? 1 : -1;
+    case SCN_BATTERY:
+      return parseScenarioNumber(arg, &ev.value) && ev.value <= 100 ? 1 : -1;
+    case SCN_RHYTHM:
+      if (arg && findRhythm(arg) >= 0) {
+        ev.value = findRhythm(arg);
+        return 1;
+      }
+      return parseScenarioNumber(arg, &ev.value) && ev.value < RHYTHM_COUNT ? 1 : -1;
+    case SCN_IMPAIR:
+      return parseScenarioImpair(tok, count, ev) ? 1 : -1;
+    case SCN_REPEAT:
+    case SCN_END:
+      // Pass control cannot repeat within the pass
+      if (ev.everyMs) return -1;
+      return a == SCN_END || !arg || parseScenarioNumber(arg, &ev.value) ? 1 : -1;
+    default:
+      return -1;  // Unknown action
+  }
+}
+
+/**
+ * Parse the uploaded script (or the built-in soak) into scenarioEvents.
+ * On an error *errorLine receives the failing line.
+ */
+bool loadScenario(uint16_t* errorLine) {
+  const char* src = scenarioTextLen ? scenarioText : SCENARIO_SOAK;
+  size_t len = scenarioTextLen ? scenarioTextLen : strlen(SCENARIO_SOAK);
+  char line[96];
+  uint8_t lineLen = 0;
+  uint16_t lineNo = 1;
+
+  scenarioEventCount = 0;
+  for (size_t i = 0; i <= len; i++) {
+    char c = i < len ? src[i] : '\n';
+    if (c != '\n' && c != ';') {
+      if (c != '\r' && lineLen < sizeof(line) - 1) line[lineLen++] = c;
+      continue;
+    }
+    line[lineLen] = '\0';
+    lineLen = 0;
+
+    ScenarioEvent ev;
+    int8_t r = parseScenarioLine(line, ev);
+    if (r < 0 || (r > 0 && scenarioEventCount == SCENARIO_MAX_EVENTS)) {
+      Serial.printf("[SCN] Line %u: %s\n", lineNo,
+        r < 0 ? "cannot parse" : "too many events (SCENARIO_MAX_EVENTS)");
+      *errorLine = lineNo;
+      return false;
+    }
+    if (r > 0) scenarioEvents[scenarioEventCount++] = ev;
+    if (c == '\n') lineNo++;
+  }
+  if (scenarioEventCount == 0) {
+    Serial.println("[SCN] Script has no events");
+    *errorLine = 0;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Store script text from the control characteristic (BLE task). A running
+ * scenario is not affected until the next start.
+ */
+void scenarioUpload(const uint8_t* data, size_t len, bool append) {
+  if (!append) scenarioTextLen = 0;
+  size_t room = SCENARIO_TEXT_SIZE - scenarioTextLen;
+  if (len > room) {
+    Serial.printf("[SCN] Script truncated to %u bytes (SCENARIO_TEXT_SIZE)\n", SCENARIO_TEXT_SIZE);
+    len = room;
+  }
+  memcpy(scenarioText + scenarioTextLen, data, len);
+  scenarioTextLen += len;
+  Serial.printf("[SCN] Script: %u bytes\n", scenarioTextLen);
+}
 
-    // S wave (negative deflection after R)
-    value -= gaussian(posInBeat, 0.24, 0.008) * 0.25;
+/**
+ * Serial upload ('u'): every line goes to the script until a line holding
+ * a single '.'.
+ */
+void scenarioSerialInput(char c) {
+  if (c == '\r') return;
+  if (c != '\n') {
+    if (scenarioTextLen < SCENARIO_TEXT_SIZE) scenarioText[scenarioTextLen++] = c;
+    return;
+  }
+  if (scenarioTextLen - scenarioLineStart == 1 && scenarioText[scenarioLineStart] == '.') {
+    scenarioTextLen = scenarioLineStart;
+    scenarioUploading = false;
+    Serial.printf("[SCN] Script: %u bytes%s — 'x' starts it\n", scenarioTextLen,
+      scenarioTextLen >= SCENARIO_TEXT_SIZE - 1 ? " (truncated)" : "");
+    return;
+  }
+  if (scenarioTextLen < SCENARIO_TEXT_SIZE) scenarioText[scenarioTextLen++] = '\n';
+  scenarioLineStart = scenarioTextLen;
+}
 
-    // T wave (broad positive)
-    value += gaussian(posInBeat, 0.38, 0.040) * 0.30;
+void pauseAdvertising(unsigned long now, uint32_t ms) {
+  advertisingPaused = true;
+  advertisingResumeAt = now + ms;
+  followerAdvertising = false;
+  BLEDevice::stopAdvertising();
+}
 
-    // U wave (very small)
-    value += gaussian(posInBeat, 0.50, 0.025) * 0.03;
+void resumeAdvertising() {
+  advertisingPaused = false;
+  if (FLEET_ENABLED) {
+    fleetAdvertisePending = true;
+  } else if (!deviceConnected) {
+    BLEDevice::startAdvertising();
+    Serial.println("[BLE] Advertising restarted.");
+  } else if (ECG_FOLLOWERS) {
+    followerAdvertisePending = true;
   }
+}
+
+void stopScenario(uint8_t state, const char* why) {
+  uint32_t t = millis() - scenarioStartMs;
+  scenarioState = state;
+  rampActive = false;
+  if (advertisingPaused) resumeAdvertising();
+  Serial.printf("[SCN] %s in pass %u at %02u:%02u:%02u\n", why, scenarioPass,
+    t / 3600000, t / 60000 % 60, t / 1000 % 60);
+  updateScenarioStatus(0xFFFF, t, ringFrameBase + ringHead.load(std::memory_order_relaxed));
+}
 
-  // Baseline wander (very slow sinusoidal)
-  value += sin((float)idx / SAMPLE_RATE * 0.3) * 0.02;
+void startScenario(unsigned long now) {
+  uint16_t errorLine;
+  if (!loadScenario(&errorLine)) {
+    scenarioState = SCENARIO_ERROR;
+    rampActive = false;
+    updateScenarioStatus(errorLine, 0, 0);
+    return;
+  }
+  for (uint8_t i = 0; i < scenarioEventCount; i++) {
+    scenarioEvents[i].nextMs = scenarioEvents[i].atMs;
+  }
+  scenarioPass = 0;
+  scenarioStartMs = now;
+  rampActive = false;
+  scenarioState = SCENARIO_RUNNING;
+  seedPending = true;  // Same waveform state at every start
+  Serial.printf("[SCN] Started: %u events (%s), waveform restarted from seed 0x%08X\n",
+    scenarioEventCount, scenarioTextLen ? "uploaded" : "built-in soak", requestedSeed);
+  updateScenarioStatus(0xFFFF, 0, ringFrameBase + ringHead.load(std::memory_order_relaxed));
+}
 
-  // Noise addition (small amount — for realism)
-  value += ((float)random(-100, 100) / 100.0) * 0.015;
+/**
+ * Run event `index`, due at `atMs` into the pass. Returns false when the
+ * event ended the pass (repeat, end).
+ */
+bool runScenarioEvent(uint8_t index, uint32_t atMs, unsigned long now) {
+  const ScenarioEvent& ev = scenarioEvents[index];
+  uint32_t frame = ringFrameBase + ringHead.load(std::memory_order_relaxed);
+  Serial.printf("[SCN] %02u:%02u:%02u.%03u  pass %u  seq=%u  frame=%u  %s\n",
+    atMs / 3600000, atMs / 60000 % 60, atMs / 1000 % 60, atMs % 1000,
+    scenarioPass, sequenceNumber, frame, ev.text);
+  updateScenarioStatus(index, atMs, frame);
 
-  return value;
+  switch (ev.action) {
+    case SCN_MARK:
+      break;
+    case SCN_BPM:
+      rampActive = false;
+      setHeartRate(synth, ev.value);
+      break;
+    case SCN_RAMP:
+      rampFromBPM = synth.heartRateBPM;
+      rampToBPM = ev.value;
+      rampStartMs = now;
+      rampDurationMs = ev.durationMs;
+      rampActive = true;
+      break;
+    case SCN_PVC:
+      synth.arrhythmiaMode = true;
+      arrhythmiaStart = now;
+      arrhythmiaDurationMs = ev.durationMs;
+      break;
+    case SCN_DISCONNECT:
+      if (ev.durationMs) pauseAdvertising(now, ev.durationMs);
+      if (deviceConnected) pServer->disconnect(primaryConnId);
+      for (uint8_t k = 0; FLEET_ENABLED && k < VIRTUAL_HOLTERS; k++) {
+        if (fleet[k].connected) pServer->disconnect(fleet[k].connId);
+      }
+      for (uint8_t k = 0; k < ECG_FOLLOWERS; k++) {
+        if (followers[k].connected) pServer->disconnect(followers[k].connId);
+      }
+      break;
+    case SCN_LEADS:
+      if (applyStreamConfig(streamFormat, ev.value)) updateControlStatus();
+      break;
+    case SCN_RATE:
+      if (applySampleRate(ev.value)) updateControlStatus();
+      break;
+    case SCN_LINK:
+      applyLinkProfile(ev.value);
+      break;
+    case SCN_SOURCE:
+      if (applySampleSource(ev.value)) updateControlStatus();
+      break;
+    case SCN_SEED:
+      requestedSeed = ev.value;
+      seedPending = true;
+      break;
+    case SCN_BATTERY:
+      setBatteryLevel(ev.value);
+      break;
+    case SCN_RHYTHM:
+      rampActive = false;
+      if (applyRhythm(ev.value)) updateControlStatus();
+      break;
+    case SCN_IMPAIR: {
+      ImpairConfig c = impairConfigured;
+      switch (ev.param) {
+        case SCN_IMPAIR_DROP:    c.dropPermille = ev.value; break;
+        case SCN_IMPAIR_BURST:   c.burstPermille = ev.value; c.burstLength = ev.durationMs; break;
+        case SCN_IMPAIR_REORDER: c.reorderWindow = ev.value; break;
+        case SCN_IMPAIR_DUP:     c.dupPermille = ev.value; break;
+        case SCN_IMPAIR_STALL:   c.stallPermille = ev.value; c.stallMs = ev.durationMs; break;
+        case SCN_IMPAIR_SEED:    c.seed = ev.value; break;
+        case SCN_IMPAIR_OFF:     c = {}; break;
+      }
+      applyImpairment(c);
+      break;
+    }
+    case SCN_REPEAT:
+      if (ev.value && scenarioPass + 1u >= ev.value) {
+        stopScenario(SCENARIO_DONE, "Last pass done");
+        return false;
+      }
+      // The next pass starts when this one was due, so passes do not drift
+      scenarioPass++;
+      scenarioStartMs += atMs;
+      for (uint8_t i = 0; i < scenarioEventCount; i++) {
+        scenarioEvents[i].nextMs = scenarioEvents[i].atMs;
+      }
+      return false;
+    case SCN_END:
+      stopScenario(SCENARIO_DONE, "Ended");
+      return false;
+  }
+  return true;
 }
 
 /**
- * Convert mV value to raw ADC value.
- * Mobile app does the reverse: raw * adcToMv = mV
- * So we do: mV / adcToMv = raw
+ * loop(): start/stop requests, due events, the BPM ramp and the end of an
+ * advertising pause.
  */
-int16_t mvToADC(float mv) {
-  return (int16_t)(mv / ADC_TO_MV);
+void serviceScenario(unsigned long now) {
+  if (scenarioStopPending) {
+    scenarioStopPending = false;
+    if (scenarioState == SCENARIO_RUNNING) stopScenario(SCENARIO_IDLE, "Stopped");
+  }
+  if (scenarioStartPending) {
+    scenarioStartPending = false;
+    startScenario(now);
+  }
+  if (advertisingPaused && (long)(now - advertisingResumeAt) >= 0) {
+    resumeAdvertising();
+  }
+  if (scenarioState != SCENARIO_RUNNING) return;
+
+  // Due events in time order, script order for equal times
+  bool pending = false;
+  for (;;) {
+    uint32_t t = now - scenarioStartMs;
+    int16_t due = -1;
+    pending = false;
+    for (uint8_t i = 0; i < scenarioEventCount; i++) {
+      uint32_t next = scenarioEvents[i].nextMs;
+      if (next == SCENARIO_NEVER) continue;
+      pending = true;
+      if (next <= t && (due < 0 || next < scenarioEvents[due].nextMs)) due = i;
+    }
+    if (due < 0) break;
+
+    ScenarioEvent& ev = scenarioEvents[due];
+    uint32_t at = ev.nextMs;
+    ev.nextMs = ev.everyMs ? at + ev.everyMs : SCENARIO_NEVER;
+    if (!runScenarioEvent(due, at, now)) return;
+  }
+
+  if (rampActive && now - lastRampStep >= SCENARIO_RAMP_STEP_MS) {
+    lastRampStep = now;
+    uint32_t elapsed = now - rampStartMs;
+    if (elapsed >= rampDurationMs) {
+      setHeartRate(synth, rampToBPM);
+      rampActive = false;
+    } else {
+      setHeartRate(synth, rampFromBPM + (rampToBPM - rampFromBPM) * elapsed / rampDurationMs);
+    }
+  }
+
+  if (!pending && !rampActive) stopScenario(SCENARIO_DONE, "Timeline done");
 }
 
 // ─────────────────────────────────────────────────────────────────────────────
-// BLE Packet Sending
+// Diagnostics Characteristic
 // ─────────────────────────────────────────────────────────────────────────────
 
+#define DIAG_HEADER_SIZE  52
+#define DIAG_STAT_SIZE    (16 + 4 * DIAG_HIST_BUCKETS)
+#define DIAG_CLOCK_OFFSET (DIAG_HEADER_SIZE + DIAG_STAT_COUNT * DIAG_STAT_SIZE)  // 244
+#define DIAG_BENCH_OFFSET (DIAG_CLOCK_OFFSET + 12)                              // 256
+#define DIAG_VALUE_SIZE   (DIAG_BENCH_OFFSET + 36)                              // 292
+static_assert(DIAG_VALUE_SIZE <= NOTIFY_VALUE_MAX, "diagnostics outgrew NOTIFY_VALUE_MAX");
+
 /**
- * Build ECG packet and send as BLE notification.
- * 
- * Packet format (exactly matches ECGParser.ts):
- *   Byte 0-1: uint16 sequence number (little-endian)
- *   Byte 2-3: uint16 sample count (little-endian)
- *   Byte 4+:  int16[] ADC values (little-endian)
- */
-void sendECGPacket() {
-  // Packet size: 4 byte header + (samples * 2 bytes)
-  const int packetSize = 4 + SAMPLES_PER_PACKET * 2;
-  uint8_t packet[packetSize];
-
-  // Header: sequence number (uint16 LE)
-  packet[0] = sequenceNumber & 0xFF;
-  packet[1] = (sequenceNumber >> 8) & 0xFF;
-
-  // Header: sample count (uint16 LE)
-  packet[2] = SAMPLES_PER_PACKET & 0xFF;
-  packet[3] = (SAMPLES_PER_PACKET >> 8) & 0xFF;
-
-  // Generate samples and write to packet
-  for (int i = 0; i < SAMPLES_PER_PACKET; i++) {
-    float mv = generateECGSample(sampleIndex);
-    int16_t adcValue = mvToADC(mv);
-
-    // int16 little-endian
-    int offset = 4 + i * 2;
-    packet[offset]     = adcValue & 0xFF;
-    packet[offset + 1] = (adcValue >> 8) & 0xFF;
-
-    sampleIndex++;
-
-    // R-peak check — new beat
-    if (sampleIndex >= (uint32_t)nextRPeakAt) {
-      // HRV: vary R-R interval by ±5%
-      float variation = ((float)random(-50, 50) / 1000.0) * rrIntervalSamples;
-      float newRR = rrIntervalSamples + variation;
-      
-      // Irregular R-R in arrhythmia mode
-      if (arrhythmiaMode) {
-        float extraVariation = ((float)random(-200, 200) / 1000.0) * rrIntervalSamples;
-        newRR += extraVariation;
-      }
-      
-      nextRPeakAt = sampleIndex + newRR;
+ * Refresh the diagnostics value and notify it to the central.
+ * A notification carries at most MTU - 3 bytes; read the characteristic
+ * for the complete value.
+ *
+ * Diagnostics format (little-endian):
+ *   [0]      uint8   DIAG_VERSION
+ *   [1]      uint8   Number of timing stats (DIAG_STAT_COUNT)
+ *   [2]      uint8   Histogram buckets per stat
+ *   [3]      uint8   Reserved (0)
+ *   [4-7]    uint32  Uptime (ms)
+ *   [8-11]   uint32  Free heap (bytes)
+ *   [12-15]  uint32  Minimum free heap since boot (bytes)
+ *   [16-17]  uint16  Generator task stack high-water mark (bytes left)
+ *   [18-19]  uint16  Sender task stack high-water mark
+ *   [20-21]  uint16  loop() task stack high-water mark
+ *   [22-23]  uint16  Frames queued in the sample ring (saturates at 65535)
+ *   [24-27]  uint32  Packets sent
+ *   [28-31]  uint32  Packets that missed their deadline
+ *   [32-35]  uint32  Generator late ticks
+ *   [36-39]  uint32  loop() iterations ≥ LOOP_DEADLINE_US
+ *   [40-43]  uint32  Ring overflows (frames dropped)
+ *   [44-47]  uint32  Notifications the stack refused (retried)
+ *   [48-49]  uint16  ECG packets dropped after retrying (saturates)
+ *   [50-51]  uint16  Peak TX backlog: frames queued behind a sent packet
+ *   [52+]    Per stat, in DiagStatId order:
+ *              uint32 count, uint32 min µs, uint32 avg µs, uint32 max µs,
+ *              uint32[DIAG_HIST_BUCKETS] histogram
+ *   [244-247] uint32 Effective sample rate since the clock origin (mHz)
+ *   [248-251] int32  Sample clock drift: stream time produced minus time
+ *                    elapsed (µs; within one tick of 0 while on time)
+ *   [252-255] uint32 Worst generator lag behind the sample clock (µs)
+ *   Last link benchmark (kept across connections):
+ *   [256]     uint8  State (BenchState)
+ *   [257]     uint8  Steps run
+ *   [258-259] uint16 Packet length of the peak step (bytes)
+ *   [260-263] uint32 Peak sustained samples/s
+ *   [264-265] uint16 Packets/s of the peak step
+ *   [266-267] uint16 Echoes in the round-trip percentiles
+ *   [268-271] uint32 Offered samples/s at the first refusal (0 = none)
+ *   [272-275] uint32 Refused notifications
+ *   [276-291] uint32 Round trip p50, p90, p99, max (µs)
+ */
+void updateDiagnostics() {
+  static uint8_t value[DIAG_VALUE_SIZE];
 
-      // Turn on LED (heartbeat indicator)
-      digitalWrite(LED_PIN, HIGH);
-      ledState = true;
-      lastLEDTime = millis();
-    }
+  value[0] = DIAG_VERSION;
+  value[1] = DIAG_STAT_COUNT;
+  value[2] = DIAG_HIST_BUCKETS;
+  value[3] = 0;
+  putLE32(value + 4,  millis());
+  putLE32(value + 8,  ESP.getFreeHeap());
+  putLE32(value + 12, ESP.getMinFreeHeap());
+  putLE16(value + 16, uxTaskGetStackHighWaterMark(generatorTask));
+  putLE16(value + 18, uxTaskGetStackHighWaterMark(senderTask));
+  putLE16(value + 20, loopStackHighWater);
+  putLE16(value + 22, min<uint32_t>(ringAvailable(), 0xFFFF));
+  putLE32(value + 24, diagPacketsSent);
+  putLE32(value + 28, diagDeadlineMisses);
+  putLE32(value + 32, diagGeneratorLateTicks);
+  putLE32(value + 36, diagLoopOverruns);
+  putLE32(value + 40, ringOverflows);
+  putLE32(value + 44, diagTxRetries);
+  putLE16(value + 48, min<uint32_t>(diagTxDrops, 0xFFFF));
+  putLE16(value + 50, min<uint32_t>(diagTxBacklogMax, 0xFFFF));
+
+  uint8_t* p = value + DIAG_HEADER_SIZE;
+  for (uint8_t i = 0; i < DIAG_STAT_COUNT; i++, p += DIAG_STAT_SIZE) {
+    const TimingStat& st = diagStats[i];
+    putLE32(p,      st.count);
+    putLE32(p + 4,  st.count ? st.minUs : 0);
+    putLE32(p + 8,  st.count ? (uint32_t)(st.sumUs / st.count) : 0);
+    putLE32(p + 12, st.maxUs);
+    for (uint8_t b = 0; b < DIAG_HIST_BUCKETS; b++) putLE32(p + 16 + 4 * b, st.hist[b]);
   }
+  putLE32(value + DIAG_CLOCK_OFFSET,     diagClockRateMilliHz);
+  putLE32(value + DIAG_CLOCK_OFFSET + 4, (uint32_t)diagClockDriftUs);
+  putLE32(value + DIAG_CLOCK_OFFSET + 8, diagClockLagMaxUs);
+
+  p = value + DIAG_BENCH_OFFSET;
+  p[0] = bench.state;
+  p[1] = bench.steps;
+  putLE16(p + 2,  bench.peakLen);
+  putLE32(p + 4,  bench.peakSps);
+  putLE16(p + 8,  bench.peakPps);
+  putLE16(p + 10, bench.rttCount);
+  putLE32(p + 12, bench.refusedAtSps);
+  putLE32(p + 16, bench.refused);
+  putLE32(p + 20, bench.rttP50Us);
+  putLE32(p + 24, bench.rttP90Us);
+  putLE32(p + 28, bench.rttP99Us);
+  putLE32(p + 32, bench.rttMaxUs);
 
-  sequenceNumber++;
+  notifyValue(diagValue, value, sizeof(value));
+}
+
+/**
+ * Serial mirror of the diagnostics characteristic.
+ */
+void printDiagnostics() {
+  Serial.printf("[DIAG] heap=%u min=%u ble=%u  stack gen=%u tx=%u loop=%u  packets=%u missed=%u  gen_late=%u  loop_over=%u  overflows=%u\n",
+    ESP.getFreeHeap(), ESP.getMinFreeHeap(), bleHeapBytes,
+    uxTaskGetStackHighWaterMark(generatorTask), uxTaskGetStackHighWaterMark(senderTask),
+    loopStackHighWater, diagPacketsSent, diagDeadlineMisses,
+    diagGeneratorLateTicks, diagLoopOverruns, ringOverflows);
+  Serial.printf("[DIAG] tx retries=%u drops=%u backlog_max=%u frames (%.1f s)%s\n",
+    diagTxRetries, diagTxDrops, diagTxBacklogMax, (float)diagTxBacklogMax / sampleRate,
+    txCongested ? "  CONGESTED" : "");
+  if (impairActive) printImpairStats("[DIAG] impairment: ");
+  if (fecGroup) Serial.printf("[DIAG] fec: 1 parity per %u packets, %u parity packets sent\n",
+    fecGroup, diagFecParity);
+  Serial.printf("[DIAG] clock: effective %.3f Hz (nominal %u), drift %+d us, worst lag %u us\n",
+    diagClockRateMilliHz / 1000.0f, sampleRate, diagClockDriftUs, diagClockLagMaxUs);
 
-  // Send BLE notification
-  pECGChar->setValue(packet, packetSize);
-  pECGChar->notify();
+  for (uint8_t i = 0; i < DIAG_STAT_COUNT; i++) {
+    const TimingStat& st = diagStats[i];
+    if (st.count == 0) continue;
+    Serial.printf("[DIAG] %-9s n=%u  min/avg/max=%u/%u/%u us  hist=",
+      DIAG_STAT_NAMES[i], st.count, st.minUs, (uint32_t)(st.sumUs / st.count), st.maxUs);
+    for (uint8_t b = 0; b < DIAG_HIST_BUCKETS; b++) {
+      Serial.printf(b ? "/%u" : "%u", st.hist[b]);
+    }
+    Serial.println();
+  }
 }
 
 // ─────────────────────────────────────────────────────────────────────────────
@@ -278,23 +5130,35 @@ void sendECGPacket() {
 void setupBLE() {
   Serial.println("[BLE] Starting...");
 
-  // BLEDevice::init() starts the Bluedroid stack — this operation
+  // BLEDevice::init() starts the BLE host (Bluedroid or NimBLE) — this operation
   // can take 1-2 seconds and may trigger the watchdog.
   // We increase the timeout with esp_task_wdt.
   BLEDevice::init(DEVICE_NAME);
   delay(100);  // BLE stack settle
   Serial.println("[BLE] BLEDevice::init() completed");
+
+  // Accept up to BLE_MAX_MTU; the central initiates the exchange and the
+  // result arrives in centralMtuChanged().
+  BLEDevice::setMTU(BLE_MAX_MTU);
   pServer = BLEDevice::createServer();
   pServer->setCallbacks(new MyServerCallbacks());
+#if BLE_NIMBLE
+  pServer->advertiseOnDisconnect(false);  // centralDisconnected() decides
+#endif
 
   // ═══ ECG Service (Heart Rate Service 0x180D) ═══════════════════════════
   BLEService* ecgService = pServer->createService(ECG_SERVICE_UUID);
   
   pECGChar = ecgService->createCharacteristic(
     ECG_DATA_CHAR_UUID,
-    BLECharacteristic::PROPERTY_NOTIFY
+    CHR_NOTIFY
   );
-  pECGChar->addDescriptor(new BLE2902());  // CCCD — notification enable
+#if BLE_NIMBLE
+  pECGChar->setCallbacks(new EcgCallbacks());  // CCCD added by NimBLE
+#else
+  pECGCCCD = new BLE2902();
+  pECGChar->addDescriptor(pECGCCCD);  // CCCD — notification enable
+#endif
   
   ecgService->start();
 
@@ -303,10 +5167,10 @@ void setupBLE() {
   
   pBatteryChar = batteryService->createCharacteristic(
     BATTERY_LEVEL_CHAR_UUID,
-    BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_NOTIFY
+    CHR_READ | CHR_NOTIFY
   );
-  pBatteryChar->addDescriptor(new BLE2902());
-  pBatteryChar->setValue(&batteryLevel, 1);
+  attachValue(pBatteryChar, batteryValue, 1);
+  notifyValue(batteryValue, &batteryLevel, 1);
   
   batteryService->start();
 
@@ -315,22 +5179,89 @@ void setupBLE() {
   
   pFirmwareChar = deviceInfoService->createCharacteristic(
     FIRMWARE_VERSION_CHAR_UUID,
-    BLECharacteristic::PROPERTY_READ
+    CHR_READ
   );
-  pFirmwareChar->setValue(FIRMWARE_VERSION);
+  pFirmwareChar->setValue((uint8_t*)FIRMWARE_VERSION, strlen(FIRMWARE_VERSION));
   
   deviceInfoService->start();
 
+  // ═══ CardioGuard Control Service (custom) ═════════════════════════════
+  BLEService* controlService = pServer->createService(
+    BLEUUID(CONTROL_SERVICE_UUID), CONTROL_SERVICE_HANDLES);
+
+  pControlChar = controlService->createCharacteristic(
+    CONTROL_CHAR_UUID,
+    CHR_READ | CHR_WRITE | CHR_NOTIFY
+  );
+  attachValue(pControlChar, controlValue, 25, false);
+  pControlChar->setCallbacks(new ControlCallbacks());
+  updateControlStatus();
+
+  pLinkChar = controlService->createCharacteristic(
+    LINK_CHAR_UUID,
+    CHR_READ | CHR_NOTIFY
+  );
+  attachValue(pLinkChar, linkValue, 15);
+  updateLinkStatus();
+
+  pScenarioChar = controlService->createCharacteristic(
+    SCENARIO_CHAR_UUID,
+    CHR_READ | CHR_NOTIFY
+  );
+  attachValue(pScenarioChar, scenarioValue, 16 + SCENARIO_EVENT_TEXT);
+  updateScenarioStatus(0xFFFF, 0, 0);
+
+  pAnnotationChar = controlService->createCharacteristic(
+    ANNOTATION_CHAR_UUID,
+    CHR_READ | CHR_NOTIFY
+  );
+  attachValue(pAnnotationChar, annotationValue, 14);
+  annotationValue.toFollowers = true;
+
+  pSummaryChar = controlService->createCharacteristic(
+    SUMMARY_CHAR_UUID,
+    CHR_READ | CHR_NOTIFY
+  );
+  attachValue(pSummaryChar, summaryValue, 17);
+  summaryValue.toFollowers = true;
+
+  controlService->start();
+
+  // ═══ CardioGuard Diagnostics Service (custom) ═════════════════════════
+  BLEService* diagService = pServer->createService(DIAG_SERVICE_UUID);
+
+  pDiagChar = diagService->createCharacteristic(
+    DIAG_CHAR_UUID,
+    CHR_READ | CHR_NOTIFY
+  );
+  attachValue(pDiagChar, diagValue, DIAG_VALUE_SIZE);
+  updateDiagnostics();
+
+  diagService->start();
+
   // ═══ Advertising ══════════════════════════════════════════════════════
   BLEAdvertising* pAdvertising = BLEDevice::getAdvertising();
   pAdvertising->addServiceUUID(ECG_SERVICE_UUID);
   pAdvertising->setScanResponse(true);
   pAdvertising->setMinPreferred(0x06);  // Min connection interval (7.5ms)
   pAdvertising->setMaxPreferred(0x12);  // Max connection interval (22.5ms)
+#if !BLE_NIMBLE
+  BLEDevice::setCustomGapHandler(linkGapHandler);  // Granted PHY / data length / interval
   
-  BLEDevice::startAdvertising();
+  // Congestion per link; per-link subscriptions in a fleet or with followers
+  BLEDevice::setCustomGattsHandler(gattsEventHandler);
+#endif
+  if (FLEET_ENABLED) {
+    // Each Holter is advertised under its own identity
+    advertiseNextHolter();
+  } else {
+    BLEDevice::startAdvertising();
+  }
   Serial.println("[BLE] Advertising started - waiting for connection...");
   Serial.printf("[BLE] Device name: %s\n", DEVICE_NAME);
+  if (ECG_FOLLOWERS) {
+    Serial.printf("[BLE] Fan-out: up to %u followers share the stream\n", ECG_FOLLOWERS);
+  }
 }
 
 // ─────────────────────────────────────────────────────────────────────────────
@@ -357,8 +5288,41 @@ void updateHeartRateFromPot() {
   float newBPM = 40.0 + (potValue / 4095.0) * 140.0;
   
   // Smooth out sudden changes
-  heartRateBPM = heartRateBPM * 0.9 + newBPM * 0.1;
-  rrIntervalSamples = (60.0 / heartRateBPM) * SAMPLE_RATE;
+  setHeartRate(synth, synth.heartRateBPM * 0.9 + newBPM * 0.1);
+}
+
+/**
+ * Serial commands ('h', and the boot banner).
+ */
+void printHelp() {
+  Serial.println();
+  Serial.println("═══ Commands ═══");
+  Serial.println("  b: Show BPM");
+  Serial.println("  a: Toggle arrhythmia");
+  Serial.println("  r: Reset battery");
+  Serial.println("  +: BPM +10");
+  Serial.println("  -: BPM -10");
+  Serial.println("  m: Cycle rhythm (normal / af / vt / svt / brady / avblock / ste)");
+  Serial.println("  c: Toggle compressed (Rice) format");
+  Serial.println("  t: Toggle 32-bit frame index + timestamp header");
+  Serial.println("  l: Cycle leads 1 → 3 → 12");
+  Serial.println("  d: Print diagnostics");
+  Serial.println("  o: Toggle offline mode (drain / backfill)");
+  Serial.println("  v: List virtual Holters (fleet builds) and followers");
+  Serial.println("  s: Restart waveform from its seed");
+  Serial.println("  p: Toggle source (synthetic / flash replay)");
+  Serial.println("  f: Cycle sample rate 250 → 500 → 1000 Hz");
+  Serial.println("  k: Cycle link profile (balanced / throughput / low-power)");
+  Serial.println("  q: Toggle beat annotation format (beat records / heart rate measurement)");
+  Serial.println("  g: Toggle stream mode (full resolution / summary only)");
+  Serial.println("  n: Start / stop link benchmark (throughput ramp, RTT of echoes)");
+  Serial.println("  i: Cycle link impairment preset (off / mild / harsh)");
+  Serial.printf("  j: Toggle FEC parity (1 per %u packets)\n", FEC_SERIAL_GROUP);
+  Serial.println("  e: Energy report now (active / idle time, mA, µJ per frame)");
+  Serial.println("  u: Upload scenario script (end with '.')");
+  Serial.println("  x: Start / stop scenario (built-in soak if none uploaded)");
+  Serial.println("  h: Help");
+  Serial.println();
 }
 
 // ─────────────────────────────────────────────────────────────────────────────
@@ -389,147 +5353,372 @@ void setup() {
   analogReadResolution(12);  // ESP32 ADC 12-bit
 
   // Initialize ECG parameters
-  heartRateBPM = 72.0;
-  rrIntervalSamples = (60.0 / heartRateBPM) * SAMPLE_RATE;
-  nextRPeakAt = rrIntervalSamples;
+  buildBeatTemplates();
+  synthInit(synth, synthTables = allocBeatTables(true), 72.0);
+
+  // Cycle counter → µs for the diagnostics
+  cyclesPerUs = getCpuFrequencyMhz();
+  diagReset();
+
+  // Full clock for the firmware's tasks once DFS is on (power-save mode)
+#if POWER_DFS
+  esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "cg-active", &powerLock);
+#endif
+  setupPowerIdle();
+  powerReportStartUs = esp_timer_get_time();
+
+  // Virtual Holters (FLEET_SIZE > 1), the replay record, then the
+  // generator/sender tasks;
+  // recording starts now and never stops
+  setupFleet();
+  setupReplay();
+  setupSamplePipeline();
 
   // Start BLE
   Serial.println("[BLE] Starting... (this may take 2-3 seconds)");
   delay(100);  // Give the watchdog a breather
+  uint32_t heapBeforeBLE = ESP.getFreeHeap();
   setupBLE();
+  bleHeapBytes = heapBeforeBLE - ESP.getFreeHeap();
+  Serial.printf("[SYS] BLE stack (%s) + GATT database: %u KB heap, min free %u KB\n",
+    BLE_BACKEND_NAME, bleHeapBytes / 1024, ESP.getMinFreeHeap() / 1024);
+  heapTrack();
+  heapCompare();
+  startRecording();
+  if (SCENARIO_AUTOSTART) scenarioStartPending = true;
 
   Serial.println();
-  Serial.println("[INFO] Commands:");
+  Serial.println("[INFO] Inputs:");
   Serial.println("  - Potentiometer (GPIO 34):  BPM setting (40-180)");
   Serial.println("  - D8 button:                Arrhythmia mode");
-  Serial.println("  - Serial 'b' + Enter:       Print BPM");
-  Serial.println("  - Serial 'a' + Enter:       Trigger arrhythmia");
-  Serial.println();
+  Serial.println("  - Serial commands below, 'h' lists them again");
+  printHelp();
 }
 
 void loop() {
+  powerEnter(POWER_LOOP);
+  uint32_t loopStart = ESP.getCycleCount();
   unsigned long now = millis();
 
   // Feed the watchdog
   esp_task_wdt_reset();
 
   // ─── Connection status change ─────────────────────────────────
+  static uint16_t offlineFirstSeq = 0;
   if (deviceConnected && !oldDeviceConnected) {
-    // New connection
-    sequenceNumber = 0;
-    sampleIndex = 0;
-    nextRPeakAt = rrIntervalSamples;
-    Serial.println("[ECG] Streaming starting...");
+    // New connection — the sender resumes from the ring, backlog first
+    diagReset();
+    uint32_t backlog = ringAvailable();
+    if (streamMode == STREAM_MODE_SUMMARY) {
+      Serial.printf("[ECG] Summary only — raw stream paused, %u frames buffered (%.1f s)\n",
+        backlog, (float)backlog / sampleRate);
+    } else {
+      Serial.printf("[ECG] Streaming resumes at seq=%u, %u frames buffered (%.1f s)\n",
+        sequenceNumber, backlog, (float)backlog / sampleRate);
+    }
+    if (offlineMode == OFFLINE_BACKFILL && sequenceNumber != offlineFirstSeq) {
+      Serial.printf("[ECG] Offline packets seq %u..%u ready for backfill\n",
+        offlineFirstSeq, (uint16_t)(sequenceNumber - 1));
+    }
     oldDeviceConnected = deviceConnected;
   }
   if (!deviceConnected && oldDeviceConnected) {
-    // Connection lost
-    Serial.println("[ECG] Streaming stopped.");
+    // Connection lost — generation continues into the ring
+    Serial.println("[ECG] Central gone, recording offline.");
+    offlineFirstSeq = sequenceNumber;
     oldDeviceConnected = false;
     // Restart advertising — we do it here instead of the
     // onDisconnect callback because delay() inside the callback
     // blocks the BLE stack and causes broken disconnect/reconnect loops.
-    delay(100);  // Minimal wait for BLE stack cleanup
-    BLEDevice::startAdvertising();
-    Serial.println("[BLE] Advertising restarted.");
+    // Still running if it was kept up for followers.
+    if (!FLEET_ENABLED && !advertisingPaused && !followerAdvertising) {
+      delay(100);  // Minimal wait for BLE stack cleanup
+      BLEDevice::startAdvertising();
+      Serial.println("[BLE] Advertising restarted.");
+    }
   }
 
-  // ─── ECG Packet Transmission ──────────────────────────────────
-  if (deviceConnected && (now - lastPacketTime >= PACKET_INTERVAL_MS)) {
-    lastPacketTime = now;
-    sendECGPacket();
+  // ─── Followers ────────────────────────────────────────────────
+  // Every connection ends advertising; keep it up while the primary's
+  // central is connected and follower slots are free
+  if (ECG_FOLLOWERS && followerAdvertisePending && !advertisingPaused) {
+    followerAdvertisePending = false;
+    uint8_t used = followersConnected();
+    if (deviceConnected && !followerAdvertising && used < ECG_FOLLOWERS) {
+      delay(100);  // Same BLE stack cleanup wait as above
+      BLEDevice::startAdvertising();
+      followerAdvertising = true;
+      Serial.printf("[BLE] Advertising for followers (%u of %u connected)\n", used, ECG_FOLLOWERS);
+    }
+  }
 
-    // Print status every 250 packets (10 seconds)
-    if (sequenceNumber % 250 == 0) {
-      Serial.printf("[ECG] seq=%u  BPM=%.0f  battery=%u%%  arrhythmia=%s\n",
-        sequenceNumber, heartRateBPM, batteryLevel,
-        arrhythmiaMode ? "YES" : "no");
+  // ─── Fleet ────────────────────────────────────────────────────
+  if (FLEET_ENABLED) {
+    if (fleetAdvertisePending && !advertisingPaused) {
+      fleetAdvertisePending = false;
+      delay(100);  // Same BLE stack cleanup wait as above
+      advertiseNextHolter();
     }
+    updateFleetSchedules(now);
   }
 
-  // ─── Battery Simulation ────────────────────────────────────────
-  if (now - lastBatteryTime >= BATTERY_DRAIN_INTERVAL_MS) {
-    lastBatteryTime = now;
-    if (batteryLevel > 5) batteryLevel--;
-    
+  // ─── Scenario ─────────────────────────────────────────────────
+  serviceScenario(now);
+
+  // ─── ECG Status ───────────────────────────────────────────────
+  // Packets are produced by the generator/sender tasks; loop() only reports.
+  if (now - lastStatusTime >= STATUS_INTERVAL_MS) {
+    lastStatusTime = now;
     if (deviceConnected) {
-      pBatteryChar->setValue(&batteryLevel, 1);
-      pBatteryChar->notify();
+      Serial.printf("[ECG] seq=%u  BPM=%.0f  rhythm=%s  battery=%u%%  arrhythmia=%s  mtu=%u  spp=%u  leads=%u  rate=%uHz  ring=%u  overflows=%u\n",
+        sequenceNumber, synth.heartRateBPM, RHYTHMS[synth.rhythm].name, batteryLevel,
+        synth.arrhythmiaMode ? "YES" : "no", negotiatedMTU, samplesPerPacket,
+        leadCount, sampleRate, ringAvailable(), ringOverflows);
+    } else {
+      uint32_t buffered = ringAvailable();
+      Serial.printf("[ECG] offline: %u frames buffered (%.1f s, %u%% of ring)  overflows=%u\n",
+        buffered, (float)buffered / sampleRate,
+        (unsigned)((uint64_t)buffered * 100 / ringFrameCapacity), ringOverflows);
+    }
+    if (activeSource == SOURCE_REPLAY) {
+      Serial.printf("[ECG] replay: frame %u/%u (%u:%02u), %u full pass(es)\n",
+        replayFrame, replayHeader->frames, replayFrame / sampleRate / 60,
+        replayFrame / sampleRate % 60, replayLoops);
     }
-    
-    Serial.printf("[BAT] Battery: %u%%\n", batteryLevel);
+    if (FLEET_ENABLED) printFleet();
+    if (ECG_FOLLOWERS) printFollowers();
+  }
+
+  // ─── Beat Annotations + Summary (queued by the generator) ─────
+  notifyAnnotations();
+  notifySummaries();
+
+  // ─── Link Benchmark Result (finished by the sender task) ──────
+  if (benchReportPending) {
+    benchReportPending = false;
+    reportLinkBench();
+  }
+
+  // ─── Control Status (changed by the sender task) ──────────────
+  if (controlStatusDirty) {
+    controlStatusDirty = false;
+    updateControlStatus();
+  }
+
+  // ─── Link Tuning ──────────────────────────────────────────────
+  if (linkRetunePending && deviceConnected) {
+    linkRetunePending = false;
+    requestLinkParams();
+  }
+  if (linkStatusDirty) {
+    linkStatusDirty = false;
+    updateLinkStatus();
+  }
+
+  // ─── Diagnostics ──────────────────────────────────────────────
+  if (deviceConnected && (now - lastDiagTime >= DIAG_INTERVAL_MS)) {
+    lastDiagTime = now;
+    updateDiagnostics();
+    printDiagnostics();
+  }
+
+  // ─── Power Save & Energy Model ─────────────────────────────────
+  if (powerSaveActive != (linkProfile == LINK_PROFILE_LOW_POWER)) {
+    applyPowerSave(!powerSaveActive);
+  }
+  if (now - lastPowerReport >= POWER_REPORT_INTERVAL_MS) {
+    lastPowerReport = now;
+    powerReport();
+    heapTrack();
   }
 
   // ─── LED Control ─────────────────────────────────────────────
-  if (ledState && (now - lastLEDTime > 50)) {
+  uint32_t beatMs = lastBeatMs.load(std::memory_order_relaxed);
+  if (beatMs != lastLEDTime) {
+    digitalWrite(LED_PIN, HIGH);
+    ledState = true;
+    lastLEDTime = beatMs;
+  }
+  if (ledState && (long)(now - lastLEDTime) > 50) {   // The beat may be newer than now
     digitalWrite(LED_PIN, LOW);
     ledState = false;
   }
 
   // ─── Potentiometer (every 500ms) ───────────────────────────────
+  // A running scenario owns the heart rate
   static unsigned long lastPotRead = 0;
-  if (now - lastPotRead >= 500) {
+  if (now - lastPotRead >= 500 && scenarioState != SCENARIO_RUNNING) {
     lastPotRead = now;
     updateHeartRateFromPot();
   }
 
   // ─── BOOT Button → Arrhythmia Trigger ──────────────────────────
   if (digitalRead(BUTTON_PIN) == LOW) {
-    if (!arrhythmiaMode) {
-      arrhythmiaMode = true;
+    if (!synth.arrhythmiaMode) {
+      synth.arrhythmiaMode = true;
       arrhythmiaStart = now;
+      arrhythmiaDurationMs = ARRHYTHMIA_DURATION_MS;
       Serial.println("[ECG] ⚡ Arrhythmia mode ACTIVE (PVC simulation)");
     }
   }
   
   // Check arrhythmia duration
-  if (arrhythmiaMode && (now - arrhythmiaStart >= ARRHYTHMIA_DURATION_MS)) {
-    arrhythmiaMode = false;
+  if (synth.arrhythmiaMode && (now - arrhythmiaStart >= arrhythmiaDurationMs)) {
+    synth.arrhythmiaMode = false;
     Serial.println("[ECG] ✓ Normal rhythm");
   }
 
   // ─── Serial Port Commands ──────────────────────────────────────
-  if (Serial.available()) {
+  if (scenarioUploading) {
+    while (Serial.available()) scenarioSerialInput(Serial.read());
+  } else if (Serial.available()) {
     char cmd = Serial.read();
     switch (cmd) {
       case 'b':
       case 'B':
-        Serial.printf("[INFO] BPM: %.1f  R-R: %.0f samples\n",
-          heartRateBPM, rrIntervalSamples);
+        Serial.printf("[INFO] BPM: %.1f  R-R: %.0f samples  Rhythm: %s  Seed: 0x%08X\n",
+          synth.heartRateBPM, synth.rrIntervalSamples, RHYTHMS[synth.rhythm].name, synth.seed);
+        break;
+      case 'm':
+      case 'M':
+        if (applyRhythm((requestedRhythm + 1) % RHYTHM_COUNT)) updateControlStatus();
         break;
       case 'a':
       case 'A':
-        arrhythmiaMode = !arrhythmiaMode;
+        synth.arrhythmiaMode = !synth.arrhythmiaMode;
         arrhythmiaStart = now;
-        Serial.printf("[ECG] Arrhythmia: %s\n", arrhythmiaMode ? "ACTIVE" : "disabled");
+        arrhythmiaDurationMs = ARRHYTHMIA_DURATION_MS;
+        Serial.printf("[ECG] Arrhythmia: %s\n", synth.arrhythmiaMode ? "ACTIVE" : "disabled");
         break;
       case 'r':
       case 'R':
-        batteryLevel = BATTERY_START_LEVEL;
+        setBatteryLevel(BATTERY_START_LEVEL);
         Serial.println("[BAT] Battery reset → 95%");
         break;
       case '+':
-        heartRateBPM = min(180.0f, heartRateBPM + 10.0f);
-        rrIntervalSamples = (60.0 / heartRateBPM) * SAMPLE_RATE;
-        Serial.printf("[ECG] BPM increased → %.0f\n", heartRateBPM);
+        setHeartRate(synth, min(180.0f, synth.heartRateBPM + 10.0f));
+        Serial.printf("[ECG] BPM increased → %.0f\n", synth.heartRateBPM);
         break;
       case '-':
-        heartRateBPM = max(40.0f, heartRateBPM - 10.0f);
-        rrIntervalSamples = (60.0 / heartRateBPM) * SAMPLE_RATE;
-        Serial.printf("[ECG] BPM decreased → %.0f\n", heartRateBPM);
+        setHeartRate(synth, max(40.0f, synth.heartRateBPM - 10.0f));
+        Serial.printf("[ECG] BPM decreased → %.0f\n", synth.heartRateBPM);
+        break;
+      case 'c':
+      case 'C':
+        applyStreamConfig(streamFormat ^ FORMAT_RICE, configuredLeads);
+        updateControlStatus();
+        break;
+      case 't':
+      case 'T':
+        applyStreamConfig(streamFormat ^ FORMAT_STAMP, configuredLeads);
+        updateControlStatus();
+        break;
+      case 'l':
+      case 'L': {
+        uint8_t next = (configuredLeads == 1) ? 3 : (configuredLeads == 3) ? MAX_LEADS : 1;
+        applyStreamConfig(streamFormat, next);
+        updateControlStatus();
+        Serial.printf("[ECG] Leads: %u (%s..%s)\n", configuredLeads,
+          LEAD_NAMES[0], LEAD_NAMES[configuredLeads - 1]);
+        break;
+      }
+      case 'd':
+      case 'D':
+        printDiagnostics();
+        heapCompare();
+        break;
+      case 'v':
+      case 'V':
+        printFleet();
+        printFollowers();
+        break;
+      case 'f':
+      case 'F':
+        if (applySampleRate(configuredRate >= 1000 ? 250 : configuredRate * 2)) {
+          updateControlStatus();
+        }
+        break;
+      case 'k':
+      case 'K':
+        applyLinkProfile((linkProfile + 1) % 3);
+        Serial.printf("[BLE] Link: PHY %s, %u-octet PDUs, interval %.2f ms, latency %u\n",
+          linkPhyName(linkInfo.txPhy), linkInfo.txOctets, linkInfo.interval * 1.25f, linkInfo.latency);
+        break;
+      case 'p':
+      case 'P':
+        if (applySampleSource(sampleSource == SOURCE_REPLAY ? SOURCE_SYNTH : SOURCE_REPLAY)) {
+          updateControlStatus();
+        }
+        break;
+      case 's':
+      case 'S':
+        seedPending = true;
+        Serial.printf("[ECG] Waveform restarted, seed 0x%08X\n", requestedSeed);
+        break;
+      case 'o':
+      case 'O':
+        offlineMode = (offlineMode == OFFLINE_DRAIN) ? OFFLINE_BACKFILL : OFFLINE_DRAIN;
+        updateControlStatus();
+        Serial.printf("[CTL] Offline mode → %s\n", offlineMode == OFFLINE_BACKFILL ? "backfill" : "drain");
+        break;
+      case 'q':
+      case 'Q':
+        if (applyAnnotationFormat(annotationFormat ^ 1)) updateControlStatus();
+        break;
+      case 'g':
+      case 'G':
+        if (applyStreamMode(streamMode ^ 1)) updateControlStatus();
+        break;
+      case 'i':
+      case 'I': {
+        static uint8_t preset = 0;
+        preset = (preset + 1) % 3;
+        Serial.printf("[CTL] Impairment preset: %s\n", IMPAIR_PRESET_NAMES[preset]);
+        applyImpairment(IMPAIR_PRESETS[preset]);
+        break;
+      }
+      case 'j':
+      case 'J':
+        if (applyFecGroup(fecGroup ? 0 : FEC_SERIAL_GROUP)) updateControlStatus();
+        break;
+      case 'n':
+      case 'N':
+        requestLinkBench(bench.state == BENCH_RUNNING ? BENCH_REQ_STOP : BENCH_REQ_START);
+        break;
+      case 'e':
+      case 'E':
+        lastPowerReport = now;
+        powerReport();
+        break;
+      case 'u':
+      case 'U':
+        scenarioTextLen = 0;
+        scenarioLineStart = 0;
+        scenarioUploading = true;
+        Serial.println("[SCN] Send the script, end with a line holding a single '.'");
+        break;
+      case 'x':
+      case 'X':
+        if (scenarioState == SCENARIO_RUNNING) {
+          scenarioStopPending = true;
+        } else {
+          scenarioStartPending = true;
+        }
         break;
       case 'h':
       case 'H':
-        Serial.println();
-        Serial.println("═══ Commands ═══");
-        Serial.println("  b: Show BPM");
-        Serial.println("  a: Toggle arrhythmia");
-        Serial.println("  r: Reset battery");
-        Serial.println("  +: BPM +10");
-        Serial.println("  -: BPM -10");
-        Serial.println("  h: Help");
-        Serial.println();
+        printHelp();
         break;
     }
   }
+
+  // ─── Loop Timing ───────────────────────────────────────────────
+  if (diagRecord(DIAG_LOOP, ESP.getCycleCount() - loopStart) >= LOOP_DEADLINE_US) {
+    diagLoopOverruns++;
+  }
+  loopStackHighWater = uxTaskGetStackHighWaterMark(nullptr);
+
+  // Power save: give the idle task (DFS, light sleep) the time until the next pass
+  powerExit(POWER_LOOP);
+  if (powerSaveActive) delay(POWER_LOOP_PERIOD_MS);
 }
@@ -0,0 +1,182 @@
+// =============================================================================
+// CardioGuard ESP32 Holter ECG Simulator — Streaming QRS Detector
+// =============================================================================
+// See qrs_detect.h for the pipeline.
+// =============================================================================
+
+#include "qrs_detect.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Move a level 1/2^shift of the way towards a peak height.
+ */
+inline uint32_t trackLevel(uint32_t level, uint32_t height, uint8_t shift) {
+  return height > level ? level + ((height - level) >> shift)
+                        : level - ((level - height) >> shift);
+}
+
+inline void updateThreshold(QrsDetector& d) {
+  d.threshold = d.spki > d.npki ? d.npki + (d.spki - d.npki) / 4 : d.npki;
+}
+
+/**
+ * A peak that did not make it: it raises the noise level.
+ */
+void qrsNoise(QrsDetector& d, const QrsPeak& p) {
+  d.npki = trackLevel(d.npki, p.height, 3);
+  updateThreshold(d);
+}
+
+/**
+ * Accept a peak as QRS complex and describe it in *beat.
+ * `shift` is the weight of the peak in the signal level (3 = 1/8,
+ * 2 = 1/4 for a search-back).
+ */
+void qrsAccept(QrsDetector& d, const QrsPeak& p, uint8_t shift, QrsBeat* beat) {
+  uint32_t r = p.at - QRS_BANDPASS_DELAY;
+  uint32_t rr = d.found ? r - d.lastQrs : 0;
+
+  // Missed or extra beats would drag the mean: only R-R within
+  // 58-166 % of it count (any R-R sets the first mean)
+  if (rr && (!d.rrMean || (rr * 100 > d.rrMean * 58 && rr * 100 < d.rrMean * 166))) {
+    d.rrMean = d.rrMean ? trackLevel(d.rrMean, rr, 3) : rr;
+  }
+
+  d.spki = trackLevel(d.spki, p.height, shift);
+  updateThreshold(d);
+  d.found = true;
+  d.lastQrs = r;
+  d.lastSlope = p.slope;
+  d.candidate.height = 0;
+
+  beat->frame = r * d.decimation + d.decimation / 2;
+  beat->rr = rr * d.decimation;
+  beat->code = p.width >= QRS_WIDE ? BEAT_PVC : BEAT_NORMAL;
+}
+
+/**
+ * Width of the tracked complex: band-pass samples within ±QRS_WIDTH_SPAN
+ * of its extremum above half of it (a wide QRS keeps several lobes there).
+ * Only called for peaks that may become a QRS, so it adds a small bounded
+ * amount of work per sample.
+ */
+uint8_t qrsWidth(const QrsDetector& d, uint32_t n) {
+  uint32_t half = d.bpMax / 2;
+  uint32_t first = d.peak.at - QRS_WIDTH_SPAN, last = d.peak.at + QRS_WIDTH_SPAN;
+  if (n - first >= QRS_BP_HISTORY) first = n - QRS_BP_HISTORY + 1;
+  if (last > n) last = n;
+  uint8_t width = 0;
+  for (uint32_t i = first; i <= last; i++) {
+    width += (uint32_t)abs(d.bp[i % QRS_BP_HISTORY]) > half;
+  }
+  return width;
+}
+
+/**
+ * Classify a finished peak of the integrated signal.
+ */
+bool qrsDecide(QrsDetector& d, const QrsPeak& p, QrsBeat* beat) {
+  if (!d.learned) {
+    if (p.height > d.learnMax) d.learnMax = p.height;
+    return false;
+  }
+
+  uint32_t r = p.at - QRS_BANDPASS_DELAY;
+  if (d.found && r - d.lastQrs < QRS_REFRACTORY) return false;
+
+  if (p.height > d.threshold) {
+    // A steep-enough complex soon after a QRS is a QRS; a flat one is the T wave
+    if (d.found && r - d.lastQrs < QRS_T_WAVE_WINDOW && p.slope < d.lastSlope / 2) {
+      qrsNoise(d, p);
+      return false;
+    }
+    qrsAccept(d, p, 3, beat);
+    return true;
+  }
+
+  qrsNoise(d, p);
+  if (p.height > d.threshold / 2 && p.height > d.candidate.height) d.candidate = p;
+  return false;
+}
+
+void qrsInit(QrsDetector& d, uint16_t sampleRate) {
+  memset(&d, 0, sizeof(d));
+  d.decimation = sampleRate > QRS_RATE ? sampleRate / QRS_RATE : 1;
+}
+
+bool qrsProcess(QrsDetector& d, int16_t sample, QrsBeat* beat) {
+  // Box-car decimation to QRS_RATE
+  d.decimSum += sample;
+  if (++d.decimCount < d.decimation) return false;
+  int16_t x = d.decimSum / d.decimation;
+  d.decimSum = 0;
+  d.decimCount = 0;
+
+  uint32_t n = d.n++;
+
+  // Low-pass: y[n] = 2y[n-1] - y[n-2] + x[n] - 2x[n-6] + x[n-12] (gain 36)
+  d.x[n & 15] = x;
+  int32_t y = 2 * d.lp1 - d.lp2 + x - 2 * d.x[(n - 6) & 15] + d.x[(n - 12) & 15];
+  d.lp2 = d.lp1;
+  d.lp1 = y;
+  int32_t lp = y >> 2;
+
+  // High-pass: all-pass delay minus the 32-sample mean
+  d.lp[n & 63] = lp;
+  d.hpSum += lp - d.lp[(n - 32) & 63];
+  int32_t bp = d.lp[(n - 16) & 63] - d.hpSum / 32;
+  d.bp[n % QRS_BP_HISTORY] = bp;
+
+  // Slope, squared and integrated
+  int32_t slope = (2 * bp + d.bp[(n - 1) % QRS_BP_HISTORY] - d.bp[(n - 3) % QRS_BP_HISTORY] -
+                   2 * d.bp[(n - 4) % QRS_BP_HISTORY]) / 8;
+  if (slope > QRS_SLOPE_LIMIT) slope = QRS_SLOPE_LIMIT;
+  if (slope < -QRS_SLOPE_LIMIT) slope = -QRS_SLOPE_LIMIT;
+  uint32_t sq = (uint32_t)(slope * slope);
+  d.mwi += sq - d.sq[(n - QRS_MWI_LEN) & 63];
+  d.sq[n & 63] = sq;
+
+  if (!d.learned && n >= QRS_LEARN_SAMPLES) {
+    d.learned = true;
+    d.spki = d.learnMax / 2;
+    d.npki = d.learnMax / 8;
+    updateThreshold(d);
+  }
+
+  // Peak search: a peak starts when the integrated signal rises and ends
+  // once it has fallen to half its height
+  uint32_t v = d.mwi;
+  uint32_t absBp = bp < 0 ? -bp : bp;
+  uint32_t absSlope = slope < 0 ? -slope : slope;
+  bool detected = false;
+  if (!d.rising) {
+    if (v > d.lastMwi) {
+      d.rising = true;
+      d.peak = { v, n, absSlope, 0 };
+      d.bpMax = absBp;
+    }
+  } else if (v >= d.peak.height) {
+    d.peak.height = v;
+    if (absSlope > d.peak.slope) d.peak.slope = absSlope;
+    if (absBp > d.bpMax) {
+      d.bpMax = absBp;
+      d.peak.at = n;
+    }
+  } else if (v < d.peak.height / 2) {
+    d.rising = false;
+    if (d.peak.height > d.threshold / 2) d.peak.width = qrsWidth(d, n);
+    detected = qrsDecide(d, d.peak, beat);
+  }
+  d.lastMwi = v;
+
+  // Search-back: no QRS for 166 % of the mean R-R — take the best
+  // candidate above half the threshold
+  if (!detected && d.found && d.rrMean && d.candidate.height &&
+      (n - QRS_BANDPASS_DELAY - d.lastQrs) * 100 > d.rrMean * 166) {
+    qrsAccept(d, d.candidate, 2, beat);
+    detected = true;
+  }
+  return detected;
+}
@@ -0,0 +1,104 @@
+// =============================================================================
+// CardioGuard ESP32 Holter ECG Simulator — Streaming QRS Detector
+// =============================================================================
+// Integer Pan-Tompkins detector for streams whose beats are not known in
+// advance (replayed recordings). Constant work per sample, no allocation,
+// no floating point; shared by the firmware and the native benchmark.
+//
+// Pipeline (at QRS_RATE — faster streams are averaged down first):
+//   band-pass   integer low-pass + high-pass of Pan & Tompkins (1985),
+//               ~5-15 Hz, QRS_BANDPASS_DELAY samples of group delay
+//   slope       five-point derivative, clamped and squared
+//   integration QRS_MWI_LEN-sample moving window (150 ms)
+//   decision    peaks of the integrated signal against adaptive signal and
+//               noise levels, 200 ms refractory period, T-wave rejection
+//               by slope, search-back at half threshold after 166 % of the
+//               mean R-R
+// The R peak is placed at the band-pass extremum of the detected complex,
+// so a beat is reported ~0.3 s after its R peak.
+// =============================================================================
+
+#pragma once
+
+#include <stdint.h>
+
+#define QRS_RATE             250   // Hz — detector rate; 500/1000 Hz are decimated
+#define QRS_MWI_LEN          38    // 150 ms moving-window integration
+#define QRS_BANDPASS_DELAY   21    // Low-pass 5 + high-pass 16 samples
+#define QRS_REFRACTORY       50    // 200 ms — no second QRS within this
+#define QRS_T_WAVE_WINDOW    90    // 360 ms — later peaks cannot be T waves
+#define QRS_LEARN_SAMPLES    500   // 2 s of signal before the first decision
+#define QRS_SLOPE_LIMIT      4095  // Clamp of the derivative (keeps the MWI in 32 bits)
+#define QRS_WIDTH_SPAN       24    // ±96 ms around the R peak are measured for the width
+#define QRS_WIDE             11    // Width (samples above half the peak) of a 'V' beat
+#define QRS_BP_HISTORY       128   // Band-pass history — covers the span at the decision
+
+enum BeatCode : char {
+  BEAT_NORMAL  = 'N',     // MIT-BIH codes, as in replay annotations
+  BEAT_PVC     = 'V',
+  BEAT_UNKNOWN = 'Q',
+};
+
+/**
+ * One detected (or, for the synthetic source, known) beat.
+ */
+struct QrsBeat {
+  uint32_t frame;   // Stream frame of the R peak, counted from qrsInit()
+  uint32_t rr;      // Frames since the previous beat (0 = first beat)
+  char     code;    // BeatCode
+};
+
+/**
+ * Candidate complex: a peak of the integrated signal.
+ */
+struct QrsPeak {
+  uint32_t height;  // Integrated signal at the peak
+  uint32_t at;      // Detector sample of the R peak (band-pass extremum)
+  uint32_t slope;   // Largest |slope| in the complex
+  uint8_t  width;   // Band-pass samples above half the peak — grows with QRS width
+};
+
+struct QrsDetector {
+  uint8_t  decimation;     // Stream frames per detector sample
+  uint8_t  decimCount;
+  int32_t  decimSum;
+  uint32_t n;              // Detector samples so far
+
+  // Filter delay lines (indexed by n, power-of-two lengths)
+  int16_t  x[16];          // Input
+  int32_t  lp[64];         // Low-pass output — also the high-pass window
+  int32_t  lp1, lp2;       // Low-pass recursion state
+  int32_t  hpSum;          // Sum of the last 32 low-pass values
+  int32_t  bp[QRS_BP_HISTORY]; // Band-pass output — history for the QRS width
+  uint32_t sq[64];         // Squared slope — integration window
+  uint32_t mwi;            // Sum over the last QRS_MWI_LEN squared slopes
+  uint32_t lastMwi;
+
+  // Peak search on the integrated signal
+  bool     rising;         // Tracking a peak (false while it falls off)
+  QrsPeak  peak;           // Peak being tracked
+  uint32_t bpMax;          // Largest |band-pass| while rising
+
+  // Decision
+  uint32_t spki, npki;     // Signal and noise peak levels
+  uint32_t threshold;      // npki + (spki - npki) / 4
+  uint32_t learnMax;
+  bool     learned;
+  bool     found;          // A QRS was accepted since qrsInit()
+  uint32_t lastQrs;        // Detector sample of the last R peak
+  uint32_t lastSlope;
+  uint32_t rrMean;         // Running mean R-R (detector samples, 0 = unknown)
+  QrsPeak  candidate;      // Largest sub-threshold peak since the last QRS
+};
+
+/**
+ * Start a detector for a stream at `sampleRate` (250, 500 or 1000 Hz).
+ * Also used to restart it after a rate, source or waveform change.
+ */
+void qrsInit(QrsDetector& d, uint16_t sampleRate);
+
+/**
+ * Feed the next sample (ADC counts). Returns true when a beat was
+ * detected; *beat then describes it (its R peak lies in the past).
+ */
+bool qrsProcess(QrsDetector& d, int16_t sample, QrsBeat* beat);
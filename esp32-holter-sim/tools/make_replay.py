@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+# =============================================================================
+# CardioGuard ESP32 Holter ECG Simulator — Replay Record Converter
+# =============================================================================
+# Converts a real ECG recording into the image the firmware memory-maps from
+# the "ecgdata" partition (layout: see "Replay" in src/main.cpp).
+#
+#   WFDB (e.g. MIT-BIH, needs `pip install wfdb`):
+#     python tools/make_replay.py --wfdb mitdb/100 --annotator atr -o 100.bin
+#   CSV (one column per channel in mV, optional header row):
+#     python tools/make_replay.py --csv record.csv --rate 360 -o record.bin
+#
+# Then write it to the partition (offset from partitions.csv):
+#     esptool.py write_flash 0x290000 100.bin
+#
+# Signals are resampled to --sample-rate (default 250 Hz, SAMPLE_RATE) and
+# scaled to ADC counts (mV / ADC_TO_MV); annotation positions are resampled
+# with them. The firmware replays a record only while streaming at its rate.
+# =============================================================================
+
+import argparse
+import csv
+import math
+import struct
+import sys
+from array import array
+
+SAMPLE_RATE = 250            # ecg_synth.h
+SAMPLE_RATES = (250, 500, 1000)
+ADC_TO_MV = 0.00286          # ecg_synth.h
+MAX_LEADS = 12
+REPLAY_MAGIC = 0x43524743    # "CGRC"
+REPLAY_VERSION = 1
+HEADER_FORMAT = "<IHHB3xIIII24s"
+SAMPLE_OFFSET = 64           # Frames start here (header is 52 bytes)
+PARTITION_SIZE = 0x160000    # "ecgdata" in partitions.csv
+
+
+def read_wfdb(record, annotator, channels):
+    import wfdb
+    rec = wfdb.rdrecord(record, channels=channels)
+    annotations = []
+    if annotator:
+        ann = wfdb.rdann(record, annotator)
+        # Beat annotations only — rhythm and signal quality labels are skipped
+        beats = set("NLRBAaJSVrFejnE/fQ?")
+        annotations = [(int(pos), sym) for pos, sym in zip(ann.sample, ann.symbol) if sym in beats]
+    signal = [[0.0 if math.isnan(v) else v for v in row] for row in rec.p_signal.tolist()]
+    return signal, float(rec.fs), rec.record_name, annotations
+
+
+def read_csv(path, channels):
+    signal = []
+    with open(path, newline="") as f:
+        for row in csv.reader(f):
+            try:
+                values = [float(v) for v in row]
+            except ValueError:
+                continue  # Header or comment line
+            signal.append([values[c] for c in channels] if channels else values)
+    return signal, path.rsplit("/", 1)[-1].rsplit(".", 1)[0]
+
+
+def resample(signal, rate, target):
+    """Linear resampling of every channel to the target rate."""
+    if rate == target:
+        return signal
+    out = []
+    for i in range(int((len(signal) - 1) * target / rate) + 1):
+        x = i * rate / target
+        j = min(int(x), len(signal) - 2)
+        a, b, w = signal[j], signal[j + 1], x - j
+        out.append([p + (q - p) * w for p, q in zip(a, b)])
+    return out
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Build a CardioGuard replay partition image")
+    src = ap.add_mutually_exclusive_group(required=True)
+    src.add_argument("--wfdb", help="WFDB record path (without extension)")
+    src.add_argument("--csv", help="CSV file, one column per channel in mV")
+    ap.add_argument("--rate", type=float, help="CSV sample rate in Hz")
+    ap.add_argument("--sample-rate", type=int, choices=SAMPLE_RATES, default=SAMPLE_RATE,
+                    help="Replay rate in Hz (default %(default)s)")
+    ap.add_argument("--annotator", default="atr", help="WFDB annotation extension ('' for none)")
+    ap.add_argument("--channels", help="Comma-separated channel indices, in lead order (default: all)")
+    ap.add_argument("--seconds", type=float, help="Keep only the first N seconds")
+    ap.add_argument("--name", help="Record name stored in the header")
+    ap.add_argument("--partition-size", type=lambda v: int(v, 0), default=PARTITION_SIZE)
+    ap.add_argument("-o", "--output", required=True)
+    args = ap.parse_args()
+
+    channels = [int(c) for c in args.channels.split(",")] if args.channels else None
+    if args.wfdb:
+        signal, rate, name, annotations = read_wfdb(args.wfdb, args.annotator, channels)
+    else:
+        if not args.rate:
+            ap.error("--csv needs --rate")
+        signal, name = read_csv(args.csv, channels)
+        rate, annotations = args.rate, []
+
+    count = len(signal[0]) if len(signal) > 1 else 0
+    if not 1 <= count <= MAX_LEADS or any(len(row) != count for row in signal):
+        sys.exit(f"need at least two rows of 1..{MAX_LEADS} channels each")
+
+    target = args.sample_rate
+    signal = resample(signal, rate, target)
+    annotations = [(int(round(pos * target / rate)), sym) for pos, sym in annotations]
+    if args.seconds:
+        frames = int(args.seconds * target)
+        signal = signal[:frames]
+        annotations = [a for a in annotations if a[0] < frames]
+
+    adc = array("h", (max(-32768, min(32767, round(v / ADC_TO_MV))) for row in signal for v in row))
+    if sys.byteorder != "little":
+        adc.byteswap()
+    frames = len(signal)
+    sample_bytes = adc.tobytes()
+    ann_offset = (SAMPLE_OFFSET + len(sample_bytes) + 3) & ~3
+    ann_bytes = b"".join(struct.pack("<Ic3x", pos, sym[0].encode()) for pos, sym in annotations)
+
+    total = ann_offset + len(ann_bytes)
+    if total > args.partition_size:
+        max_s = (args.partition_size - SAMPLE_OFFSET) // (2 * count) // target
+        sys.exit(f"{total} bytes do not fit the {args.partition_size}-byte partition "
+                 f"(~{max_s} s at {count} channel(s)); use --seconds")
+
+    header = struct.pack(HEADER_FORMAT, REPLAY_MAGIC, REPLAY_VERSION, target, count,
+                         frames, len(annotations), SAMPLE_OFFSET, ann_offset,
+                         (args.name or name).encode()[:24])
+    image = bytearray(total)
+    image[:len(header)] = header
+    image[SAMPLE_OFFSET:SAMPLE_OFFSET + len(sample_bytes)] = sample_bytes
+    image[ann_offset:] = ann_bytes
+
+    with open(args.output, "wb") as f:
+        f.write(image)
+    print(f"{args.output}: {count} channel(s) at {target} Hz, {frames} frames ({frames / target:.0f} s), "
+          f"{len(annotations)} annotations, {total} bytes")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+# =============================================================================
+# CardioGuard ESP32 Holter ECG Simulator — Arduino IDE Sketch Sync
+# =============================================================================
+# Copies the firmware sources into the Arduino IDE sketch folder, which
+# compiles sketch/src like a library and reads the partition table from the
+# sketch folder:
+#
+#     python tools/sync_sketch.py
+#
+#   src/*.h, src/*.cpp  →  CardioGuard_Holter_Sim/src/
+#   partitions.csv      →  CardioGuard_Holter_Sim/partitions.csv
+#
+# src/bench/ is left out: the native benchmark has its own main(). Copies of
+# files no longer in src/ are removed. The copies are generated (.gitignore);
+# edit src/ and run this again before building in the Arduino IDE.
+# =============================================================================
+
+import argparse
+import filecmp
+import shutil
+import sys
+from pathlib import Path
+
+ROOT = Path(__file__).resolve().parent.parent
+SKETCH = ROOT / "CardioGuard_Holter_Sim"
+SOURCE_PATTERNS = ("*.h", "*.cpp")
+
+
+def sources():
+    files = []
+    for pattern in SOURCE_PATTERNS:
+        files.extend((ROOT / "src").glob(pattern))
+    return sorted(files)
+
+
+def sync(check):
+    """Copy changed files; with `check` only report them. Returns the count."""
+    pairs = [(f, SKETCH / "src" / f.name) for f in sources()]
+    pairs.append((ROOT / "partitions.csv", SKETCH / "partitions.csv"))
+    wanted = {dst.name for _, dst in pairs[:-1]}
+    stale = []
+    if (SKETCH / "src").is_dir():
+        stale = [f for f in (SKETCH / "src").iterdir() if f.name not in wanted]
+
+    changed = 0
+    for src, dst in pairs:
+        if dst.is_file() and not dst.is_symlink() and filecmp.cmp(src, dst, shallow=False):
+            continue
+        changed += 1
+        print(f"{'out of date' if check else 'copy'}: {dst.relative_to(ROOT)}")
+        if not check:
+            dst.parent.mkdir(exist_ok=True)
+            if dst.is_symlink():
+                dst.unlink()
+            shutil.copy2(src, dst)
+    for f in stale:
+        changed += 1
+        print(f"{'stale' if check else 'remove'}: {f.relative_to(ROOT)}")
+        if not check:
+            shutil.rmtree(f) if f.is_dir() and not f.is_symlink() else f.unlink()
+    return changed
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Copy src/ into the Arduino IDE sketch folder")
+    ap.add_argument("--check", action="store_true",
+                    help="only list copies that differ from src/ (exit 1 if any)")
+    args = ap.parse_args()
+    changed = sync(args.check)
+    if not changed:
+        print("Sketch is up to date.")
+    return 1 if args.check and changed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())